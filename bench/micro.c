@@ -0,0 +1,443 @@
+/* Microbenchmarks for the compiler's hot kernels.
+ *
+ * Each kernel is calibrated so one sample takes about SAMPLE_NS, warmed up,
+ * then sampled SAMPLES times; the median ns/op (and MB/s where the kernel
+ * has a byte size) is reported. Thresholds are ratios of each kernel's
+ * fastest sample to that of the `calibrate` kernel, a plain byte loop that
+ * does not use defsite code, so they carry across machines. With a
+ * threshold file, a kernel whose ratio exceeds its recorded one by more than
+ * the tolerance is reported; the run only fails on it with --strict, since
+ * timings on a shared machine are too noisy to gate every build on. */
+#define _POSIX_C_SOURCE 200809L
+#include "../src/defsite/common.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SAMPLES 9
+#define SAMPLE_NS 20000000ull
+#define DEFAULT_TOLERANCE 25.0
+
+typedef struct {
+    const char *name;
+    void (*run)(size_t iters);
+    size_t bytes_per_op;
+    double median_ns;
+    double min_ns;
+    double stddev_ns;
+} Kernel;
+
+static volatile size_t sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* ---- fixtures ---- */
+
+static char *page_html;
+static size_t page_len;
+static char *text_64k;
+static char *json_64k;
+static Node *page_doc;
+static Node *attr_node;
+static Node *wide_parent;
+static Scope *scopes;
+
+static BuildCtx quiet_ctx(void) {
+    BuildCtx ctx;
+    ctx.error_count = 0;
+    ctx.warning_count = 0;
+    ctx.current_file = "bench";
+    ctx.opts = NULL;
+    return ctx;
+}
+
+/* A page shaped like the demos: definitions, nested invocations, binds,
+ * named slots, attribute-heavy markup and prose. */
+static void build_page(void) {
+    StrBuf b = {0};
+    sb_append(&b, "<!doctype html>\n<html lang=\"en\" data-kind=\"post\" data-title=\"Bench\">\n<head>\n");
+    sb_append(&b, "<meta charset=\"utf-8\">\n<link rel=\"stylesheet\" href=\"/assets/site.css\">\n</head>\n<body>\n");
+    sb_append(&b, "<def-card>\n  <article class=\"card\"><h2><bind name=\"title\"></bind></h2>\n");
+    sb_append(&b, "  <a class=\"cta\" bind-href=\"href\">Open</a><section><slot></slot></section>\n");
+    sb_append(&b, "  <footer><slot name=\"meta\"></slot></footer></article>\n</def-card>\n");
+    for (int i = 0; i < 120; i++) {
+        char item[512];
+        snprintf(item,
+                 sizeof(item),
+                 "<card title=\"Entry %d &amp; friends\" href=\"/posts/%d.html\">\n"
+                 "  <p>Ownership rules at the <em>boundary</em> are part of your ABI contract; entry %d.</p>\n"
+                 "  <!-- note %d -->\n  <small slot=\"meta\">%d min read</small>\n</card>\n",
+                 i,
+                 i,
+                 i,
+                 i,
+                 i % 30);
+        sb_append(&b, item);
+    }
+    sb_append(&b, "<script>var x = \"<p>\"; if (a < b) {}</script>\n</body>\n</html>\n");
+    page_html = b.data;
+    page_len = b.len;
+}
+
+static char *make_text(size_t len, const char *specials) {
+    char *s = xmalloc(len + 1);
+    const char *words = "the quick brown fox jumps over lazy dogs ";
+    size_t wl = strlen(words);
+    size_t ns = strlen(specials);
+    for (size_t i = 0; i < len; i++) {
+        s[i] = (i % 61 == 60 && ns > 0) ? specials[(i / 61) % ns] : words[i % wl];
+    }
+    s[len] = '\0';
+    return s;
+}
+
+static void setup(void) {
+    build_page();
+    text_64k = make_text(65536, "&<>");
+    json_64k = make_text(65536, "\"\\\n\t");
+
+    BuildCtx ctx = quiet_ctx();
+    page_doc = parse_html(page_html, &ctx);
+
+    attr_node = node_new_element("a");
+    for (int i = 0; i < 16; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "data-k%d", i);
+        node_add_attr(attr_node, name, "value with \"quotes\" & <angles> and plain text");
+    }
+
+    wide_parent = node_new_element("ul");
+    for (int i = 0; i < 10000; i++) {
+        node_add_child(wide_parent, node_new_element("li"));
+    }
+
+    scopes = xmalloc(64 * sizeof(Scope));
+    Node *def = node_new_element("div");
+    for (int d = 0; d < 64; d++) {
+        scope_init(&scopes[d], d > 0 ? &scopes[d - 1] : NULL);
+        for (int k = 0; k < 8; k++) {
+            char name[32];
+            snprintf(name, sizeof(name), "comp-%d-%d", d, k);
+            scope_add_def(&scopes[d], name, def);
+        }
+    }
+    node_free(def);
+}
+
+/* ---- kernels ---- */
+
+/* FNV-1a over 64 KiB: scales with the machine, not with defsite. */
+static void k_calibrate(size_t iters) {
+    for (size_t i = 0; i < iters; i++) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (size_t j = 0; j < 65536; j++) {
+            h = (h ^ (unsigned char)text_64k[j]) * 0x100000001b3ull;
+        }
+        sink += (size_t)h;
+    }
+}
+
+static void k_parse_html(size_t iters) {
+    for (size_t i = 0; i < iters; i++) {
+        BuildCtx ctx = quiet_ctx();
+        Node *doc = parse_html(page_html, &ctx);
+        sink += doc->child_count;
+        node_free(doc);
+    }
+}
+
+static void k_find_ci(size_t iters) {
+    for (size_t i = 0; i < iters; i++) {
+        sink += find_ci(text_64k, 65536, 0, "</SCRIPT>");
+    }
+}
+
+static void k_escape_html_text(size_t iters) {
+    for (size_t i = 0; i < iters; i++) {
+        char *out = escape_html_text(text_64k);
+        sink += (size_t)out[0];
+        xfree(out);
+    }
+}
+
+static void k_serialize_attr(size_t iters) {
+    StrBuf b = {0};
+    for (size_t i = 0; i < iters; i++) {
+        b.len = 0;
+        serialize_node(&b, attr_node);
+        sink += b.len;
+    }
+    xfree(b.data);
+}
+
+static void k_serialize_page(size_t iters) {
+    StrBuf b = {0};
+    for (size_t i = 0; i < iters; i++) {
+        b.len = 0;
+        serialize_node(&b, page_doc);
+        sink += b.len;
+    }
+    xfree(b.data);
+}
+
+static void k_node_clone(size_t iters) {
+    for (size_t i = 0; i < iters; i++) {
+        Node *copy = node_clone(page_doc);
+        sink += copy->child_count;
+        node_free(copy);
+    }
+}
+
+/* One op = splice two nodes in at the front of 10k children, then remove one. */
+static void k_node_replace_child_wide(size_t iters) {
+    for (size_t i = 0; i < iters; i++) {
+        Node *two[2] = {node_new_element("li"), node_new_element("li")};
+        node_replace_child(wide_parent, 0, two, 2);
+        node_replace_child(wide_parent, 0, NULL, 0);
+        sink += wide_parent->child_count;
+    }
+}
+
+static void resolve_at_depth(size_t iters, int depth) {
+    for (size_t i = 0; i < iters; i++) {
+        DefEntry *e = scope_resolve(&scopes[depth - 1], "comp-0-7");
+        sink += (size_t)(e != NULL);
+    }
+}
+
+static void k_scope_resolve_d1(size_t iters) {
+    resolve_at_depth(iters, 1);
+}
+
+static void k_scope_resolve_d8(size_t iters) {
+    resolve_at_depth(iters, 8);
+}
+
+static void k_scope_resolve_d64(size_t iters) {
+    resolve_at_depth(iters, 64);
+}
+
+static void k_json_append_escaped(size_t iters) {
+    StrBuf b = {0};
+    for (size_t i = 0; i < iters; i++) {
+        b.len = 0;
+        json_append_escaped(&b, json_64k);
+        sink += b.len;
+    }
+    xfree(b.data);
+}
+
+/* ---- harness ---- */
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void measure(Kernel *k) {
+    size_t iters = 1;
+    for (;;) {
+        uint64_t start = now_ns();
+        k->run(iters);
+        uint64_t took = now_ns() - start;
+        if (took >= SAMPLE_NS / 4 || iters >= ((size_t)1 << 40)) {
+            iters = took > 0 ? (size_t)((double)iters * (double)SAMPLE_NS / (double)took) + 1 : iters * 16;
+            break;
+        }
+        iters *= 4;
+    }
+
+    k->run(iters);
+    double samples[SAMPLES];
+    double sum = 0;
+    for (int s = 0; s < SAMPLES; s++) {
+        uint64_t start = now_ns();
+        k->run(iters);
+        samples[s] = (double)(now_ns() - start) / (double)iters;
+        sum += samples[s];
+    }
+    qsort(samples, SAMPLES, sizeof(double), cmp_double);
+    double mean = sum / SAMPLES;
+    double var = 0;
+    for (int s = 0; s < SAMPLES; s++) {
+        var += (samples[s] - mean) * (samples[s] - mean);
+    }
+    k->median_ns = samples[SAMPLES / 2];
+    k->min_ns = samples[0];
+    k->stddev_ns = sqrt(var / (SAMPLES - 1));
+}
+
+/* Threshold file lines: "<kernel> <ratio> [tolerance_percent]", where ratio
+ * is the kernel's fastest sample over the calibration kernel's (the minimum
+ * is far steadier than the median on a shared machine); '#' starts a
+ * comment. */
+static double calib_ratio(const Kernel *k, const Kernel *calibration) {
+    return k->min_ns / calibration->min_ns;
+}
+
+static int check_thresholds(const char *path, const Kernel *calibration, Kernel *kernels, size_t count, bool strict) {
+    char *text = read_file(path);
+    if (!text) {
+        fprintf(stderr, "failed to read threshold file %s\n", path);
+        return 2;
+    }
+    int failures = 0;
+    for (char *line = strtok(text, "\n"); line; line = strtok(NULL, "\n")) {
+        char name[128];
+        double limit = 0;
+        double tolerance = DEFAULT_TOLERANCE;
+        if (line[0] == '#' || sscanf(line, "%127s %lf %lf", name, &limit, &tolerance) < 2) {
+            continue;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (!str_eq(kernels[i].name, name) || kernels[i].median_ns == 0) {
+                continue;
+            }
+            double ratio = calib_ratio(&kernels[i], calibration);
+            double allowed = limit * (1.0 + tolerance / 100.0);
+            if (ratio > allowed) {
+                printf("%s %s: %.4g x calibrate > %.4g (threshold %.4g + %.0f%%)\n",
+                       strict ? "REGRESSION" : "SLOWER",
+                       name,
+                       ratio,
+                       allowed,
+                       limit,
+                       tolerance);
+                failures++;
+            }
+        }
+    }
+    xfree(text);
+    return failures > 0 && strict ? 1 : 0;
+}
+
+static void write_thresholds(const char *path, const Kernel *calibration, const Kernel *kernels, size_t count) {
+    StrBuf out = {0};
+    char line[256];
+    sb_append(&out, "# kernel ratio_to_calibrate tolerance_percent (regenerate with: make microbench MICRO_ARGS=--update)\n");
+    for (size_t i = 0; i < count; i++) {
+        snprintf(line, sizeof(line), "%s %.4g %.0f\n", kernels[i].name, calib_ratio(&kernels[i], calibration), DEFAULT_TOLERANCE);
+        sb_append(&out, line);
+    }
+    if (!write_file(path, out.data)) {
+        fprintf(stderr, "failed to write %s\n", path);
+    }
+    xfree(out.data);
+}
+
+/* MB/s as text; "-" (or null in JSON) for kernels without a byte size. */
+static void format_mbps(const Kernel *k, const char *none, char *buf, size_t size) {
+    if (k->bytes_per_op == 0 || k->median_ns == 0) {
+        snprintf(buf, size, "%s", none);
+    } else {
+        snprintf(buf, size, "%.1f", (double)k->bytes_per_op / k->median_ns * 1e3);
+    }
+}
+
+static void write_json(const char *path, const Kernel *kernels, size_t count) {
+    StrBuf out = {0};
+    char line[512];
+    char mbps[32];
+    sb_append(&out, "[\n");
+    for (size_t i = 0; i < count; i++) {
+        format_mbps(&kernels[i], "null", mbps, sizeof(mbps));
+        snprintf(line,
+                 sizeof(line),
+                 "  {\"kernel\": \"%s\", \"median_ns\": %.2f, \"min_ns\": %.2f, \"stddev_ns\": %.2f, \"mb_per_s\": %s}%s\n",
+                 kernels[i].name,
+                 kernels[i].median_ns,
+                 kernels[i].min_ns,
+                 kernels[i].stddev_ns,
+                 mbps,
+                 i + 1 < count ? "," : "");
+        sb_append(&out, line);
+    }
+    sb_append(&out, "]\n");
+    if (!write_file(path, out.data)) {
+        fprintf(stderr, "failed to write %s\n", path);
+    }
+    xfree(out.data);
+}
+
+int main(int argc, char **argv) {
+    const char *thresholds = NULL;
+    const char *json = NULL;
+    const char *filter = NULL;
+    bool update = false;
+    bool strict = false;
+    for (int i = 1; i < argc; i++) {
+        if (starts_with(argv[i], "--thresholds=")) {
+            thresholds = argv[i] + 13;
+        } else if (starts_with(argv[i], "--json=")) {
+            json = argv[i] + 7;
+        } else if (starts_with(argv[i], "--filter=")) {
+            filter = argv[i] + 9;
+        } else if (str_eq(argv[i], "--update")) {
+            update = true;
+        } else if (str_eq(argv[i], "--strict")) {
+            strict = true;
+        } else {
+            fprintf(stderr, "Usage: %s [--filter=SUBSTR] [--json=FILE] [--thresholds=FILE [--update | --strict]]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    setup();
+    Kernel calibration = {"calibrate", k_calibrate, 65536, 0, 0, 0};
+    Kernel kernels[] = {
+        {"parse_html", k_parse_html, 0, 0, 0, 0},
+        {"find_ci_64k", k_find_ci, 65536, 0, 0, 0},
+        {"escape_html_text_64k", k_escape_html_text, 65536, 0, 0, 0},
+        {"serialize_attr_x16", k_serialize_attr, 0, 0, 0, 0},
+        {"serialize_node_page", k_serialize_page, 0, 0, 0, 0},
+        {"node_clone_page", k_node_clone, 0, 0, 0, 0},
+        {"node_replace_child_10k", k_node_replace_child_wide, 0, 0, 0, 0},
+        {"scope_resolve_depth1", k_scope_resolve_d1, 0, 0, 0, 0},
+        {"scope_resolve_depth8", k_scope_resolve_d8, 0, 0, 0, 0},
+        {"scope_resolve_depth64", k_scope_resolve_d64, 0, 0, 0, 0},
+        {"json_append_escaped_64k", k_json_append_escaped, 65536, 0, 0, 0},
+    };
+    kernels[0].bytes_per_op = page_len;
+    size_t count = sizeof(kernels) / sizeof(kernels[0]);
+
+    printf("%-26s %12s %12s %10s %10s %10s\n", "kernel", "median ns", "min ns", "stddev %", "MB/s", "x calib");
+    /* Always measured first: the other kernels are judged against it. */
+    measure(&calibration);
+    char mbps[32];
+    for (size_t i = 0; i <= count; i++) {
+        Kernel *k = i == 0 ? &calibration : &kernels[i - 1];
+        if (i > 0 && filter && !strstr(k->name, filter)) {
+            continue;
+        }
+        if (i > 0) {
+            measure(k);
+        }
+        format_mbps(k, "-", mbps, sizeof(mbps));
+        printf("%-26s %12.1f %12.1f %10.1f %10s %10.4g\n",
+               k->name,
+               k->median_ns,
+               k->min_ns,
+               k->stddev_ns / k->median_ns * 100.0,
+               mbps,
+               calib_ratio(k, &calibration));
+        fflush(stdout);
+    }
+
+    if (json) {
+        write_json(json, kernels, count);
+    }
+    if (thresholds && update) {
+        write_thresholds(thresholds, &calibration, kernels, count);
+        printf("Wrote %s\n", thresholds);
+        return 0;
+    }
+    return thresholds ? check_thresholds(thresholds, &calibration, kernels, count, strict) : 0;
+}
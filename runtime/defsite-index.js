@@ -0,0 +1,144 @@
+// Decoder for search-index.bin (written by `defsite --index-binary`).
+//
+//   const index = DefsiteIndex.decode(await (await fetch("search-index.bin")).arrayBuffer());
+//   index.length, index.url(i), index.get(i, "tags"), index.record(i), index.records()
+//
+// Columns are read through typed arrays over the fetched buffer; strings are
+// decoded on first use. record(i) returns the same { url, meta } shape as
+// search-index.json, with every meta value as a string.
+(function (global) {
+  const MAGIC = "DSX1";
+  const HEADER_SIZE = 32;
+  const COLUMN_SIZE = 20;
+  const INT_MISSING = -2147483648;
+
+  const COLUMN_STRING = 0;
+  const COLUMN_INT = 1;
+  const COLUMN_DATE = 2;
+  const COLUMN_LIST = 3;
+
+  function pad2(n) {
+    return n < 10 ? "0" + n : String(n);
+  }
+
+  function decode(buffer) {
+    const view = new DataView(buffer);
+    const magic = String.fromCharCode(
+      view.getUint8(0),
+      view.getUint8(1),
+      view.getUint8(2),
+      view.getUint8(3),
+    );
+    if (magic !== MAGIC || view.getUint32(4, true) !== 1) {
+      throw new Error("not a defsite binary index (version 1)");
+    }
+
+    const count = view.getUint32(8, true);
+    const columnCount = view.getUint32(12, true);
+    const stringCount = view.getUint32(16, true);
+    const offsets = new Uint32Array(buffer, view.getUint32(20, true), stringCount + 1);
+    const bytes = new Uint8Array(buffer, view.getUint32(24, true), view.getUint32(28, true));
+    const textDecoder = new TextDecoder();
+    const cache = new Array(stringCount);
+
+    function string(id) {
+      let value = cache[id];
+      if (value === undefined) {
+        value = textDecoder.decode(bytes.subarray(offsets[id], offsets[id + 1]));
+        cache[id] = value;
+      }
+      return value;
+    }
+
+    const columns = [];
+    const byName = new Map();
+    for (let c = 0; c < columnCount; c += 1) {
+      const base = HEADER_SIZE + c * COLUMN_SIZE;
+      const type = view.getUint32(base + 4, true);
+      const dataPos = view.getUint32(base + 12, true);
+      const column = {
+        name: string(view.getUint32(base, true)),
+        type,
+        present: new Uint8Array(buffer, view.getUint32(base + 8, true), Math.ceil(count / 8)),
+        data:
+          type === COLUMN_INT
+            ? new Int32Array(buffer, dataPos, count)
+            : new Uint32Array(buffer, dataPos, type === COLUMN_LIST ? count + 1 : count),
+        ids: null,
+      };
+      if (type === COLUMN_LIST) {
+        column.ids = new Uint32Array(buffer, view.getUint32(base + 16, true), column.data[count]);
+      }
+      columns.push(column);
+      if (c > 0 && !byName.has(column.name)) {
+        byName.set(column.name, column);
+      }
+    }
+
+    function has(column, i) {
+      return (column.present[i >> 3] & (1 << (i & 7))) !== 0;
+    }
+
+    // Typed value: string, number (int columns), "YYYY-MM-DD" (date
+    // columns), array of strings (list columns), or null when absent.
+    function value(column, i) {
+      if (!has(column, i)) {
+        return null;
+      }
+      switch (column.type) {
+        case COLUMN_INT:
+          return column.data[i] === INT_MISSING ? null : column.data[i];
+        case COLUMN_DATE: {
+          const ymd = column.data[i];
+          return `${Math.floor(ymd / 10000)}-${pad2(Math.floor(ymd / 100) % 100)}-${pad2(ymd % 100)}`;
+        }
+        case COLUMN_LIST: {
+          const out = [];
+          for (let k = column.data[i]; k < column.data[i + 1]; k += 1) {
+            out.push(string(column.ids[k]));
+          }
+          return out;
+        }
+        default:
+          return string(column.data[i]);
+      }
+    }
+
+    function record(i) {
+      const meta = {};
+      for (let c = 1; c < columns.length; c += 1) {
+        const v = value(columns[c], i);
+        if (v !== null) {
+          meta[columns[c].name] = Array.isArray(v) ? v.join(",") : String(v);
+        }
+      }
+      return { url: string(columns[0].data[i]), meta };
+    }
+
+    return {
+      length: count,
+      columns: columns.slice(1).map((column) => column.name),
+      url(i) {
+        return string(columns[0].data[i]);
+      },
+      get(i, name) {
+        const column = byName.get(name);
+        return column ? value(column, i) : null;
+      },
+      record,
+      records() {
+        const out = new Array(count);
+        for (let i = 0; i < count; i += 1) {
+          out[i] = record(i);
+        }
+        return out;
+      },
+    };
+  }
+
+  const api = { decode };
+  global.DefsiteIndex = api;
+  if (typeof module !== "undefined" && module.exports) {
+    module.exports = api;
+  }
+})(typeof window !== "undefined" ? window : globalThis);
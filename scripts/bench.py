@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""End-to-end build benchmark over generated synthetic sites.
+
+Generates each profile's site with scripts/gen-site.py (cached between runs),
+runs clean builds of it, and reports median wall time, pages/s, input MB/s
+and peak RSS. Results go to stdout as a table and to --out as JSON.
+
+With --baseline, exits non-zero when a profile's wall time or peak RSS
+regressed by more than --tolerance against that earlier results file.
+"""
+
+import argparse
+import json
+import os
+import platform
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+PROFILES = {
+    "small": ["--pages", "200", "--page-size", "4096"],
+    "medium": ["--pages", "2000", "--page-size", "8192"],
+    "large": ["--pages", "10000", "--page-size", "8192", "--components", "10", "--depth", "5"],
+    "deep": ["--pages", "500", "--page-size", "16384", "--components", "24", "--depth", "20", "--fanout", "4"],
+    "wide": ["--pages", "500", "--page-size", "65536", "--fanout", "8", "--bind-density", "1.0"],
+}
+
+
+def tree_size(path):
+    total = 0
+    files = 0
+    for dirpath, _, names in os.walk(path):
+        for name in names:
+            total += os.path.getsize(os.path.join(dirpath, name))
+            files += 1
+    return total, files
+
+
+def ensure_site(name, gen_args, work):
+    src = os.path.join(work, name, "src")
+    stamp_path = os.path.join(work, name, "params.json")
+    gen = os.path.join(ROOT, "scripts", "gen-site.py")
+    stamp = {"args": gen_args, "generator_mtime": os.path.getmtime(gen)}
+    try:
+        with open(stamp_path) as f:
+            if json.load(f) == stamp and os.path.isdir(src):
+                return src
+    except (OSError, ValueError):
+        pass
+    subprocess.run([sys.executable, gen, src] + gen_args, check=True)
+    with open(stamp_path, "w") as f:
+        json.dump(stamp, f)
+    return src
+
+
+def run_build(binary, defsite_args, src, out):
+    if os.path.isdir(out):
+        shutil.rmtree(out)
+    start = time.perf_counter()
+    proc = subprocess.Popen([binary] + defsite_args + [src, out], stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    stderr = proc.stderr.read()
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.perf_counter() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode != 0:
+        sys.stderr.write(stderr.decode(errors="replace"))
+        raise SystemExit(f"build of {src} failed with exit code {proc.returncode}")
+    m = re.search(rb"with (\d+) warning", stderr)
+    return wall, usage.ru_maxrss, int(m.group(1)) if m else 0
+
+
+def git_commit():
+    try:
+        return subprocess.run(["git", "rev-parse", "HEAD"], cwd=ROOT, capture_output=True, text=True, check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return ""
+
+
+def compare(results, baseline_path, tolerance):
+    with open(baseline_path) as f:
+        baseline = {p["name"]: p for p in json.load(f)["profiles"]}
+    failed = False
+    for p in results["profiles"]:
+        base = baseline.get(p["name"])
+        if not base:
+            continue
+        for key in ("wall_s", "peak_rss_kb"):
+            if base[key] > 0 and p[key] > base[key] * (1 + tolerance):
+                print(f"REGRESSION {p['name']} {key}: {base[key]} -> {p[key]} (+{(p[key] / base[key] - 1) * 100:.1f}%)")
+                failed = True
+    return failed
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("--profiles", default="small,medium", help=f"comma list of: {', '.join(PROFILES)}")
+    p.add_argument("--repeat", type=int, default=3)
+    p.add_argument("--binary", default=os.path.join(ROOT, "bin", "defsite"))
+    p.add_argument("--defsite-args", default="", help="extra build flags, e.g. '--io=uring --minify'")
+    p.add_argument("--work", default=os.path.join(ROOT, "generated", "bench"))
+    p.add_argument("--out", default=None, help="results JSON (default: <work>/results.json)")
+    p.add_argument("--baseline", default=None, help="earlier results JSON to compare against")
+    p.add_argument("--tolerance", type=float, default=0.10)
+    args = p.parse_args()
+
+    defsite_args = args.defsite_args.split()
+    results = {
+        "commit": git_commit(),
+        "timestamp": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "machine": {"platform": platform.platform(), "cpus": os.cpu_count()},
+        "defsite_args": defsite_args,
+        "profiles": [],
+    }
+
+    print(f"{'profile':<10} {'pages':>7} {'input MB':>9} {'wall s':>8} {'pages/s':>9} {'MB/s':>8} {'peak RSS MB':>12}")
+    for name in [n.strip() for n in args.profiles.split(",") if n.strip()]:
+        if name not in PROFILES:
+            raise SystemExit(f"unknown profile '{name}'")
+        src = ensure_site(name, PROFILES[name], args.work)
+        out = os.path.join(args.work, name, "out")
+        input_bytes, _ = tree_size(src)
+        pages = sum(1 for _, _, names in os.walk(src) for n in names if n.endswith(".html"))
+
+        _, _, warnings = run_build(args.binary, defsite_args, src, out)  # also warms the page cache
+        walls = []
+        rss = 0
+        for _ in range(max(1, args.repeat)):
+            wall, peak, _ = run_build(args.binary, defsite_args, src, out)
+            walls.append(wall)
+            rss = max(rss, peak)
+        output_bytes, _ = tree_size(out)
+        wall = statistics.median(walls)
+
+        entry = {
+            "name": name,
+            "generator_args": PROFILES[name],
+            "pages": pages,
+            "input_bytes": input_bytes,
+            "output_bytes": output_bytes,
+            "runs_s": [round(w, 4) for w in walls],
+            "wall_s": round(wall, 4),
+            "pages_per_s": round(pages / wall, 1),
+            "mb_per_s": round(input_bytes / wall / 1e6, 2),
+            "peak_rss_kb": rss,
+            "warnings": warnings,
+        }
+        results["profiles"].append(entry)
+        print(
+            f"{name:<10} {pages:>7} {input_bytes / 1e6:>9.1f} {wall:>8.3f} {entry['pages_per_s']:>9.0f} "
+            f"{entry['mb_per_s']:>8.1f} {rss / 1024:>12.1f}"
+        )
+
+    out_path = args.out or os.path.join(args.work, "results.json")
+    os.makedirs(os.path.dirname(out_path), exist_ok=True)
+    with open(out_path, "w") as f:
+        json.dump(results, f, indent=2)
+        f.write("\n")
+    print(f"Results: {out_path}")
+
+    if args.baseline and compare(results, args.baseline, args.tolerance):
+        raise SystemExit(1)
+
+
+if __name__ == "__main__":
+    main()
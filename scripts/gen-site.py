@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""Generate a seeded synthetic DefSite source tree for scaling benchmarks.
+
+The same seed and knobs always produce byte-identical output.
+
+Each page defines `--components` components inline (there is no cross-file
+import), where component i invokes component i+1 around its slot until
+`--depth` is reached, so one top-level invocation expands `--depth` levels.
+Every component also exposes `--fanout` named slots that invocations fill.
+"""
+
+import argparse
+import os
+import random
+import shutil
+
+WORDS = (
+    "alpha beta cache compile deploy engine fetch graph hash index join kernel "
+    "layout merge node output parse query render scope slot token update vector "
+    "write yield zone buffer cursor delta entry frame gather header input layer"
+).split()
+
+TAGS = "c rust lisp systems tooling compiler parser profiling cache security build web".split()
+
+
+def words(rng, n):
+    return " ".join(rng.choice(WORDS) for _ in range(n))
+
+
+def bind_names(args):
+    """Bind sites per component: title and href, plus up to 8 more by density."""
+    return ["title", "href"] + [f"v{k}" for k in range(round(args.bind_density * 8))]
+
+
+def bind_attrs(rng, args, n):
+    values = {"title": words(rng, 3), "href": f"/p/{n}.html"}
+    return "".join(f' {name}="{values.get(name) or words(rng, 1)}"' for name in bind_names(args))
+
+
+def component_defs(rng, args):
+    out = []
+    extra = "".join(f'<span><bind name="{name}"></bind></span>' for name in bind_names(args)[2:])
+    for i in range(args.components):
+        inner = "<div><slot></slot></div>"
+        if i + 1 < min(args.depth, args.components):
+            inner = f"<div><c{i + 1}{bind_attrs(rng, args, i)}><slot></slot></c{i + 1}></div>"
+        named = "".join(f'<aside class="s{k}"><slot name="s{k}"></slot></aside>' for k in range(args.fanout))
+        out.append(
+            f"<def-c{i}>\n"
+            f'  <section class="c{i}">\n'
+            f'    <h3><bind name="title"></bind></h3>\n'
+            f'    <a bind-href="href" bind-aria-label="title">more</a>{extra}\n'
+            f"    {inner}\n"
+            f"    {named}\n"
+            f"  </section>\n"
+            f"</def-c{i}>\n"
+        )
+    return "".join(out)
+
+
+def invocation(rng, args, n):
+    comp = 0 if rng.random() < 0.5 else rng.randrange(args.components)
+    attrs = bind_attrs(rng, args, n)
+    slots = "".join(
+        f'<p slot="s{k}">{words(rng, 4)}</p>' for k in range(args.fanout) if rng.random() < 0.75
+    )
+    return f"<c{comp}{attrs}>\n  <p>{words(rng, 24)}</p>\n  {slots}\n</c{comp}>\n"
+
+
+def page(rng, args, n, assets):
+    meta = {
+        "kind": "post",
+        "slug": f"post-{n}",
+        "title": f"Post {n}: {words(rng, 4)}",
+        "summary": words(rng, 16),
+        "tags": ",".join(rng.sample(TAGS, 3)),
+        "published": f"20{rng.randrange(20, 27)}-{rng.randrange(1, 13):02d}-{rng.randrange(1, 29):02d}",
+        "time-min": str(rng.randrange(2, 30)),
+    }
+    for k in range(max(0, args.meta - len(meta))):
+        meta[f"f{k}"] = words(rng, 2)
+    meta = dict(list(meta.items())[: args.meta])
+    attrs = "".join(f'\n  data-{k}="{v}"' for k, v in meta.items())
+
+    head = '<meta charset="utf-8">\n'
+    for asset in assets[:3]:
+        if asset.endswith(".css"):
+            head += f'<link rel="stylesheet" href="/{asset}">\n'
+        elif asset.endswith(".js"):
+            head += f'<script src="/{asset}"></script>\n'
+
+    body = [component_defs(rng, args)]
+    size = sum(len(b) for b in body)
+    i = 0
+    while size < args.page_size:
+        block = invocation(rng, args, n * 1000 + i)
+        body.append(block)
+        size += len(block)
+        i += 1
+    return f"<!doctype html>\n<html lang=\"en\"{attrs}>\n<head>\n{head}</head>\n<body>\n{''.join(body)}</body>\n</html>\n"
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("out", help="source directory to (re)create")
+    p.add_argument("--seed", type=int, default=1)
+    p.add_argument("--pages", type=int, default=1000)
+    p.add_argument("--page-size", type=int, default=8192, help="approximate body bytes per page")
+    p.add_argument("--components", type=int, default=6)
+    p.add_argument("--depth", type=int, default=3, help="component nesting depth per invocation")
+    p.add_argument("--fanout", type=int, default=2, help="named slots per component")
+    p.add_argument("--bind-density", type=float, default=0.5, help="0-1: extra <bind> sites per component (up to 8)")
+    p.add_argument("--assets", type=int, default=20)
+    p.add_argument("--asset-size", type=int, default=16384)
+    p.add_argument("--meta", type=int, default=7, help="data-* keys per page")
+    p.add_argument("--pages-per-dir", type=int, default=1000)
+    args = p.parse_args()
+    args.components = max(1, args.components)
+
+    rng = random.Random(args.seed)
+    if os.path.isdir(args.out):
+        shutil.rmtree(args.out)
+    os.makedirs(os.path.join(args.out, "assets"))
+
+    exts = ["css", "js", "png", "svg"]
+    assets = []
+    for a in range(args.assets):
+        name = f"assets/a{a}.{exts[a % len(exts)]}"
+        assets.append(name)
+        with open(os.path.join(args.out, name), "wb") as f:
+            f.write(rng.randbytes(args.asset_size) if name.endswith(".png") else words(rng, args.asset_size // 6).encode())
+
+    for n in range(args.pages):
+        d = os.path.join(args.out, "posts", f"{n // args.pages_per_dir:04d}")
+        os.makedirs(d, exist_ok=True)
+        with open(os.path.join(d, f"post-{n}.html"), "w") as f:
+            f.write(page(rng, args, n, assets))
+
+    with open(os.path.join(args.out, "index.html"), "w") as f:
+        f.write(f"<!doctype html>\n<html>\n<body>\n<h1>Synthetic site</h1>\n<p>{args.pages} pages</p>\n</body>\n</html>\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,409 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef DEFSITE_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef DEFSITE_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define ARCHIVE_BUFFER_SIZE (1u << 20)
+
+/* --archive=FILE: outputs under the output directory are appended to one
+ * tar or zip stream instead of being written as files. Build state
+ * (.defsite-*) stays on disk so incremental indexing still works. All
+ * writes to the archive are sequential and go through one large buffer.
+ * This file owns the stream and its compression; the member formats are
+ * in archivetar.c and archivezip.c. */
+static struct {
+    bool enabled;
+    ArchiveFormat format;
+    char *out_dir;
+    size_t out_dir_len;
+    char *path;
+    FILE *out;
+    bool failed;
+    uint64_t offset;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    size_t files;
+    char *oversize;
+    time_t mtime;
+    StrMap dirs;
+    pthread_mutex_t lock;
+#ifdef DEFSITE_HAVE_ZLIB
+    z_stream gz;
+#endif
+#ifdef DEFSITE_HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+    char *packed;
+} state;
+
+bool archive_parse_format(const char *name, ArchiveFormat *format) {
+    if (str_eq(name, "tar")) {
+        *format = ARCHIVE_TAR;
+    } else if (str_eq(name, "tar.gz") || str_eq(name, "tgz")) {
+        *format = ARCHIVE_TAR_GZ;
+    } else if (str_eq(name, "tar.zst") || str_eq(name, "tzst")) {
+        *format = ARCHIVE_TAR_ZST;
+    } else if (str_eq(name, "zip")) {
+        *format = ARCHIVE_ZIP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* The format named by the archive's file extension, if any. */
+bool archive_format_for_path(const char *path, ArchiveFormat *format) {
+    static const char *const EXTS[] = {".tar.gz", ".tgz", ".tar.zst", ".tzst", ".tar", ".zip"};
+    size_t len = strlen(path);
+    for (size_t i = 0; i < sizeof(EXTS) / sizeof(EXTS[0]); i++) {
+        size_t n = strlen(EXTS[i]);
+        if (len > n && str_eq(path + len - n, EXTS[i])) {
+            return archive_parse_format(EXTS[i] + 1, format);
+        }
+    }
+    return false;
+}
+
+bool archive_format_available(ArchiveFormat format) {
+#ifndef DEFSITE_HAVE_ZLIB
+    if (format == ARCHIVE_TAR_GZ) {
+        return false;
+    }
+#endif
+#ifndef DEFSITE_HAVE_ZSTD
+    if (format == ARCHIVE_TAR_ZST) {
+        return false;
+    }
+#endif
+    (void)format;
+    return true;
+}
+
+static void sink_raw(const void *data, size_t len) {
+    if (len > 0 && !state.failed && fwrite(data, 1, len, state.out) != len) {
+        state.failed = true;
+    }
+    state.bytes_out += len;
+}
+
+/* Everything written to the archive passes through here, compressed for
+ * tar.gz and tar.zst. finish flushes the compressor's last frame. */
+static void sink(const void *data, size_t len, bool finish) {
+    state.offset += len;
+    switch (state.format) {
+    case ARCHIVE_TAR:
+    case ARCHIVE_ZIP:
+        sink_raw(data, len);
+        break;
+    case ARCHIVE_TAR_GZ:
+#ifdef DEFSITE_HAVE_ZLIB
+        state.gz.next_in = (Bytef *)data;
+        state.gz.avail_in = (uInt)len;
+        for (;;) {
+            state.gz.next_out = (Bytef *)state.packed;
+            state.gz.avail_out = ARCHIVE_BUFFER_SIZE;
+            int rc = deflate(&state.gz, finish ? Z_FINISH : Z_NO_FLUSH);
+            sink_raw(state.packed, ARCHIVE_BUFFER_SIZE - state.gz.avail_out);
+            if (rc == Z_STREAM_ERROR) {
+                state.failed = true;
+                break;
+            }
+            if (finish ? rc == Z_STREAM_END : state.gz.avail_in == 0 && state.gz.avail_out != 0) {
+                break;
+            }
+        }
+#endif
+        break;
+    case ARCHIVE_TAR_ZST:
+#ifdef DEFSITE_HAVE_ZSTD
+    {
+        ZSTD_inBuffer in = {data, len, 0};
+        for (;;) {
+            ZSTD_outBuffer out = {state.packed, ARCHIVE_BUFFER_SIZE, 0};
+            size_t rc = ZSTD_compressStream2(state.zstd, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+            sink_raw(state.packed, out.pos);
+            if (ZSTD_isError(rc)) {
+                state.failed = true;
+                break;
+            }
+            if (finish ? rc == 0 : in.pos == in.size) {
+                break;
+            }
+        }
+    }
+#endif
+        break;
+    }
+}
+
+void archive_sink(const void *data, size_t len) {
+    sink(data, len, false);
+}
+
+/* Bytes written so far, before compression. */
+uint64_t archive_offset(void) {
+    return state.offset;
+}
+
+int64_t archive_mtime(void) {
+    return (int64_t)state.mtime;
+}
+
+bool archive_init(const BuildOptions *opts) {
+    memset(&state, 0, sizeof(state));
+    strmap_init(&state.dirs);
+    if (!opts->archive_path) {
+        return true;
+    }
+    archive_zip_init();
+    state.format = opts->archive_format;
+    state.out_dir = xstrdup(opts->out_dir);
+    state.out_dir_len = strlen(state.out_dir);
+    while (state.out_dir_len > 1 && state.out_dir[state.out_dir_len - 1] == '/') {
+        state.out_dir[--state.out_dir_len] = '\0';
+    }
+    state.path = xstrdup(opts->archive_path);
+
+    /* Reproducible archives: SOURCE_DATE_EPOCH wins over the clock. */
+    const char *epoch = getenv("SOURCE_DATE_EPOCH");
+    state.mtime = epoch && *epoch ? (time_t)strtoll(epoch, NULL, 10) : time(NULL);
+
+    if (str_eq(state.path, "-")) {
+        if (isatty(STDOUT_FILENO)) {
+            fprintf(stderr, "refusing to write an archive to a terminal; redirect stdout or pass --archive=FILE\n");
+            return false;
+        }
+        /* The archive keeps the real stdout; per-file progress lines that
+         * go to stdout are sent to stderr instead. */
+        int fd = dup(STDOUT_FILENO);
+        state.out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+        if (state.out) {
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        }
+    } else {
+        state.out = fopen(state.path, "wb");
+    }
+    if (!state.out) {
+        fprintf(stderr, "cannot open archive %s: %s\n", state.path, strerror(errno));
+        return false;
+    }
+    setvbuf(state.out, NULL, _IOFBF, ARCHIVE_BUFFER_SIZE);
+
+    if (state.format == ARCHIVE_TAR_GZ || state.format == ARCHIVE_TAR_ZST) {
+        state.packed = xmalloc(ARCHIVE_BUFFER_SIZE);
+    }
+#ifdef DEFSITE_HAVE_ZLIB
+    if (state.format == ARCHIVE_TAR_GZ && deflateInit2(&state.gz, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "cannot start gzip stream for %s\n", state.path);
+        return false;
+    }
+#endif
+#ifdef DEFSITE_HAVE_ZSTD
+    if (state.format == ARCHIVE_TAR_ZST) {
+        state.zstd = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(state.zstd, ZSTD_c_compressionLevel, 3);
+    }
+#endif
+    pthread_mutex_init(&state.lock, NULL);
+    state.enabled = true;
+    return true;
+}
+
+bool archive_enabled(void) {
+    return state.enabled;
+}
+
+/* True for outputs that go into the archive: paths below the output
+ * directory other than build state. */
+bool archive_claims(const char *path) {
+    if (!state.enabled || strncmp(path, state.out_dir, state.out_dir_len) != 0 || path[state.out_dir_len] != '/') {
+        return false;
+    }
+    const char *base = strrchr(path, '/') + 1;
+    return path[state.out_dir_len + 1] != '\0' && !starts_with(base, ".defsite-");
+}
+
+static const char *member_name(const char *path) {
+    const char *rel = path + state.out_dir_len;
+    while (*rel == '/') {
+        rel++;
+    }
+    return rel;
+}
+
+/* Emits entries for the directories above name that are not in yet. */
+static void add_parent_dirs(const char *name) {
+    for (const char *p = strchr(name, '/'); p; p = strchr(p + 1, '/')) {
+        char *dir = substr_dup(name, 0, (size_t)(p - name) + 1);
+        if (strmap_contains(&state.dirs, dir)) {
+            xfree(dir);
+            continue;
+        }
+        strmap_put(&state.dirs, dir, NULL);
+        if (state.format == ARCHIVE_ZIP) {
+            archive_zip_dir(dir);
+        } else {
+            archive_tar_header(dir, 0, '5', 0755);
+        }
+        xfree(dir);
+    }
+}
+
+static bool too_large_for_zip(const char *name, uint64_t size) {
+    if (state.format != ARCHIVE_ZIP || archive_zip_fits(size)) {
+        return false;
+    }
+    if (!state.oversize) {
+        state.oversize = xstrdup(name);
+    }
+    return true;
+}
+
+/* Appends one in-memory output. Safe to call from compression workers. */
+bool archive_add(const char *path, const char *data, size_t len) {
+    const char *name = member_name(path);
+    pthread_mutex_lock(&state.lock);
+    if (too_large_for_zip(name, len)) {
+        pthread_mutex_unlock(&state.lock);
+        return false;
+    }
+    add_parent_dirs(name);
+    if (state.format == ARCHIVE_ZIP) {
+        archive_zip_member(name, data, len);
+    } else {
+        archive_tar_member(name, data, len);
+    }
+    state.files++;
+    state.bytes_in += len;
+    bool ok = !state.failed;
+    pthread_mutex_unlock(&state.lock);
+    return ok;
+}
+
+/* Appends a file from disk in chunks, for assets too large to hold. */
+bool archive_add_file(const char *path, const char *src_path) {
+    const char *name = member_name(path);
+    FILE *in = fopen(src_path, "rb");
+    struct stat st;
+    if (!in || fstat(fileno(in), &st) != 0) {
+        if (in) {
+            fclose(in);
+        }
+        return false;
+    }
+    uint64_t size = (uint64_t)st.st_size;
+    pthread_mutex_lock(&state.lock);
+    bool ok = !too_large_for_zip(name, size);
+    if (ok) {
+        add_parent_dirs(name);
+        if (state.format == ARCHIVE_ZIP) {
+            archive_zip_begin(name);
+        } else {
+            archive_tar_header(name, size, '0', 0644);
+        }
+    }
+    /* The header promised size bytes; a file that changes underneath is an
+     * error rather than a corrupt archive. */
+    char buf[65536];
+    uint64_t done = 0;
+    uint32_t crc = 0;
+    while (ok && done < size) {
+        size_t want = size - done < sizeof(buf) ? (size_t)(size - done) : sizeof(buf);
+        size_t got = fread(buf, 1, want, in);
+        if (got != want) {
+            ok = false;
+            state.failed = true;
+            break;
+        }
+        crc = archive_zip_crc(crc, buf, got);
+        sink(buf, got, false);
+        done += got;
+    }
+    if (ok && state.format == ARCHIVE_ZIP) {
+        archive_zip_end(crc, size);
+    } else if (ok) {
+        archive_tar_pad(size);
+    }
+    fclose(in);
+    if (ok) {
+        state.files++;
+        state.bytes_in += size;
+    }
+    ok = ok && !state.failed;
+    pthread_mutex_unlock(&state.lock);
+    return ok;
+}
+
+static const char *format_name(ArchiveFormat format) {
+    switch (format) {
+    case ARCHIVE_TAR_GZ:
+        return "tar.gz";
+    case ARCHIVE_TAR_ZST:
+        return "tar.zst";
+    case ARCHIVE_ZIP:
+        return "zip";
+    case ARCHIVE_TAR:
+        break;
+    }
+    return "tar";
+}
+
+void archive_finish(BuildCtx *ctx) {
+    if (!state.enabled) {
+        return;
+    }
+    if (state.format == ARCHIVE_ZIP) {
+        archive_zip_finish();
+    } else {
+        archive_tar_finish();
+    }
+    sink(NULL, 0, true);
+    if (fclose(state.out) != 0) {
+        state.failed = true;
+    }
+    if (state.oversize) {
+        log_error(ctx, "%s is too large for a zip archive (4 GiB per file); use a tar archive", state.oversize);
+    }
+    if (state.failed) {
+        log_error(ctx, "failed to write archive %s", state.path);
+    } else {
+        fprintf(stderr,
+                "Archived %zu file(s) into %s (%s): %llu -> %llu bytes\n",
+                state.files,
+                str_eq(state.path, "-") ? "stdout" : state.path,
+                format_name(state.format),
+                (unsigned long long)state.bytes_in,
+                (unsigned long long)state.bytes_out);
+    }
+
+#ifdef DEFSITE_HAVE_ZLIB
+    if (state.format == ARCHIVE_TAR_GZ) {
+        deflateEnd(&state.gz);
+    }
+#endif
+#ifdef DEFSITE_HAVE_ZSTD
+    ZSTD_freeCCtx(state.zstd);
+#endif
+    archive_zip_free();
+    xfree(state.packed);
+    xfree(state.out_dir);
+    xfree(state.path);
+    xfree(state.oversize);
+    strmap_free(&state.dirs, NULL);
+    pthread_mutex_destroy(&state.lock);
+    state.enabled = false;
+}
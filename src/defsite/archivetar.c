@@ -0,0 +1,126 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define TAR_BLOCK 512
+
+/* The tar writer behind --archive: ustar headers, with a pax "path"
+ * record for names ustar cannot hold. Members go to the archive sink,
+ * which compresses for tar.gz and tar.zst; callers hold the archive lock. */
+
+/* Writes v as a NUL-terminated octal field, or base-256 when it does not
+ * fit (GNU and POSIX tars read both). */
+static void tar_number(char *field, size_t width, uint64_t v) {
+    uint64_t limit = 1ull << (3 * (width - 1));
+    if (v < limit) {
+        snprintf(field, width, "%0*llo", (int)(width - 1), (unsigned long long)v);
+        return;
+    }
+    memset(field, 0, width);
+    field[0] = (char)0x80;
+    for (size_t i = width - 1; i > 0 && v > 0; i--) {
+        field[i] = (char)(v & 0xff);
+        v >>= 8;
+    }
+}
+
+static void tar_block(const char *name, uint64_t size, char type, unsigned mode) {
+    char h[TAR_BLOCK];
+    memset(h, 0, sizeof(h));
+    size_t len = strlen(name);
+    if (len <= 100) {
+        memcpy(h, name, len);
+    } else {
+        /* ustar splits long names at a '/' into prefix (155) and name (100). */
+        const char *split = NULL;
+        for (const char *p = name + len - 101; p < name + len && !split; p++) {
+            if (*p == '/' && (size_t)(p - name) <= 155) {
+                split = p;
+            }
+        }
+        memcpy(h, split + 1, len - (size_t)(split - name) - 1);
+        memcpy(h + 345, name, (size_t)(split - name));
+    }
+    tar_number(h + 100, 8, mode);
+    tar_number(h + 108, 8, 0);
+    tar_number(h + 116, 8, 0);
+    tar_number(h + 124, 12, size);
+    tar_number(h + 136, 12, (uint64_t)archive_mtime());
+    h[156] = type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(h); i++) {
+        sum += (unsigned char)h[i];
+    }
+    snprintf(h + 148, 8, "%06o", sum);
+    archive_sink(h, sizeof(h));
+}
+
+/* Pads a member of size bytes out to the next block. */
+void archive_tar_pad(uint64_t size) {
+    static const char zeros[TAR_BLOCK];
+    size_t rem = (size_t)(size % TAR_BLOCK);
+    if (rem) {
+        archive_sink(zeros, TAR_BLOCK - rem);
+    }
+}
+
+/* True when ustar's name/prefix split cannot hold name. */
+static bool tar_needs_pax(const char *name) {
+    size_t len = strlen(name);
+    if (len <= 100) {
+        return false;
+    }
+    for (const char *p = name + (len > 101 ? len - 101 : 0); p < name + len; p++) {
+        if (*p == '/' && (size_t)(p - name) <= 155 && len - (size_t)(p - name) - 1 <= 100 && p > name) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* type is '0' for a file and '5' for a directory; size bytes of data and
+ * archive_tar_pad must follow a file's header. */
+void archive_tar_header(const char *name, uint64_t size, char type, unsigned mode) {
+    if (!tar_needs_pax(name)) {
+        tar_block(name, size, type, mode);
+        return;
+    }
+    /* A pax "path" record; its length prefix counts its own digits. */
+    size_t body = strlen(" path=\n") + strlen(name);
+    size_t total = body + 1;
+    while (total != body + (size_t)snprintf(NULL, 0, "%zu", total)) {
+        total = body + (size_t)snprintf(NULL, 0, "%zu", total);
+    }
+    StrBuf record = {0};
+    char digits[32];
+    snprintf(digits, sizeof(digits), "%zu", total);
+    sb_append(&record, digits);
+    sb_append(&record, " path=");
+    sb_append(&record, name);
+    sb_append(&record, "\n");
+    char short_name[101];
+    snprintf(short_name, sizeof(short_name), "PaxHeaders/%.88s", strrchr(name, '/') ? strrchr(name, '/') + 1 : name);
+    tar_block(short_name, record.len, 'x', 0644);
+    archive_sink(record.data, record.len);
+    archive_tar_pad(record.len);
+    xfree(record.data);
+    char fallback[101];
+    snprintf(fallback, sizeof(fallback), "%.100s", name);
+    tar_block(fallback, size, type, mode);
+}
+
+void archive_tar_member(const char *name, const char *data, size_t len) {
+    archive_tar_header(name, len, '0', 0644);
+    archive_sink(data, len);
+    archive_tar_pad(len);
+}
+
+/* Two zero blocks end the archive. */
+void archive_tar_finish(void) {
+    static const char zeros[TAR_BLOCK * 2];
+    archive_sink(zeros, sizeof(zeros));
+}
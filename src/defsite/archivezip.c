@@ -0,0 +1,278 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <string.h>
+#include <time.h>
+
+#ifdef DEFSITE_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define ZIP_MAX_32 0xffffffffu
+
+/* The zip writer behind --archive: local headers as members are added,
+ * the central directory (with zip64 records when needed) at the end.
+ * Members are deflated when zlib is built in and it makes them smaller.
+ * Callers hold the archive lock. */
+
+/* Central directory record for one zip member. */
+typedef struct {
+    char *name;
+    uint32_t crc;
+    uint64_t csize;
+    uint64_t usize;
+    uint64_t offset;
+    uint16_t method;
+    uint16_t flags;
+    bool is_dir;
+} ZipEntry;
+
+static struct {
+    ZipEntry *entries;
+    size_t count;
+    size_t cap;
+    uint32_t crc_table[256];
+} state;
+
+void archive_zip_init(void) {
+    memset(&state, 0, sizeof(state));
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        state.crc_table[i] = c;
+    }
+}
+
+uint32_t archive_zip_crc(uint32_t crc, const char *data, size_t len) {
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = state.crc_table[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/* Members are limited to 4 GiB: sizes in the local header and data
+ * descriptor are 32-bit. */
+bool archive_zip_fits(uint64_t size) {
+    return size < ZIP_MAX_32;
+}
+
+static void dos_time(uint16_t *time_out, uint16_t *date_out) {
+    time_t mtime = (time_t)archive_mtime();
+    struct tm tm;
+    gmtime_r(&mtime, &tm);
+    if (tm.tm_year < 80) {
+        tm.tm_year = 80;
+        tm.tm_mon = 0;
+        tm.tm_mday = 1;
+        tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    }
+    *time_out = (uint16_t)((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+    *date_out = (uint16_t)(((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+}
+
+static void put16(char *p, uint16_t v) {
+    p[0] = (char)(v & 0xff);
+    p[1] = (char)(v >> 8);
+}
+
+static void put32(char *p, uint32_t v) {
+    put16(p, (uint16_t)(v & 0xffff));
+    put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put64(char *p, uint64_t v) {
+    put32(p, (uint32_t)(v & 0xffffffffu));
+    put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static ZipEntry *zip_push(const char *name) {
+    if (state.count == state.cap) {
+        state.cap = state.cap == 0 ? 256 : state.cap * 2;
+        state.entries = xrealloc(state.entries, state.cap * sizeof(ZipEntry));
+    }
+    ZipEntry *e = &state.entries[state.count++];
+    memset(e, 0, sizeof(*e));
+    e->name = xstrdup(name);
+    e->offset = archive_offset();
+    return e;
+}
+
+/* Local header; bit 3 (data descriptor) leaves crc and sizes to follow
+ * the data. Bit 11 marks names as UTF-8. */
+static void zip_local_header(const ZipEntry *e) {
+    char h[30];
+    uint16_t t;
+    uint16_t d;
+    dos_time(&t, &d);
+    size_t name_len = strlen(e->name);
+    put32(h, 0x04034b50u);
+    put16(h + 4, 20);
+    put16(h + 6, e->flags);
+    put16(h + 8, e->method);
+    put16(h + 10, t);
+    put16(h + 12, d);
+    bool deferred = e->flags & 0x8;
+    put32(h + 14, deferred ? 0 : e->crc);
+    put32(h + 18, deferred ? 0 : (uint32_t)e->csize);
+    put32(h + 22, deferred ? 0 : (uint32_t)e->usize);
+    put16(h + 26, (uint16_t)name_len);
+    put16(h + 28, 0);
+    archive_sink(h, sizeof(h));
+    archive_sink(e->name, name_len);
+}
+
+#ifdef DEFSITE_HAVE_ZLIB
+static bool deflate_raw(const char *data, size_t len, StrBuf *out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (len > ZIP_MAX_32 || deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    uLong bound = deflateBound(&zs, (uLong)len);
+    out->data = xmalloc(bound);
+    out->cap = bound;
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = (uInt)len;
+    zs.next_out = (Bytef *)out->data;
+    zs.avail_out = (uInt)bound;
+    int rc = deflate(&zs, Z_FINISH);
+    out->len = zs.total_out;
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END;
+}
+#endif
+
+/* name ends with '/'. */
+void archive_zip_dir(const char *name) {
+    ZipEntry *e = zip_push(name);
+    e->flags = 0x800;
+    e->is_dir = true;
+    zip_local_header(e);
+}
+
+void archive_zip_member(const char *name, const char *data, size_t len) {
+    ZipEntry *e = zip_push(name);
+    e->flags = 0x800;
+    e->crc = archive_zip_crc(0, data, len);
+    e->usize = len;
+    e->csize = len;
+    const char *body = data;
+    StrBuf packed = {0};
+#ifdef DEFSITE_HAVE_ZLIB
+    if (deflate_raw(data, len, &packed) && packed.len < len) {
+        e->method = 8;
+        e->csize = packed.len;
+        body = packed.data;
+    }
+#endif
+    zip_local_header(e);
+    archive_sink(body, (size_t)e->csize);
+    xfree(packed.data);
+}
+
+/* A member whose data is streamed after its header, stored as is; the
+ * crc and size go in a data descriptor written by archive_zip_end. */
+void archive_zip_begin(const char *name) {
+    ZipEntry *e = zip_push(name);
+    e->flags = 0x808;
+    zip_local_header(e);
+}
+
+void archive_zip_end(uint32_t crc, uint64_t size) {
+    ZipEntry *e = &state.entries[state.count - 1];
+    e->crc = crc;
+    e->csize = size;
+    e->usize = size;
+    char d[16];
+    put32(d, 0x08074b50u);
+    put32(d + 4, crc);
+    put32(d + 8, (uint32_t)size);
+    put32(d + 12, (uint32_t)size);
+    archive_sink(d, sizeof(d));
+}
+
+/* Central directory, then zip64 end records when the entry count or the
+ * directory's offset overflow the classic fields. */
+void archive_zip_finish(void) {
+    uint64_t cd_start = archive_offset();
+    uint16_t t;
+    uint16_t d;
+    dos_time(&t, &d);
+    for (size_t i = 0; i < state.count; i++) {
+        const ZipEntry *e = &state.entries[i];
+        bool big_offset = e->offset >= ZIP_MAX_32;
+        char h[46];
+        char extra[12];
+        size_t name_len = strlen(e->name);
+        put32(h, 0x02014b50u);
+        put16(h + 4, (3 << 8) | 45);
+        put16(h + 6, big_offset ? 45 : 20);
+        put16(h + 8, e->flags);
+        put16(h + 10, e->method);
+        put16(h + 12, t);
+        put16(h + 14, d);
+        put32(h + 16, e->crc);
+        put32(h + 20, (uint32_t)e->csize);
+        put32(h + 24, (uint32_t)e->usize);
+        put16(h + 28, (uint16_t)name_len);
+        put16(h + 30, big_offset ? sizeof(extra) : 0);
+        put16(h + 32, 0);
+        put16(h + 34, 0);
+        put16(h + 36, 0);
+        put32(h + 38, (uint32_t)(e->is_dir ? 040755u : 0100644u) << 16 | (e->is_dir ? 0x10 : 0));
+        put32(h + 42, big_offset ? ZIP_MAX_32 : (uint32_t)e->offset);
+        archive_sink(h, sizeof(h));
+        archive_sink(e->name, name_len);
+        if (big_offset) {
+            put16(extra, 0x0001);
+            put16(extra + 2, 8);
+            put64(extra + 4, e->offset);
+            archive_sink(extra, sizeof(extra));
+        }
+    }
+    uint64_t cd_size = archive_offset() - cd_start;
+    bool zip64 = state.count >= 0xffff || cd_start >= ZIP_MAX_32 || cd_size >= ZIP_MAX_32;
+    if (zip64) {
+        uint64_t record_start = archive_offset();
+        char r[56];
+        put32(r, 0x06064b50u);
+        put64(r + 4, sizeof(r) - 12);
+        put16(r + 12, (3 << 8) | 45);
+        put16(r + 14, 45);
+        put32(r + 16, 0);
+        put32(r + 20, 0);
+        put64(r + 24, state.count);
+        put64(r + 32, state.count);
+        put64(r + 40, cd_size);
+        put64(r + 48, cd_start);
+        archive_sink(r, sizeof(r));
+        char l[20];
+        put32(l, 0x07064b50u);
+        put32(l + 4, 0);
+        put64(l + 8, record_start);
+        put32(l + 16, 1);
+        archive_sink(l, sizeof(l));
+    }
+    char end[22];
+    uint16_t count16 = zip64 ? 0xffff : (uint16_t)state.count;
+    put32(end, 0x06054b50u);
+    put16(end + 4, 0);
+    put16(end + 6, 0);
+    put16(end + 8, count16);
+    put16(end + 10, count16);
+    put32(end + 12, zip64 ? ZIP_MAX_32 : (uint32_t)cd_size);
+    put32(end + 16, zip64 ? ZIP_MAX_32 : (uint32_t)cd_start);
+    put16(end + 20, 0);
+    archive_sink(end, sizeof(end));
+}
+
+void archive_zip_free(void) {
+    for (size_t i = 0; i < state.count; i++) {
+        xfree(state.entries[i].name);
+    }
+    xfree(state.entries);
+    memset(&state, 0, sizeof(state));
+}
@@ -0,0 +1,358 @@
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BUILD_BATCH_SIZE 64
+#define BUILD_MAX_BATCHED_ASSET (8u * 1024u * 1024u)
+
+typedef struct {
+    char *src_path;
+    char *dst_path;
+    char *rel_path;
+    bool is_page;
+    bool streamed;
+    bool hash_only;
+} BuildJob;
+
+typedef struct {
+    BuildJob *items;
+    size_t count;
+    size_t cap;
+} JobList;
+
+/* Counts for --quiet, which prints these instead of one line per file. */
+typedef struct {
+    size_t done;
+    size_t total;
+    size_t pages;
+    size_t others;
+    bool tty;
+} BuildProgress;
+
+static void joblist_push(JobList *list, const char *src, const char *dst, const char *rel, bool is_page, bool streamed, bool hash_only) {
+    if (list->count == list->cap) {
+        size_t next = list->cap == 0 ? 64 : list->cap * 2;
+        list->items = xrealloc(list->items, next * sizeof(BuildJob));
+        list->cap = next;
+    }
+    BuildJob *job = &list->items[list->count++];
+    job->src_path = xstrdup(src);
+    job->dst_path = xstrdup(dst);
+    job->rel_path = xstrdup(rel);
+    job->is_page = is_page;
+    job->streamed = streamed;
+    job->hash_only = hash_only;
+}
+
+static void joblist_free(JobList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        xfree(list->items[i].src_path);
+        xfree(list->items[i].dst_path);
+        xfree(list->items[i].rel_path);
+    }
+    xfree(list->items);
+}
+
+/* Collection templates go to `collections` (with the directory their rows
+ * are written to) rather than `jobs`; their data files are not copied, and
+ * listing templates are left to the discovery index. */
+static void plan_directory(const char *src, const char *dst, const char *rel, JobList *jobs, JobList *collections, BuildCtx *ctx) {
+    if (ensure_dir(dst) != 0) {
+        log_error(ctx, "failed to create directory %s: %s", dst, strerror(errno));
+        return;
+    }
+
+    DIR *dir = opendir(src);
+    if (!dir) {
+        log_error(ctx, "failed to open directory %s: %s", src, strerror(errno));
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (str_eq(name, ".") || str_eq(name, "..")) {
+            continue;
+        }
+
+        char src_path[MAX_PATH_LEN];
+        char dst_path[MAX_PATH_LEN];
+        char rel_path[MAX_PATH_LEN];
+        snprintf(src_path, sizeof(src_path), "%s/%s", src, name);
+        snprintf(dst_path, sizeof(dst_path), "%s/%s", dst, name);
+        snprintf(rel_path, sizeof(rel_path), "%s%s%s", rel, rel[0] ? "/" : "", name);
+
+        struct stat st;
+        if (stat(src_path, &st) != 0) {
+            log_error(ctx, "stat failed for %s: %s", src_path, strerror(errno));
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            plan_directory(src_path, dst_path, rel_path, jobs, collections, ctx);
+            continue;
+        }
+
+        if (collection_is_template(src_path)) {
+            joblist_push(collections, src_path, dst, rel_path, true, false, false);
+            continue;
+        }
+        if (collection_is_data(src_path) || listing_is_template(src_path)) {
+            continue;
+        }
+
+        bool is_page = has_html_ext(src_path);
+        bool streamed = !is_page && (size_t)st.st_size > BUILD_MAX_BATCHED_ASSET;
+        /* Another shard writes this file; a fingerprinted asset is still
+         * hashed here so this shard's pages can refer to its hashed name. */
+        bool hash_only = !shard_owns(ctx->opts, rel_path);
+        if (hash_only && (is_page || !fingerprint_wants(rel_path))) {
+            continue;
+        }
+        joblist_push(jobs, src_path, dst_path, rel_path, is_page, streamed, hash_only);
+    }
+
+    closedir(dir);
+}
+
+/* With fingerprinting on, assets must be hashed before anything that refers
+ * to them: plain assets first, then stylesheets (which may reference them),
+ * then pages. */
+static int job_phase(const BuildJob *job) {
+    if (job->is_page) {
+        return 2;
+    }
+    const char *dot = strrchr(job->rel_path, '.');
+    return dot && str_eq(dot, ".css") ? 1 : 0;
+}
+
+static void order_jobs_for_fingerprint(JobList *jobs) {
+    BuildJob *sorted = xmalloc((jobs->count + 1) * sizeof(BuildJob));
+    size_t n = 0;
+    for (int phase = 0; phase <= 2; phase++) {
+        for (size_t i = 0; i < jobs->count; i++) {
+            if (job_phase(&jobs->items[i]) == phase) {
+                sorted[n++] = jobs->items[i];
+            }
+        }
+    }
+    xfree(jobs->items);
+    jobs->items = sorted;
+    jobs->cap = jobs->count + 1;
+}
+
+/* Points the job's output at the hashed file name and records the mapping. */
+static void fingerprint_job(BuildJob *job, uint64_t hash) {
+    char *hashed = fingerprint_add(job->rel_path, hash);
+    const char *hashed_name = strrchr(hashed, '/');
+    hashed_name = hashed_name ? hashed_name + 1 : hashed;
+    const char *slash = strrchr(job->dst_path, '/');
+    size_t dir_len = slash ? (size_t)(slash - job->dst_path) + 1 : 0;
+
+    StrBuf dst = {0};
+    sb_append_n(&dst, job->dst_path, dir_len);
+    sb_append(&dst, hashed_name);
+    xfree(job->dst_path);
+    job->dst_path = dst.data;
+    xfree(hashed);
+}
+
+/* Compiles one page, taking it from the shared build cache when possible.
+ * ctx->current_file names the source for diagnostics. */
+bool compile_page(const char *rel_path, const char *source, size_t len, StrBuf *page, BuildCtx *ctx) {
+    char key[33];
+    if (cache_pages_enabled()) {
+        cache_key("page", rel_path, source, len, key);
+        if (cache_lookup("page", key, &page->data, &page->len)) {
+            /* Still listed in --profile and --mem-stats, marked cached. */
+            profile_cached("page", rel_path);
+            mem_page_cached(rel_path);
+            stats_page(rel_path, len, page->len);
+            return true;
+        }
+    }
+    int errors = ctx->error_count;
+    int warnings = ctx->warning_count;
+    profile_begin();
+    mem_page_begin();
+    bool compiled = compile_html_source(source, page, ctx);
+    mem_page_end(rel_path);
+    profile_end("page", rel_path, NULL);
+    /* Pages with diagnostics are rebuilt so they are reported again. */
+    if (cache_pages_enabled() && compiled && ctx->error_count == errors && ctx->warning_count == warnings) {
+        cache_publish(key, page->data ? page->data : "", page->len);
+    }
+    stats_page(rel_path, len, page->len);
+    return compiled;
+}
+
+/* Reads every source in the batch at once, compiles pages in memory, then
+ * writes all outputs at once so the I/O backend can submit them together. */
+static void run_batch(BuildJob *jobs, size_t count, BuildCtx *ctx, BuildProgress *progress) {
+    IoFile *reads = xmalloc(count * sizeof(IoFile));
+    IoFile *writes = xmalloc(count * sizeof(IoFile));
+    size_t *read_of = xmalloc(count * sizeof(size_t));
+    size_t *write_of = xmalloc(count * sizeof(size_t));
+    bool *ok = xmalloc(count * sizeof(bool));
+    size_t nreads = 0;
+    size_t nwrites = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        read_of[i] = (size_t)-1;
+        write_of[i] = (size_t)-1;
+        ok[i] = false;
+        if (!jobs[i].streamed) {
+            read_of[i] = nreads;
+            reads[nreads++].path = jobs[i].src_path;
+        }
+    }
+    profile_begin();
+    io_read_batch(reads, nreads);
+    profile_end("phase", "read", NULL);
+
+    profile_begin();
+    for (size_t i = 0; i < count; i++) {
+        BuildJob *job = &jobs[i];
+        if (job->streamed) {
+            uint64_t hash;
+            if (fingerprint_wants(job->rel_path) && hash_file(job->src_path, &hash)) {
+                fingerprint_job(job, hash);
+            }
+            continue;
+        }
+        IoFile *in = &reads[read_of[i]];
+        if (!in->ok) {
+            if (job->is_page) {
+                log_error(ctx, "failed to read %s", job->src_path);
+            } else {
+                log_error(ctx, "failed to copy %s to %s", job->src_path, job->dst_path);
+            }
+            continue;
+        }
+
+        IoFile *out = &writes[nwrites];
+        out->path = job->dst_path;
+        if (job->is_page) {
+            const char *prev_file = ctx->current_file;
+            ctx->current_file = job->src_path;
+            StrBuf page = {0};
+            compile_page(job->rel_path, in->data, in->len, &page, ctx);
+            ctx->current_file = prev_file;
+            out->data = page.data ? page.data : xstrdup("");
+            out->len = page.len;
+        } else {
+            out->data = in->data;
+            out->len = in->len;
+            in->data = NULL;
+            if (fingerprint_wants(job->rel_path)) {
+                char *css = job_phase(job) == 1 ? fingerprint_rewrite_css(out->data, out->len, job->src_path) : NULL;
+                if (css) {
+                    xfree(out->data);
+                    out->data = css;
+                    out->len = strlen(css);
+                }
+                fingerprint_job(job, hash_bytes(out->data, out->len));
+                out->path = job->dst_path;
+            }
+        }
+        if (job->hash_only) {
+            xfree(out->data);
+            continue;
+        }
+        write_of[i] = nwrites++;
+    }
+    profile_end("phase", "compile", NULL);
+    profile_begin();
+    io_write_batch(writes, nwrites);
+    profile_end("phase", "write", NULL);
+
+    for (size_t i = 0; i < count; i++) {
+        BuildJob *job = &jobs[i];
+        if (job->hash_only) {
+            continue;
+        }
+        if (job->streamed) {
+            profile_begin();
+            ok[i] = copy_file(job->src_path, job->dst_path);
+            profile_end("phase", "copy", job->rel_path);
+            if (!ok[i]) {
+                log_error(ctx, "failed to copy %s to %s", job->src_path, job->dst_path);
+            }
+        } else if (write_of[i] != (size_t)-1) {
+            ok[i] = writes[write_of[i]].ok;
+            if (!ok[i] && job->is_page) {
+                log_error(ctx, "failed to write %s", job->dst_path);
+            } else if (!ok[i]) {
+                log_error(ctx, "failed to copy %s to %s", job->src_path, job->dst_path);
+            }
+        }
+        if (ok[i]) {
+            if (job->is_page) {
+                progress->pages++;
+            } else {
+                progress->others++;
+            }
+            if (!ctx->opts || !ctx->opts->quiet) {
+                printf("Processed: %s -> %s\n", job->src_path, job->dst_path);
+            }
+            if (write_of[i] != (size_t)-1) {
+                IoFile *out = &writes[write_of[i]];
+                compress_submit(out->path, out->data, out->len);
+                out->data = NULL;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nreads; i++) {
+        xfree(reads[i].data);
+    }
+    for (size_t i = 0; i < nwrites; i++) {
+        xfree(writes[i].data);
+    }
+    xfree(reads);
+    xfree(writes);
+    xfree(read_of);
+    xfree(write_of);
+    xfree(ok);
+}
+
+void process_directory(const char *src, const char *dst, BuildCtx *ctx) {
+    JobList jobs = {0};
+    JobList collections = {0};
+    profile_begin();
+    plan_directory(src, dst, "", &jobs, &collections, ctx);
+    if (fingerprint_enabled()) {
+        order_jobs_for_fingerprint(&jobs);
+    }
+    profile_end("phase", "plan", NULL);
+
+    bool quiet = ctx->opts && ctx->opts->quiet;
+    BuildProgress progress = {0, jobs.count, 0, 0, quiet && isatty(STDERR_FILENO)};
+    for (size_t i = 0; i < jobs.count; i += BUILD_BATCH_SIZE) {
+        size_t n = jobs.count - i < BUILD_BATCH_SIZE ? jobs.count - i : BUILD_BATCH_SIZE;
+        run_batch(&jobs.items[i], n, ctx, &progress);
+        progress.done += n;
+        if (progress.tty) {
+            fprintf(stderr, "\rBuilding: %zu/%zu files", progress.done, progress.total);
+        }
+    }
+    if (progress.tty) {
+        fprintf(stderr, "\n");
+    }
+    /* After every asset, so fingerprinted names are known to the rows. */
+    for (size_t i = 0; i < collections.count; i++) {
+        progress.pages += collection_build(collections.items[i].src_path, src, collections.items[i].dst_path, ctx);
+    }
+    if (quiet) {
+        printf("Processed %zu page(s) and %zu other file(s) into %s\n", progress.pages, progress.others, dst);
+    }
+
+    joblist_free(&jobs);
+    joblist_free(&collections);
+}
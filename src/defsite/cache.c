@@ -0,0 +1,192 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef DEFSITE_COMPILER_ID
+#define DEFSITE_COMPILER_ID "dev"
+#endif
+
+#define CACHE_FORMAT "defsite-cache 1"
+#define CACHE_SEED_2 0x9e3779b97f4a7c15ull
+
+/* Shared build cache (--cache-dir): content-addressed entries under
+ * DIR/objects/<2 hex>/<30 hex>, each "defsite-cache 1 <len> <hash>\n"
+ * followed by the payload. Entries are published like any other output
+ * (temporary file, then rename), so readers on any machine see either
+ * nothing or a whole entry. */
+static struct {
+    bool enabled;
+    bool pages;
+    char *dir;
+    uint64_t options_hash;
+    size_t page_hits;
+    size_t page_misses;
+    size_t meta_hits;
+    size_t meta_misses;
+    size_t published;
+    size_t rejected;
+} state;
+
+void cache_init(const BuildOptions *opts) {
+    memset(&state, 0, sizeof(state));
+    if (!opts->cache_dir) {
+        return;
+    }
+    state.enabled = true;
+    /* Full-text terms are collected while a page compiles, so a page taken
+     * from the cache would be missing from search-text/. */
+    state.pages = !opts->fulltext;
+    state.dir = xstrdup(opts->cache_dir);
+
+    /* Everything besides the page itself that changes compiled output. */
+    char settings[256];
+    snprintf(settings,
+             sizeof(settings),
+             "%s\x1f%s\x1fminify=%d:%d\x1f" "fingerprint=%d:%s\x1f" "budget=%zu:%zu:%zu",
+             CACHE_FORMAT,
+             DEFSITE_COMPILER_ID,
+             opts->minify,
+             opts->keep_comments,
+             opts->fingerprint,
+             opts->fingerprint_exts ? opts->fingerprint_exts : "",
+             opts->max_page_nodes,
+             opts->max_page_bytes,
+             opts->max_page_ms);
+    state.options_hash = hash_str(settings);
+
+    if (ensure_dir(state.dir) != 0) {
+        fprintf(stderr, "WARN: build cache %s is not writable (%s); reading only\n", state.dir, strerror(errno));
+    }
+}
+
+bool cache_pages_enabled(void) {
+    return state.enabled && state.pages;
+}
+
+bool cache_enabled(void) {
+    return state.enabled;
+}
+
+/* Two differently seeded 64-bit hashes over the same fields, printed as 32
+ * hex digits. `kind` separates page outputs from index metadata. */
+void cache_key(const char *kind, const char *rel_path, const char *source, size_t len, char out[33]) {
+    uint64_t extra = str_eq(kind, "page") ? fingerprint_digest() : 0;
+    uint64_t h[2] = {HASH_SEED, CACHE_SEED_2};
+    for (int i = 0; i < 2; i++) {
+        h[i] = hash_update(h[i], &state.options_hash, sizeof(state.options_hash));
+        h[i] = hash_update(h[i], &extra, sizeof(extra));
+        h[i] = hash_update(h[i], kind, strlen(kind) + 1);
+        h[i] = hash_update(h[i], rel_path, strlen(rel_path) + 1);
+        h[i] = hash_update(h[i], source, len);
+    }
+    snprintf(out, 33, "%016" PRIx64 "%016" PRIx64, h[0], h[1]);
+}
+
+static void entry_path(const char *key, char *path, size_t size) {
+    snprintf(path, size, "%s/objects/%.2s/%s", state.dir, key, key + 2);
+}
+
+static void count_lookup(const char *key_kind, bool hit) {
+    bool page = str_eq(key_kind, "page");
+    if (hit) {
+        (*(page ? &state.page_hits : &state.meta_hits))++;
+    } else {
+        (*(page ? &state.page_misses : &state.meta_misses))++;
+    }
+}
+
+/* Returns the cached payload for key in *data (xmalloc'd), or false. Entries
+ * whose header, length or checksum do not match are treated as misses. */
+bool cache_lookup(const char *kind, const char *key, char **data, size_t *len) {
+    if (!state.enabled) {
+        return false;
+    }
+    char path[MAX_PATH_LEN];
+    entry_path(key, path, sizeof(path));
+    IoFile f = {path, NULL, 0, false};
+    if (access(path, R_OK) != 0) {
+        count_lookup(kind, false);
+        return false;
+    }
+    io_read_batch(&f, 1);
+    const char *nl = f.ok ? memchr(f.data, '\n', f.len) : NULL;
+    size_t payload_len = 0;
+    uint64_t sum = 0;
+    bool ok = nl && sscanf(f.data, CACHE_FORMAT " %zu %" SCNx64, &payload_len, &sum) == 2;
+    size_t offset = nl ? (size_t)(nl - f.data) + 1 : 0;
+    ok = ok && f.len - offset == payload_len && hash_bytes(f.data + offset, payload_len) == sum;
+    if (!ok) {
+        if (f.ok) {
+            state.rejected++;
+        }
+        xfree(f.data);
+        count_lookup(kind, false);
+        return false;
+    }
+    memmove(f.data, f.data + offset, payload_len);
+    f.data[payload_len] = '\0';
+    *data = f.data;
+    *len = payload_len;
+    count_lookup(kind, true);
+    return true;
+}
+
+/* Concurrent publishers of one key write identical bytes, so the last
+ * rename wins harmlessly. Failures only cost a future hit. */
+void cache_publish(const char *key, const char *data, size_t len) {
+    if (!state.enabled) {
+        return;
+    }
+    char path[MAX_PATH_LEN];
+    char dir[MAX_PATH_LEN];
+    entry_path(key, path, sizeof(path));
+    snprintf(dir, sizeof(dir), "%s/objects", state.dir);
+    ensure_dir(dir);
+    snprintf(dir, sizeof(dir), "%s/objects/%.2s", state.dir, key);
+    ensure_dir(dir);
+
+    char header[96];
+    int n = snprintf(header, sizeof(header), CACHE_FORMAT " %zu %016" PRIx64 "\n", len, hash_bytes(data, len));
+    StrBuf entry = {0};
+    sb_append_n(&entry, header, (size_t)n);
+    sb_append_n(&entry, data, len);
+    if (write_file_n(path, entry.data, entry.len)) {
+        state.published++;
+    }
+    xfree(entry.data);
+}
+
+static double rate(size_t hits, size_t misses) {
+    return hits + misses ? 100.0 * (double)hits / (double)(hits + misses) : 0.0;
+}
+
+void cache_finish(void) {
+    if (!state.enabled) {
+        return;
+    }
+    fprintf(stderr,
+            "Build cache: pages %zu/%zu hit (%.1f%%), index metadata %zu/%zu hit (%.1f%%), %zu entr%s published",
+            state.page_hits,
+            state.page_hits + state.page_misses,
+            rate(state.page_hits, state.page_misses),
+            state.meta_hits,
+            state.meta_hits + state.meta_misses,
+            rate(state.meta_hits, state.meta_misses),
+            state.published,
+            state.published == 1 ? "y" : "ies");
+    if (state.rejected > 0) {
+        fprintf(stderr, ", %zu damaged entr%s ignored", state.rejected, state.rejected == 1 ? "y" : "ies");
+    }
+    if (!state.pages) {
+        fprintf(stderr, " (page outputs not cached with --fulltext)");
+    }
+    fprintf(stderr, "\n");
+    xfree(state.dir);
+    state.enabled = false;
+}
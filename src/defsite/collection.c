@@ -0,0 +1,478 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define COLLECTION_SUFFIX ".collection.html"
+#define COLLECTION_TASK_ROWS 32
+#define COLLECTION_TASKS_PER_THREAD 4
+
+/* Data-driven pages: a template `NAME.collection.html` plus `NAME.jsonl` or
+ * `NAME.csv` beside it. Every row becomes `<slug>.html` in the template's
+ * directory. The template is parsed once; rows are compiled from it on a
+ * worker pool, and their discovery records are taken from the row data
+ * rather than from the compiled pages. The data files are read by
+ * collectiondata.c. */
+
+static struct {
+    StrMap loaded; /* template path -> Collection */
+    WorkPool *pool;
+    bool initialized;
+} state;
+
+bool collection_is_template(const char *path) {
+    size_t len = strlen(path);
+    size_t suffix = strlen(COLLECTION_SUFFIX);
+    return len > suffix && str_eq(path + len - suffix, COLLECTION_SUFFIX);
+}
+
+static bool file_exists(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* Path of the template's data file with the given extension. */
+static void data_path_for(const char *template_path, const char *ext, char *out, size_t size) {
+    size_t stem = strlen(template_path) - strlen(COLLECTION_SUFFIX);
+    snprintf(out, size, "%.*s%s", (int)stem, template_path, ext);
+}
+
+bool collection_is_data(const char *path) {
+    const char *dot = strrchr(path, '.');
+    if (!dot || (!str_eq(dot, ".jsonl") && !str_eq(dot, ".csv"))) {
+        return false;
+    }
+    char template_path[MAX_PATH_LEN];
+    snprintf(template_path, sizeof(template_path), "%.*s%s", (int)(dot - path), path, COLLECTION_SUFFIX);
+    return file_exists(template_path);
+}
+
+void collection_row_free(CollectionRow *r) {
+    node_free(r->row);
+    for (size_t i = 0; i < r->slot_count; i++) {
+        xfree(r->slots[i].name);
+        xfree(r->slots[i].html);
+    }
+    xfree(r->slots);
+    xfree(r->url);
+    xfree(r->src_path);
+}
+
+static void collection_free(void *p) {
+    Collection *c = p;
+    if (!c) {
+        return;
+    }
+    for (size_t i = 0; i < c->row_count; i++) {
+        collection_row_free(&c->rows[i]);
+    }
+    xfree(c->rows);
+    node_free(c->page);
+    xfree(c->template_path);
+    xfree(c->data_path);
+    xfree(c);
+}
+
+CollectionRow *collection_row_begin(Collection *c, size_t line, size_t bytes) {
+    if (c->row_count == c->row_cap) {
+        c->row_cap = c->row_cap == 0 ? 64 : c->row_cap * 2;
+        c->rows = xrealloc(c->rows, c->row_cap * sizeof(CollectionRow));
+    }
+    CollectionRow *r = &c->rows[c->row_count++];
+    memset(r, 0, sizeof(*r));
+    r->row = node_new_element("row");
+    r->line = line;
+    r->bytes = bytes;
+    return r;
+}
+
+/* `slot` holds the default slot's HTML and `slot:NAME` a named slot's;
+ * any other field becomes an attribute of the row. An empty value is left
+ * out, so a <bind default="..."> applies. */
+void collection_row_set(CollectionRow *r, const char *key, const char *value) {
+    if (!value[0]) {
+        return;
+    }
+    if (str_eq(key, "slot") || starts_with(key, "slot:")) {
+        if (r->slot_count == r->slot_cap) {
+            r->slot_cap = r->slot_cap == 0 ? 4 : r->slot_cap * 2;
+            r->slots = xrealloc(r->slots, r->slot_cap * sizeof(RowSlot));
+        }
+        RowSlot *slot = &r->slots[r->slot_count++];
+        slot->name = xstrdup(key[4] == ':' ? key + 5 : "");
+        slot->html = xstrdup(value);
+        return;
+    }
+    node_add_attr(r->row, key, value);
+}
+
+/* ---- loading ---- */
+
+static bool valid_slug(const char *slug) {
+    if (!slug[0] || slug[0] == '.' || strlen(slug) > 200) {
+        return false;
+    }
+    for (const char *p = slug; *p; p++) {
+        if (*p == '/' || *p == '\\' || (unsigned char)*p < 0x20) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Gives each row its output path, dropping (with an error) rows without a
+ * usable slug, rows sharing one, and rows that would replace a source page. */
+static void assign_urls(Collection *c, const char *src_dir, BuildCtx *ctx) {
+    const char *rel = c->template_path + strlen(src_dir);
+    rel += *rel == '/';
+    const char *slash = strrchr(rel, '/');
+    int dir_len = slash ? (int)(slash - rel) + 1 : 0;
+
+    StrMap seen;
+    strmap_init(&seen);
+    size_t kept = 0;
+    for (size_t i = 0; i < c->row_count; i++) {
+        CollectionRow *r = &c->rows[i];
+        const char *slug = node_get_attr(r->row, "slug");
+        char url[MAX_PATH_LEN];
+        char src_path[MAX_PATH_LEN * 2];
+        bool ok = false;
+        if (!slug) {
+            log_error(ctx, "%s:%zu: row has no slug", c->data_path, r->line);
+        } else if (!valid_slug(slug)) {
+            log_error(ctx, "%s:%zu: invalid slug '%s' (expected a file name without '/')", c->data_path, r->line, slug);
+        } else {
+            snprintf(url, sizeof(url), "%.*s%s.html", dir_len, rel, slug);
+            snprintf(src_path, sizeof(src_path), "%s/%s", src_dir, url);
+            void *first = strmap_get(&seen, url);
+            if (first) {
+                log_error(ctx, "%s:%zu: duplicate slug '%s' (first used on line %zu)", c->data_path, r->line, slug,
+                          (size_t)(uintptr_t)first);
+            } else if (file_exists(src_path)) {
+                log_error(ctx, "%s:%zu: slug '%s' would replace the source page %s", c->data_path, r->line, slug, src_path);
+            } else {
+                strmap_put(&seen, url, (void *)(uintptr_t)r->line);
+                ok = true;
+            }
+        }
+        if (!ok) {
+            collection_row_free(r);
+            continue;
+        }
+        r->url = xstrdup(url);
+        r->src_path = xstrdup(src_path);
+        c->rows[kept++] = *r;
+    }
+    c->row_count = kept;
+    strmap_free(&seen, NULL);
+}
+
+static Node *find_html(Node *node) {
+    if (node->type == NODE_ELEMENT && str_eq(node->tag, "html")) {
+        return node;
+    }
+    for (size_t i = 0; i < node->child_count; i++) {
+        Node *found = find_html(node->children[i]);
+        if (found) {
+            return found;
+        }
+    }
+    return NULL;
+}
+
+static Collection *load_collection(const char *template_path, const char *src_dir, BuildCtx *ctx) {
+    Collection *c = xmalloc(sizeof(Collection));
+    memset(c, 0, sizeof(*c));
+    c->template_path = xstrdup(template_path);
+
+    char jsonl[MAX_PATH_LEN];
+    char csv[MAX_PATH_LEN];
+    data_path_for(template_path, ".jsonl", jsonl, sizeof(jsonl));
+    data_path_for(template_path, ".csv", csv, sizeof(csv));
+    bool has_jsonl = file_exists(jsonl);
+    bool has_csv = file_exists(csv);
+    if (has_jsonl == has_csv) {
+        log_error(ctx, has_jsonl ? "collection %s has both %s and %s; keep one" : "collection %s needs its rows in %s or %s",
+                  template_path, jsonl, csv);
+        return c;
+    }
+    c->data_path = xstrdup(has_jsonl ? jsonl : csv);
+
+    char *source = read_file(template_path);
+    char *data = read_file(c->data_path);
+    if (!source || !data) {
+        log_error(ctx, "failed to read %s", source ? c->data_path : template_path);
+        xfree(source);
+        xfree(data);
+        return c;
+    }
+
+    const char *prev_file = ctx->current_file;
+    ctx->current_file = template_path;
+    MemSubsystem prev_mem = mem_enter(MEM_PARSER);
+    c->page = domcache_parse(source, ctx);
+    mem_leave(prev_mem);
+    c->html = find_html(c->page);
+    ctx->current_file = prev_file;
+
+    if (has_jsonl) {
+        collection_load_jsonl(c, data, ctx);
+    } else {
+        collection_load_csv(c, data, ctx);
+    }
+    assign_urls(c, src_dir, ctx);
+    xfree(source);
+    xfree(data);
+    return c;
+}
+
+/* Loads the collection once per run; the build and the index share it. */
+static Collection *collection_get(const char *template_path, const char *src_dir, BuildCtx *ctx) {
+    if (!state.initialized) {
+        strmap_init(&state.loaded);
+        state.initialized = true;
+    }
+    Collection *c = strmap_get(&state.loaded, template_path);
+    if (!c) {
+        profile_begin();
+        c = load_collection(template_path, src_dir, ctx);
+        profile_end("phase", "collection-load", template_path);
+        strmap_put(&state.loaded, template_path, c);
+    }
+    return c;
+}
+
+/* ---- building ---- */
+
+typedef struct {
+    const Collection *c;
+    size_t first;
+    size_t count;
+    const char *dst_dir;
+    IoFile *outs;
+    BuildCtx ctx;
+} RowTask;
+
+static void build_slots(const CollectionRow *r, SlotPayload *payload, BuildCtx *ctx) {
+    for (size_t i = 0; i < r->slot_count; i++) {
+        Node *fragment = parse_html(r->slots[i].html, ctx);
+        NodeList *nodes = r->slots[i].name[0] ? &slotpayload_get_named(payload, r->slots[i].name)->nodes
+                                              : &payload->default_nodes;
+        for (size_t k = 0; k < fragment->child_count; k++) {
+            fragment->children[k]->parent = NULL;
+            nodelist_push(nodes, fragment->children[k]);
+        }
+        fragment->child_count = 0;
+        node_free(fragment);
+    }
+}
+
+static void render_rows(void *arg) {
+    RowTask *t = arg;
+    const BuildOptions *opts = t->ctx.opts;
+    for (size_t i = 0; i < t->count; i++) {
+        const CollectionRow *r = &t->c->rows[t->first + i];
+        IoFile *out = &t->outs[i];
+        out->path = NULL;
+        out->data = NULL;
+        out->len = 0;
+        out->ok = false;
+        if (!shard_owns(opts, r->url)) {
+            continue;
+        }
+        t->ctx.current_file = r->src_path;
+        profile_begin();
+        mem_page_begin();
+        SlotPayload payload = {0};
+        build_slots(r, &payload, &t->ctx);
+        StrBuf page = {0};
+        compile_collection_row(t->c->page, r->row, &payload, &page, &t->ctx);
+        slotpayload_free(&payload);
+        mem_page_end(r->url);
+        profile_end("page", r->url, NULL);
+        stats_page(r->url, r->bytes, page.len);
+
+        const char *name = strrchr(r->url, '/');
+        StrBuf path = {0};
+        sb_append(&path, t->dst_dir);
+        sb_append(&path, "/");
+        sb_append(&path, name ? name + 1 : r->url);
+        out->path = path.data;
+        out->data = page.data ? page.data : xstrdup("");
+        out->len = page.len;
+    }
+}
+
+/* Compiles every row of the collection into dst_dir, a group of tasks at a
+ * time, writing each group as one batch. Returns the pages written. */
+size_t collection_build(const char *template_path, const char *src_dir, const char *dst_dir, BuildCtx *ctx) {
+    Collection *c = collection_get(template_path, src_dir, ctx);
+    if (!c->page || c->row_count == 0) {
+        return 0;
+    }
+    if (!state.pool) {
+        state.pool = pool_create(ctx->opts ? ctx->opts->jobs : 0);
+    }
+    size_t threads = pool_thread_count(state.pool);
+    size_t group = (threads ? threads : 1) * COLLECTION_TASKS_PER_THREAD * COLLECTION_TASK_ROWS;
+    bool quiet = ctx->opts && ctx->opts->quiet;
+
+    size_t written = 0;
+    IoFile *outs = xmalloc(group * sizeof(IoFile));
+    IoFile *writes = xmalloc(group * sizeof(IoFile));
+    RowTask *tasks = xmalloc((group / COLLECTION_TASK_ROWS + 1) * sizeof(RowTask));
+    for (size_t base = 0; base < c->row_count; base += group) {
+        size_t n = c->row_count - base < group ? c->row_count - base : group;
+        size_t ntasks = 0;
+        profile_begin();
+        for (size_t off = 0; off < n; off += COLLECTION_TASK_ROWS) {
+            RowTask *t = &tasks[ntasks++];
+            t->c = c;
+            t->first = base + off;
+            t->count = n - off < COLLECTION_TASK_ROWS ? n - off : COLLECTION_TASK_ROWS;
+            t->dst_dir = dst_dir;
+            t->outs = outs + off;
+            t->ctx.error_count = 0;
+            t->ctx.warning_count = 0;
+            t->ctx.current_file = NULL;
+            t->ctx.opts = ctx->opts;
+            pool_submit(state.pool, render_rows, t);
+        }
+        pool_wait(state.pool);
+        profile_end("phase", "compile", NULL);
+        for (size_t k = 0; k < ntasks; k++) {
+            ctx->error_count += tasks[k].ctx.error_count;
+            ctx->warning_count += tasks[k].ctx.warning_count;
+        }
+
+        size_t nwrites = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (outs[i].path) {
+                writes[nwrites++] = outs[i];
+            }
+        }
+        profile_begin();
+        io_write_batch(writes, nwrites);
+        profile_end("phase", "write", NULL);
+        for (size_t i = 0; i < nwrites; i++) {
+            if (!writes[i].ok) {
+                log_error(ctx, "failed to write %s", writes[i].path);
+                xfree(writes[i].data);
+            } else {
+                written++;
+                if (!quiet) {
+                    printf("Processed: %s -> %s\n", template_path, writes[i].path);
+                }
+                compress_submit(writes[i].path, writes[i].data, writes[i].len);
+            }
+            xfree((char *)writes[i].path);
+        }
+    }
+    xfree(tasks);
+    xfree(writes);
+    xfree(outs);
+    return written;
+}
+
+/* Renders the row whose page is rel_path (relative to src_dir) for `serve
+ * --lazy`, looking through the collections in that directory. Sets *found
+ * to whether any row produces rel_path; the collections stay loaded until
+ * collection_finish(), which the caller runs when a template or data file
+ * changes. */
+bool collection_render_url(const char *src_dir, const char *rel_path, StrBuf *out, BuildCtx *ctx, bool *found) {
+    *found = false;
+    const char *slash = strrchr(rel_path, '/');
+    char dir_path[MAX_PATH_LEN * 2];
+    snprintf(dir_path, sizeof(dir_path), "%s%s%.*s", src_dir, slash ? "/" : "", slash ? (int)(slash - rel_path) : 0,
+             rel_path);
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        return false;
+    }
+    char template_path[MAX_PATH_LEN * 2 + 256];
+    const Collection *c = NULL;
+    const CollectionRow *r = NULL;
+    struct dirent *entry;
+    while (!r && (entry = readdir(dir)) != NULL) {
+        if (!collection_is_template(entry->d_name)) {
+            continue;
+        }
+        snprintf(template_path, sizeof(template_path), "%s/%s", dir_path, entry->d_name);
+        c = collection_get(template_path, src_dir, ctx);
+        for (size_t i = 0; c->page && i < c->row_count && !r; i++) {
+            if (str_eq(c->rows[i].url, rel_path)) {
+                r = &c->rows[i];
+            }
+        }
+    }
+    closedir(dir);
+    if (!r) {
+        return false;
+    }
+    *found = true;
+    ctx->current_file = r->src_path;
+    SlotPayload payload = {0};
+    build_slots(r, &payload, ctx);
+    bool ok = compile_collection_row(c->page, r->row, &payload, out, ctx);
+    slotpayload_free(&payload);
+    return ok;
+}
+
+/* ---- index ---- */
+
+size_t collection_row_count(const char *template_path, const char *src_dir, BuildCtx *ctx) {
+    Collection *c = collection_get(template_path, src_dir, ctx);
+    return c->page ? c->row_count : 0;
+}
+
+const char *collection_row_url(const char *template_path, size_t row) {
+    const Collection *c = strmap_get(&state.loaded, template_path);
+    return c->rows[row].url;
+}
+
+const char *collection_row_src_path(const char *template_path, size_t row) {
+    const Collection *c = strmap_get(&state.loaded, template_path);
+    return c->rows[row].src_path;
+}
+
+/* The row's page <html> element without children: the template's literal
+ * attributes with its bind-* attributes bound to the row, which is all a
+ * discovery record needs. NULL when the template has no <html>. */
+Node *collection_row_html(const char *template_path, size_t row) {
+    const Collection *c = strmap_get(&state.loaded, template_path);
+    if (!c->html) {
+        return NULL;
+    }
+    const Node *fields = c->rows[row].row;
+    Node *html = node_new_element("html");
+    for (size_t i = 0; i < c->html->attr_count; i++) {
+        const Attr *a = &c->html->attrs[i];
+        if (!starts_with(a->name, "bind-")) {
+            node_add_attr(html, a->name, a->value);
+        }
+    }
+    for (size_t i = 0; i < c->html->attr_count; i++) {
+        const Attr *a = &c->html->attrs[i];
+        const char *value = starts_with(a->name, "bind-") && a->name[5] ? node_get_attr(fields, a->value ? a->value : "") : NULL;
+        if (value) {
+            node_remove_attr(html, a->name + 5);
+            node_add_attr(html, a->name + 5, value);
+        }
+    }
+    return html;
+}
+
+void collection_finish(void) {
+    if (state.pool) {
+        pool_destroy(state.pool);
+        state.pool = NULL;
+    }
+    if (state.initialized) {
+        strmap_free(&state.loaded, collection_free);
+        state.initialized = false;
+    }
+}
@@ -0,0 +1,194 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Collection data files: rows are read from JSON Lines or CSV into the
+ * Collection, one CollectionRow per record; a bad record is reported with
+ * its line and skipped. */
+
+/* ---- JSON Lines ---- */
+
+static bool json_scalar_text(const JsonValue *v, StrBuf *out) {
+    char num[64];
+    switch (v->type) {
+    case JSON_STRING:
+        sb_append(out, v->string);
+        return true;
+    case JSON_NUMBER:
+        if (v->number == (double)(long long)v->number) {
+            snprintf(num, sizeof(num), "%lld", (long long)v->number);
+        } else {
+            snprintf(num, sizeof(num), "%.15g", v->number);
+        }
+        sb_append(out, num);
+        return true;
+    case JSON_BOOL:
+        sb_append(out, v->boolean ? "true" : "false");
+        return true;
+    case JSON_NULL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Strings, numbers and booleans as text; a list of them joined with
+ * commas, the way list metadata such as data-tags is written. */
+static bool json_field_text(const JsonValue *v, StrBuf *out) {
+    if (v->type != JSON_ARRAY) {
+        return json_scalar_text(v, out);
+    }
+    for (size_t i = 0; i < v->count; i++) {
+        if (i > 0) {
+            sb_append(out, ",");
+        }
+        if (!json_scalar_text(v->items[i], out)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void collection_load_jsonl(Collection *c, char *text, BuildCtx *ctx) {
+    size_t line_no = 0;
+    for (char *line = text; line && *line;) {
+        char *next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        line_no++;
+        const char *p = line;
+        while (*p == ' ' || *p == '\t' || *p == '\r') {
+            p++;
+        }
+        if (*p) {
+            size_t error_offset = 0;
+            JsonValue *obj = json_parse(line, &error_offset);
+            if (!obj || obj->type != JSON_OBJECT) {
+                log_error(ctx, "%s:%zu: expected one JSON object per line", c->data_path, line_no);
+            } else {
+                CollectionRow *r = collection_row_begin(c, line_no, strlen(line));
+                bool ok = true;
+                for (size_t i = 0; i < obj->count; i++) {
+                    StrBuf value = {0};
+                    if (!json_field_text(obj->items[i], &value)) {
+                        log_error(ctx, "%s:%zu: field '%s' must be a string, number, boolean or list of them",
+                                  c->data_path, line_no, obj->keys[i]);
+                        ok = false;
+                    } else {
+                        collection_row_set(r, obj->keys[i], value.data ? value.data : "");
+                    }
+                    xfree(value.data);
+                }
+                if (!ok) {
+                    collection_row_free(r);
+                    c->row_count--;
+                }
+            }
+            json_free(obj);
+        }
+        line = next;
+    }
+}
+
+/* ---- CSV ---- */
+
+/* One RFC 4180 record: comma-separated fields, optionally double-quoted
+ * with "" for a literal quote; quoted fields may span lines. Returns false
+ * at the end of the text. */
+static bool csv_record(const char **pos, StringStack *fields, size_t *line, bool *ok) {
+    const char *p = *pos;
+    if (!*p) {
+        return false;
+    }
+    StrBuf field = {0};
+    bool quoted = false;
+    bool was_quoted = false;
+    for (;;) {
+        char ch = *p;
+        if (quoted) {
+            if (!ch) {
+                *ok = false;
+                break;
+            }
+            if (ch == '"' && p[1] == '"') {
+                sb_append_n(&field, "\"", 1);
+                p += 2;
+                continue;
+            }
+            if (ch == '"') {
+                quoted = false;
+                p++;
+                continue;
+            }
+            if (ch == '\n') {
+                (*line)++;
+            }
+            sb_append_n(&field, p, 1);
+            p++;
+            continue;
+        }
+        if (ch == '"' && !was_quoted && field.len == 0) {
+            quoted = true;
+            was_quoted = true;
+            p++;
+            continue;
+        }
+        if (ch == ',' || ch == '\n' || ch == '\0' || (ch == '\r' && p[1] == '\n')) {
+            strstack_push(fields, field.data ? field.data : "");
+            xfree(field.data);
+            field = (StrBuf){0};
+            was_quoted = false;
+            if (ch == ',') {
+                p++;
+                continue;
+            }
+            p += ch == '\r' ? 2 : ch == '\n' ? 1 : 0;
+            (*line)++;
+            break;
+        }
+        sb_append_n(&field, p, 1);
+        p++;
+    }
+    xfree(field.data);
+    *pos = p;
+    return true;
+}
+
+void collection_load_csv(Collection *c, const char *text, BuildCtx *ctx) {
+    const char *pos = text;
+    size_t line = 1;
+    StringStack header = {0};
+    bool ok = true;
+    if (!csv_record(&pos, &header, &line, &ok) || !ok) {
+        log_error(ctx, "%s: missing header row", c->data_path);
+        strstack_free(&header);
+        return;
+    }
+    for (;;) {
+        size_t first_line = line;
+        const char *start = pos;
+        StringStack fields = {0};
+        if (!csv_record(&pos, &fields, &line, &ok)) {
+            strstack_free(&fields);
+            break;
+        }
+        if (!ok) {
+            log_error(ctx, "%s:%zu: unterminated quoted field", c->data_path, first_line);
+            strstack_free(&fields);
+            break;
+        }
+        bool blank = fields.count == 1 && !fields.items[0][0];
+        if (!blank && fields.count != header.count) {
+            log_error(ctx, "%s:%zu: %zu field(s) where the header has %zu", c->data_path, first_line, fields.count, header.count);
+        } else if (!blank) {
+            CollectionRow *r = collection_row_begin(c, first_line, (size_t)(pos - start));
+            for (size_t i = 0; i < fields.count; i++) {
+                collection_row_set(r, header.items[i], fields.items[i]);
+            }
+        }
+        strstack_free(&fields);
+    }
+    strstack_free(&header);
+}
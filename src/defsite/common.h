@@ -1,11 +1,14 @@
 #ifndef DEFSITE_COMMON_H
 #define DEFSITE_COMMON_H
 
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define MAX_PATH_LEN 4096
 #define MAX_EXPANSION_DEPTH 64
+#define HASH_SEED 1469598103934665603ull
 
 typedef enum {
     NODE_DOCUMENT,
@@ -40,10 +43,13 @@ typedef struct {
     size_t cap;
 } StringStack;
 
+typedef struct BuildOptions BuildOptions;
+
 typedef struct {
     int error_count;
     int warning_count;
     const char *current_file;
+    const BuildOptions *opts;
 } BuildCtx;
 
 typedef struct {
@@ -84,9 +90,273 @@ typedef struct {
     size_t cap;
 } StrBuf;
 
+typedef enum {
+    IO_BACKEND_STDIO,
+    IO_BACKEND_URING
+} IoBackend;
+
+typedef struct {
+    const char *path;
+    char *data;
+    size_t len;
+    bool ok;
+} IoFile;
+
+typedef struct IoStream IoStream;
+
+/* Updated from compression workers as well as the main thread. */
+typedef struct {
+    _Atomic size_t open;
+    _Atomic size_t seek;
+    _Atomic size_t stat;
+    _Atomic size_t read;
+    _Atomic size_t write;
+    _Atomic size_t close;
+    _Atomic size_t enter;
+    _Atomic size_t ring_ops;
+    _Atomic size_t bytes_read;
+    _Atomic size_t bytes_written;
+    _Atomic uint64_t ns;
+    _Atomic size_t outputs_changed;
+    _Atomic size_t outputs_unchanged;
+} IoCounters;
+
+typedef enum {
+    URING_OPENAT,
+    URING_STATX,
+    URING_READ,
+    URING_WRITE,
+    URING_CLOSE
+} UringOpKind;
+
+typedef struct {
+    UringOpKind kind;
+    const char *path;
+    int flags;
+    int fd;
+    void *buf;
+    size_t len;
+    size_t offset;
+    size_t size;
+    size_t tag;
+    int result;
+} UringOp;
+
+typedef struct IoUring IoUring;
+
+typedef struct {
+    char *key;
+    uint64_t hash;
+    void *value;
+} StrMapEntry;
+
+typedef struct {
+    StrMapEntry *slots;
+    size_t count;
+    size_t cap;
+} StrMap;
+
+typedef enum {
+    MEM_OTHER,
+    MEM_PARSER,
+    MEM_DOM,
+    MEM_EXPAND,
+    MEM_SERIALIZE,
+    MEM_INDEX,
+    MEM_SUBSYSTEM_COUNT
+} MemSubsystem;
+
+typedef enum {
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} JsonType;
+
+/* Arrays and objects keep their items in order; keys is set for objects. */
+typedef struct JsonValue JsonValue;
+struct JsonValue {
+    JsonType type;
+    bool boolean;
+    double number;
+    char *string;
+    JsonValue **items;
+    char **keys;
+    size_t count;
+    size_t cap;
+};
+
+/* One search-index entry: a page's URL and its root data-* attributes. */
+typedef struct {
+    char *key;
+    char *value;
+} MetaField;
+
+typedef struct {
+    char *url;
+    MetaField *meta;
+    size_t meta_count;
+    size_t meta_cap;
+} DiscoveryRecord;
+
+typedef struct {
+    DiscoveryRecord *items;
+    size_t count;
+    size_t cap;
+} DiscoveryList;
+
+/* Collects records for the index. Records are checked against the unique
+ * keys with one hash map per key as they arrive, and once the pending batch
+ * exceeds the memory cap it is sorted by URL and spilled to a run file next
+ * to the output; the runs are merged when the index is written. A builder
+ * that keeps every record (for outputs that need them all at once) never
+ * spills. */
+typedef struct {
+    DiscoveryList pending;
+    size_t pending_bytes;
+    size_t memory_cap;
+    size_t total;
+    bool keep_all;
+    bool over_cap;
+    char run_prefix[MAX_PATH_LEN + 32];
+    StringStack runs;
+    StringStack unique_keys;
+    StrMap *seen;
+} IndexBuilder;
+
+/* A listing template's <listing> settings, and the records it shows
+ * split into groups (see listingselect.c). */
+typedef struct {
+    const char *card;
+    const char *kind;
+    const char *group_by;
+    long per_page;
+    const char *sort_key;
+    bool sort_descending;
+} ListingSpec;
+
+typedef struct {
+    char *value;
+    char *slug;
+    const DiscoveryRecord **items;
+    size_t count;
+    size_t cap;
+} ListingGroup;
+
+typedef struct {
+    ListingGroup *items;
+    size_t count;
+    size_t cap;
+} ListingGroupList;
+
+/* A collection template and its data rows (see collection.c). */
+typedef struct {
+    char *name; /* "" for the default slot */
+    char *html;
+} RowSlot;
+
+typedef struct {
+    Node *row; /* <row> element carrying the fields as attributes */
+    RowSlot *slots;
+    size_t slot_count;
+    size_t slot_cap;
+    char *url;      /* output path relative to the output root */
+    char *src_path; /* where the page would live in the source tree */
+    size_t line;
+    size_t bytes;
+} CollectionRow;
+
+typedef struct {
+    char *template_path;
+    char *data_path;
+    Node *page;
+    const Node *html;
+    CollectionRow *rows;
+    size_t row_count;
+    size_t row_cap;
+} Collection;
+
+typedef void (*PoolFn)(void *arg);
+typedef struct WorkPool WorkPool;
+
+/* What `defsite` was asked to do; a first argument naming a command selects
+ * it, anything else is a whole-tree build. */
+typedef enum {
+    COMMAND_BUILD,
+    COMMAND_MERGE,
+    COMMAND_COMPILE,
+    COMMAND_INDEX,
+    COMMAND_NINJA,
+    COMMAND_SERVE
+} BuildCommand;
+
+typedef enum {
+    ARCHIVE_TAR,
+    ARCHIVE_TAR_GZ,
+    ARCHIVE_TAR_ZST,
+    ARCHIVE_ZIP
+} ArchiveFormat;
+
+#define COMPRESS_GZIP 1u
+#define COMPRESS_ZSTD 2u
+
+struct BuildOptions {
+    BuildCommand command;
+    const char *program;
+    const char *src_dir;
+    const char *out_dir;
+    IoBackend io_backend;
+    bool io_report;
+    unsigned compress_formats;
+    int gzip_level;
+    int zstd_level;
+    size_t jobs;
+    bool minify;
+    bool keep_comments;
+    bool fingerprint;
+    const char *fingerprint_exts;
+    bool index_binary;
+    size_t index_shard_size;
+    const char *index_facets;
+    const char *index_sorts;
+    const char *index_unique;
+    size_t index_memory_kb;
+    bool fulltext;
+    size_t fulltext_shard_len;
+    bool fulltext_prefixes;
+    const char *profile_path;
+    size_t profile_top;
+    const char *mem_stats_path;
+    const char *stats_path;
+    size_t max_page_nodes;
+    size_t max_page_bytes;
+    size_t max_page_ms;
+    const char *diagnostics_json;
+    bool quiet;
+    size_t shard_index;
+    size_t shard_count;
+    const char **merge_inputs;
+    size_t merge_input_count;
+    const char *cache_dir;
+    const char *parse_cache_dir;
+    const char *compile_input;
+    const char *compile_output;
+    const char *depfile_path;
+    bool compile_batch;
+    const char *archive_path;
+    ArchiveFormat archive_format;
+    bool serve_lazy;
+    const char *serve_bind;
+    int serve_port;
+    size_t serve_cache_mb;
+};
+
 /* util.c */
 void *xmalloc(size_t size);
 void *xrealloc(void *ptr, size_t size);
+void xfree(void *ptr);
 char *xstrdup(const char *s);
 char *substr_dup(const char *s, size_t start, size_t end);
 void to_lower_inplace(char *s);
@@ -100,12 +370,151 @@ void log_warning(BuildCtx *ctx, const char *fmt, ...);
 
 void sb_append_n(StrBuf *b, const char *s, size_t n);
 void sb_append(StrBuf *b, const char *s);
+void json_append_escaped(StrBuf *b, const char *s);
 
-char *read_file(const char *path);
-bool write_file(const char *path, const char *data);
 int ensure_dir(const char *path);
 bool has_html_ext(const char *path);
+
+/* diag.c */
+void diag_init(const BuildOptions *opts);
+void diag_record(bool is_error, const char *file, const char *fmt, va_list ap);
+void diag_absorb(const JsonValue *report, BuildCtx *ctx);
+void diag_flush(BuildCtx *ctx);
+
+/* json.c */
+JsonValue *json_parse(const char *text, size_t *error_offset);
+JsonValue *json_read_file(const char *path, BuildCtx *ctx);
+const JsonValue *json_get(const JsonValue *obj, const char *key);
+const char *json_get_string(const JsonValue *obj, const char *key);
+double json_get_number(const JsonValue *obj, const char *key);
+void json_free(JsonValue *v);
+
+/* io.c */
+bool io_init(IoBackend requested);
+void io_shutdown(void);
+IoBackend io_backend(void);
+void io_report(void);
+void io_set_output_dir(const char *dir);
+extern IoCounters io_counters;
+uint64_t io_now_ns(void);
+IoUring *io_ring(void);
+void io_note_output(const char *path, bool changed);
+void io_temp_path(const char *path, char *out, size_t size);
+char *io_read_whole(const char *path, size_t *len_out);
+bool io_write_whole(const char *path, const char *data, size_t n);
+bool io_same_contents(const char *path, const char *data, size_t n);
+char *read_file(const char *path);
+bool write_file(const char *path, const char *data);
+bool write_file_n(const char *path, const char *data, size_t len);
+
+/* iostream.c */
 bool copy_file(const char *src, const char *dst);
+bool hash_file(const char *path, uint64_t *out);
+IoStream *io_stream_create(const char *path);
+IoStream *io_stream_open(const char *path);
+bool io_stream_write(IoStream *s, const char *data, size_t len);
+bool io_stream_read_line(IoStream *s, char **line, size_t *cap);
+bool io_stream_close(IoStream *s);
+
+/* iobatch.c */
+void io_read_batch(IoFile *files, size_t count);
+void io_write_batch(IoFile *files, size_t count);
+
+/* uring.c */
+IoUring *uring_open(unsigned entries);
+void uring_close(IoUring *ring);
+size_t uring_run(IoUring *ring, UringOp *ops, size_t count);
+
+/* map.c */
+uint64_t hash_update(uint64_t h, const void *data, size_t len);
+uint64_t hash_bytes(const void *data, size_t len);
+uint64_t hash_str(const char *s);
+void strmap_init(StrMap *map);
+void *strmap_get(const StrMap *map, const char *key);
+bool strmap_contains(const StrMap *map, const char *key);
+void *strmap_put(StrMap *map, const char *key, void *value);
+void strmap_free(StrMap *map, void (*free_value)(void *));
+
+/* pool.c */
+size_t pool_default_threads(void);
+WorkPool *pool_create(size_t threads);
+size_t pool_thread_count(const WorkPool *pool);
+void pool_submit(WorkPool *pool, PoolFn fn, void *arg);
+void pool_wait(WorkPool *pool);
+void pool_destroy(WorkPool *pool);
+
+/* compress.c */
+bool compress_format_available(unsigned format);
+void compress_init(const BuildOptions *opts);
+void compress_submit(const char *path, char *data, size_t len);
+void compress_finish(BuildCtx *ctx);
+
+/* fingerprint.c */
+void fingerprint_init(const BuildOptions *opts);
+bool fingerprint_enabled(void);
+bool fingerprint_wants(const char *rel_path);
+char *fingerprint_add(const char *rel_path, uint64_t hash);
+uint64_t fingerprint_digest(void);
+char *fingerprint_base_dir(const char *src_path);
+char *fingerprint_rewrite_url(const char *url, const char *base_dir);
+void fingerprint_rewrite_tree(Node *doc, const char *src_path);
+char *fingerprint_rewrite_css(const char *css, size_t len, const char *src_path);
+void fingerprint_finish(const char *out_dir, BuildCtx *ctx);
+
+/* fulltext.c */
+void fulltext_init(const BuildOptions *opts);
+void fulltext_add_page(const Node *doc, const char *src_path);
+void fulltext_finish(const char *out_dir, BuildCtx *ctx);
+
+/* cache.c */
+void cache_init(const BuildOptions *opts);
+bool cache_enabled(void);
+bool cache_pages_enabled(void);
+void cache_key(const char *kind, const char *rel_path, const char *source, size_t len, char out[33]);
+bool cache_lookup(const char *kind, const char *key, char **data, size_t *len);
+void cache_publish(const char *key, const char *data, size_t len);
+void cache_finish(void);
+
+/* domcache.c */
+void domcache_init(const BuildOptions *opts);
+Node *domcache_parse(const char *source, BuildCtx *ctx);
+void domcache_finish(void);
+
+/* memstats.c */
+extern bool mem_accounting;
+void mem_init(const BuildOptions *opts);
+MemSubsystem mem_enter(MemSubsystem subsystem);
+void mem_leave(MemSubsystem prev);
+size_t mem_block_size(void *ptr);
+MemSubsystem mem_block_owner(void *ptr);
+void mem_note_alloc(size_t old_size, MemSubsystem old_owner, void *ptr);
+void mem_note_free(void *ptr);
+void mem_page_begin(void);
+void mem_page_end(const char *path);
+void mem_page_cached(const char *path);
+void mem_finish(BuildCtx *ctx);
+
+/* profile.c */
+void profile_init(const BuildOptions *opts);
+bool profile_enabled(void);
+void profile_begin(void);
+void profile_end(const char *cat, const char *name, const char *detail);
+void profile_cached(const char *cat, const char *name);
+void profile_finish(BuildCtx *ctx);
+
+/* stats.c */
+void stats_init(const BuildOptions *opts);
+bool stats_enabled(void);
+uint64_t stats_now(void);
+void stats_component(const Node *invocation, int depth, Node *const *produced, size_t produced_count, uint64_t start);
+void stats_page(const char *path, size_t input_bytes, size_t output_bytes);
+void stats_absorb(const JsonValue *report);
+void stats_finish(BuildCtx *ctx);
+
+/* options.c */
+void options_init(BuildOptions *opts);
+bool options_parse(BuildOptions *opts, int argc, char **argv);
+void options_print_usage(const char *prog);
 
 /* dom.c */
 Node *node_new_document(void);
@@ -122,6 +531,7 @@ void node_add_child(Node *parent, Node *child);
 void node_free(Node *n);
 Node *node_clone(const Node *src);
 void node_replace_child(Node *parent, size_t idx, Node **new_nodes, size_t new_count);
+void node_measure(const Node *n, size_t *nodes, size_t *bytes);
 
 bool is_void_tag(const char *tag);
 bool is_native_tag(const char *tag);
@@ -147,14 +557,160 @@ DefEntry *scope_resolve(Scope *scope, const char *name);
 char *escape_html_text(const char *s);
 void serialize_node(StrBuf *b, const Node *n);
 
+/* minify.c */
+void minify_tree(Node *n, bool keep_comments);
+void serialize_node_minified(StrBuf *b, const Node *n);
+
 /* parser.c */
 Node *parse_html(const char *src, BuildCtx *ctx);
 
 /* engine.c */
+bool compile_html_source(const char *source, StrBuf *out, BuildCtx *ctx);
 bool process_html_file(const char *input_path, const char *output_path, BuildCtx *ctx);
+bool compile_collection_row(const Node *page, const Node *row, SlotPayload *slots, StrBuf *out, BuildCtx *ctx);
+
+/* collection.c */
+bool collection_is_template(const char *path);
+bool collection_is_data(const char *path);
+size_t collection_build(const char *template_path, const char *src_dir, const char *dst_dir, BuildCtx *ctx);
+size_t collection_row_count(const char *template_path, const char *src_dir, BuildCtx *ctx);
+const char *collection_row_url(const char *template_path, size_t row);
+const char *collection_row_src_path(const char *template_path, size_t row);
+Node *collection_row_html(const char *template_path, size_t row);
+bool collection_render_url(const char *src_dir, const char *rel_path, StrBuf *out, BuildCtx *ctx, bool *found);
+void collection_finish(void);
+CollectionRow *collection_row_begin(Collection *c, size_t line, size_t bytes);
+void collection_row_set(CollectionRow *r, const char *key, const char *value);
+void collection_row_free(CollectionRow *r);
+
+/* collectiondata.c */
+void collection_load_jsonl(Collection *c, char *text, BuildCtx *ctx);
+void collection_load_csv(Collection *c, const char *text, BuildCtx *ctx);
+
+/* listing.c */
+bool listing_is_template(const char *path);
+bool listing_find(const char *src_dir);
+void listing_build(const char *src_dir, const char *out_dir, const DiscoveryRecord *records, size_t count, BuildCtx *ctx);
+
+/* listingselect.c */
+bool listing_read_spec(const Node *listing, ListingSpec *spec, BuildCtx *ctx);
+void listing_select(const ListingSpec *spec, const DiscoveryRecord *records, size_t count, const char *template_path,
+                    const char *stem, ListingGroupList *groups, BuildCtx *ctx);
+void listing_groups_free(ListingGroupList *groups);
+
+/* build.c */
 void process_directory(const char *src, const char *dst, BuildCtx *ctx);
+bool compile_page(const char *rel_path, const char *source, size_t len, StrBuf *page, BuildCtx *ctx);
 
 /* index.c */
+void record_free(DiscoveryRecord *r);
+void record_copy(DiscoveryRecord *dst, const DiscoveryRecord *src);
+int record_cmp(const void *a, const void *b);
+const char *record_meta_get(const DiscoveryRecord *rec, const char *key);
+void record_meta_set(DiscoveryRecord *rec, const char *key, const char *value);
+DiscoveryRecord *discovery_list_push(DiscoveryList *list);
+void discovery_list_free(DiscoveryList *list);
+bool is_date_format(const char *s);
+void split_list(const char *value, StringStack *out);
+void write_index_outputs(IndexBuilder *builder, const char *out_json_path, const char *src_dir, size_t cache_hits, BuildCtx *ctx);
 void generate_discovery_index(const char *src_dir, const char *out_json_path, BuildCtx *ctx);
 
+/* indexcache.c */
+void index_record_append(StrBuf *b, const char *stamp, const char *rel, const DiscoveryRecord *rec);
+bool index_record_parse(char *line, const char **stamp, DiscoveryRecord *rec);
+void index_cache_header(StrBuf *b, const char *src_dir);
+void index_cache_load(const char *path, const char *src_dir, StrMap *cache);
+const DiscoveryRecord *index_cache_lookup(const StrMap *cache, const char *rel, const char *stamp);
+void index_cache_free(StrMap *cache);
+bool index_shared_lookup(const char *rel, const IoFile *src, DiscoveryRecord *rec);
+void index_shared_publish(const IoFile *src, const DiscoveryRecord *rec);
+
+/* indexsort.c */
+void index_builder_init(IndexBuilder *b, const char *out_dir, const BuildOptions *opts, bool keep_all);
+void index_builder_free(IndexBuilder *b);
+void index_builder_add(IndexBuilder *b, DiscoveryRecord *rec, BuildCtx *ctx);
+void serialize_record_json(StrBuf *b, const DiscoveryRecord *r);
+bool write_index_json(const char *out_json_path, IndexBuilder *b, DiscoveryList *keep, const char *fragment_header, StrBuf *copy, BuildCtx *ctx);
+
+/* indexbin.c */
+void write_index_binary(const char *out_json_path, const DiscoveryList *list, BuildCtx *ctx);
+
+/* indexshards.c */
+void write_index_shards(const char *out_json_path, const DiscoveryList *list, const BuildOptions *opts, BuildCtx *ctx);
+
+/* indexmerge.c */
+void merge_index_fragments(const char *const *fragments, size_t count, const char *out_json_path, BuildCtx *ctx);
+
+/* archive.c */
+bool archive_parse_format(const char *name, ArchiveFormat *format);
+bool archive_format_for_path(const char *path, ArchiveFormat *format);
+bool archive_format_available(ArchiveFormat format);
+bool archive_init(const BuildOptions *opts);
+bool archive_enabled(void);
+bool archive_claims(const char *path);
+bool archive_add(const char *path, const char *data, size_t len);
+bool archive_add_file(const char *path, const char *src_path);
+void archive_finish(BuildCtx *ctx);
+void archive_sink(const void *data, size_t len);
+uint64_t archive_offset(void);
+int64_t archive_mtime(void);
+
+/* archivetar.c */
+void archive_tar_header(const char *name, uint64_t size, char type, unsigned mode);
+void archive_tar_pad(uint64_t size);
+void archive_tar_member(const char *name, const char *data, size_t len);
+void archive_tar_finish(void);
+
+/* archivezip.c */
+void archive_zip_init(void);
+uint32_t archive_zip_crc(uint32_t crc, const char *data, size_t len);
+bool archive_zip_fits(uint64_t size);
+void archive_zip_dir(const char *name);
+void archive_zip_member(const char *name, const char *data, size_t len);
+void archive_zip_begin(const char *name);
+void archive_zip_end(uint32_t crc, uint64_t size);
+void archive_zip_finish(void);
+void archive_zip_free(void);
+
+/* shard.c */
+bool shard_owns(const BuildOptions *opts, const char *rel_path);
+char *shard_fragment_path(const char *dir, const char *name);
+void merge_shards(const BuildOptions *opts, BuildCtx *ctx);
+
+/* ninja.c */
+void compile_files(const BuildOptions *opts, BuildCtx *ctx);
+void write_build_ninja(const BuildOptions *opts, BuildCtx *ctx);
+
+/* serve.c */
+void serve_run(const BuildOptions *opts, BuildCtx *ctx);
+
+/* servecache.c */
+typedef struct ServeEntry ServeEntry;
+/* What a request answers with: the page body for 200, else nothing. */
+typedef struct {
+    const char *body;
+    size_t len;
+    int status; /* 200, 404 (no such page or row) or 500 (compile errors) */
+} ServePage;
+bool serve_cache_start(const BuildOptions *opts);
+void serve_cache_finish(bool started, size_t requests);
+ServeEntry *serve_cache_acquire(const char *rel_path, ServePage *page, const char **how);
+void serve_cache_release(ServeEntry *e);
+void serve_cache_invalidate(const char *rel_path);
+void serve_cache_invalidate_dir(const char *rel_dir);
+void serve_cache_collection_changed(const char *rel_dir);
+
+/* servewatch.c */
+int serve_watch_start(const char *src_dir);
+void serve_watch_events(void);
+void serve_watch_finish(void);
+
+/* servehttp.c */
+bool http_read_request(int fd, char *method, char *target);
+int http_request_rel_path(const char *target, char *rel, size_t cap);
+bool http_send_all(int fd, const char *data, size_t len);
+void http_send_head(int fd, int status, const char *reason, const char *type, size_t len, const char *extra);
+void http_send_text(int fd, int status, const char *reason, bool head_only, const char *extra);
+void http_send_file(int fd, const char *path, const char *rel_path, bool head_only);
+
 #endif
@@ -0,0 +1,383 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef DEFSITE_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef DEFSITE_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESS_MANIFEST ".defsite-compress"
+
+typedef struct {
+    char *path;
+    char *rel;
+    char *data;
+    size_t len;
+} CompressJob;
+
+static const char *COMPRESSIBLE_EXTS[] = {
+    ".html", ".htm", ".js", ".mjs", ".json", ".css", ".svg", ".xml", ".txt"
+};
+
+static struct {
+    bool enabled;
+    bool prune;
+    unsigned formats;
+    int gzip_level;
+    int zstd_level;
+    char *out_dir;
+    char manifest_path[MAX_PATH_LEN];
+    WorkPool *pool;
+    StrMap previous;
+    StrMap current;
+    StringStack failures;
+    size_t compressed;
+    size_t skipped;
+    size_t bytes_in;
+    size_t bytes_out;
+    size_t pruned;
+    pthread_mutex_t lock;
+} state;
+
+bool compress_format_available(unsigned format) {
+#ifdef DEFSITE_HAVE_ZLIB
+    if (format == COMPRESS_GZIP) {
+        return true;
+    }
+#endif
+#ifdef DEFSITE_HAVE_ZSTD
+    if (format == COMPRESS_ZSTD) {
+        return true;
+    }
+#endif
+    (void)format;
+    return false;
+}
+
+static bool compress_wants(const char *path) {
+    const char *dot = strrchr(path, '.');
+    if (!dot) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(COMPRESSIBLE_EXTS) / sizeof(COMPRESSIBLE_EXTS[0]); i++) {
+        if (str_eq(dot, COMPRESSIBLE_EXTS[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void load_manifest(void) {
+    char *text = read_file(state.manifest_path);
+    if (!text) {
+        return;
+    }
+    char *line = text;
+    while (*line) {
+        char *end = strchr(line, '\n');
+        if (end) {
+            *end = '\0';
+        }
+        char *space = strchr(line, ' ');
+        if (space) {
+            *space = '\0';
+            strmap_put(&state.previous, space + 1, xstrdup(line));
+        }
+        if (!end) {
+            break;
+        }
+        line = end + 1;
+    }
+    xfree(text);
+}
+
+void compress_init(const BuildOptions *opts) {
+    memset(&state, 0, sizeof(state));
+    strmap_init(&state.previous);
+    strmap_init(&state.current);
+    bool whole_tree = opts->command == COMMAND_BUILD || opts->command == COMMAND_MERGE;
+    if (!opts->out_dir || (opts->compress_formats == 0 && (!whole_tree || archive_enabled()))) {
+        return;
+    }
+    state.out_dir = xstrdup(opts->out_dir);
+    snprintf(state.manifest_path, sizeof(state.manifest_path), "%s/%s", opts->out_dir, COMPRESS_MANIFEST);
+    /* Sidecars from an earlier build are not in a new archive, and the
+     * output directory's are left alone. */
+    if (!archive_enabled()) {
+        load_manifest();
+    }
+    /* Without --compress a whole-tree build only removes old sidecars. */
+    state.prune = state.previous.count > 0;
+    if (opts->compress_formats == 0) {
+        return;
+    }
+    state.enabled = true;
+    state.formats = opts->compress_formats;
+    state.gzip_level = opts->gzip_level;
+    state.zstd_level = opts->zstd_level;
+    pthread_mutex_init(&state.lock, NULL);
+    state.pool = pool_create(opts->jobs);
+}
+
+#ifdef DEFSITE_HAVE_ZLIB
+static bool gzip_buffer(const char *data, size_t len, int level, StrBuf *out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (len > 0xffffffffu || deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    uLong bound = deflateBound(&zs, (uLong)len);
+    out->data = xmalloc(bound);
+    out->cap = bound;
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = (uInt)len;
+    zs.next_out = (Bytef *)out->data;
+    zs.avail_out = (uInt)bound;
+    int rc = deflate(&zs, Z_FINISH);
+    out->len = zs.total_out;
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END;
+}
+#endif
+
+#ifdef DEFSITE_HAVE_ZSTD
+static bool zstd_buffer(const char *data, size_t len, int level, StrBuf *out) {
+    size_t bound = ZSTD_compressBound(len);
+    out->data = xmalloc(bound);
+    out->cap = bound;
+    size_t n = ZSTD_compress(out->data, bound, data, len, level);
+    if (ZSTD_isError(n)) {
+        return false;
+    }
+    out->len = n;
+    return true;
+}
+#endif
+
+static bool write_sidecar(const char *path, const char *suffix, unsigned format, const CompressJob *job, size_t *out_bytes) {
+    StrBuf packed = {0};
+    bool ok = false;
+    (void)job;
+    (void)format;
+#ifdef DEFSITE_HAVE_ZLIB
+    if (format == COMPRESS_GZIP) {
+        ok = gzip_buffer(job->data, job->len, state.gzip_level, &packed);
+    }
+#endif
+#ifdef DEFSITE_HAVE_ZSTD
+    if (format == COMPRESS_ZSTD) {
+        ok = zstd_buffer(job->data, job->len, state.zstd_level, &packed);
+    }
+#endif
+    if (ok) {
+        char sidecar[MAX_PATH_LEN];
+        snprintf(sidecar, sizeof(sidecar), "%s%s", path, suffix);
+        ok = write_file_n(sidecar, packed.data, packed.len);
+        *out_bytes += packed.len;
+    }
+    xfree(packed.data);
+    return ok;
+}
+
+static bool sidecars_present(const char *path) {
+    char sidecar[MAX_PATH_LEN];
+    struct stat st;
+    if (state.formats & COMPRESS_GZIP) {
+        snprintf(sidecar, sizeof(sidecar), "%s.gz", path);
+        if (stat(sidecar, &st) != 0) {
+            return false;
+        }
+    }
+    if (state.formats & COMPRESS_ZSTD) {
+        snprintf(sidecar, sizeof(sidecar), "%s.zst", path);
+        if (stat(sidecar, &st) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void compress_job_run(void *arg) {
+    CompressJob *job = arg;
+    profile_begin();
+    char stamp[64];
+    snprintf(stamp,
+             sizeof(stamp),
+             "%016llx:%u:%d:%d",
+             (unsigned long long)hash_bytes(job->data, job->len),
+             state.formats,
+             state.gzip_level,
+             state.zstd_level);
+
+    const char *prev = strmap_get(&state.previous, job->rel);
+    bool unchanged = prev && str_eq(prev, stamp) && sidecars_present(job->path);
+
+    bool ok = true;
+    size_t out_bytes = 0;
+    if (!unchanged) {
+        if (state.formats & COMPRESS_GZIP) {
+            ok = write_sidecar(job->path, ".gz", COMPRESS_GZIP, job, &out_bytes) && ok;
+        }
+        if (state.formats & COMPRESS_ZSTD) {
+            ok = write_sidecar(job->path, ".zst", COMPRESS_ZSTD, job, &out_bytes) && ok;
+        }
+    }
+
+    pthread_mutex_lock(&state.lock);
+    if (!ok) {
+        strstack_push(&state.failures, job->path);
+    } else {
+        xfree(strmap_put(&state.current, job->rel, xstrdup(stamp)));
+        if (unchanged) {
+            state.skipped++;
+        } else {
+            state.compressed++;
+            state.bytes_in += job->len;
+            state.bytes_out += out_bytes;
+        }
+    }
+    pthread_mutex_unlock(&state.lock);
+    profile_end("compress", unchanged ? "unchanged" : "sidecars", job->rel);
+
+    xfree(job->path);
+    xfree(job->rel);
+    xfree(job->data);
+    xfree(job);
+}
+
+/* Takes ownership of data. Compression runs on the worker pool. */
+void compress_submit(const char *path, char *data, size_t len) {
+    if (!state.enabled || !compress_wants(path)) {
+        xfree(data);
+        return;
+    }
+    size_t base_len = strlen(state.out_dir);
+    const char *rel = path;
+    if (strncmp(path, state.out_dir, base_len) == 0 && path[base_len] == '/') {
+        rel = path + base_len + 1;
+    }
+
+    CompressJob *job = xmalloc(sizeof(CompressJob));
+    job->path = xstrdup(path);
+    job->rel = xstrdup(rel);
+    job->data = data;
+    job->len = len;
+    pool_submit(state.pool, compress_job_run, job);
+}
+
+static int cmp_str_ptr(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void save_manifest(BuildCtx *ctx) {
+    char **keys = xmalloc((state.current.count + 1) * sizeof(char *));
+    size_t n = 0;
+    for (size_t i = 0; i < state.current.cap; i++) {
+        if (state.current.slots[i].key) {
+            keys[n++] = state.current.slots[i].key;
+        }
+    }
+    qsort(keys, n, sizeof(char *), cmp_str_ptr);
+
+    StrBuf out = {0};
+    for (size_t i = 0; i < n; i++) {
+        sb_append(&out, strmap_get(&state.current, keys[i]));
+        sb_append(&out, " ");
+        sb_append(&out, keys[i]);
+        sb_append(&out, "\n");
+    }
+    if (!write_file(state.manifest_path, out.data ? out.data : "")) {
+        log_warning(ctx, "failed to write compression manifest %s", state.manifest_path);
+    }
+    xfree(out.data);
+    xfree(keys);
+}
+
+static void remove_sidecars(const char *rel, unsigned formats) {
+    static const struct {
+        unsigned format;
+        const char *suffix;
+    } SIDECARS[] = {{COMPRESS_GZIP, ".gz"}, {COMPRESS_ZSTD, ".zst"}};
+    for (size_t i = 0; i < sizeof(SIDECARS) / sizeof(SIDECARS[0]); i++) {
+        if (!(formats & SIDECARS[i].format)) {
+            continue;
+        }
+        char sidecar[MAX_PATH_LEN * 2];
+        snprintf(sidecar, sizeof(sidecar), "%s/%s%s", state.out_dir, rel, SIDECARS[i].suffix);
+        if (unlink(sidecar) == 0) {
+            state.pruned++;
+        }
+    }
+}
+
+/* Deletes the sidecars the manifest lists that this build no longer wants:
+ * those of outputs that are gone, and those in formats dropped from
+ * --compress. An output that still exists but was not written this run
+ * (e.g. by `index`) keeps its entry for the next build. */
+static void prune_sidecars(void) {
+    unsigned all = COMPRESS_GZIP | COMPRESS_ZSTD;
+    for (size_t i = 0; i < state.previous.cap; i++) {
+        const StrMapEntry *e = &state.previous.slots[i];
+        if (!e->key) {
+            continue;
+        }
+        if (strmap_contains(&state.current, e->key)) {
+            remove_sidecars(e->key, all & ~state.formats);
+            continue;
+        }
+        char path[MAX_PATH_LEN * 2];
+        snprintf(path, sizeof(path), "%s/%s", state.out_dir, e->key);
+        struct stat st;
+        if (state.enabled && stat(path, &st) == 0) {
+            remove_sidecars(e->key, all & ~state.formats);
+            xfree(strmap_put(&state.current, e->key, xstrdup(e->value)));
+        } else {
+            remove_sidecars(e->key, all);
+        }
+    }
+    if (state.pruned > 0) {
+        fprintf(stderr, "Removed %zu stale compressed sidecar(s)\n", state.pruned);
+    }
+}
+
+void compress_finish(BuildCtx *ctx) {
+    if (state.enabled) {
+        pool_wait(state.pool);
+        pool_destroy(state.pool);
+        for (size_t i = 0; i < state.failures.count; i++) {
+            log_error(ctx, "failed to write compressed sidecar for %s", state.failures.items[i]);
+        }
+    }
+    if (state.prune) {
+        prune_sidecars();
+    }
+    if (state.enabled) {
+        save_manifest(ctx);
+        fprintf(stderr,
+                "Compressed %zu output(s) (%zu unchanged skipped): %zu -> %zu bytes\n",
+                state.compressed,
+                state.skipped,
+                state.bytes_in,
+                state.bytes_out);
+        pthread_mutex_destroy(&state.lock);
+    } else if (state.prune) {
+        unlink(state.manifest_path);
+    }
+
+    strstack_free(&state.failures);
+    strmap_free(&state.previous, xfree);
+    strmap_free(&state.current, xfree);
+    xfree(state.out_dir);
+    state.out_dir = NULL;
+    state.enabled = false;
+    state.prune = false;
+}
@@ -0,0 +1,370 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIAG_CODE_WORDS 4
+
+/* One distinct diagnostic: repeats of the same code and message (which
+ * carries the symbol) are counted instead of stored again. */
+typedef struct {
+    bool is_error;
+    char *code;
+    char *message;
+    char *file;
+    char *last_file;
+    uint64_t seq;
+    size_t count;
+    size_t file_count;
+} DiagEntry;
+
+typedef struct {
+    DiagEntry *items;
+    size_t count;
+    size_t cap;
+    StrMap index;
+} DiagBuffer;
+
+static struct {
+    const char *json_path;
+    char *shard_path;
+    DiagBuffer **buffers;
+    size_t buffer_count;
+    size_t buffer_cap;
+    pthread_mutex_t lock;
+} state = {NULL, NULL, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+static _Thread_local DiagBuffer *local;
+static _Atomic uint64_t next_seq;
+
+void diag_init(const BuildOptions *opts) {
+    state.json_path = opts->diagnostics_json;
+    if (opts->shard_count > 0) {
+        state.shard_path = shard_fragment_path(opts->out_dir, "diagnostics.json");
+    }
+}
+
+static DiagBuffer *local_buffer(void) {
+    if (local) {
+        return local;
+    }
+    local = xmalloc(sizeof(DiagBuffer));
+    memset(local, 0, sizeof(*local));
+    strmap_init(&local->index);
+    pthread_mutex_lock(&state.lock);
+    if (state.buffer_count == state.buffer_cap) {
+        state.buffer_cap = state.buffer_cap == 0 ? 8 : state.buffer_cap * 2;
+        state.buffers = xrealloc(state.buffers, state.buffer_cap * sizeof(DiagBuffer *));
+    }
+    state.buffers[state.buffer_count++] = local;
+    pthread_mutex_unlock(&state.lock);
+    return local;
+}
+
+/* A stable code from the literal start of the format string, e.g.
+ * "unknown invocation symbol <%s>" -> "unknown-invocation-symbol". */
+static char *diag_code(const char *fmt) {
+    StrBuf code = {0};
+    int words = 0;
+    bool in_word = false;
+    for (const char *p = fmt; *p && *p != '%' && words <= DIAG_CODE_WORDS; p++) {
+        char c = *p;
+        bool word_byte = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+        if (word_byte) {
+            if (!in_word) {
+                words++;
+                if (words > DIAG_CODE_WORDS) {
+                    break;
+                }
+                if (code.len > 0) {
+                    sb_append(&code, "-");
+                }
+            }
+            char lower = (char)(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+            sb_append_n(&code, &lower, 1);
+            in_word = true;
+        } else {
+            in_word = false;
+            if (c == '<' || c == '\'' || c == '(') {
+                break;
+            }
+        }
+    }
+    if (!code.data) {
+        sb_append(&code, "diagnostic");
+    }
+    return code.data;
+}
+
+/* True when file a sorts before file b in report order. */
+static bool file_before(const char *a, const char *b) {
+    if ((a[0] == '\0') != (b[0] == '\0')) {
+        return b[0] == '\0';
+    }
+    return strcmp(a, b) < 0;
+}
+
+void diag_record(bool is_error, const char *file, const char *fmt, va_list ap) {
+    char small[512];
+    va_list copy;
+    va_copy(copy, ap);
+    int n = vsnprintf(small, sizeof(small), fmt, copy);
+    va_end(copy);
+    char *message = small;
+    if (n >= (int)sizeof(small)) {
+        message = xmalloc((size_t)n + 1);
+        vsnprintf(message, (size_t)n + 1, fmt, ap);
+    }
+
+    DiagBuffer *buf = local_buffer();
+    StrBuf key = {0};
+    sb_append(&key, is_error ? "E" : "W");
+    sb_append(&key, fmt);
+    sb_append(&key, "\x1f");
+    sb_append(&key, message);
+
+    void *found = strmap_get(&buf->index, key.data);
+    if (found) {
+        DiagEntry *e = &buf->items[(size_t)(uintptr_t)found - 1];
+        e->count++;
+        const char *f = file ? file : "";
+        if (file_before(f, e->file)) {
+            xfree(e->file);
+            e->file = xstrdup(f);
+        }
+        if (!str_eq(e->last_file, f)) {
+            xfree(e->last_file);
+            e->last_file = xstrdup(f);
+            e->file_count++;
+        }
+    } else {
+        if (buf->count == buf->cap) {
+            buf->cap = buf->cap == 0 ? 64 : buf->cap * 2;
+            buf->items = xrealloc(buf->items, buf->cap * sizeof(DiagEntry));
+        }
+        DiagEntry *e = &buf->items[buf->count++];
+        e->is_error = is_error;
+        e->code = diag_code(fmt);
+        e->message = xstrdup(message);
+        e->file = xstrdup(file ? file : "");
+        e->last_file = xstrdup(file ? file : "");
+        e->seq = atomic_fetch_add(&next_seq, 1);
+        e->count = 1;
+        e->file_count = 1;
+        strmap_put(&buf->index, key.data, (void *)(uintptr_t)buf->count);
+    }
+    xfree(key.data);
+    if (message != small) {
+        xfree(message);
+    }
+}
+
+/* Adds the entries of a --diagnostics-json report (a shard's, when merging)
+ * to the calling thread's buffer, counting them toward ctx. */
+void diag_absorb(const JsonValue *report, BuildCtx *ctx) {
+    if (!report || report->type != JSON_ARRAY) {
+        return;
+    }
+    DiagBuffer *buf = local_buffer();
+    for (size_t i = 0; i < report->count; i++) {
+        const JsonValue *item = report->items[i];
+        bool is_error = str_eq(json_get_string(item, "severity"), "error");
+        const char *code = json_get_string(item, "code");
+        const char *file = json_get_string(item, "file");
+        const char *message = json_get_string(item, "message");
+        size_t count = (size_t)json_get_number(item, "count");
+        size_t files = (size_t)json_get_number(item, "files");
+        count = count ? count : 1;
+        files = files ? files : 1;
+
+        StrBuf key = {0};
+        sb_append(&key, is_error ? "E" : "W");
+        sb_append(&key, code);
+        sb_append(&key, "\x1f");
+        sb_append(&key, file);
+        sb_append(&key, "\x1f");
+        sb_append(&key, message);
+        void *found = strmap_get(&buf->index, key.data);
+        if (found) {
+            DiagEntry *e = &buf->items[(size_t)(uintptr_t)found - 1];
+            e->count += count;
+            e->file_count += files;
+        } else {
+            if (buf->count == buf->cap) {
+                buf->cap = buf->cap == 0 ? 64 : buf->cap * 2;
+                buf->items = xrealloc(buf->items, buf->cap * sizeof(DiagEntry));
+            }
+            DiagEntry *e = &buf->items[buf->count++];
+            e->is_error = is_error;
+            e->code = xstrdup(code);
+            e->message = xstrdup(message);
+            e->file = xstrdup(file);
+            e->last_file = xstrdup(file);
+            e->seq = atomic_fetch_add(&next_seq, 1);
+            e->count = count;
+            e->file_count = files;
+            strmap_put(&buf->index, key.data, (void *)(uintptr_t)buf->count);
+        }
+        xfree(key.data);
+        if (is_error) {
+            ctx->error_count += (int)count;
+        } else {
+            ctx->warning_count += (int)count;
+        }
+    }
+}
+
+/* File order first; diagnostics without a file go last, in the order raised. */
+static int cmp_entry(const void *a, const void *b) {
+    const DiagEntry *x = *(const DiagEntry *const *)a;
+    const DiagEntry *y = *(const DiagEntry *const *)b;
+    bool x_global = x->file[0] == '\0';
+    bool y_global = y->file[0] == '\0';
+    if (x_global != y_global) {
+        return x_global ? 1 : -1;
+    }
+    int c = strcmp(x->file, y->file);
+    if (c != 0) {
+        return c;
+    }
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static void write_json(const char *path, DiagEntry **entries, size_t count, BuildCtx *ctx) {
+    StrBuf b = {0};
+    char num[96];
+    sb_append(&b, "[");
+    for (size_t i = 0; i < count; i++) {
+        const DiagEntry *e = entries[i];
+        sb_append(&b, i ? ",\n  {\"severity\": " : "\n  {\"severity\": ");
+        sb_append(&b, e->is_error ? "\"error\"" : "\"warning\"");
+        sb_append(&b, ", \"code\": ");
+        json_append_escaped(&b, e->code);
+        sb_append(&b, ", \"file\": ");
+        json_append_escaped(&b, e->file);
+        sb_append(&b, ", \"message\": ");
+        json_append_escaped(&b, e->message);
+        snprintf(num, sizeof(num), ", \"count\": %zu, \"files\": %zu}", e->count, e->file_count);
+        sb_append(&b, num);
+    }
+    sb_append(&b, count ? "\n]\n" : "]\n");
+    if (!write_file(path, b.data)) {
+        fprintf(stderr, "WARN: failed to write diagnostics %s\n", path);
+        ctx->warning_count++;
+    }
+    xfree(b.data);
+}
+
+static void free_buffer(DiagBuffer *buf) {
+    for (size_t i = 0; i < buf->count; i++) {
+        xfree(buf->items[i].code);
+        xfree(buf->items[i].message);
+        xfree(buf->items[i].file);
+        xfree(buf->items[i].last_file);
+    }
+    xfree(buf->items);
+    strmap_free(&buf->index, NULL);
+    xfree(buf);
+}
+
+/* Folds src into dst: counts add up, and dst keeps the file that comes
+ * first in report order so the result does not depend on which thread
+ * raised the diagnostic first. */
+static void merge_entry(DiagEntry *dst, DiagEntry *src) {
+    dst->count += src->count;
+    dst->file_count += src->file_count;
+    if (file_before(src->file, dst->file)) {
+        char *file = dst->file;
+        dst->file = src->file;
+        src->file = file;
+    }
+    if (src->seq < dst->seq) {
+        dst->seq = src->seq;
+    }
+}
+
+/* Prints every buffered diagnostic once, in file order, with its repeat
+ * count, and writes the JSON report if one was requested. Each thread
+ * deduplicates its own buffer; entries with the same severity, code and
+ * message from different threads are merged here. */
+void diag_flush(BuildCtx *ctx) {
+    pthread_mutex_lock(&state.lock);
+    size_t total = 0;
+    for (size_t i = 0; i < state.buffer_count; i++) {
+        total += state.buffers[i]->count;
+    }
+    DiagEntry **entries = xmalloc((total + 1) * sizeof(DiagEntry *));
+    size_t n = 0;
+    StrMap merged;
+    strmap_init(&merged);
+    for (size_t i = 0; i < state.buffer_count; i++) {
+        for (size_t j = 0; j < state.buffers[i]->count; j++) {
+            DiagEntry *e = &state.buffers[i]->items[j];
+            StrBuf key = {0};
+            sb_append(&key, e->is_error ? "E" : "W");
+            sb_append(&key, e->code);
+            sb_append(&key, "\x1f");
+            sb_append(&key, e->message);
+            void *found = strmap_get(&merged, key.data);
+            if (found) {
+                merge_entry(entries[(size_t)(uintptr_t)found - 1], e);
+            } else {
+                entries[n++] = e;
+                strmap_put(&merged, key.data, (void *)(uintptr_t)n);
+            }
+            xfree(key.data);
+        }
+    }
+    strmap_free(&merged, NULL);
+    qsort(entries, n, sizeof(DiagEntry *), cmp_entry);
+
+    StrBuf out = {0};
+    char num[96];
+    for (size_t i = 0; i < n; i++) {
+        const DiagEntry *e = entries[i];
+        sb_append(&out, e->is_error ? "ERROR: " : "WARN: ");
+        if (e->file[0]) {
+            sb_append(&out, "[");
+            sb_append(&out, e->file);
+            sb_append(&out, "] ");
+        }
+        sb_append(&out, e->message);
+        if (e->count > 1) {
+            if (e->file_count > 1) {
+                snprintf(num, sizeof(num), " (%zu times in %zu files)", e->count, e->file_count);
+            } else {
+                snprintf(num, sizeof(num), " (%zu times)", e->count);
+            }
+            sb_append(&out, num);
+        }
+        sb_append(&out, "\n");
+    }
+    if (out.len > 0) {
+        fwrite(out.data, 1, out.len, stderr);
+    }
+    xfree(out.data);
+
+    if (state.json_path) {
+        write_json(state.json_path, entries, n, ctx);
+    }
+    if (state.shard_path) {
+        write_json(state.shard_path, entries, n, ctx);
+        xfree(state.shard_path);
+        state.shard_path = NULL;
+    }
+    xfree(entries);
+    for (size_t i = 0; i < state.buffer_count; i++) {
+        free_buffer(state.buffers[i]);
+    }
+    xfree(state.buffers);
+    state.buffers = NULL;
+    state.buffer_count = 0;
+    state.buffer_cap = 0;
+    local = NULL;
+    pthread_mutex_unlock(&state.lock);
+}
@@ -30,11 +30,13 @@ static const char *VOID_TAGS[] = {
 static const size_t NATIVE_TAG_COUNT = sizeof(NATIVE_TAGS) / sizeof(NATIVE_TAGS[0]);
 static const size_t VOID_TAG_COUNT = sizeof(VOID_TAGS) / sizeof(VOID_TAGS[0]);
 
-static Node *node_new(NodeType type) {
+/* Tree storage is accounted to MEM_DOM whichever phase builds the tree. */
+static Node *node_new(NodeType type, const char *tag, const char *text) {
+    MemSubsystem prev_mem = mem_enter(MEM_DOM);
     Node *n = xmalloc(sizeof(Node));
     n->type = type;
-    n->tag = NULL;
-    n->text = NULL;
+    n->tag = tag ? xstrdup(tag) : NULL;
+    n->text = text ? xstrdup(text) : NULL;
     n->attrs = NULL;
     n->attr_count = 0;
     n->attr_cap = 0;
@@ -42,41 +44,35 @@ static Node *node_new(NodeType type) {
     n->child_count = 0;
     n->child_cap = 0;
     n->parent = NULL;
+    mem_leave(prev_mem);
     return n;
 }
 
 Node *node_new_document(void) {
-    return node_new(NODE_DOCUMENT);
+    return node_new(NODE_DOCUMENT, NULL, NULL);
 }
 
 Node *node_new_element(const char *tag) {
-    Node *n = node_new(NODE_ELEMENT);
-    n->tag = xstrdup(tag);
-    return n;
+    return node_new(NODE_ELEMENT, tag, NULL);
 }
 
 Node *node_new_text(const char *text) {
-    Node *n = node_new(NODE_TEXT);
-    n->text = xstrdup(text);
-    return n;
+    return node_new(NODE_TEXT, NULL, text);
 }
 
 Node *node_new_comment(const char *text) {
-    Node *n = node_new(NODE_COMMENT);
-    n->text = xstrdup(text);
-    return n;
+    return node_new(NODE_COMMENT, NULL, text);
 }
 
 Node *node_new_decl(const char *text) {
-    Node *n = node_new(NODE_DECL);
-    n->text = xstrdup(text);
-    return n;
+    return node_new(NODE_DECL, NULL, text);
 }
 
 void node_add_attr(Node *n, const char *name, const char *value) {
     if (n->type != NODE_ELEMENT) {
         return;
     }
+    MemSubsystem prev_mem = mem_enter(MEM_DOM);
     if (n->attr_count == n->attr_cap) {
         size_t next = n->attr_cap == 0 ? 4 : n->attr_cap * 2;
         n->attrs = xrealloc(n->attrs, next * sizeof(Attr));
@@ -85,6 +81,7 @@ void node_add_attr(Node *n, const char *name, const char *value) {
     n->attrs[n->attr_count].name = xstrdup(name);
     n->attrs[n->attr_count].value = xstrdup(value);
     n->attr_count++;
+    mem_leave(prev_mem);
 }
 
 const char *node_get_attr(const Node *n, const char *name) {
@@ -105,8 +102,8 @@ void node_remove_attr(Node *n, const char *name) {
     }
     for (size_t i = 0; i < n->attr_count; i++) {
         if (str_eq(n->attrs[i].name, name)) {
-            free(n->attrs[i].name);
-            free(n->attrs[i].value);
+            xfree(n->attrs[i].name);
+            xfree(n->attrs[i].value);
             if (i + 1 < n->attr_count) {
                 memmove(&n->attrs[i], &n->attrs[i + 1], (n->attr_count - i - 1) * sizeof(Attr));
             }
@@ -119,7 +116,9 @@ void node_remove_attr(Node *n, const char *name) {
 void node_add_child(Node *parent, Node *child) {
     if (parent->child_count == parent->child_cap) {
         size_t next = parent->child_cap == 0 ? 4 : parent->child_cap * 2;
+        MemSubsystem prev_mem = mem_enter(MEM_DOM);
         parent->children = xrealloc(parent->children, next * sizeof(Node *));
+        mem_leave(prev_mem);
         parent->child_cap = next;
     }
     child->parent = parent;
@@ -130,28 +129,22 @@ void node_free(Node *n) {
     if (!n) {
         return;
     }
-    free(n->tag);
-    free(n->text);
+    xfree(n->tag);
+    xfree(n->text);
     for (size_t i = 0; i < n->attr_count; i++) {
-        free(n->attrs[i].name);
-        free(n->attrs[i].value);
+        xfree(n->attrs[i].name);
+        xfree(n->attrs[i].value);
     }
-    free(n->attrs);
+    xfree(n->attrs);
     for (size_t i = 0; i < n->child_count; i++) {
         node_free(n->children[i]);
     }
-    free(n->children);
-    free(n);
+    xfree(n->children);
+    xfree(n);
 }
 
 Node *node_clone(const Node *src) {
-    Node *dst = node_new(src->type);
-    if (src->tag) {
-        dst->tag = xstrdup(src->tag);
-    }
-    if (src->text) {
-        dst->text = xstrdup(src->text);
-    }
+    Node *dst = node_new(src->type, src->tag, src->text);
     for (size_t i = 0; i < src->attr_count; i++) {
         node_add_attr(dst, src->attrs[i].name, src->attrs[i].value);
     }
@@ -161,6 +154,23 @@ Node *node_clone(const Node *src) {
     return dst;
 }
 
+/* Counts the nodes of a subtree and approximates its serialized size
+ * without serializing it. */
+void node_measure(const Node *n, size_t *nodes, size_t *bytes) {
+    (*nodes)++;
+    if (n->type == NODE_ELEMENT) {
+        *bytes += 2 * strlen(n->tag) + 5;
+        for (size_t i = 0; i < n->attr_count; i++) {
+            *bytes += strlen(n->attrs[i].name) + strlen(n->attrs[i].value) + 4;
+        }
+    } else if (n->text) {
+        *bytes += strlen(n->text) + (n->type == NODE_COMMENT ? 7 : n->type == NODE_DECL ? 3 : 0);
+    }
+    for (size_t i = 0; i < n->child_count; i++) {
+        node_measure(n->children[i], nodes, bytes);
+    }
+}
+
 void node_replace_child(Node *parent, size_t idx, Node **new_nodes, size_t new_count) {
     if (!parent || idx >= parent->child_count) {
         return;
@@ -175,7 +185,9 @@ void node_replace_child(Node *parent, size_t idx, Node **new_nodes, size_t new_c
         while (next < final_count) {
             next *= 2;
         }
+        MemSubsystem prev_mem = mem_enter(MEM_DOM);
         parent->children = xrealloc(parent->children, next * sizeof(Node *));
+        mem_leave(prev_mem);
         parent->child_cap = next;
     }
 
@@ -245,7 +257,7 @@ void strstack_pop(StringStack *s) {
     if (s->count == 0) {
         return;
     }
-    free(s->items[s->count - 1]);
+    xfree(s->items[s->count - 1]);
     s->count--;
 }
 
@@ -260,9 +272,9 @@ bool strstack_contains(const StringStack *s, const char *item) {
 
 void strstack_free(StringStack *s) {
     for (size_t i = 0; i < s->count; i++) {
-        free(s->items[i]);
+        xfree(s->items[i]);
     }
-    free(s->items);
+    xfree(s->items);
 }
 
 void nodelist_push(NodeList *list, Node *node) {
@@ -278,7 +290,7 @@ void nodelist_free(NodeList *list) {
     for (size_t i = 0; i < list->count; i++) {
         node_free(list->items[i]);
     }
-    free(list->items);
+    xfree(list->items);
 }
 
 NamedSlot *slotpayload_get_named(SlotPayload *payload, const char *name) {
@@ -305,10 +317,10 @@ NamedSlot *slotpayload_get_named(SlotPayload *payload, const char *name) {
 void slotpayload_free(SlotPayload *payload) {
     nodelist_free(&payload->default_nodes);
     for (size_t i = 0; i < payload->named_count; i++) {
-        free(payload->named[i].name);
+        xfree(payload->named[i].name);
         nodelist_free(&payload->named[i].nodes);
     }
-    free(payload->named);
+    xfree(payload->named);
 }
 
 void scope_init(Scope *scope, Scope *parent) {
@@ -320,10 +332,10 @@ void scope_init(Scope *scope, Scope *parent) {
 
 void scope_free(Scope *scope) {
     for (size_t i = 0; i < scope->def_count; i++) {
-        free(scope->defs[i].name);
+        xfree(scope->defs[i].name);
         node_free(scope->defs[i].def_node);
     }
-    free(scope->defs);
+    xfree(scope->defs);
 }
 
 DefEntry *scope_find_local_def(Scope *scope, const char *name) {
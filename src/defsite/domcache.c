@@ -0,0 +1,351 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef DEFSITE_COMPILER_ID
+#define DEFSITE_COMPILER_ID "dev"
+#endif
+
+#define DOM_MAGIC "DSD1"
+#define DOM_VERSION 1u
+#define DOM_NONE UINT32_MAX
+#define DOM_SEED_2 0x9e3779b97f4a7c15ull
+
+/* Parse cache (--parse-cache=DIR): the parsed tree of each source, keyed by
+ * a hash of its bytes, so a page whose source did not change is expanded
+ * from the stored tree instead of being parsed again. One file per source,
+ * DIR/<2 hex>/<30 hex>.dom, in native byte order:
+ *   header   magic, version, source hash (2 x u64), source length,
+ *            node, attribute and string-table sizes
+ *   nodes    { type, tag, text, attr_count, child_count } in pre-order
+ *   attrs    { name, value } in node order
+ *   strings  deduplicated NUL-terminated strings; fields are offsets
+ * Files are read with mmap and checked against the source hash and their
+ * own sizes before use. */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t hash[2];
+    uint64_t source_len;
+    uint32_t node_count;
+    uint32_t attr_count;
+    uint32_t string_bytes;
+    uint32_t reserved;
+} DomHeader;
+
+typedef struct {
+    uint32_t type;
+    uint32_t tag;
+    uint32_t text;
+    uint32_t attr_count;
+    uint32_t child_count;
+} DomNode;
+
+typedef struct {
+    uint32_t name;
+    uint32_t value;
+} DomAttr;
+
+static struct {
+    bool enabled;
+    char *dir;
+    size_t hits;
+    size_t misses;
+    size_t written;
+    size_t rejected;
+} state;
+
+void domcache_init(const BuildOptions *opts) {
+    memset(&state, 0, sizeof(state));
+    if (!opts->parse_cache_dir) {
+        return;
+    }
+    state.enabled = true;
+    state.dir = xstrdup(opts->parse_cache_dir);
+    if (ensure_dir(state.dir) != 0) {
+        fprintf(stderr, "WARN: parse cache %s is not writable (%s); reading only\n", state.dir, strerror(errno));
+    }
+}
+
+/* Sources are hashed on every lookup, so this reads 8 bytes per step into
+ * two independently mixed lanes (128 bits) instead of FNV's byte loop. */
+static void source_hash(const char *source, size_t len, uint64_t out[2]) {
+    uint64_t a = hash_bytes(DEFSITE_COMPILER_ID, sizeof(DEFSITE_COMPILER_ID)) ^ len;
+    uint64_t b = DOM_SEED_2 ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, source + i, 8);
+        a = (a ^ w) * 0x100000001b3ull;
+        a ^= a >> 29;
+        b = (b + w) * 0xff51afd7ed558ccdull;
+        b ^= b >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, source + i, len - i);
+    a = (a ^ tail) * 0x100000001b3ull;
+    b = (b + tail) * 0xff51afd7ed558ccdull;
+    a ^= a >> 33;
+    a *= 0xc4ceb9fe1a85ec53ull;
+    a ^= a >> 33;
+    b ^= b >> 33;
+    b *= 0xc4ceb9fe1a85ec53ull;
+    b ^= b >> 33;
+    out[0] = a;
+    out[1] = b;
+}
+
+static void entry_path(const uint64_t hash[2], char *path, size_t size, bool dir_only) {
+    char hex[33];
+    snprintf(hex, sizeof(hex), "%016" PRIx64 "%016" PRIx64, hash[0], hash[1]);
+    if (dir_only) {
+        snprintf(path, size, "%s/%.2s", state.dir, hex);
+    } else {
+        snprintf(path, size, "%s/%.2s/%s.dom", state.dir, hex, hex + 2);
+    }
+}
+
+/* Serialization: strings are interned so repeated tag and attribute names
+ * (the atoms of a page) are stored once. */
+typedef struct {
+    StrBuf nodes;
+    StrBuf attrs;
+    StrBuf strings;
+    StrMap offsets;
+    uint32_t node_count;
+    uint32_t attr_count;
+} DomWriter;
+
+static uint32_t intern(DomWriter *w, const char *s) {
+    if (!s) {
+        return DOM_NONE;
+    }
+    void *found = strmap_get(&w->offsets, s);
+    if (found) {
+        return (uint32_t)((uintptr_t)found - 1);
+    }
+    uint32_t offset = (uint32_t)w->strings.len;
+    sb_append_n(&w->strings, s, strlen(s) + 1);
+    strmap_put(&w->offsets, s, (void *)(uintptr_t)(offset + 1));
+    return offset;
+}
+
+static void write_node(DomWriter *w, const Node *n) {
+    DomNode dn = {(uint32_t)n->type, intern(w, n->tag), intern(w, n->text), (uint32_t)n->attr_count, (uint32_t)n->child_count};
+    sb_append_n(&w->nodes, (const char *)&dn, sizeof(dn));
+    w->node_count++;
+    for (size_t i = 0; i < n->attr_count; i++) {
+        DomAttr da = {intern(w, n->attrs[i].name), intern(w, n->attrs[i].value)};
+        sb_append_n(&w->attrs, (const char *)&da, sizeof(da));
+        w->attr_count++;
+    }
+    for (size_t i = 0; i < n->child_count; i++) {
+        write_node(w, n->children[i]);
+    }
+}
+
+static void store(const Node *doc, const uint64_t hash[2], size_t source_len) {
+    DomWriter w;
+    memset(&w, 0, sizeof(w));
+    strmap_init(&w.offsets);
+    intern(&w, "");
+    write_node(&w, doc);
+
+    DomHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DOM_MAGIC, 4);
+    h.version = DOM_VERSION;
+    h.hash[0] = hash[0];
+    h.hash[1] = hash[1];
+    h.source_len = source_len;
+    h.node_count = w.node_count;
+    h.attr_count = w.attr_count;
+    h.string_bytes = (uint32_t)w.strings.len;
+
+    StrBuf file = {0};
+    sb_append_n(&file, (const char *)&h, sizeof(h));
+    sb_append_n(&file, w.nodes.data ? w.nodes.data : "", w.nodes.len);
+    sb_append_n(&file, w.attrs.data ? w.attrs.data : "", w.attrs.len);
+    sb_append_n(&file, w.strings.data ? w.strings.data : "", w.strings.len);
+
+    char path[MAX_PATH_LEN];
+    entry_path(hash, path, sizeof(path), true);
+    ensure_dir(path);
+    entry_path(hash, path, sizeof(path), false);
+    if (write_file_n(path, file.data, file.len)) {
+        state.written++;
+    }
+    xfree(file.data);
+    xfree(w.nodes.data);
+    xfree(w.attrs.data);
+    xfree(w.strings.data);
+    strmap_free(&w.offsets, NULL);
+}
+
+/* Rebuilds the tree from a mapped file; NULL if any size or offset is out
+ * of range. Nodes are created iteratively so deep documents are safe. */
+static Node *load_tree(const char *base, size_t size, const uint64_t hash[2], size_t source_len) {
+    if (size < sizeof(DomHeader)) {
+        return NULL;
+    }
+    DomHeader h;
+    memcpy(&h, base, sizeof(h));
+    uint64_t need = sizeof(DomHeader) + (uint64_t)h.node_count * sizeof(DomNode) + (uint64_t)h.attr_count * sizeof(DomAttr) + h.string_bytes;
+    if (memcmp(h.magic, DOM_MAGIC, 4) != 0 || h.version != DOM_VERSION || h.hash[0] != hash[0] || h.hash[1] != hash[1] ||
+        h.source_len != source_len || need != size || h.node_count == 0 || h.string_bytes == 0) {
+        return NULL;
+    }
+    const DomNode *nodes = (const DomNode *)(base + sizeof(DomHeader));
+    const DomAttr *attrs = (const DomAttr *)(nodes + h.node_count);
+    const char *strings = (const char *)(attrs + h.attr_count);
+    if (strings[h.string_bytes - 1] != '\0') {
+        return NULL;
+    }
+
+    /* Each stack entry is a node still waiting for children. */
+    Node **stack = xmalloc((size_t)h.node_count * sizeof(Node *));
+    uint32_t *remaining = xmalloc((size_t)h.node_count * sizeof(uint32_t));
+    size_t depth = 0;
+    Node *root = NULL;
+    uint32_t next_attr = 0;
+    bool ok = true;
+    for (uint32_t i = 0; i < h.node_count && ok; i++) {
+        DomNode dn;
+        memcpy(&dn, &nodes[i], sizeof(dn));
+        if (dn.type > NODE_DECL || (dn.tag != DOM_NONE && dn.tag >= h.string_bytes) ||
+            (dn.text != DOM_NONE && dn.text >= h.string_bytes) || dn.attr_count > h.attr_count - next_attr || dn.child_count > h.node_count - i - 1 ||
+            (i > 0 && depth == 0)) {
+            ok = false;
+            break;
+        }
+        const char *tag = dn.tag == DOM_NONE ? NULL : strings + dn.tag;
+        const char *text = dn.text == DOM_NONE ? "" : strings + dn.text;
+        Node *n = NULL;
+        switch ((NodeType)dn.type) {
+        case NODE_DOCUMENT: n = node_new_document(); break;
+        case NODE_ELEMENT: n = node_new_element(tag ? tag : ""); break;
+        case NODE_TEXT: n = node_new_text(text); break;
+        case NODE_COMMENT: n = node_new_comment(text); break;
+        case NODE_DECL: n = node_new_decl(text); break;
+        }
+        /* Exact-size child and attribute arrays: no growth while filling. */
+        MemSubsystem prev_mem = mem_enter(MEM_DOM);
+        if (dn.child_count > 0) {
+            n->children = xmalloc((size_t)dn.child_count * sizeof(Node *));
+            n->child_cap = dn.child_count;
+        }
+        if (dn.attr_count > 0 && n->type == NODE_ELEMENT) {
+            n->attrs = xmalloc((size_t)dn.attr_count * sizeof(Attr));
+            n->attr_cap = dn.attr_count;
+        }
+        mem_leave(prev_mem);
+        if (depth > 0) {
+            node_add_child(stack[depth - 1], n);
+            remaining[depth - 1]--;
+        } else {
+            root = n;
+        }
+        for (uint32_t a = 0; a < dn.attr_count; a++) {
+            DomAttr da;
+            memcpy(&da, &attrs[next_attr++], sizeof(da));
+            if (da.name >= h.string_bytes || da.value >= h.string_bytes) {
+                ok = false;
+                break;
+            }
+            node_add_attr(n, strings + da.name, strings + da.value);
+        }
+        stack[depth] = n;
+        remaining[depth] = dn.child_count;
+        depth++;
+        while (depth > 0 && remaining[depth - 1] == 0) {
+            depth--;
+        }
+    }
+    if (depth != 0 || next_attr != h.attr_count) {
+        ok = false;
+    }
+    xfree(stack);
+    xfree(remaining);
+    if (!ok) {
+        node_free(root);
+        return NULL;
+    }
+    return root;
+}
+
+static Node *load(const uint64_t hash[2], size_t source_len) {
+    char path[MAX_PATH_LEN];
+    entry_path(hash, path, sizeof(path), false);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    Node *doc = NULL;
+    bool mapped = false;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base != MAP_FAILED) {
+            mapped = true;
+            doc = load_tree(base, (size_t)st.st_size, hash, source_len);
+            munmap(base, (size_t)st.st_size);
+        }
+    }
+    close(fd);
+    if (!doc && mapped) {
+        state.rejected++;
+    }
+    return doc;
+}
+
+/* parse_html through the cache. Trees whose parse raised diagnostics are not
+ * stored, so those diagnostics are reported on every build. */
+Node *domcache_parse(const char *source, BuildCtx *ctx) {
+    if (!state.enabled) {
+        return parse_html(source, ctx);
+    }
+    size_t len = strlen(source);
+    uint64_t hash[2];
+    source_hash(source, len, hash);
+    Node *doc = load(hash, len);
+    if (doc) {
+        state.hits++;
+        return doc;
+    }
+    state.misses++;
+    int errors = ctx->error_count;
+    int warnings = ctx->warning_count;
+    doc = parse_html(source, ctx);
+    if (ctx->error_count == errors && ctx->warning_count == warnings) {
+        store(doc, hash, len);
+    }
+    return doc;
+}
+
+void domcache_finish(void) {
+    if (!state.enabled) {
+        return;
+    }
+    size_t lookups = state.hits + state.misses;
+    fprintf(stderr,
+            "Parse cache: %zu/%zu hit (%.1f%%), %zu tree(s) written",
+            state.hits,
+            lookups,
+            lookups ? 100.0 * (double)state.hits / (double)lookups : 0.0,
+            state.written);
+    if (state.rejected > 0) {
+        fprintf(stderr, ", %zu damaged file(s) ignored", state.rejected);
+    }
+    fprintf(stderr, "\n");
+    xfree(state.dir);
+    state.enabled = false;
+}
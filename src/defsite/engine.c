@@ -1,11 +1,10 @@
+#define _POSIX_C_SOURCE 200809L
 #include "common.h"
 
-#include <dirent.h>
-#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <time.h>
 
 static void collect_defs_for_scope(Node *scope_root, Scope *scope, BuildCtx *ctx) {
     for (size_t i = 0; i < scope_root->child_count; i++) {
@@ -71,7 +70,7 @@ static NodeList *slot_lookup_payload(SlotPayload *payload, const char *name) {
 static void set_or_replace_attr(Node *node, const char *name, const char *value) {
     for (size_t i = 0; i < node->attr_count; i++) {
         if (str_eq(node->attrs[i].name, name)) {
-            free(node->attrs[i].value);
+            xfree(node->attrs[i].value);
             node->attrs[i].value = xstrdup(value ? value : "");
             return;
         }
@@ -98,38 +97,40 @@ static void apply_bind_attrs(Node *node, const Node *invocation, BuildCtx *ctx)
 
         if (!target_attr[0]) {
             log_error(ctx, "invalid bind attribute '%s'", bind_name_copy);
-            free(bind_name_copy);
-            free(bind_source_copy);
+            xfree(bind_name_copy);
+            xfree(bind_source_copy);
             continue;
         }
 
         if (!bind_source_copy[0]) {
             log_error(ctx, "bind attribute '%s' missing source key", bind_name_copy);
-            free(bind_name_copy);
-            free(bind_source_copy);
+            xfree(bind_name_copy);
+            xfree(bind_source_copy);
             continue;
         }
 
         const char *value = node_get_attr(invocation, bind_source_copy);
         if (!value) {
             log_warning(ctx, "missing bind '%s' on <%s>", bind_source_copy, invocation->tag);
-            free(bind_name_copy);
-            free(bind_source_copy);
+            xfree(bind_name_copy);
+            xfree(bind_source_copy);
             continue;
         }
 
         set_or_replace_attr(node, target_attr, value);
 
-        free(bind_name_copy);
-        free(bind_source_copy);
+        xfree(bind_name_copy);
+        xfree(bind_source_copy);
     }
 }
 
-static void substitute_binds_slots(Node *node, const Node *invocation, SlotPayload *payload, BuildCtx *ctx) {
+/* skip_defs leaves def-* bodies alone, for binding a collection row into a
+ * whole page whose components bind their own invocations. */
+static void substitute_binds_slots(Node *node, const Node *invocation, SlotPayload *payload, bool skip_defs, BuildCtx *ctx) {
     size_t i = 0;
     while (i < node->child_count) {
         Node *child = node->children[i];
-        if (child->type != NODE_ELEMENT) {
+        if (child->type != NODE_ELEMENT || (skip_defs && is_def_tag(child->tag))) {
             i++;
             continue;
         }
@@ -156,7 +157,7 @@ static void substitute_binds_slots(Node *node, const Node *invocation, SlotPaylo
 
             char *escaped = escape_html_text(value);
             Node *text_node = node_new_text(escaped);
-            free(escaped);
+            xfree(escaped);
 
             Node *repl[1] = {text_node};
             node_replace_child(node, i, repl, 1);
@@ -173,12 +174,12 @@ static void substitute_binds_slots(Node *node, const Node *invocation, SlotPaylo
             }
             NodeList clones = clone_nodelist(src);
             node_replace_child(node, i, clones.items, clones.count);
-            free(clones.items);
+            xfree(clones.items);
             i += src->count;
             continue;
         }
 
-        substitute_binds_slots(child, invocation, payload, ctx);
+        substitute_binds_slots(child, invocation, payload, skip_defs, ctx);
         i++;
     }
 }
@@ -193,7 +194,7 @@ static void collect_slot_payload(const Node *invocation, SlotPayload *payload) {
                 char *slot_name_copy = xstrdup(slot_name);
                 node_remove_attr(clone, "slot");
                 NamedSlot *named = slotpayload_get_named(payload, slot_name_copy);
-                free(slot_name_copy);
+                xfree(slot_name_copy);
                 nodelist_push(&named->nodes, clone);
                 continue;
             }
@@ -202,6 +203,14 @@ static void collect_slot_payload(const Node *invocation, SlotPayload *payload) {
     }
 }
 
+static void warn_unused_slots(const SlotPayload *payload, const Node *invocation, BuildCtx *ctx) {
+    for (size_t i = 0; i < payload->named_count; i++) {
+        if (!payload->named[i].used && payload->named[i].nodes.count > 0) {
+            log_warning(ctx, "unknown named slot '%s' provided to <%s>", payload->named[i].name, invocation->tag);
+        }
+    }
+}
+
 static Node *make_synthetic_root_from_def(const Node *def_node) {
     Node *root = node_new_document();
     for (size_t i = 0; i < def_node->child_count; i++) {
@@ -210,13 +219,80 @@ static Node *make_synthetic_root_from_def(const Node *def_node) {
     return root;
 }
 
-static void process_scope(Node *scope_root, Scope *parent_scope, BuildCtx *ctx, StringStack *stack, int expansion_depth);
+/* Per-page expansion state: the chain of invocations being expanded (for
+ * cycle detection and diagnostics) and the work done against the budgets. */
+typedef struct {
+    StringStack stack;
+    size_t nodes;
+    size_t bytes;
+    size_t max_nodes;
+    size_t max_bytes;
+    uint64_t deadline_ns;
+    bool over_budget;
+} ExpandState;
+
+static uint64_t expand_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void expand_state_init(ExpandState *state, const BuildOptions *opts) {
+    memset(state, 0, sizeof(*state));
+    if (!opts) {
+        return;
+    }
+    state->max_nodes = opts->max_page_nodes;
+    state->max_bytes = opts->max_page_bytes;
+    if (opts->max_page_ms > 0) {
+        state->deadline_ns = expand_now_ns() + (uint64_t)opts->max_page_ms * 1000000ull;
+    }
+}
+
+static void report_budget(ExpandState *state, const Node *invocation, BuildCtx *ctx, const char *what) {
+    StrBuf chain = {0};
+    for (size_t i = 0; i < state->stack.count; i++) {
+        sb_append(&chain, "<");
+        sb_append(&chain, state->stack.items[i]);
+        sb_append(&chain, "> > ");
+    }
+    sb_append(&chain, "<");
+    sb_append(&chain, invocation->tag);
+    sb_append(&chain, ">");
+    log_error(ctx, "expansion budget exceeded (%s) while expanding %s", what, chain.data);
+    xfree(chain.data);
+    state->over_budget = true;
+}
+
+/* Adds a new expansion's nodes to the page totals; false once a budget is
+ * exceeded, after reporting the invocation chain. */
+static bool charge_budget(ExpandState *state, const Node *synthetic, const Node *invocation, BuildCtx *ctx) {
+    if (state->max_nodes > 0 || state->max_bytes > 0) {
+        for (size_t i = 0; i < synthetic->child_count; i++) {
+            node_measure(synthetic->children[i], &state->nodes, &state->bytes);
+        }
+    }
+    char what[128];
+    if (state->max_nodes > 0 && state->nodes > state->max_nodes) {
+        snprintf(what, sizeof(what), "%zu nodes created, limit %zu", state->nodes, state->max_nodes);
+    } else if (state->max_bytes > 0 && state->bytes > state->max_bytes) {
+        snprintf(what, sizeof(what), "%zu bytes created, limit %zu", state->bytes, state->max_bytes);
+    } else if (state->deadline_ns > 0 && expand_now_ns() > state->deadline_ns) {
+        snprintf(what, sizeof(what), "time limit %zu ms", ctx->opts->max_page_ms);
+    } else {
+        return true;
+    }
+    report_budget(state, invocation, ctx, what);
+    return false;
+}
+
+static void process_scope(Node *scope_root, Scope *parent_scope, BuildCtx *ctx, ExpandState *state, int expansion_depth);
 
 static bool expand_component(Node *invocation,
                              const DefEntry *resolved_def,
                              Scope *caller_scope,
                              BuildCtx *ctx,
-                             StringStack *stack,
+                             ExpandState *state,
                              int expansion_depth,
                              Node ***out_nodes,
                              size_t *out_count) {
@@ -228,7 +304,7 @@ static bool expand_component(Node *invocation,
         return false;
     }
 
-    if (strstack_contains(stack, invocation->tag)) {
+    if (strstack_contains(&state->stack, invocation->tag)) {
         log_error(ctx, "recursive component cycle detected at <%s>", invocation->tag);
         return false;
     }
@@ -237,17 +313,18 @@ static bool expand_component(Node *invocation,
     collect_slot_payload(invocation, &payload);
 
     Node *synthetic = make_synthetic_root_from_def(resolved_def->def_node);
-    substitute_binds_slots(synthetic, invocation, &payload, ctx);
+    substitute_binds_slots(synthetic, invocation, &payload, false, ctx);
+    warn_unused_slots(&payload, invocation, ctx);
 
-    for (size_t i = 0; i < payload.named_count; i++) {
-        if (!payload.named[i].used && payload.named[i].nodes.count > 0) {
-            log_warning(ctx, "unknown named slot '%s' provided to <%s>", payload.named[i].name, invocation->tag);
-        }
+    if (!charge_budget(state, synthetic, invocation, ctx)) {
+        node_free(synthetic);
+        slotpayload_free(&payload);
+        return false;
     }
 
-    strstack_push(stack, invocation->tag);
-    process_scope(synthetic, caller_scope, ctx, stack, expansion_depth + 1);
-    strstack_pop(stack);
+    strstack_push(&state->stack, invocation->tag);
+    process_scope(synthetic, caller_scope, ctx, state, expansion_depth + 1);
+    strstack_pop(&state->stack);
 
     *out_count = synthetic->child_count;
     if (*out_count > 0) {
@@ -265,13 +342,13 @@ static bool expand_component(Node *invocation,
     return true;
 }
 
-static void process_scope(Node *scope_root, Scope *parent_scope, BuildCtx *ctx, StringStack *stack, int expansion_depth) {
+static void process_scope(Node *scope_root, Scope *parent_scope, BuildCtx *ctx, ExpandState *state, int expansion_depth) {
     Scope local;
     scope_init(&local, parent_scope);
     collect_defs_for_scope(scope_root, &local, ctx);
 
     size_t i = 0;
-    while (i < scope_root->child_count) {
+    while (i < scope_root->child_count && !state->over_budget) {
         Node *child = scope_root->children[i];
 
         if (child->type != NODE_ELEMENT) {
@@ -288,22 +365,100 @@ static void process_scope(Node *scope_root, Scope *parent_scope, BuildCtx *ctx,
         if (should_expand_component(child, &local, &resolved, ctx)) {
             Node **expanded_nodes = NULL;
             size_t expanded_count = 0;
-            bool ok = expand_component(child, resolved, &local, ctx, stack, expansion_depth, &expanded_nodes, &expanded_count);
+            profile_begin();
+            uint64_t stats_start = stats_now();
+            bool ok = expand_component(child, resolved, &local, ctx, state, expansion_depth, &expanded_nodes, &expanded_count);
+            profile_end("component", child->tag, ctx->current_file);
             if (ok) {
+                stats_component(child, expansion_depth + 1, expanded_nodes, expanded_count, stats_start);
                 node_replace_child(scope_root, i, expanded_nodes, expanded_count);
-                free(expanded_nodes);
+                xfree(expanded_nodes);
                 i += expanded_count;
                 continue;
             }
         }
 
-        process_scope(child, &local, ctx, stack, expansion_depth);
+        process_scope(child, &local, ctx, state, expansion_depth);
         i++;
     }
 
     scope_free(&local);
 }
 
+/* Expands, rewrites and serializes a parsed page into out; frees doc. */
+static bool compile_document(Node *doc, StrBuf *out, int errors_before, BuildCtx *ctx) {
+    profile_begin();
+    MemSubsystem prev_mem = mem_enter(MEM_EXPAND);
+    ExpandState state;
+    expand_state_init(&state, ctx->opts);
+    process_scope(doc, NULL, ctx, &state, 0);
+    strstack_free(&state.stack);
+    profile_end("compile", "expand", ctx->current_file);
+
+    /* A page over budget is abandoned rather than serialized. */
+    if (state.over_budget) {
+        node_free(doc);
+        mem_leave(prev_mem);
+        return false;
+    }
+
+    profile_begin();
+    mem_enter(MEM_OTHER);
+    fulltext_add_page(doc, ctx->current_file);
+    fingerprint_rewrite_tree(doc, ctx->current_file);
+    profile_end("compile", "rewrite", ctx->current_file);
+
+    profile_begin();
+    mem_enter(MEM_SERIALIZE);
+    if (ctx->opts && ctx->opts->minify) {
+        minify_tree(doc, ctx->opts->keep_comments);
+        serialize_node_minified(out, doc);
+    } else {
+        serialize_node(out, doc);
+    }
+    node_free(doc);
+    mem_leave(prev_mem);
+    profile_end("compile", "serialize", ctx->current_file);
+
+    if (state.max_bytes > 0 && out->len > state.max_bytes) {
+        log_error(ctx, "expansion budget exceeded (%zu output bytes, limit %zu)", out->len, state.max_bytes);
+        out->len = 0;
+        out->data[0] = '\0';
+        return false;
+    }
+    return ctx->error_count == errors_before;
+}
+
+bool compile_html_source(const char *source, StrBuf *out, BuildCtx *ctx) {
+    int errors_before = ctx->error_count;
+
+    profile_begin();
+    MemSubsystem prev_mem = mem_enter(MEM_PARSER);
+    Node *doc = domcache_parse(source, ctx);
+    mem_leave(prev_mem);
+    profile_end("compile", "parse", ctx->current_file);
+
+    return compile_document(doc, out, errors_before, ctx);
+}
+
+/* A collection template is instantiated like a component body with the row
+ * as its invocation: row fields feed page-level <bind> and bind-* and row
+ * slots fill page-level <slot>s. The template itself is not modified, so
+ * rows can be compiled from it in parallel. */
+bool compile_collection_row(const Node *page, const Node *row, SlotPayload *slots, StrBuf *out, BuildCtx *ctx) {
+    int errors_before = ctx->error_count;
+
+    profile_begin();
+    MemSubsystem prev_mem = mem_enter(MEM_DOM);
+    Node *doc = node_clone(page);
+    substitute_binds_slots(doc, row, slots, true, ctx);
+    warn_unused_slots(slots, row, ctx);
+    mem_leave(prev_mem);
+    profile_end("compile", "bind", ctx->current_file);
+
+    return compile_document(doc, out, errors_before, ctx);
+}
+
 bool process_html_file(const char *input_path, const char *output_path, BuildCtx *ctx) {
     char *input = read_file(input_path);
     if (!input) {
@@ -314,76 +469,16 @@ bool process_html_file(const char *input_path, const char *output_path, BuildCtx
     const char *prev_file = ctx->current_file;
     ctx->current_file = input_path;
 
-    Node *doc = parse_html(input, ctx);
-    free(input);
-
-    StringStack stack = {0};
-    process_scope(doc, NULL, ctx, &stack, 0);
-    strstack_free(&stack);
-
     StrBuf out = {0};
-    serialize_node(&out, doc);
-    node_free(doc);
+    compile_html_source(input, &out, ctx);
+    xfree(input);
 
     bool ok = write_file(output_path, out.data ? out.data : "");
     if (!ok) {
         log_error(ctx, "failed to write %s", output_path);
     }
 
-    free(out.data);
+    xfree(out.data);
     ctx->current_file = prev_file;
     return ok;
 }
-
-void process_directory(const char *src, const char *dst, BuildCtx *ctx) {
-    if (ensure_dir(dst) != 0) {
-        log_error(ctx, "failed to create directory %s: %s", dst, strerror(errno));
-        return;
-    }
-
-    DIR *dir = opendir(src);
-    if (!dir) {
-        log_error(ctx, "failed to open directory %s: %s", src, strerror(errno));
-        return;
-    }
-
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        const char *name = entry->d_name;
-        if (str_eq(name, ".") || str_eq(name, "..")) {
-            continue;
-        }
-
-        char src_path[MAX_PATH_LEN];
-        char dst_path[MAX_PATH_LEN];
-        snprintf(src_path, sizeof(src_path), "%s/%s", src, name);
-        snprintf(dst_path, sizeof(dst_path), "%s/%s", dst, name);
-
-        struct stat st;
-        if (stat(src_path, &st) != 0) {
-            log_error(ctx, "stat failed for %s: %s", src_path, strerror(errno));
-            continue;
-        }
-
-        if (S_ISDIR(st.st_mode)) {
-            process_directory(src_path, dst_path, ctx);
-            continue;
-        }
-
-        bool ok = false;
-        if (has_html_ext(src_path)) {
-            ok = process_html_file(src_path, dst_path, ctx);
-        } else {
-            ok = copy_file(src_path, dst_path);
-            if (!ok) {
-                log_error(ctx, "failed to copy %s to %s", src_path, dst_path);
-            }
-        }
-
-        if (ok) {
-            printf("Processed: %s -> %s\n", src_path, dst_path);
-        }
-    }
-
-    closedir(dir);
-}
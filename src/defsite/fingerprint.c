@@ -0,0 +1,401 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FINGERPRINT_MANIFEST "asset-manifest.json"
+/* 48 bits: collisions stay unlikely across many thousands of versions of
+ * an asset kept side by side on a CDN. */
+#define FINGERPRINT_HEX_DIGITS 12
+
+static const char *DEFAULT_EXTS = "css,js,mjs,png,jpg,jpeg,gif,svg,webp,avif,woff,woff2,ttf,otf,mp4,webm,mp3,ogg,wasm";
+
+static const char *URL_ATTRS[] = {"src", "href", "poster", "data-image"};
+
+static struct {
+    bool enabled;
+    char *src_dir;
+    StringStack exts;
+    StrMap assets;
+    uint64_t digest;
+} state;
+
+void fingerprint_init(const BuildOptions *opts) {
+    memset(&state, 0, sizeof(state));
+    strmap_init(&state.assets);
+    if (!opts->fingerprint) {
+        return;
+    }
+    state.enabled = true;
+    state.src_dir = xstrdup(opts->src_dir);
+    char *list = xstrdup(opts->fingerprint_exts ? opts->fingerprint_exts : DEFAULT_EXTS);
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        to_lower_inplace(tok);
+        strstack_push(&state.exts, tok);
+    }
+    xfree(list);
+}
+
+bool fingerprint_enabled(void) {
+    return state.enabled;
+}
+
+bool fingerprint_wants(const char *rel_path) {
+    if (!state.enabled) {
+        return false;
+    }
+    const char *slash = strrchr(rel_path, '/');
+    const char *dot = strrchr(rel_path, '.');
+    if (!dot || (slash && dot < slash) || dot == rel_path || (slash && dot == slash + 1)) {
+        return false;
+    }
+    char *ext = xstrdup(dot + 1);
+    to_lower_inplace(ext);
+    bool wanted = strstack_contains(&state.exts, ext);
+    xfree(ext);
+    return wanted;
+}
+
+/* "dir/name.ext" -> "dir/name.<hash12>.ext"; records the mapping. */
+char *fingerprint_add(const char *rel_path, uint64_t hash) {
+    const char *dot = strrchr(rel_path, '.');
+    size_t stem = (size_t)(dot - rel_path);
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+
+    StrBuf name = {0};
+    sb_append_n(&name, rel_path, stem);
+    sb_append(&name, ".");
+    sb_append_n(&name, hex, FINGERPRINT_HEX_DIGITS);
+    sb_append(&name, dot);
+    char *prev = strmap_put(&state.assets, rel_path, xstrdup(name.data));
+    state.digest ^= hash_update(hash_str(rel_path), name.data, name.len);
+    if (prev) {
+        state.digest ^= hash_update(hash_str(rel_path), prev, strlen(prev));
+        xfree(prev);
+    }
+    return name.data;
+}
+
+/* Order-independent hash of the asset mappings recorded so far; pages that
+ * reference fingerprinted assets compile differently when it changes. */
+uint64_t fingerprint_digest(void) {
+    return state.digest;
+}
+
+static bool is_external_url(const char *url) {
+    if (!url[0] || url[0] == '#' || starts_with(url, "//")) {
+        return true;
+    }
+    for (const char *p = url; *p && *p != '/' && *p != '?' && *p != '#'; p++) {
+        if (*p == ':') {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Joins base_dir and a relative path, resolving "." and ".." segments. */
+static char *resolve_path(const char *base_dir, const char *path, size_t path_len) {
+    StrBuf joined = {0};
+    if (path[0] != '/' && base_dir && base_dir[0]) {
+        sb_append(&joined, base_dir);
+        sb_append(&joined, "/");
+    }
+    sb_append_n(&joined, path, path_len);
+
+    char **segs = xmalloc((joined.len + 1) * sizeof(char *));
+    size_t count = 0;
+    for (char *tok = strtok(joined.data, "/"); tok; tok = strtok(NULL, "/")) {
+        if (str_eq(tok, ".")) {
+            continue;
+        }
+        if (str_eq(tok, "..")) {
+            if (count > 0) {
+                count--;
+            }
+            continue;
+        }
+        segs[count++] = tok;
+    }
+
+    StrBuf out = {0};
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) {
+            sb_append(&out, "/");
+        }
+        sb_append(&out, segs[i]);
+    }
+    xfree(segs);
+    xfree(joined.data);
+    return out.data ? out.data : xstrdup("");
+}
+
+/* Returns a rewritten URL when it points at a fingerprinted asset, else NULL.
+ * Only the file name changes, so the URL keeps its relative shape. */
+char *fingerprint_rewrite_url(const char *url, const char *base_dir) {
+    if (!state.enabled || !url || is_external_url(url)) {
+        return NULL;
+    }
+    size_t path_len = strcspn(url, "?#");
+    if (path_len == 0) {
+        return NULL;
+    }
+    char *resolved = resolve_path(base_dir, url, path_len);
+    const char *hashed = strmap_get(&state.assets, resolved);
+    xfree(resolved);
+    if (!hashed) {
+        return NULL;
+    }
+
+    const char *url_name = url;
+    for (size_t i = 0; i < path_len; i++) {
+        if (url[i] == '/') {
+            url_name = url + i + 1;
+        }
+    }
+    const char *hashed_name = strrchr(hashed, '/');
+    hashed_name = hashed_name ? hashed_name + 1 : hashed;
+
+    StrBuf out = {0};
+    sb_append_n(&out, url, (size_t)(url_name - url));
+    sb_append(&out, hashed_name);
+    sb_append(&out, url + path_len);
+    return out.data;
+}
+
+/* Directory of a source path relative to the source root ("" for the root). */
+char *fingerprint_base_dir(const char *src_path) {
+    const char *rel = src_path ? src_path : "";
+    size_t root_len = state.src_dir ? strlen(state.src_dir) : 0;
+    if (root_len > 0 && strncmp(rel, state.src_dir, root_len) == 0 && rel[root_len] == '/') {
+        rel += root_len + 1;
+    }
+    const char *slash = strrchr(rel, '/');
+    return slash ? substr_dup(rel, 0, (size_t)(slash - rel)) : xstrdup("");
+}
+
+static char *rewrite_srcset(const char *srcset, const char *base_dir) {
+    StrBuf out = {0};
+    bool changed = false;
+    const char *p = srcset;
+    while (*p) {
+        while (*p == ' ' || *p == ',' || *p == '\n' || *p == '\t') {
+            sb_append_n(&out, p++, 1);
+        }
+        size_t url_len = strcspn(p, " \t\n,");
+        if (url_len == 0) {
+            continue;
+        }
+        char *url = substr_dup(p, 0, url_len);
+        char *next = fingerprint_rewrite_url(url, base_dir);
+        sb_append(&out, next ? next : url);
+        changed = changed || next != NULL;
+        xfree(next);
+        xfree(url);
+        p += url_len;
+        size_t desc_len = strcspn(p, ",");
+        sb_append_n(&out, p, desc_len);
+        p += desc_len;
+    }
+    if (!changed) {
+        xfree(out.data);
+        return NULL;
+    }
+    return out.data;
+}
+
+static void replace_attr_value(Attr *a, char *value) {
+    xfree(a->value);
+    a->value = value;
+}
+
+static void rewrite_node(Node *n, const char *base_dir) {
+    for (size_t i = 0; i < n->attr_count; i++) {
+        Attr *a = &n->attrs[i];
+        char *next = NULL;
+        if (str_eq(a->name, "srcset")) {
+            next = rewrite_srcset(a->value, base_dir);
+        } else {
+            for (size_t k = 0; k < sizeof(URL_ATTRS) / sizeof(URL_ATTRS[0]); k++) {
+                if (str_eq(a->name, URL_ATTRS[k])) {
+                    next = fingerprint_rewrite_url(a->value, base_dir);
+                    break;
+                }
+            }
+        }
+        if (next) {
+            replace_attr_value(a, next);
+        }
+    }
+    for (size_t i = 0; i < n->child_count; i++) {
+        rewrite_node(n->children[i], base_dir);
+    }
+}
+
+void fingerprint_rewrite_tree(Node *doc, const char *src_path) {
+    if (!state.enabled || state.assets.count == 0) {
+        return;
+    }
+    char *base_dir = fingerprint_base_dir(src_path);
+    rewrite_node(doc, base_dir);
+    xfree(base_dir);
+}
+
+/* Rewrites url(...) references in a stylesheet; returns NULL when nothing changed. */
+char *fingerprint_rewrite_css(const char *css, size_t len, const char *src_path) {
+    if (!state.enabled || state.assets.count == 0) {
+        return NULL;
+    }
+    char *base_dir = fingerprint_base_dir(src_path);
+    StrBuf out = {0};
+    bool changed = false;
+    size_t pos = 0;
+    for (;;) {
+        size_t at = find_ci(css, len, pos, "url(");
+        if (at == (size_t)-1) {
+            break;
+        }
+        size_t start = at + 4;
+        while (start < len && (css[start] == ' ' || css[start] == '"' || css[start] == '\'')) {
+            start++;
+        }
+        size_t end = start;
+        while (end < len && css[end] != ')' && css[end] != '"' && css[end] != '\'' && css[end] != ' ') {
+            end++;
+        }
+        sb_append_n(&out, css + pos, start - pos);
+        char *url = substr_dup(css, start, end);
+        char *next = fingerprint_rewrite_url(url, base_dir);
+        sb_append(&out, next ? next : url);
+        changed = changed || next != NULL;
+        xfree(next);
+        xfree(url);
+        pos = end;
+    }
+    sb_append_n(&out, css + pos, len - pos);
+    xfree(base_dir);
+    if (!changed) {
+        xfree(out.data);
+        return NULL;
+    }
+    return out.data;
+}
+
+static int cmp_str_ptr(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* A manifest entry names a file of ours only if it stays inside the output
+ * directory. */
+static bool is_plain_rel_path(const char *path) {
+    if (!path[0] || path[0] == '/') {
+        return false;
+    }
+    for (const char *seg = path; seg; seg = strchr(seg, '/') ? strchr(seg, '/') + 1 : NULL) {
+        size_t len = strcspn(seg, "/");
+        if (len == 0 || (len == 2 && seg[0] == '.' && seg[1] == '.')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Deletes the hashed files the previous build's manifest lists that this
+ * build no longer produces, so old versions of an asset do not pile up in
+ * the output. A name that is now an ordinary source file is left alone. */
+static void remove_stale(const char *out_dir, const char *manifest_path, BuildCtx *ctx) {
+    char *text = read_file(manifest_path);
+    if (!text) {
+        return;
+    }
+    size_t offset = 0;
+    JsonValue *previous = json_parse(text, &offset);
+    xfree(text);
+    if (!previous || previous->type != JSON_OBJECT) {
+        json_free(previous);
+        return;
+    }
+    StrMap current;
+    strmap_init(&current);
+    for (size_t i = 0; i < state.assets.cap; i++) {
+        if (state.assets.slots[i].key) {
+            strmap_put(&current, state.assets.slots[i].value, NULL);
+        }
+    }
+    size_t removed = 0;
+    for (size_t i = 0; i < previous->count; i++) {
+        const JsonValue *v = previous->items[i];
+        if (v->type != JSON_STRING || strmap_contains(&current, v->string) || !is_plain_rel_path(v->string)) {
+            continue;
+        }
+        char path[MAX_PATH_LEN * 2];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", state.src_dir, v->string);
+        if (stat(path, &st) == 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", out_dir, v->string);
+        if (unlink(path) == 0) {
+            removed++;
+        } else if (errno != ENOENT) {
+            log_warning(ctx, "failed to remove stale fingerprinted asset %s: %s", path, strerror(errno));
+        }
+    }
+    if (removed > 0) {
+        fprintf(stderr, "Removed %zu stale fingerprinted asset(s)\n", removed);
+    }
+    strmap_free(&current, NULL);
+    json_free(previous);
+}
+
+void fingerprint_finish(const char *out_dir, BuildCtx *ctx) {
+    if (!state.enabled) {
+        return;
+    }
+    char **keys = xmalloc((state.assets.count + 1) * sizeof(char *));
+    size_t n = 0;
+    for (size_t i = 0; i < state.assets.cap; i++) {
+        if (state.assets.slots[i].key) {
+            keys[n++] = state.assets.slots[i].key;
+        }
+    }
+    qsort(keys, n, sizeof(char *), cmp_str_ptr);
+
+    StrBuf out = {0};
+    sb_append(&out, "{\n");
+    for (size_t i = 0; i < n; i++) {
+        sb_append(&out, "  ");
+        json_append_escaped(&out, keys[i]);
+        sb_append(&out, ": ");
+        json_append_escaped(&out, strmap_get(&state.assets, keys[i]));
+        sb_append(&out, i + 1 < n ? ",\n" : "\n");
+    }
+    sb_append(&out, "}\n");
+
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", out_dir, FINGERPRINT_MANIFEST);
+    /* Only a whole-tree build hashes every asset; an archive starts empty,
+     * and a failed build may have stopped before hashing them all. */
+    bool whole = ctx->opts && ctx->opts->command == COMMAND_BUILD;
+    if (whole && !archive_enabled() && ctx->error_count == 0) {
+        remove_stale(out_dir, path, ctx);
+    }
+    if (!write_file(path, out.data)) {
+        log_error(ctx, "failed to write %s", path);
+        xfree(out.data);
+    } else {
+        compress_submit(path, out.data, out.len);
+    }
+
+    xfree(keys);
+    strmap_free(&state.assets, xfree);
+    strstack_free(&state.exts);
+    xfree(state.src_dir);
+    state.enabled = false;
+}
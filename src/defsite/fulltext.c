@@ -0,0 +1,397 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FULLTEXT_DIR "search-text"
+#define FULLTEXT_MIN_TERM 2
+#define FULLTEXT_MAX_TERM 64
+#define FULLTEXT_MAX_PREFIX 8
+
+/* Elements whose text is never shown as page content. */
+static const char *SKIP_TAGS[] = {"head", "script", "style", "template", "noscript", "svg", "math"};
+
+typedef struct {
+    uint32_t *docs;
+    size_t count;
+    size_t cap;
+} TermPosting;
+
+static struct {
+    bool enabled;
+    size_t shard_len;
+    bool prefixes;
+    char *src_dir;
+    StringStack docs;
+    StrMap terms;
+    pthread_mutex_t lock;
+} state;
+
+void fulltext_init(const BuildOptions *opts) {
+    memset(&state, 0, sizeof(state));
+    strmap_init(&state.terms);
+    if (!opts->fulltext) {
+        return;
+    }
+    state.enabled = true;
+    state.shard_len = opts->fulltext_shard_len;
+    state.prefixes = opts->fulltext_prefixes;
+    state.src_dir = xstrdup(opts->src_dir);
+    pthread_mutex_init(&state.lock, NULL);
+}
+
+static bool is_term_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+/* Splits text into lowercase terms. Non-ASCII bytes count as word bytes so
+ * UTF-8 words stay whole; character references such as "&amp;" are skipped. */
+static void tokenize(const char *text, StrMap *seen) {
+    const unsigned char *p = (const unsigned char *)text;
+    char term[FULLTEXT_MAX_TERM + 1];
+    while (*p) {
+        if (*p == '&') {
+            const unsigned char *q = p + 1;
+            while (*q && (is_term_byte(*q) || *q == '#') && *q < 0x80) {
+                q++;
+            }
+            if (*q == ';' && q > p + 1) {
+                p = q + 1;
+                continue;
+            }
+        }
+        if (!is_term_byte(*p)) {
+            p++;
+            continue;
+        }
+        size_t len = 0;
+        bool too_long = false;
+        while (*p && is_term_byte(*p)) {
+            if (len < FULLTEXT_MAX_TERM) {
+                term[len++] = (char)(*p >= 'A' && *p <= 'Z' ? *p + ('a' - 'A') : *p);
+            } else {
+                too_long = true;
+            }
+            p++;
+        }
+        term[len] = '\0';
+        if (len >= FULLTEXT_MIN_TERM && !too_long) {
+            strmap_put(seen, term, NULL);
+        }
+    }
+}
+
+static void collect_text(const Node *n, StrMap *seen) {
+    if (n->type == NODE_TEXT && n->text) {
+        tokenize(n->text, seen);
+        return;
+    }
+    if (n->type == NODE_ELEMENT && n->tag) {
+        for (size_t i = 0; i < sizeof(SKIP_TAGS) / sizeof(SKIP_TAGS[0]); i++) {
+            if (str_eq(n->tag, SKIP_TAGS[i])) {
+                return;
+            }
+        }
+    }
+    for (size_t i = 0; i < n->child_count; i++) {
+        collect_text(n->children[i], seen);
+    }
+}
+
+static const Node *find_element(const Node *n, const char *tag) {
+    if (n->type == NODE_ELEMENT && n->tag && str_eq(n->tag, tag)) {
+        return n;
+    }
+    for (size_t i = 0; i < n->child_count; i++) {
+        const Node *found = find_element(n->children[i], tag);
+        if (found) {
+            return found;
+        }
+    }
+    return NULL;
+}
+
+/* Same rule as the discovery index: a page is indexed when its <html> has data-* attributes. */
+static bool is_indexed_page(const Node *html) {
+    for (size_t i = 0; i < html->attr_count; i++) {
+        if (html->attrs[i].name && starts_with(html->attrs[i].name, "data-") && html->attrs[i].name[5]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void fulltext_add_page(const Node *doc, const char *src_path) {
+    if (!state.enabled || !src_path) {
+        return;
+    }
+    const Node *html = find_element(doc, "html");
+    if (!html || !is_indexed_page(html)) {
+        return;
+    }
+    const Node *body = find_element(html, "body");
+
+    StrMap seen;
+    strmap_init(&seen);
+    collect_text(body ? body : html, &seen);
+
+    const char *rel = src_path;
+    size_t root_len = strlen(state.src_dir);
+    if (strncmp(rel, state.src_dir, root_len) == 0 && rel[root_len] == '/') {
+        rel += root_len + 1;
+    }
+
+    pthread_mutex_lock(&state.lock);
+    uint32_t doc_id = (uint32_t)state.docs.count;
+    strstack_push(&state.docs, rel);
+    for (size_t i = 0; i < seen.cap; i++) {
+        if (!seen.slots[i].key) {
+            continue;
+        }
+        TermPosting *p = strmap_get(&state.terms, seen.slots[i].key);
+        if (!p) {
+            p = xmalloc(sizeof(TermPosting));
+            memset(p, 0, sizeof(*p));
+            strmap_put(&state.terms, seen.slots[i].key, p);
+        }
+        if (p->count == p->cap) {
+            p->cap = p->cap == 0 ? 4 : p->cap * 2;
+            p->docs = xrealloc(p->docs, p->cap * sizeof(uint32_t));
+        }
+        p->docs[p->count++] = doc_id;
+    }
+    pthread_mutex_unlock(&state.lock);
+
+    strmap_free(&seen, NULL);
+}
+
+static void posting_free(void *p) {
+    TermPosting *posting = p;
+    xfree(posting->docs);
+    xfree(posting);
+}
+
+static int cmp_str_ptr(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Shard key is the first shard_len bytes of a term, with bytes outside
+ * [a-z0-9] hex-escaped so it is safe as a file name. */
+static void shard_key(const char *term, size_t shard_len, StrBuf *out) {
+    out->len = 0;
+    for (size_t i = 0; i < shard_len && term[i]; i++) {
+        unsigned char c = (unsigned char)term[i];
+        if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) {
+            sb_append_n(out, term + i, 1);
+        } else {
+            char hex[4];
+            snprintf(hex, sizeof(hex), "_%02x", c);
+            sb_append(out, hex);
+        }
+    }
+}
+
+static void clear_fulltext_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (starts_with(entry->d_name, "terms-")) {
+            char path[MAX_PATH_LEN];
+            if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) < (int)sizeof(path)) {
+                unlink(path);
+            }
+        }
+    }
+    closedir(d);
+}
+
+static void fulltext_write(const char *dir, const char *name, StrBuf *out, BuildCtx *ctx) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (!write_file_n(path, out->data ? out->data : "", out->len)) {
+        log_error(ctx, "failed to write %s", path);
+        xfree(out->data);
+    } else {
+        compress_submit(path, out->data, out->len);
+    }
+    memset(out, 0, sizeof(*out));
+}
+
+/* Appends the prefix entries of one shard: every prefix of at least
+ * shard_len (and at most FULLTEXT_MAX_PREFIX) bytes maps to the terms that
+ * start with it. Terms arrive sorted, so completions of a prefix are adjacent. */
+static void append_prefixes(StrBuf *out, char **terms, size_t first, size_t end) {
+    bool any = false;
+    sb_append(out, ",\n  \"prefixes\": {");
+    for (size_t plen = state.shard_len; plen <= FULLTEXT_MAX_PREFIX; plen++) {
+        size_t i = first;
+        while (i < end) {
+            if (strlen(terms[i]) <= plen) {
+                i++;
+                continue;
+            }
+            size_t j = i + 1;
+            while (j < end && strncmp(terms[j], terms[i], plen) == 0) {
+                j++;
+            }
+            char *prefix = substr_dup(terms[i], 0, plen);
+            sb_append(out, any ? ",\n    " : "\n    ");
+            json_append_escaped(out, prefix);
+            sb_append(out, ": [");
+            bool first_term = true;
+            for (size_t k = i; k < j; k++) {
+                if (strlen(terms[k]) > plen) {
+                    if (!first_term) {
+                        sb_append(out, ", ");
+                    }
+                    json_append_escaped(out, terms[k]);
+                    first_term = false;
+                }
+            }
+            sb_append(out, "]");
+            xfree(prefix);
+            any = true;
+            i = j;
+        }
+    }
+    sb_append(out, any ? "\n  }" : "}");
+}
+
+/* Writes <out>/search-text/: docs.json (ids -> URLs, same order as
+ * search-index.json), manifest.json and one terms-<key>.json per term prefix
+ * with delta-encoded doc id postings. */
+void fulltext_finish(const char *out_dir, BuildCtx *ctx) {
+    if (!state.enabled) {
+        return;
+    }
+
+    /* Renumber docs in URL order so ids line up with search-index.json. */
+    size_t ndocs = state.docs.count;
+    char **sorted_docs = xmalloc((ndocs + 1) * sizeof(char *));
+    memcpy(sorted_docs, state.docs.items, ndocs * sizeof(char *));
+    qsort(sorted_docs, ndocs, sizeof(char *), cmp_str_ptr);
+    StrMap rank;
+    strmap_init(&rank);
+    for (size_t i = 0; i < ndocs; i++) {
+        strmap_put(&rank, sorted_docs[i], (void *)(uintptr_t)(i + 1));
+    }
+    uint32_t *remap = xmalloc((ndocs + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < ndocs; i++) {
+        remap[i] = (uint32_t)(uintptr_t)strmap_get(&rank, state.docs.items[i]) - 1;
+    }
+
+    char **terms = xmalloc((state.terms.count + 1) * sizeof(char *));
+    size_t nterms = 0;
+    for (size_t i = 0; i < state.terms.cap; i++) {
+        if (state.terms.slots[i].key) {
+            terms[nterms++] = state.terms.slots[i].key;
+        }
+    }
+    qsort(terms, nterms, sizeof(char *), cmp_str_ptr);
+
+    char dir[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s/%s", out_dir, FULLTEXT_DIR);
+    if (ensure_dir(dir) != 0) {
+        log_error(ctx, "failed to create directory %s", dir);
+    } else {
+        clear_fulltext_dir(dir);
+
+        StrBuf manifest = {0};
+        char num[64];
+        snprintf(num, sizeof(num), "{\n  \"version\": 1,\n  \"docs\": %zu,\n  \"terms\": %zu,\n", ndocs, nterms);
+        sb_append(&manifest, num);
+        snprintf(num, sizeof(num), "  \"shard_prefix\": %zu,\n", state.shard_len);
+        sb_append(&manifest, num);
+        sb_append(&manifest, state.prefixes ? "  \"prefixes\": true,\n  \"shards\": [" : "  \"prefixes\": false,\n  \"shards\": [");
+
+        StrBuf key = {0};
+        StrBuf next_key = {0};
+        size_t shards = 0;
+        size_t i = 0;
+        while (i < nterms) {
+            shard_key(terms[i], state.shard_len, &key);
+            size_t end = i + 1;
+            while (end < nterms) {
+                shard_key(terms[end], state.shard_len, &next_key);
+                if (!str_eq(next_key.data, key.data)) {
+                    break;
+                }
+                end++;
+            }
+
+            StrBuf out = {0};
+            sb_append(&out, "{\n  \"terms\": {");
+            for (size_t t = i; t < end; t++) {
+                TermPosting *p = strmap_get(&state.terms, terms[t]);
+                for (size_t d = 0; d < p->count; d++) {
+                    p->docs[d] = remap[p->docs[d]];
+                }
+                qsort(p->docs, p->count, sizeof(uint32_t), cmp_u32);
+
+                sb_append(&out, t > i ? ",\n    " : "\n    ");
+                json_append_escaped(&out, terms[t]);
+                sb_append(&out, ": [");
+                uint32_t prev = 0;
+                for (size_t d = 0; d < p->count; d++) {
+                    snprintf(num, sizeof(num), d > 0 ? ",%u" : "%u", p->docs[d] - prev);
+                    sb_append(&out, num);
+                    prev = p->docs[d];
+                }
+                sb_append(&out, "]");
+            }
+            sb_append(&out, "\n  }");
+            if (state.prefixes) {
+                append_prefixes(&out, terms, i, end);
+            }
+            sb_append(&out, "\n}\n");
+
+            char name[MAX_PATH_LEN];
+            snprintf(name, sizeof(name), "terms-%s.json", key.data);
+            fulltext_write(dir, name, &out, ctx);
+
+            sb_append(&manifest, shards > 0 ? ", " : "");
+            json_append_escaped(&manifest, key.data);
+            shards++;
+            i = end;
+        }
+        sb_append(&manifest, "]\n}\n");
+        fulltext_write(dir, "manifest.json", &manifest, ctx);
+
+        StrBuf docs = {0};
+        sb_append(&docs, "[");
+        for (size_t d = 0; d < ndocs; d++) {
+            sb_append(&docs, d > 0 ? ",\n  " : "\n  ");
+            json_append_escaped(&docs, sorted_docs[d]);
+        }
+        sb_append(&docs, ndocs > 0 ? "\n]\n" : "]\n");
+        fulltext_write(dir, "docs.json", &docs, ctx);
+
+        xfree(key.data);
+        xfree(next_key.data);
+        fprintf(stderr, "Generated full-text index: %s (%zu docs, %zu terms, %zu shard(s))\n", dir, ndocs, nterms, shards);
+    }
+
+    xfree(terms);
+    xfree(remap);
+    xfree(sorted_docs);
+    strmap_free(&rank, NULL);
+    strmap_free(&state.terms, posting_free);
+    strstack_free(&state.docs);
+    pthread_mutex_destroy(&state.lock);
+    xfree(state.src_dir);
+    state.enabled = false;
+}
@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L
 #include "common.h"
 
 #include <dirent.h>
@@ -7,44 +8,29 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-typedef struct {
-    char *key;
-    char *value;
-} MetaField;
-
-typedef struct {
-    char *url;
-    MetaField *meta;
-    size_t meta_count;
-    size_t meta_cap;
-} DiscoveryRecord;
-
-typedef struct {
-    DiscoveryRecord *items;
-    size_t count;
-    size_t cap;
-} DiscoveryList;
+#define INDEX_READ_BATCH 64
+#define INDEX_CACHE_NAME ".defsite-index"
 
-static void record_free(DiscoveryRecord *r) {
+void record_free(DiscoveryRecord *r) {
     if (!r) {
         return;
     }
-    free(r->url);
+    xfree(r->url);
     for (size_t i = 0; i < r->meta_count; i++) {
-        free(r->meta[i].key);
-        free(r->meta[i].value);
+        xfree(r->meta[i].key);
+        xfree(r->meta[i].value);
     }
-    free(r->meta);
+    xfree(r->meta);
 }
 
-static void list_free(DiscoveryList *list) {
+void discovery_list_free(DiscoveryList *list) {
     for (size_t i = 0; i < list->count; i++) {
         record_free(&list->items[i]);
     }
-    free(list->items);
+    xfree(list->items);
 }
 
-static DiscoveryRecord *list_push(DiscoveryList *list) {
+DiscoveryRecord *discovery_list_push(DiscoveryList *list) {
     if (list->count == list->cap) {
         size_t next = list->cap == 0 ? 8 : list->cap * 2;
         list->items = xrealloc(list->items, next * sizeof(DiscoveryRecord));
@@ -71,7 +57,7 @@ static char *path_relative_to(const char *full, const char *base) {
     return xstrdup(full);
 }
 
-static bool is_date_format(const char *s) {
+bool is_date_format(const char *s) {
     if (!s || strlen(s) != 10) {
         return false;
     }
@@ -102,7 +88,7 @@ static Node *find_html_node(Node *node) {
     return NULL;
 }
 
-static const char *record_meta_get(const DiscoveryRecord *rec, const char *key) {
+const char *record_meta_get(const DiscoveryRecord *rec, const char *key) {
     for (size_t i = 0; i < rec->meta_count; i++) {
         if (str_eq(rec->meta[i].key, key)) {
             return rec->meta[i].value;
@@ -111,10 +97,10 @@ static const char *record_meta_get(const DiscoveryRecord *rec, const char *key)
     return "";
 }
 
-static void record_meta_set(DiscoveryRecord *rec, const char *key, const char *value) {
+void record_meta_set(DiscoveryRecord *rec, const char *key, const char *value) {
     for (size_t i = 0; i < rec->meta_count; i++) {
         if (str_eq(rec->meta[i].key, key)) {
-            free(rec->meta[i].value);
+            xfree(rec->meta[i].value);
             rec->meta[i].value = xstrdup(value ? value : "");
             return;
         }
@@ -150,49 +136,56 @@ static size_t collect_meta_from_html_attrs(DiscoveryRecord *rec, const Node *htm
     return count;
 }
 
-static void collect_entry_from_file(const char *src_dir, const char *file_path, DiscoveryList *list, BuildCtx *ctx) {
-    char *content = read_file(file_path);
-    if (!content) {
-        log_warning(ctx, "failed to read %s while building discovery index", file_path);
-        return;
-    }
-
+/* Extracts the page's root data-* attributes. Returns false when the page
+ * has no <html> or no metadata, i.e. contributes no record. */
+static bool extract_record(const char *file_path, const char *content, DiscoveryRecord *rec, BuildCtx *ctx) {
     const char *prev_file = ctx->current_file;
     ctx->current_file = file_path;
-    Node *doc = parse_html(content, ctx);
-    free(content);
+    Node *doc = domcache_parse(content, ctx);
 
     Node *html = find_html_node(doc);
-    if (!html) {
-        node_free(doc);
-        ctx->current_file = prev_file;
-        return;
-    }
+    size_t meta_count = html ? collect_meta_from_html_attrs(rec, html) : 0;
 
-    char *rel = path_relative_to(file_path, src_dir);
-    DiscoveryRecord rec = {0};
-    rec.url = rel;
-    size_t meta_count = collect_meta_from_html_attrs(&rec, html);
-    if (meta_count == 0) {
-        record_free(&rec);
-        node_free(doc);
-        ctx->current_file = prev_file;
-        return;
-    }
+    node_free(doc);
+    ctx->current_file = prev_file;
+    return meta_count > 0;
+}
 
-    const char *published = record_meta_get(&rec, "published");
-    if (published[0] && !is_date_format(published)) {
-        log_warning(ctx, "metadata invalid data-published format in %s (expected YYYY-MM-DD)", rel);
-    }
+typedef struct {
+    char *path;
+    char stamp[64];
+} IndexSource;
 
-    DiscoveryRecord *dst = list_push(list);
-    *dst = rec;
+typedef struct {
+    IndexSource *items;
+    size_t count;
+    size_t cap;
+} PathList;
 
-    node_free(doc);
-    ctx->current_file = prev_file;
+static void pathlist_push(PathList *list, const char *path, const struct stat *st) {
+    if (list->count == list->cap) {
+        size_t next = list->cap == 0 ? 64 : list->cap * 2;
+        list->items = xrealloc(list->items, next * sizeof(IndexSource));
+        list->cap = next;
+    }
+    IndexSource *src = &list->items[list->count++];
+    src->path = xstrdup(path);
+    snprintf(src->stamp,
+             sizeof(src->stamp),
+             "%lld.%09ld:%lld",
+             (long long)st->st_mtim.tv_sec,
+             (long)st->st_mtim.tv_nsec,
+             (long long)st->st_size);
+}
+
+static void pathlist_free(PathList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        xfree(list->items[i].path);
+    }
+    xfree(list->items);
 }
 
-static void scan_dir_recursive(const char *src_dir, const char *dir_path, DiscoveryList *list, BuildCtx *ctx) {
+static void scan_dir_recursive(const char *dir_path, PathList *paths) {
     DIR *dir = opendir(dir_path);
     if (!dir) {
         return;
@@ -212,121 +205,263 @@ static void scan_dir_recursive(const char *src_dir, const char *dir_path, Discov
         }
 
         if (S_ISDIR(st.st_mode)) {
-            scan_dir_recursive(src_dir, full, list, ctx);
+            scan_dir_recursive(full, paths);
             continue;
         }
 
         if (has_html_ext(full)) {
-            collect_entry_from_file(src_dir, full, list, ctx);
+            pathlist_push(paths, full, &st);
         }
     }
 
     closedir(dir);
 }
 
-static int record_cmp(const void *a, const void *b) {
+void record_copy(DiscoveryRecord *dst, const DiscoveryRecord *src) {
+    memset(dst, 0, sizeof(*dst));
+    dst->url = xstrdup(src->url);
+    for (size_t i = 0; i < src->meta_count; i++) {
+        record_meta_set(dst, src->meta[i].key, src->meta[i].value);
+    }
+}
+
+int record_cmp(const void *a, const void *b) {
     const DiscoveryRecord *ra = (const DiscoveryRecord *)a;
     const DiscoveryRecord *rb = (const DiscoveryRecord *)b;
     return strcmp(ra->url ? ra->url : "", rb->url ? rb->url : "");
 }
 
-static void json_append_escaped(StrBuf *b, const char *s) {
-    sb_append(b, "\"");
-    for (const char *p = s ? s : ""; *p; p++) {
-        switch (*p) {
-        case '\\': sb_append(b, "\\\\"); break;
-        case '"': sb_append(b, "\\\""); break;
-        case '\n': sb_append(b, "\\n"); break;
-        case '\r': sb_append(b, "\\r"); break;
-        case '\t': sb_append(b, "\\t"); break;
-        default: sb_append_n(b, p, 1); break;
+void split_list(const char *value, StringStack *out) {
+    char *copy = xstrdup(value ? value : "");
+    for (char *tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+        while (*tok == ' ' || *tok == '\t') {
+            tok++;
+        }
+        size_t len = strlen(tok);
+        while (len > 0 && (tok[len - 1] == ' ' || tok[len - 1] == '\t')) {
+            tok[--len] = '\0';
+        }
+        if (len > 0) {
+            strstack_push(out, tok);
         }
     }
-    sb_append(b, "\"");
+    xfree(copy);
 }
 
-static void json_append_meta(StrBuf *b, const DiscoveryRecord *r) {
-    sb_append(b, "{");
-    if (r->meta_count > 0) {
-        sb_append(b, "\n");
+/* Per-build adjustments applied to fresh and cached records alike. */
+static void finish_record(const char *file_path, DiscoveryRecord *rec, IndexBuilder *builder, BuildCtx *ctx) {
+    char *image = fingerprint_rewrite_url(record_meta_get(rec, "image"), "");
+    if (!image) {
+        char *base_dir = fingerprint_base_dir(file_path);
+        image = fingerprint_rewrite_url(record_meta_get(rec, "image"), base_dir);
+        xfree(base_dir);
     }
-
-    for (size_t i = 0; i < r->meta_count; i++) {
-        sb_append(b, "      ");
-        json_append_escaped(b, r->meta[i].key);
-        sb_append(b, ": ");
-        json_append_escaped(b, r->meta[i].value);
-        if (i + 1 < r->meta_count) {
-            sb_append(b, ",");
-        }
-        sb_append(b, "\n");
+    if (image) {
+        record_meta_set(rec, "image", image);
+        xfree(image);
     }
 
-    if (r->meta_count > 0) {
-        sb_append(b, "    ");
+    const char *published = record_meta_get(rec, "published");
+    if (published[0] && !is_date_format(published)) {
+        log_warning(ctx, "metadata invalid data-published format in %s (expected YYYY-MM-DD)", rec->url);
     }
-    sb_append(b, "}");
+
+    index_builder_add(builder, rec, ctx);
 }
 
-static void serialize_record_json(StrBuf *b, const DiscoveryRecord *r) {
-    sb_append(b, "  {\n");
-    sb_append(b, "    \"url\": ");
-    json_append_escaped(b, r->url ? r->url : "");
-    sb_append(b, ",\n");
-    sb_append(b, "    \"meta\": ");
-    json_append_meta(b, r);
-    sb_append(b, "\n");
-    sb_append(b, "  }");
+/* A collection's records come from its rows: the template's <html> data-*
+ * attributes with bind-* bound to each row. They are cheap to rebuild, so
+ * they are not kept in the index cache. */
+static void collect_collection(const char *template_path, const char *src_dir, IndexBuilder *builder, BuildCtx *ctx) {
+    size_t rows = collection_row_count(template_path, src_dir, ctx);
+    for (size_t i = 0; i < rows; i++) {
+        if (!shard_owns(ctx->opts, collection_row_url(template_path, i))) {
+            continue;
+        }
+        Node *html = collection_row_html(template_path, i);
+        DiscoveryRecord rec = {0};
+        if (html && collect_meta_from_html_attrs(&rec, html) > 0) {
+            rec.url = xstrdup(collection_row_url(template_path, i));
+            finish_record(collection_row_src_path(template_path, i), &rec, builder, ctx);
+        }
+        record_free(&rec);
+        node_free(html);
+    }
 }
 
-static void warn_duplicate_slugs(const DiscoveryList *list, BuildCtx *ctx) {
-    for (size_t i = 0; i < list->count; i++) {
-        const char *slug_i = record_meta_get(&list->items[i], "slug");
+static void collect_entries(const char *src_dir, const char *cache_path, IndexBuilder *builder, size_t *cache_hits, BuildCtx *ctx) {
+    PathList paths = {0};
+    scan_dir_recursive(src_dir, &paths);
+
+    StrMap cache;
+    strmap_init(&cache);
+    index_cache_load(cache_path, src_dir, &cache);
+    StrBuf next_cache = {0};
+    index_cache_header(&next_cache, src_dir);
 
-        if (!slug_i[0]) {
+    size_t *misses = xmalloc((paths.count + 1) * sizeof(size_t));
+    size_t nmisses = 0;
+    for (size_t i = 0; i < paths.count; i++) {
+        if (listing_is_template(paths.items[i].path)) {
             continue;
         }
+        if (collection_is_template(paths.items[i].path)) {
+            collect_collection(paths.items[i].path, src_dir, builder, ctx);
+            continue;
+        }
+        char *rel = path_relative_to(paths.items[i].path, src_dir);
+        if (!shard_owns(ctx->opts, rel)) {
+            xfree(rel);
+            continue;
+        }
+        const DiscoveryRecord *cached = index_cache_lookup(&cache, rel, paths.items[i].stamp);
+        if (cached) {
+            index_record_append(&next_cache, paths.items[i].stamp, rel, cached);
+            if (cached->meta_count > 0) {
+                DiscoveryRecord rec;
+                record_copy(&rec, cached);
+                finish_record(paths.items[i].path, &rec, builder, ctx);
+            }
+            (*cache_hits)++;
+        } else {
+            misses[nmisses++] = i;
+        }
+        xfree(rel);
+    }
 
-        for (size_t j = i + 1; j < list->count; j++) {
-            const char *slug_j = record_meta_get(&list->items[j], "slug");
-
-            if (str_eq(slug_i, slug_j)) {
-                log_warning(ctx, "duplicate metadata slug '%s' in discovery index", slug_i);
+    IoFile batch[INDEX_READ_BATCH];
+    for (size_t base = 0; base < nmisses; base += INDEX_READ_BATCH) {
+        size_t n = nmisses - base < INDEX_READ_BATCH ? nmisses - base : INDEX_READ_BATCH;
+        for (size_t i = 0; i < n; i++) {
+            batch[i].path = paths.items[misses[base + i]].path;
+        }
+        io_read_batch(batch, n);
+        for (size_t i = 0; i < n; i++) {
+            if (!batch[i].ok) {
+                log_warning(ctx, "failed to read %s while building discovery index", batch[i].path);
+                continue;
+            }
+            DiscoveryRecord rec = {0};
+            char *rel = path_relative_to(batch[i].path, src_dir);
+            bool has_record = index_shared_lookup(rel, &batch[i], &rec);
+            if (!rec.url) {
+                rec.url = rel;
+                rel = NULL;
+                int errors = ctx->error_count;
+                int warnings = ctx->warning_count;
+                has_record = extract_record(batch[i].path, batch[i].data, &rec, ctx);
+                if (ctx->error_count == errors && ctx->warning_count == warnings) {
+                    index_shared_publish(&batch[i], &rec);
+                }
             }
+            xfree(rel);
+            index_record_append(&next_cache, paths.items[misses[base + i]].stamp, rec.url, &rec);
+            if (has_record) {
+                finish_record(batch[i].path, &rec, builder, ctx);
+            }
+            record_free(&rec);
+            xfree(batch[i].data);
         }
     }
+
+    if (!write_file_n(cache_path, next_cache.data, next_cache.len)) {
+        log_warning(ctx, "failed to write discovery index cache %s", cache_path);
+    }
+    xfree(next_cache.data);
+    xfree(misses);
+    index_cache_free(&cache);
+    pathlist_free(&paths);
 }
 
-void generate_discovery_index(const char *src_dir, const char *out_json_path, BuildCtx *ctx) {
+/* Writes search-index.json and the optional binary and sharded forms from
+ * a filled builder, which is freed, then the listing pages under src_dir
+ * (NULL when merging shards, which have no listing templates). The builder
+ * must keep all records if any output other than the JSON is wanted. */
+void write_index_outputs(IndexBuilder *builder, const char *out_json_path, const char *src_dir, size_t cache_hits, BuildCtx *ctx) {
+    const BuildOptions *opts = ctx->opts;
+    bool listings = src_dir && listing_find(src_dir);
     DiscoveryList list = {0};
-    scan_dir_recursive(src_dir, src_dir, &list, ctx);
 
-    if (list.count == 0) {
+    char out_dir[MAX_PATH_LEN];
+    const char *slash = strrchr(out_json_path, '/');
+    snprintf(out_dir, sizeof(out_dir), "%.*s", slash ? (int)(slash - out_json_path) : 1, slash ? out_json_path : ".");
+
+    if (builder->total == 0) {
         unlink(out_json_path);
-        list_free(&list);
+        if (opts && opts->index_binary) {
+            write_index_binary(out_json_path, &list, ctx);
+        }
+        if (opts && opts->index_shard_size > 0) {
+            write_index_shards(out_json_path, &list, opts, ctx);
+        }
+        index_builder_free(builder);
+        if (listings) {
+            listing_build(src_dir, out_dir, NULL, 0, ctx);
+        }
         return;
     }
 
-    warn_duplicate_slugs(&list, ctx);
-    qsort(list.items, list.count, sizeof(DiscoveryRecord), record_cmp);
-
-    StrBuf out = {0};
-    sb_append(&out, "[\n");
-    for (size_t i = 0; i < list.count; i++) {
-        serialize_record_json(&out, &list.items[i]);
-        if (i + 1 < list.count) {
-            sb_append(&out, ",");
+    /* A copy for the compressed sidecars, which cannot read the index back
+     * when it went into an archive. */
+    StrBuf copy = {0};
+    bool compress = opts && opts->compress_formats;
+    if (write_index_json(out_json_path, builder, builder->keep_all ? &list : NULL, NULL, compress ? &copy : NULL, ctx)) {
+        if (cache_hits > 0) {
+            fprintf(stderr, "Generated discovery index: %s (%zu items, %zu page(s) from cache)\n", out_json_path, builder->total, cache_hits);
+        } else {
+            fprintf(stderr, "Generated discovery index: %s (%zu items)\n", out_json_path, builder->total);
+        }
+        if (builder->runs.count > 0) {
+            fprintf(stderr, "Discovery index sort spilled %zu run(s) to disk\n", builder->runs.count);
+        }
+        if (compress) {
+            compress_submit(out_json_path, copy.data, copy.len);
+            copy.data = NULL;
         }
-        sb_append(&out, "\n");
     }
-    sb_append(&out, "]\n");
+    xfree(copy.data);
+    index_builder_free(builder);
 
-    if (!write_file(out_json_path, out.data ? out.data : "[]\n")) {
-        log_error(ctx, "failed to write %s", out_json_path);
-    } else {
-        fprintf(stderr, "Generated discovery index: %s (%zu items)\n", out_json_path, list.count);
+    if (opts && opts->index_binary) {
+        write_index_binary(out_json_path, &list, ctx);
+    }
+    if (opts && opts->index_shard_size > 0) {
+        write_index_shards(out_json_path, &list, opts, ctx);
+    }
+    if (listings) {
+        listing_build(src_dir, out_dir, list.items, list.count, ctx);
     }
+    discovery_list_free(&list);
+}
 
-    free(out.data);
-    list_free(&list);
+void generate_discovery_index(const char *src_dir, const char *out_json_path, BuildCtx *ctx) {
+    char out_dir[MAX_PATH_LEN];
+    const char *slash = strrchr(out_json_path, '/');
+    snprintf(out_dir, sizeof(out_dir), "%.*s", slash ? (int)(slash - out_json_path) : 1, slash ? out_json_path : ".");
+    char cache_path[MAX_PATH_LEN + 32];
+    snprintf(cache_path, sizeof(cache_path), "%s/%s", out_dir, INDEX_CACHE_NAME);
+
+    /* A --shard build writes only the JSON fragment, so it never keeps. */
+    const BuildOptions *opts = ctx->opts;
+    bool whole = !opts || opts->shard_count == 0;
+    bool keep_all = whole && (listing_find(src_dir) || (opts && (opts->index_binary || opts->index_shard_size > 0)));
+    IndexBuilder builder;
+    index_builder_init(&builder, out_dir, opts, keep_all);
+    size_t cache_hits = 0;
+    collect_entries(src_dir, cache_path, &builder, &cache_hits, ctx);
+
+    if (whole) {
+        write_index_outputs(&builder, out_json_path, src_dir, cache_hits, ctx);
+        return;
+    }
+
+    /* A shard writes only its partial index; merge writes the real one. */
+    char header[64];
+    snprintf(header, sizeof(header), "defsite-shard-index 1\t%zu/%zu\n", opts->shard_index, opts->shard_count);
+    char *fragment = shard_fragment_path(out_dir, "index");
+    if (write_index_json(fragment, &builder, NULL, header, NULL, ctx)) {
+        fprintf(stderr, "Generated partial discovery index: %s (%zu items, shard %zu/%zu)\n", fragment, builder.total, opts->shard_index, opts->shard_count);
+    }
+    xfree(fragment);
+    index_builder_free(&builder);
 }
@@ -0,0 +1,267 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Binary index layout (little-endian, every section 4-byte aligned):
+ *   header   "DSX1", u32 version, u32 records, u32 columns, u32 strings,
+ *            u32 string_offsets_pos, u32 string_data_pos, u32 string_data_len
+ *   columns  per column: u32 name, u32 type, u32 present_pos, u32 data_pos, u32 list_pos
+ *   strings  u32 offsets[strings + 1] into UTF-8 data; string 0 is ""
+ * Column 0 is the record URL. The decoder lives in runtime/defsite-index.js. */
+#define BIN_INDEX_MAGIC "DSX1"
+#define BIN_INDEX_VERSION 1u
+#define BIN_HEADER_SIZE 32u
+#define BIN_COLUMN_SIZE 20u
+#define BIN_INT_MISSING INT32_MIN
+
+typedef enum {
+    COLUMN_STRING = 0,
+    COLUMN_INT = 1,
+    COLUMN_DATE = 2,
+    COLUMN_LIST = 3
+} ColumnType;
+
+typedef struct {
+    StrMap ids;
+    StringStack values;
+} StringTable;
+
+static uint32_t strtab_id(StringTable *t, const char *s) {
+    void *found = strmap_get(&t->ids, s);
+    if (found) {
+        return (uint32_t)(uintptr_t)found - 1;
+    }
+    uint32_t id = (uint32_t)t->values.count;
+    strstack_push(&t->values, s);
+    strmap_put(&t->ids, s, (void *)(uintptr_t)(id + 1));
+    return id;
+}
+
+static void bin_put_u32(StrBuf *b, uint32_t v) {
+    unsigned char bytes[4] = {(unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24)};
+    sb_append_n(b, (const char *)bytes, 4);
+}
+
+static void bin_set_u32(StrBuf *b, size_t pos, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        b->data[pos + (size_t)i] = (char)(unsigned char)(v >> (8 * i));
+    }
+}
+
+static void bin_align(StrBuf *b) {
+    while (b->len % 4 != 0) {
+        sb_append_n(b, "", 1);
+    }
+}
+
+static bool parse_int32(const char *s, int32_t *out) {
+    const char *p = s;
+    if (*p == '-') {
+        p++;
+    }
+    if (!*p || (p[0] == '0' && p[1]) || strlen(p) > 10) {
+        return false;
+    }
+    long long v = 0;
+    for (; *p; p++) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+        v = v * 10 + (*p - '0');
+    }
+    v = s[0] == '-' ? -v : v;
+    if (v <= BIN_INT_MISSING || v > INT32_MAX || str_eq(s, "-0")) {
+        return false;
+    }
+    *out = (int32_t)v;
+    return true;
+}
+
+/* A value stores as a list only if joining its parts with "," gives it back. */
+static bool is_plain_list(const char *s) {
+    if (!s[0]) {
+        return false;
+    }
+    for (const char *p = s; *p; p++) {
+        bool edge = p == s || p[1] == '\0' || p[1] == ',' || p[-1] == ',';
+        if ((*p == ',' && (p == s || p[1] == ',' || p[1] == '\0')) || (edge && (*p == ' ' || *p == '\t'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static ColumnType classify_column(const DiscoveryList *list, const char *key) {
+    bool all_int = true;
+    bool all_date = true;
+    bool all_list = true;
+    bool any_comma = false;
+    size_t present = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        const DiscoveryRecord *r = &list->items[i];
+        for (size_t m = 0; m < r->meta_count; m++) {
+            if (!str_eq(r->meta[m].key, key)) {
+                continue;
+            }
+            const char *v = r->meta[m].value;
+            int32_t ignored;
+            present++;
+            all_int = all_int && parse_int32(v, &ignored);
+            all_date = all_date && is_date_format(v);
+            all_list = all_list && is_plain_list(v);
+            any_comma = any_comma || strchr(v, ',') != NULL;
+        }
+    }
+    if (present == 0) {
+        return COLUMN_STRING;
+    }
+    if (all_int) {
+        return COLUMN_INT;
+    }
+    if (all_date) {
+        return COLUMN_DATE;
+    }
+    return all_list && any_comma ? COLUMN_LIST : COLUMN_STRING;
+}
+
+static const MetaField *record_meta_find(const DiscoveryRecord *rec, const char *key) {
+    for (size_t i = 0; i < rec->meta_count; i++) {
+        if (str_eq(rec->meta[i].key, key)) {
+            return &rec->meta[i];
+        }
+    }
+    return NULL;
+}
+
+static void serialize_column(StrBuf *b, size_t dir_pos, const DiscoveryList *list, const char *key, ColumnType type, StringTable *strings) {
+    bin_set_u32(b, dir_pos, strtab_id(strings, key));
+    bin_set_u32(b, dir_pos + 4, (uint32_t)type);
+
+    const bool is_url = dir_pos == BIN_HEADER_SIZE;
+    bin_set_u32(b, dir_pos + 8, (uint32_t)b->len);
+    for (size_t i = 0; i < list->count; i += 8) {
+        unsigned char bits = 0;
+        for (size_t k = 0; k < 8 && i + k < list->count; k++) {
+            if (is_url || record_meta_find(&list->items[i + k], key)) {
+                bits |= (unsigned char)(1u << k);
+            }
+        }
+        sb_append_n(b, (const char *)&bits, 1);
+    }
+    bin_align(b);
+
+    bin_set_u32(b, dir_pos + 12, (uint32_t)b->len);
+    StrBuf ids = {0};
+    uint32_t list_len = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        const DiscoveryRecord *r = &list->items[i];
+        const MetaField *f = is_url ? NULL : record_meta_find(r, key);
+        const char *v = is_url ? (r->url ? r->url : "") : (f ? f->value : "");
+        if (type == COLUMN_INT) {
+            int32_t n = BIN_INT_MISSING;
+            if (f) {
+                parse_int32(v, &n);
+            }
+            bin_put_u32(b, (uint32_t)n);
+        } else if (type == COLUMN_DATE) {
+            uint32_t ymd = f ? (uint32_t)atoi(v) * 10000u + (uint32_t)atoi(v + 5) * 100u + (uint32_t)atoi(v + 8) : 0;
+            bin_put_u32(b, ymd);
+        } else if (type == COLUMN_LIST) {
+            bin_put_u32(b, list_len);
+            char *parts = xstrdup(f ? v : "");
+            for (char *tok = strtok(parts, ","); tok; tok = strtok(NULL, ",")) {
+                bin_put_u32(&ids, strtab_id(strings, tok));
+                list_len++;
+            }
+            xfree(parts);
+        } else {
+            bin_put_u32(b, strtab_id(strings, v));
+        }
+    }
+    if (type == COLUMN_LIST) {
+        bin_put_u32(b, list_len);
+        bin_set_u32(b, dir_pos + 16, (uint32_t)b->len);
+        sb_append_n(b, ids.data ? ids.data : "", ids.len);
+    }
+    xfree(ids.data);
+}
+
+/* Columnar twin of search-index.json: typed columns over a deduplicated
+ * string table, so clients can read it through typed arrays without a JSON parse. */
+static void serialize_index_binary(StrBuf *b, const DiscoveryList *list) {
+    /* Column 0 is the URL; meta columns follow in first-seen key order. */
+    StringStack keys = {0};
+    StrMap seen;
+    strmap_init(&seen);
+    strstack_push(&keys, "url");
+    for (size_t i = 0; i < list->count; i++) {
+        for (size_t m = 0; m < list->items[i].meta_count; m++) {
+            const char *key = list->items[i].meta[m].key;
+            if (!strmap_contains(&seen, key)) {
+                strmap_put(&seen, key, NULL);
+                strstack_push(&keys, key);
+            }
+        }
+    }
+    strmap_free(&seen, NULL);
+
+    StringTable strings = {0};
+    strmap_init(&strings.ids);
+    strtab_id(&strings, "");
+
+    sb_append_n(b, BIN_INDEX_MAGIC, 4);
+    bin_put_u32(b, BIN_INDEX_VERSION);
+    bin_put_u32(b, (uint32_t)list->count);
+    bin_put_u32(b, (uint32_t)keys.count);
+    for (size_t i = 0; i < 4 + keys.count * (BIN_COLUMN_SIZE / 4); i++) {
+        bin_put_u32(b, 0);
+    }
+
+    for (size_t c = 0; c < keys.count; c++) {
+        ColumnType type = c == 0 ? COLUMN_STRING : classify_column(list, keys.items[c]);
+        serialize_column(b, BIN_HEADER_SIZE + c * BIN_COLUMN_SIZE, list, keys.items[c], type, &strings);
+    }
+
+    bin_set_u32(b, 16, (uint32_t)strings.values.count);
+    bin_set_u32(b, 20, (uint32_t)b->len);
+    uint32_t offset = 0;
+    for (size_t i = 0; i < strings.values.count; i++) {
+        bin_put_u32(b, offset);
+        offset += (uint32_t)strlen(strings.values.items[i]);
+    }
+    bin_put_u32(b, offset);
+    bin_set_u32(b, 24, (uint32_t)b->len);
+    bin_set_u32(b, 28, offset);
+    for (size_t i = 0; i < strings.values.count; i++) {
+        sb_append(b, strings.values.items[i]);
+    }
+    bin_align(b);
+
+    strmap_free(&strings.ids, NULL);
+    strstack_free(&strings.values);
+    strstack_free(&keys);
+}
+
+void write_index_binary(const char *out_json_path, const DiscoveryList *list, BuildCtx *ctx) {
+    char path[MAX_PATH_LEN];
+    const char *dot = strrchr(out_json_path, '.');
+    int stem = dot ? (int)(dot - out_json_path) : (int)strlen(out_json_path);
+    snprintf(path, sizeof(path), "%.*s.bin", stem, out_json_path);
+
+    if (list->count == 0) {
+        unlink(path);
+        return;
+    }
+    StrBuf out = {0};
+    serialize_index_binary(&out, list);
+    if (!write_file_n(path, out.data, out.len)) {
+        log_error(ctx, "failed to write %s", path);
+    } else {
+        fprintf(stderr, "Generated binary discovery index: %s (%zu bytes)\n", path, out.len);
+    }
+    xfree(out.data);
+}
@@ -0,0 +1,188 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Index cache: <out>/.defsite-index holds the extracted record of every
+ * source page, keyed by path and mtime/size stamp, so unchanged pages are
+ * not read or parsed again. One line per page:
+ *   stamp TAB path [TAB key TAB value]...
+ * with backslash escapes for tab, newline and backslash. The same line
+ * format carries spilled sort runs, shard fragments and shared cache entries. */
+#define INDEX_CACHE_VERSION "defsite-index-cache 1"
+
+typedef struct {
+    char *stamp;
+    DiscoveryRecord rec;
+} CachedRecord;
+
+static void cached_record_free(void *p) {
+    CachedRecord *c = p;
+    xfree(c->stamp);
+    record_free(&c->rec);
+    xfree(c);
+}
+
+static void cache_append_field(StrBuf *b, const char *s) {
+    for (const char *p = s; *p; p++) {
+        if (*p == '\t') {
+            sb_append(b, "\\t");
+        } else if (*p == '\n') {
+            sb_append(b, "\\n");
+        } else if (*p == '\r') {
+            sb_append(b, "\\r");
+        } else if (*p == '\\') {
+            sb_append(b, "\\\\");
+        } else {
+            sb_append_n(b, p, 1);
+        }
+    }
+}
+
+/* Parses "stamp TAB url [TAB key TAB value]..." in place into rec (which
+ * must be empty); *stamp points into line. Returns false on a malformed line. */
+bool index_record_parse(char *line, const char **stamp, DiscoveryRecord *rec) {
+    size_t max = 1;
+    for (const char *p = line; *p; p++) {
+        max += *p == '\t';
+    }
+    char **fields = xmalloc(max * sizeof(char *));
+    size_t n = 0;
+    char *w = line;
+    fields[n++] = w;
+    for (char *r = line; *r; r++) {
+        if (*r == '\t') {
+            *w++ = '\0';
+            fields[n++] = w;
+        } else if (*r == '\\' && r[1]) {
+            r++;
+            *w++ = *r == 't' ? '\t' : *r == 'n' ? '\n' : *r == 'r' ? '\r' : *r;
+        } else {
+            *w++ = *r;
+        }
+    }
+    *w = '\0';
+
+    bool ok = n >= 2 && n % 2 == 0;
+    if (ok) {
+        *stamp = fields[0];
+        rec->url = xstrdup(fields[1]);
+        for (size_t i = 2; i + 1 < n; i += 2) {
+            record_meta_set(rec, fields[i], fields[i + 1]);
+        }
+    }
+    xfree(fields);
+    return ok;
+}
+
+void index_cache_header(StrBuf *b, const char *src_dir) {
+    sb_append(b, INDEX_CACHE_VERSION);
+    sb_append(b, "\t");
+    cache_append_field(b, src_dir);
+    sb_append(b, "\n");
+}
+
+void index_cache_load(const char *path, const char *src_dir, StrMap *cache) {
+    char *text = read_file(path);
+    if (!text) {
+        return;
+    }
+    StrBuf header = {0};
+    index_cache_header(&header, src_dir);
+    if (!starts_with(text, header.data)) {
+        xfree(header.data);
+        xfree(text);
+        return;
+    }
+
+    char *line = text + header.len;
+    xfree(header.data);
+    while (*line) {
+        char *end = strchr(line, '\n');
+        if (end) {
+            *end = '\0';
+        }
+        CachedRecord *c = xmalloc(sizeof(CachedRecord));
+        memset(c, 0, sizeof(*c));
+        const char *stamp;
+        if (index_record_parse(line, &stamp, &c->rec)) {
+            c->stamp = xstrdup(stamp);
+            CachedRecord *prev = strmap_put(cache, c->rec.url, c);
+            if (prev) {
+                cached_record_free(prev);
+            }
+        } else {
+            cached_record_free(c);
+        }
+        if (!end) {
+            break;
+        }
+        line = end + 1;
+    }
+    xfree(text);
+}
+
+void index_record_append(StrBuf *b, const char *stamp, const char *rel, const DiscoveryRecord *rec) {
+    sb_append(b, stamp);
+    sb_append(b, "\t");
+    cache_append_field(b, rel);
+    for (size_t i = 0; i < rec->meta_count; i++) {
+        sb_append(b, "\t");
+        cache_append_field(b, rec->meta[i].key);
+        sb_append(b, "\t");
+        cache_append_field(b, rec->meta[i].value);
+    }
+    sb_append(b, "\n");
+}
+
+/* Returns the cached record for rel if its stamp still matches. */
+const DiscoveryRecord *index_cache_lookup(const StrMap *cache, const char *rel, const char *stamp) {
+    const CachedRecord *c = strmap_get(cache, rel);
+    return c && str_eq(c->stamp, stamp) ? &c->rec : NULL;
+}
+
+void index_cache_free(StrMap *cache) {
+    strmap_free(cache, cached_record_free);
+}
+
+/* The shared build cache (--cache-dir) holds extracted records by content,
+ * so they survive a fresh checkout where the mtime-keyed cache above cannot.
+ * Sets rec->url only on a hit. */
+bool index_shared_lookup(const char *rel, const IoFile *src, DiscoveryRecord *rec) {
+    if (!cache_enabled()) {
+        return false;
+    }
+    char key[33];
+    cache_key("meta", rel, src->data, src->len, key);
+    char *line = NULL;
+    size_t len = 0;
+    if (!cache_lookup("meta", key, &line, &len)) {
+        return false;
+    }
+    if (len > 0 && line[len - 1] == '\n') {
+        line[len - 1] = '\0';
+    }
+    const char *stamp;
+    bool ok = index_record_parse(line, &stamp, rec) && str_eq(rec->url, rel);
+    if (!ok) {
+        record_free(rec);
+        memset(rec, 0, sizeof(*rec));
+    }
+    xfree(line);
+    return ok && rec->meta_count > 0;
+}
+
+/* Publishes a freshly extracted record (or its absence) for src. */
+void index_shared_publish(const IoFile *src, const DiscoveryRecord *rec) {
+    if (!cache_enabled()) {
+        return;
+    }
+    char key[33];
+    cache_key("meta", rec->url, src->data, src->len, key);
+    StrBuf line = {0};
+    index_record_append(&line, "-", rec->url, rec);
+    cache_publish(key, line.data, line.len);
+    xfree(line.data);
+}
@@ -0,0 +1,43 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Rebuilds the discovery index from the partial indexes of a set of shards.
+ * Unique keys are checked again here, since duplicates may span shards. */
+void merge_index_fragments(const char *const *fragments, size_t count, const char *out_json_path, BuildCtx *ctx) {
+    char out_dir[MAX_PATH_LEN];
+    const char *slash = strrchr(out_json_path, '/');
+    snprintf(out_dir, sizeof(out_dir), "%.*s", slash ? (int)(slash - out_json_path) : 1, slash ? out_json_path : ".");
+
+    const BuildOptions *opts = ctx->opts;
+    bool keep_all = opts && (opts->index_binary || opts->index_shard_size > 0);
+    IndexBuilder builder;
+    index_builder_init(&builder, out_dir, opts, keep_all);
+    char *line = NULL;
+    size_t cap = 0;
+    for (size_t i = 0; i < count; i++) {
+        IoStream *in = io_stream_open(fragments[i]);
+        if (!in) {
+            log_error(ctx, "failed to read partial index %s", fragments[i]);
+            continue;
+        }
+        bool header = true;
+        while (io_stream_read_line(in, &line, &cap)) {
+            if (header) {
+                header = false;
+                continue;
+            }
+            const char *stamp;
+            DiscoveryRecord rec = {0};
+            if (index_record_parse(line, &stamp, &rec)) {
+                index_builder_add(&builder, &rec, ctx);
+            }
+            record_free(&rec);
+        }
+        io_stream_close(in);
+    }
+    xfree(line);
+    write_index_outputs(&builder, out_json_path, NULL, 0, ctx);
+}
@@ -0,0 +1,297 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    const DiscoveryRecord *rec;
+    const char *key;
+    size_t pos;
+} SortItem;
+
+/* Numeric values compare as numbers, everything else bytewise; missing sorts first. */
+static int sort_value_cmp(const char *a, const char *b) {
+    char *end_a;
+    char *end_b;
+    long long na = strtoll(a, &end_a, 10);
+    long long nb = strtoll(b, &end_b, 10);
+    if (a[0] && b[0] && !*end_a && !*end_b) {
+        return na < nb ? -1 : na > nb;
+    }
+    return strcmp(a, b);
+}
+
+static int sort_item_cmp(const void *pa, const void *pb) {
+    const SortItem *a = pa;
+    const SortItem *b = pb;
+    int c = sort_value_cmp(record_meta_get(a->rec, a->key), record_meta_get(b->rec, b->key));
+    return c != 0 ? c : (a->pos > b->pos) - (a->pos < b->pos);
+}
+
+static int sort_item_cmp_desc(const void *pa, const void *pb) {
+    const SortItem *a = pa;
+    const SortItem *b = pb;
+    int c = sort_value_cmp(record_meta_get(b->rec, b->key), record_meta_get(a->rec, a->key));
+    return c != 0 ? c : (a->pos > b->pos) - (a->pos < b->pos);
+}
+
+static char *file_safe_key(const char *key) {
+    char *out = xstrdup(key);
+    for (char *p = out; *p; p++) {
+        bool ok = (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '-' || *p == '_';
+        if (!ok) {
+            *p = '_';
+        }
+    }
+    return out;
+}
+
+static void shard_write(const char *dir, const char *name, StrBuf *out, BuildCtx *ctx) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (!write_file_n(path, out->data ? out->data : "", out->len)) {
+        log_error(ctx, "failed to write %s", path);
+        xfree(out->data);
+    } else {
+        compress_submit(path, out->data, out->len);
+    }
+    out->data = NULL;
+    out->len = 0;
+    out->cap = 0;
+}
+
+/* Removes shard, facet and sort files left by a previous build. */
+static void clear_shard_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        const char *name = entry->d_name;
+        if (starts_with(name, "shard-") || starts_with(name, "facet-") || starts_with(name, "sort-")) {
+            char path[MAX_PATH_LEN];
+            if (snprintf(path, sizeof(path), "%s/%s", dir, name) < (int)sizeof(path)) {
+                unlink(path);
+            }
+        }
+    }
+    closedir(d);
+}
+
+static void append_id_list(StrBuf *b, const size_t *ids, size_t n) {
+    char num[32];
+    sb_append(b, "[");
+    for (size_t i = 0; i < n; i++) {
+        snprintf(num, sizeof(num), i > 0 ? ",%zu" : "%zu", ids[i]);
+        sb_append(b, num);
+    }
+    sb_append(b, "]");
+}
+
+typedef struct {
+    size_t *ids;
+    size_t count;
+    size_t cap;
+} Posting;
+
+static void posting_free(void *p) {
+    Posting *posting = p;
+    xfree(posting->ids);
+    xfree(posting);
+}
+
+static int cmp_str_ptr(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Writes one facet file ({"value": [ids]}) and its value counts into the manifest. */
+static void write_facet(const char *dir, const char *key, const SortItem *order, size_t count, StrBuf *manifest, BuildCtx *ctx) {
+    StrMap postings;
+    strmap_init(&postings);
+    for (size_t id = 0; id < count; id++) {
+        StringStack values = {0};
+        split_list(record_meta_get(order[id].rec, key), &values);
+        for (size_t v = 0; v < values.count; v++) {
+            Posting *p = strmap_get(&postings, values.items[v]);
+            if (!p) {
+                p = xmalloc(sizeof(Posting));
+                memset(p, 0, sizeof(*p));
+                strmap_put(&postings, values.items[v], p);
+            }
+            if (p->count > 0 && p->ids[p->count - 1] == id) {
+                continue;
+            }
+            if (p->count == p->cap) {
+                p->cap = p->cap == 0 ? 8 : p->cap * 2;
+                p->ids = xrealloc(p->ids, p->cap * sizeof(size_t));
+            }
+            p->ids[p->count++] = id;
+        }
+        strstack_free(&values);
+    }
+
+    char **values = xmalloc((postings.count + 1) * sizeof(char *));
+    size_t n = 0;
+    for (size_t i = 0; i < postings.cap; i++) {
+        if (postings.slots[i].key) {
+            values[n++] = postings.slots[i].key;
+        }
+    }
+    qsort(values, n, sizeof(char *), cmp_str_ptr);
+
+    char *safe = file_safe_key(key);
+    char name[MAX_PATH_LEN];
+    snprintf(name, sizeof(name), "facet-%s.json", safe);
+    xfree(safe);
+
+    StrBuf out = {0};
+    char num[32];
+    sb_append(&out, "{\n");
+    sb_append(manifest, "    ");
+    json_append_escaped(manifest, key);
+    sb_append(manifest, ": {\"file\": ");
+    json_append_escaped(manifest, name);
+    sb_append(manifest, ", \"values\": {");
+    for (size_t i = 0; i < n; i++) {
+        const Posting *p = strmap_get(&postings, values[i]);
+        sb_append(&out, "  ");
+        json_append_escaped(&out, values[i]);
+        sb_append(&out, ": ");
+        append_id_list(&out, p->ids, p->count);
+        sb_append(&out, i + 1 < n ? ",\n" : "\n");
+
+        json_append_escaped(manifest, values[i]);
+        snprintf(num, sizeof(num), i + 1 < n ? ": %zu, " : ": %zu", p->count);
+        sb_append(manifest, num);
+    }
+    sb_append(&out, "}\n");
+    sb_append(manifest, "}}");
+    shard_write(dir, name, &out, ctx);
+
+    xfree(values);
+    strmap_free(&postings, posting_free);
+}
+
+/* Splits the index into fixed-size shards under <stem>/ with a small manifest,
+ * per-facet posting lists and sort permutations. Record ids are positions in
+ * shard order, which is newest first by the first sort key, so the first page
+ * of the default listing needs only the manifest and shard 0. */
+void write_index_shards(const char *out_json_path, const DiscoveryList *list, const BuildOptions *opts, BuildCtx *ctx) {
+    char dir[MAX_PATH_LEN];
+    const char *dot = strrchr(out_json_path, '.');
+    int stem = dot ? (int)(dot - out_json_path) : (int)strlen(out_json_path);
+    snprintf(dir, sizeof(dir), "%.*s", stem, out_json_path);
+    /* No records: no index, like search-index.json itself. */
+    if (list->count == 0) {
+        clear_shard_dir(dir);
+        char manifest_path[MAX_PATH_LEN + 16];
+        snprintf(manifest_path, sizeof(manifest_path), "%s/manifest.json", dir);
+        unlink(manifest_path);
+        rmdir(dir);
+        return;
+    }
+    if (ensure_dir(dir) != 0) {
+        log_error(ctx, "failed to create directory %s", dir);
+        return;
+    }
+    clear_shard_dir(dir);
+
+    StringStack facets = {0};
+    StringStack sorts = {0};
+    split_list(opts->index_facets, &facets);
+    split_list(opts->index_sorts, &sorts);
+
+    size_t count = list->count;
+    SortItem *order = xmalloc((count + 1) * sizeof(SortItem));
+    for (size_t i = 0; i < count; i++) {
+        order[i].rec = &list->items[i];
+        order[i].key = sorts.count > 0 ? sorts.items[0] : "";
+        order[i].pos = i;
+    }
+    if (sorts.count > 0) {
+        qsort(order, count, sizeof(SortItem), sort_item_cmp_desc);
+    }
+
+    size_t shard_size = opts->index_shard_size;
+    size_t shard_count = (count + shard_size - 1) / shard_size;
+    char name[MAX_PATH_LEN];
+    char num[64];
+
+    StrBuf manifest = {0};
+    sb_append(&manifest, "{\n  \"version\": 1,\n");
+    snprintf(num, sizeof(num), "  \"count\": %zu,\n  \"shard_size\": %zu,\n", count, shard_size);
+    sb_append(&manifest, num);
+    sb_append(&manifest, "  \"order\": ");
+    json_append_escaped(&manifest, sorts.count > 0 ? sorts.items[0] : "url");
+    sb_append(&manifest, ",\n  \"order_direction\": ");
+    sb_append(&manifest, sorts.count > 0 ? "\"desc\",\n" : "\"asc\",\n");
+    sb_append(&manifest, "  \"shards\": [");
+
+    for (size_t s = 0; s < shard_count; s++) {
+        snprintf(name, sizeof(name), "shard-%04zu.json", s);
+        StrBuf out = {0};
+        sb_append(&out, "[\n");
+        size_t end = (s + 1) * shard_size < count ? (s + 1) * shard_size : count;
+        for (size_t i = s * shard_size; i < end; i++) {
+            serialize_record_json(&out, order[i].rec);
+            sb_append(&out, i + 1 < end ? ",\n" : "\n");
+        }
+        sb_append(&out, "]\n");
+        shard_write(dir, name, &out, ctx);
+
+        if (s > 0) {
+            sb_append(&manifest, ", ");
+        }
+        json_append_escaped(&manifest, name);
+    }
+    sb_append(&manifest, "],\n  \"facets\": {");
+
+    for (size_t f = 0; f < facets.count; f++) {
+        sb_append(&manifest, f > 0 ? ",\n" : "\n");
+        write_facet(dir, facets.items[f], order, count, &manifest, ctx);
+    }
+    sb_append(&manifest, facets.count > 0 ? "\n  },\n  \"sorts\": {" : "},\n  \"sorts\": {");
+
+    /* Ascending permutations of record ids; clients walk them backwards for descending. */
+    SortItem *sorted = xmalloc((count + 1) * sizeof(SortItem));
+    size_t *ids = xmalloc((count + 1) * sizeof(size_t));
+    for (size_t k = 0; k < sorts.count; k++) {
+        for (size_t i = 0; i < count; i++) {
+            sorted[i] = order[i];
+            sorted[i].key = sorts.items[k];
+            sorted[i].pos = i;
+        }
+        qsort(sorted, count, sizeof(SortItem), sort_item_cmp);
+        for (size_t i = 0; i < count; i++) {
+            ids[i] = sorted[i].pos;
+        }
+
+        char *safe = file_safe_key(sorts.items[k]);
+        snprintf(name, sizeof(name), "sort-%s.json", safe);
+        xfree(safe);
+        StrBuf out = {0};
+        append_id_list(&out, ids, count);
+        sb_append(&out, "\n");
+        shard_write(dir, name, &out, ctx);
+
+        sb_append(&manifest, k > 0 ? ",\n    " : "\n    ");
+        json_append_escaped(&manifest, sorts.items[k]);
+        sb_append(&manifest, ": ");
+        json_append_escaped(&manifest, name);
+    }
+    sb_append(&manifest, sorts.count > 0 ? "\n  }\n}\n" : "}\n}\n");
+    shard_write(dir, "manifest.json", &manifest, ctx);
+
+    fprintf(stderr, "Generated sharded discovery index: %s (%zu shard(s), %zu facet(s), %zu sort(s))\n", dir, shard_count, facets.count, sorts.count);
+
+    xfree(ids);
+    xfree(sorted);
+    xfree(order);
+    strstack_free(&facets);
+    strstack_free(&sorts);
+}
@@ -0,0 +1,261 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* IndexBuilder (see common.h): unique-key checks, sorted spill runs, and
+ * the k-way merge that streams search-index.json out. */
+
+void index_builder_init(IndexBuilder *b, const char *out_dir, const BuildOptions *opts, bool keep_all) {
+    memset(b, 0, sizeof(*b));
+    b->keep_all = keep_all;
+    b->memory_cap = (opts ? opts->index_memory_kb : 256 * 1024) * 1024u;
+    snprintf(b->run_prefix, sizeof(b->run_prefix), "%s/.defsite-index-run", out_dir);
+    split_list(opts ? opts->index_unique : "slug", &b->unique_keys);
+    b->seen = xmalloc((b->unique_keys.count + 1) * sizeof(StrMap));
+    for (size_t i = 0; i < b->unique_keys.count; i++) {
+        strmap_init(&b->seen[i]);
+    }
+}
+
+void index_builder_free(IndexBuilder *b) {
+    for (size_t i = 0; i < b->runs.count; i++) {
+        unlink(b->runs.items[i]);
+    }
+    for (size_t i = 0; i < b->unique_keys.count; i++) {
+        strmap_free(&b->seen[i], xfree);
+    }
+    xfree(b->seen);
+    strstack_free(&b->unique_keys);
+    strstack_free(&b->runs);
+    discovery_list_free(&b->pending);
+}
+
+static size_t record_bytes(const DiscoveryRecord *r) {
+    size_t n = sizeof(DiscoveryRecord) + strlen(r->url) + 1;
+    for (size_t i = 0; i < r->meta_count; i++) {
+        n += sizeof(MetaField) + strlen(r->meta[i].key) + strlen(r->meta[i].value) + 2;
+    }
+    return n;
+}
+
+static void builder_spill(IndexBuilder *b, BuildCtx *ctx) {
+    qsort(b->pending.items, b->pending.count, sizeof(DiscoveryRecord), record_cmp);
+    char path[MAX_PATH_LEN + 64];
+    snprintf(path, sizeof(path), "%s-%zu", b->run_prefix, b->runs.count);
+    IoStream *out = io_stream_create(path);
+    if (!out) {
+        /* Without a run file the batch simply stays in memory. */
+        log_warning(ctx, "failed to create index sort run %s; keeping records in memory", path);
+        b->memory_cap = SIZE_MAX;
+        return;
+    }
+    StrBuf line = {0};
+    for (size_t i = 0; i < b->pending.count; i++) {
+        line.len = 0;
+        index_record_append(&line, "-", b->pending.items[i].url, &b->pending.items[i]);
+        io_stream_write(out, line.data, line.len);
+    }
+    xfree(line.data);
+    strstack_push(&b->runs, path);
+    if (!io_stream_close(out)) {
+        log_error(ctx, "failed to write index sort run %s", path);
+    }
+    discovery_list_free(&b->pending);
+    memset(&b->pending, 0, sizeof(b->pending));
+    b->pending_bytes = 0;
+}
+
+void index_builder_add(IndexBuilder *b, DiscoveryRecord *rec, BuildCtx *ctx) {
+    for (size_t k = 0; k < b->unique_keys.count; k++) {
+        const char *value = record_meta_get(rec, b->unique_keys.items[k]);
+        if (!value[0]) {
+            continue;
+        }
+        const char *first = strmap_get(&b->seen[k], value);
+        if (first) {
+            log_warning(ctx,
+                        "duplicate metadata %s '%s' in discovery index (%s and %s)",
+                        b->unique_keys.items[k],
+                        value,
+                        first,
+                        rec->url);
+        } else {
+            strmap_put(&b->seen[k], value, xstrdup(rec->url));
+        }
+    }
+
+    b->pending_bytes += record_bytes(rec);
+    b->total++;
+    DiscoveryRecord *dst = discovery_list_push(&b->pending);
+    *dst = *rec;
+    memset(rec, 0, sizeof(*rec));
+    if (b->pending_bytes <= b->memory_cap) {
+        return;
+    }
+    if (!b->keep_all) {
+        builder_spill(b, ctx);
+    } else if (!b->over_cap) {
+        /* Spilling would not help: the records are all loaded again. */
+        b->over_cap = true;
+        log_warning(ctx,
+                    "discovery index records exceed --index-memory=%zuK; --index-binary, --index-shard-size and "
+                    "listing pages hold every record in memory",
+                    b->memory_cap / 1024);
+    }
+}
+
+static void json_append_meta(StrBuf *b, const DiscoveryRecord *r) {
+    sb_append(b, "{");
+    if (r->meta_count > 0) {
+        sb_append(b, "\n");
+    }
+
+    for (size_t i = 0; i < r->meta_count; i++) {
+        sb_append(b, "      ");
+        json_append_escaped(b, r->meta[i].key);
+        sb_append(b, ": ");
+        json_append_escaped(b, r->meta[i].value);
+        if (i + 1 < r->meta_count) {
+            sb_append(b, ",");
+        }
+        sb_append(b, "\n");
+    }
+
+    if (r->meta_count > 0) {
+        sb_append(b, "    ");
+    }
+    sb_append(b, "}");
+}
+
+void serialize_record_json(StrBuf *b, const DiscoveryRecord *r) {
+    sb_append(b, "  {\n");
+    sb_append(b, "    \"url\": ");
+    json_append_escaped(b, r->url ? r->url : "");
+    sb_append(b, ",\n");
+    sb_append(b, "    \"meta\": ");
+    json_append_meta(b, r);
+    sb_append(b, "\n");
+    sb_append(b, "  }");
+}
+
+/* Reads records back from one spilled run, in URL order. */
+typedef struct {
+    IoStream *in;
+    char *line;
+    size_t cap;
+    DiscoveryRecord cur;
+    bool has;
+} RunReader;
+
+static void run_reader_next(RunReader *r) {
+    record_free(&r->cur);
+    memset(&r->cur, 0, sizeof(r->cur));
+    r->has = false;
+    const char *stamp;
+    while (io_stream_read_line(r->in, &r->line, &r->cap)) {
+        if (index_record_parse(r->line, &stamp, &r->cur)) {
+            r->has = true;
+            return;
+        }
+    }
+}
+
+#define INDEX_WRITE_CHUNK (64u * 1024u)
+
+/* Merges the spilled runs and the in-memory remainder in URL order and
+ * streams search-index.json out in fixed-size chunks. Records are moved into
+ * keep (when given) for the binary and sharded outputs, which need them all.
+ * With a fragment header the records are written as cache lines instead,
+ * which is the partial index a --shard build leaves for `defsite merge`. */
+bool write_index_json(const char *out_json_path, IndexBuilder *b, DiscoveryList *keep, const char *fragment_header, StrBuf *copy, BuildCtx *ctx) {
+    qsort(b->pending.items, b->pending.count, sizeof(DiscoveryRecord), record_cmp);
+    size_t nruns = b->runs.count;
+    RunReader *runs = xmalloc((nruns + 1) * sizeof(RunReader));
+    memset(runs, 0, (nruns + 1) * sizeof(RunReader));
+    for (size_t i = 0; i < nruns; i++) {
+        runs[i].in = io_stream_open(b->runs.items[i]);
+        if (!runs[i].in) {
+            log_error(ctx, "failed to read index sort run %s", b->runs.items[i]);
+            continue;
+        }
+        run_reader_next(&runs[i]);
+    }
+
+    IoStream *out = io_stream_create(out_json_path);
+    StrBuf chunk = {0};
+    size_t pos = 0;
+    size_t written = 0;
+    sb_append(&chunk, fragment_header ? fragment_header : "[\n");
+    for (;;) {
+        DiscoveryRecord *next = pos < b->pending.count ? &b->pending.items[pos] : NULL;
+        RunReader *from = NULL;
+        for (size_t i = 0; i < nruns; i++) {
+            if (runs[i].has && (!next || strcmp(runs[i].cur.url, next->url) < 0)) {
+                next = &runs[i].cur;
+                from = &runs[i];
+            }
+        }
+        if (!next) {
+            break;
+        }
+
+        if (fragment_header) {
+            index_record_append(&chunk, "-", next->url, next);
+        } else {
+            if (written > 0) {
+                sb_append(&chunk, ",\n");
+            }
+            serialize_record_json(&chunk, next);
+        }
+        written++;
+        if (chunk.len >= INDEX_WRITE_CHUNK) {
+            if (out) {
+                io_stream_write(out, chunk.data, chunk.len);
+            }
+            if (copy) {
+                sb_append_n(copy, chunk.data, chunk.len);
+            }
+            chunk.len = 0;
+        }
+
+        if (keep) {
+            *discovery_list_push(keep) = *next;
+            memset(next, 0, sizeof(*next));
+        }
+        if (from) {
+            run_reader_next(from);
+        } else {
+            pos++;
+        }
+    }
+    if (!fragment_header) {
+        sb_append(&chunk, "\n]\n");
+    }
+
+    bool ok = out != NULL;
+    if (out) {
+        io_stream_write(out, chunk.data, chunk.len);
+        ok = io_stream_close(out);
+    }
+    if (copy) {
+        sb_append_n(copy, chunk.data, chunk.len);
+    }
+    xfree(chunk.data);
+    for (size_t i = 0; i < nruns; i++) {
+        if (runs[i].in) {
+            io_stream_close(runs[i].in);
+        }
+        xfree(runs[i].line);
+        record_free(&runs[i].cur);
+    }
+    xfree(runs);
+
+    if (!ok) {
+        log_error(ctx, "failed to write %s", out_json_path);
+    }
+    return ok;
+}
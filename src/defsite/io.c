@@ -0,0 +1,233 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IO_RING_ENTRIES 256
+
+/* File I/O for the build: the backend, the counters behind io_report, and
+ * publishing whole outputs. Streams and copies are in iostream.c, batched
+ * reads and writes in iobatch.c. */
+
+static IoBackend active_backend = IO_BACKEND_STDIO;
+static IoUring *ring = NULL;
+IoCounters io_counters;
+static char *output_dir = NULL;
+static _Atomic unsigned long temp_seq;
+
+uint64_t io_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+bool io_init(IoBackend requested) {
+    active_backend = IO_BACKEND_STDIO;
+    if (requested != IO_BACKEND_URING) {
+        return true;
+    }
+    ring = uring_open(IO_RING_ENTRIES);
+    if (!ring) {
+        return false;
+    }
+    active_backend = IO_BACKEND_URING;
+    return true;
+}
+
+void io_shutdown(void) {
+    uring_close(ring);
+    ring = NULL;
+    active_backend = IO_BACKEND_STDIO;
+    xfree(output_dir);
+    output_dir = NULL;
+}
+
+/* Files written under dir (other than .defsite-* build state) are counted as
+ * outputs in io_report. */
+void io_set_output_dir(const char *dir) {
+    xfree(output_dir);
+    output_dir = dir ? xstrdup(dir) : NULL;
+}
+
+void io_note_output(const char *path, bool changed) {
+    size_t root_len = output_dir ? strlen(output_dir) : 0;
+    if (root_len == 0 || strncmp(path, output_dir, root_len) != 0 || path[root_len] != '/') {
+        return;
+    }
+    const char *base = strrchr(path, '/') + 1;
+    if (starts_with(base, ".defsite-")) {
+        return;
+    }
+    if (changed) {
+        io_counters.outputs_changed++;
+    } else {
+        io_counters.outputs_unchanged++;
+    }
+}
+
+/* "path.tmp.<pid>.<seq>": beside path, so the rename stays on one file system. */
+void io_temp_path(const char *path, char *out, size_t size) {
+    snprintf(out, size, "%s.tmp.%ld.%lu", path, (long)getpid(), (unsigned long)atomic_fetch_add(&temp_seq, 1));
+}
+
+IoBackend io_backend(void) {
+    return active_backend;
+}
+
+/* The ring for batched I/O; NULL unless the uring backend is active. */
+IoUring *io_ring(void) {
+    return ring;
+}
+
+void io_report(void) {
+    size_t ops = io_counters.open + io_counters.seek + io_counters.stat + io_counters.read + io_counters.write + io_counters.close;
+    size_t syscalls = ops - io_counters.ring_ops + io_counters.enter;
+    size_t bytes_read = io_counters.bytes_read;
+    size_t bytes_written = io_counters.bytes_written;
+    double ms = (double)io_counters.ns / 1e6;
+    fprintf(stderr,
+            "I/O [%s]: %zu syscalls for %zu file ops (open %zu, seek %zu, stat %zu, read %zu, write %zu, close %zu; "
+            "%zu via %zu ring submits), %zu bytes read, %zu bytes written, %.2f ms\n",
+            active_backend == IO_BACKEND_URING ? "uring" : "stdio",
+            syscalls,
+            ops,
+            (size_t)io_counters.open,
+            (size_t)io_counters.seek,
+            (size_t)io_counters.stat,
+            (size_t)io_counters.read,
+            (size_t)io_counters.write,
+            (size_t)io_counters.close,
+            (size_t)io_counters.ring_ops,
+            (size_t)io_counters.enter,
+            bytes_read,
+            bytes_written,
+            ms);
+    if (output_dir) {
+        size_t changed = io_counters.outputs_changed;
+        size_t unchanged = io_counters.outputs_unchanged;
+        fprintf(stderr, "Outputs: %zu changed, %zu unchanged (of %zu written to %s)\n", changed, unchanged, changed + unchanged, output_dir);
+    }
+}
+
+char *io_read_whole(const char *path, size_t *len_out) {
+    FILE *f = fopen(path, "rb");
+    io_counters.open++;
+    if (!f) {
+        return NULL;
+    }
+    io_counters.seek += 3;
+    if (fseek(f, 0, SEEK_END) != 0) {
+        fclose(f);
+        io_counters.close++;
+        return NULL;
+    }
+    long size = ftell(f);
+    if (size < 0) {
+        fclose(f);
+        io_counters.close++;
+        return NULL;
+    }
+    if (fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        io_counters.close++;
+        return NULL;
+    }
+
+    char *buf = xmalloc((size_t)size + 1);
+    size_t got = fread(buf, 1, (size_t)size, f);
+    io_counters.read++;
+    fclose(f);
+    io_counters.close++;
+    if (got != (size_t)size) {
+        xfree(buf);
+        return NULL;
+    }
+    buf[size] = '\0';
+    io_counters.bytes_read += got;
+    *len_out = got;
+    return buf;
+}
+
+bool io_write_whole(const char *path, const char *data, size_t n) {
+    FILE *f = fopen(path, "wb");
+    io_counters.open++;
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(data, 1, n, f) == n;
+    io_counters.write++;
+    if (fclose(f) != 0) {
+        ok = false;
+    }
+    io_counters.close++;
+    if (ok) {
+        io_counters.bytes_written += n;
+    }
+    return ok;
+}
+
+/* True when path already holds exactly data. A size mismatch, the usual
+ * case for a changed file, is settled by one stat. */
+bool io_same_contents(const char *path, const char *data, size_t n) {
+    struct stat st;
+    io_counters.stat++;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size != n) {
+        return false;
+    }
+    size_t len = 0;
+    char *old = io_read_whole(path, &len);
+    bool same = old && len == n && memcmp(old, data, n) == 0;
+    xfree(old);
+    return same;
+}
+
+/* Leaves path alone when it already holds data; otherwise writes a temporary
+ * file beside it and renames it into place, so readers (a dev server, a sync
+ * job) see the old file or the new one, never a partial one. */
+static bool publish_file(const char *path, const char *data, size_t n) {
+    if (archive_claims(path)) {
+        return archive_add(path, data, n);
+    }
+    if (io_same_contents(path, data, n)) {
+        io_note_output(path, false);
+        return true;
+    }
+    char tmp[MAX_PATH_LEN + 64];
+    io_temp_path(path, tmp, sizeof(tmp));
+    bool ok = io_write_whole(tmp, data, n) && rename(tmp, path) == 0;
+    if (ok) {
+        io_note_output(path, true);
+    } else {
+        unlink(tmp);
+    }
+    return ok;
+}
+
+char *read_file(const char *path) {
+    uint64_t start = io_now_ns();
+    size_t len = 0;
+    char *data = io_read_whole(path, &len);
+    io_counters.ns += io_now_ns() - start;
+    return data;
+}
+
+bool write_file(const char *path, const char *data) {
+    uint64_t start = io_now_ns();
+    bool ok = publish_file(path, data, strlen(data));
+    io_counters.ns += io_now_ns() - start;
+    return ok;
+}
+
+bool write_file_n(const char *path, const char *data, size_t len) {
+    uint64_t start = io_now_ns();
+    bool ok = publish_file(path, data, len);
+    io_counters.ns += io_now_ns() - start;
+    return ok;
+}
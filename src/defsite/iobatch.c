@@ -0,0 +1,226 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Batched reads and writes: with the uring backend a whole batch is opened,
+ * read or written and closed in a few ring submits; otherwise each file goes
+ * through the stdio paths in io.c. */
+
+static void uring_close_fds(const int *fds, size_t count) {
+    UringOp *ops = xmalloc((count > 0 ? count : 1) * sizeof(UringOp));
+    memset(ops, 0, (count > 0 ? count : 1) * sizeof(UringOp));
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (fds[i] >= 0) {
+            ops[n].kind = URING_CLOSE;
+            ops[n].fd = fds[i];
+            n++;
+        }
+    }
+    io_counters.enter += uring_run(io_ring(), ops, n);
+    io_counters.close += n;
+    io_counters.ring_ops += n;
+    xfree(ops);
+}
+
+/* Short reads/writes are rare for regular files; finish them synchronously. */
+static bool finish_short_io(UringOp *op, bool is_write, size_t total) {
+    size_t done = op->result > 0 ? (size_t)op->result : 0;
+    while (done < total) {
+        ssize_t rc = is_write ? pwrite(op->fd, (char *)op->buf + done, total - done, (off_t)done)
+                              : pread(op->fd, (char *)op->buf + done, total - done, (off_t)done);
+        if (is_write) {
+            io_counters.write++;
+        } else {
+            io_counters.read++;
+        }
+        if (rc <= 0) {
+            return false;
+        }
+        done += (size_t)rc;
+    }
+    return true;
+}
+
+static void uring_read_batch(IoFile *files, size_t count) {
+    UringOp *ops = xmalloc(count * 2 * sizeof(UringOp));
+    memset(ops, 0, count * 2 * sizeof(UringOp));
+    for (size_t i = 0; i < count; i++) {
+        ops[i * 2].kind = URING_OPENAT;
+        ops[i * 2].path = files[i].path;
+        ops[i * 2].flags = O_RDONLY;
+        ops[i * 2 + 1].kind = URING_STATX;
+        ops[i * 2 + 1].path = files[i].path;
+    }
+    io_counters.enter += uring_run(io_ring(), ops, count * 2);
+    io_counters.open += count;
+    io_counters.stat += count;
+    io_counters.ring_ops += count * 2;
+
+    UringOp *reads = xmalloc(count * sizeof(UringOp));
+    memset(reads, 0, count * sizeof(UringOp));
+    size_t nreads = 0;
+    for (size_t i = 0; i < count; i++) {
+        int fd = ops[i * 2].result;
+        if (fd < 0 || ops[i * 2 + 1].result < 0) {
+            continue;
+        }
+        size_t size = ops[i * 2 + 1].size;
+        files[i].data = xmalloc(size + 1);
+        files[i].len = size;
+        reads[nreads].kind = URING_READ;
+        reads[nreads].fd = fd;
+        reads[nreads].buf = files[i].data;
+        reads[nreads].len = size;
+        reads[nreads].offset = 0;
+        reads[nreads].tag = i;
+        nreads++;
+    }
+    io_counters.enter += uring_run(io_ring(), reads, nreads);
+    io_counters.read += nreads;
+    io_counters.ring_ops += nreads;
+
+    for (size_t r = 0; r < nreads; r++) {
+        IoFile *f = &files[reads[r].tag];
+        bool ok = reads[r].result >= 0 && finish_short_io(&reads[r], false, f->len);
+        if (!ok) {
+            xfree(f->data);
+            f->data = NULL;
+            f->len = 0;
+            continue;
+        }
+        f->data[f->len] = '\0';
+        f->ok = true;
+        io_counters.bytes_read += f->len;
+    }
+
+    int *fds = xmalloc(count * sizeof(int));
+    for (size_t i = 0; i < count; i++) {
+        fds[i] = ops[i * 2].result;
+    }
+    uring_close_fds(fds, count);
+    xfree(fds);
+    xfree(reads);
+    xfree(ops);
+}
+
+static void uring_write_batch(IoFile *files, size_t count) {
+    UringOp *ops = xmalloc(count * sizeof(UringOp));
+    memset(ops, 0, count * sizeof(UringOp));
+    for (size_t i = 0; i < count; i++) {
+        ops[i].kind = URING_OPENAT;
+        ops[i].path = files[i].path;
+        ops[i].flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    io_counters.enter += uring_run(io_ring(), ops, count);
+    io_counters.open += count;
+    io_counters.ring_ops += count;
+
+    UringOp *writes = xmalloc(count * sizeof(UringOp));
+    memset(writes, 0, count * sizeof(UringOp));
+    size_t nwrites = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i].result < 0) {
+            continue;
+        }
+        writes[nwrites].kind = URING_WRITE;
+        writes[nwrites].fd = ops[i].result;
+        writes[nwrites].buf = files[i].data;
+        writes[nwrites].len = files[i].len;
+        writes[nwrites].tag = i;
+        nwrites++;
+    }
+    io_counters.enter += uring_run(io_ring(), writes, nwrites);
+    io_counters.write += nwrites;
+    io_counters.ring_ops += nwrites;
+
+    for (size_t w = 0; w < nwrites; w++) {
+        IoFile *f = &files[writes[w].tag];
+        f->ok = writes[w].result >= 0 && finish_short_io(&writes[w], true, f->len);
+        if (f->ok) {
+            io_counters.bytes_written += f->len;
+        }
+    }
+
+    int *fds = xmalloc(count * sizeof(int));
+    for (size_t i = 0; i < count; i++) {
+        fds[i] = ops[i].result;
+    }
+    uring_close_fds(fds, count);
+    xfree(fds);
+    xfree(writes);
+    xfree(ops);
+}
+
+void io_read_batch(IoFile *files, size_t count) {
+    uint64_t start = io_now_ns();
+    for (size_t i = 0; i < count; i++) {
+        files[i].data = NULL;
+        files[i].len = 0;
+        files[i].ok = false;
+    }
+    if (io_backend() == IO_BACKEND_URING && count > 0) {
+        uring_read_batch(files, count);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            files[i].data = io_read_whole(files[i].path, &files[i].len);
+            files[i].ok = files[i].data != NULL;
+        }
+    }
+    io_counters.ns += io_now_ns() - start;
+}
+
+/* Outputs already holding their bytes are skipped; the rest are written to
+ * temporary files in one batch and renamed into place. */
+void io_write_batch(IoFile *files, size_t count) {
+    uint64_t start = io_now_ns();
+    IoFile *temps = xmalloc((count > 0 ? count : 1) * sizeof(IoFile));
+    size_t *file_of = xmalloc((count > 0 ? count : 1) * sizeof(size_t));
+    size_t ntemps = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *data = files[i].data ? files[i].data : "";
+        if (archive_claims(files[i].path)) {
+            files[i].ok = archive_add(files[i].path, data, files[i].len);
+            continue;
+        }
+        if (io_same_contents(files[i].path, data, files[i].len)) {
+            files[i].ok = true;
+            io_note_output(files[i].path, false);
+            continue;
+        }
+        char tmp[MAX_PATH_LEN + 64];
+        io_temp_path(files[i].path, tmp, sizeof(tmp));
+        temps[ntemps].path = xstrdup(tmp);
+        temps[ntemps].data = (char *)data;
+        temps[ntemps].len = files[i].len;
+        temps[ntemps].ok = false;
+        file_of[ntemps++] = i;
+    }
+
+    if (io_backend() == IO_BACKEND_URING && ntemps > 0) {
+        uring_write_batch(temps, ntemps);
+    } else {
+        for (size_t t = 0; t < ntemps; t++) {
+            temps[t].ok = io_write_whole(temps[t].path, temps[t].data, temps[t].len);
+        }
+    }
+
+    for (size_t t = 0; t < ntemps; t++) {
+        IoFile *f = &files[file_of[t]];
+        f->ok = temps[t].ok && rename(temps[t].path, f->path) == 0;
+        if (f->ok) {
+            io_note_output(f->path, true);
+        } else {
+            unlink(temps[t].path);
+        }
+        xfree((char *)temps[t].path);
+    }
+    xfree(temps);
+    xfree(file_of);
+    io_counters.ns += io_now_ns() - start;
+}
@@ -0,0 +1,287 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Streamed file I/O for outputs too large to assemble in memory, whole-file
+ * hashing, and copying assets. Writes publish the same way io.c does:
+ * through a temporary file, and only when the bytes change. */
+
+/* A created stream writes to a temporary file and compares what it writes
+ * with the existing output (old) as it goes; close renames the temporary
+ * into place, or drops it when the output turned out identical. */
+struct IoStream {
+    FILE *f;
+    bool ok;
+    char *path;
+    char *tmp;
+    FILE *old;
+    bool same;
+    StrBuf archived;
+    bool to_archive;
+};
+
+static IoStream *io_stream_open_mode(const char *path, const char *mode) {
+    uint64_t start = io_now_ns();
+    FILE *f = fopen(path, mode);
+    io_counters.open++;
+    io_counters.ns += io_now_ns() - start;
+    if (!f) {
+        return NULL;
+    }
+    IoStream *s = xmalloc(sizeof(IoStream));
+    memset(s, 0, sizeof(*s));
+    s->f = f;
+    s->ok = true;
+    return s;
+}
+
+/* Buffered sequential writer for outputs too large to assemble in memory.
+ * An archived output is collected in memory instead, since archive members
+ * are written whole. */
+IoStream *io_stream_create(const char *path) {
+    if (archive_claims(path)) {
+        IoStream *s = xmalloc(sizeof(IoStream));
+        memset(s, 0, sizeof(*s));
+        s->ok = true;
+        s->path = xstrdup(path);
+        s->to_archive = true;
+        return s;
+    }
+    char tmp[MAX_PATH_LEN + 64];
+    io_temp_path(path, tmp, sizeof(tmp));
+    IoStream *s = io_stream_open_mode(tmp, "wb");
+    if (!s) {
+        return NULL;
+    }
+    s->path = xstrdup(path);
+    s->tmp = xstrdup(tmp);
+    s->old = fopen(path, "rb");
+    io_counters.open++;
+    s->same = s->old != NULL;
+    return s;
+}
+
+IoStream *io_stream_open(const char *path) {
+    return io_stream_open_mode(path, "rb");
+}
+
+/* Reads the next len bytes of the existing output and compares them. */
+static void stream_compare(IoStream *s, const char *data, size_t len) {
+    char buf[65536];
+    while (s->same && len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        size_t got = fread(buf, 1, want, s->old);
+        io_counters.read++;
+        io_counters.bytes_read += got;
+        s->same = got == want && memcmp(buf, data, want) == 0;
+        data += want;
+        len -= want;
+    }
+}
+
+bool io_stream_write(IoStream *s, const char *data, size_t len) {
+    if (s->to_archive) {
+        sb_append_n(&s->archived, data, len);
+        return true;
+    }
+    uint64_t start = io_now_ns();
+    if (s->old) {
+        stream_compare(s, data, len);
+    }
+    if (s->ok && len > 0) {
+        s->ok = fwrite(data, 1, len, s->f) == len;
+        io_counters.write++;
+        io_counters.bytes_written += len;
+    }
+    io_counters.ns += io_now_ns() - start;
+    return s->ok;
+}
+
+/* Reads one line without its newline into *line, growing it through
+ * xrealloc so the buffer can be released with xfree; false at end of file. */
+bool io_stream_read_line(IoStream *s, char **line, size_t *cap) {
+    uint64_t start = io_now_ns();
+    size_t len = 0;
+    bool got = false;
+    for (;;) {
+        if (!*line || *cap - len < 2) {
+            *cap = *cap < 128 ? 256 : *cap * 2;
+            *line = xrealloc(*line, *cap);
+        }
+        if (!fgets(*line + len, (int)(*cap - len), s->f)) {
+            break;
+        }
+        got = true;
+        len += strlen(*line + len);
+        if (len > 0 && (*line)[len - 1] == '\n') {
+            (*line)[--len] = '\0';
+            io_counters.bytes_read++;
+            break;
+        }
+    }
+    io_counters.read++;
+    io_counters.bytes_read += len;
+    io_counters.ns += io_now_ns() - start;
+    return got;
+}
+
+bool io_stream_close(IoStream *s) {
+    if (s->to_archive) {
+        bool ok = archive_add(s->path, s->archived.data ? s->archived.data : "", s->archived.len);
+        xfree(s->archived.data);
+        xfree(s->path);
+        xfree(s);
+        return ok;
+    }
+    uint64_t start = io_now_ns();
+    bool ok = s->ok && !ferror(s->f);
+    if (fclose(s->f) != 0) {
+        ok = false;
+    }
+    io_counters.close++;
+    if (s->old) {
+        s->same = s->same && fgetc(s->old) == EOF;
+        fclose(s->old);
+        io_counters.close++;
+    }
+    if (s->tmp) {
+        bool keep_old = ok && s->same;
+        if (keep_old || !ok || rename(s->tmp, s->path) != 0) {
+            unlink(s->tmp);
+            ok = keep_old;
+        }
+        if (ok) {
+            io_note_output(s->path, !keep_old);
+        }
+    }
+    io_counters.ns += io_now_ns() - start;
+    xfree(s->path);
+    xfree(s->tmp);
+    xfree(s);
+    return ok;
+}
+
+bool hash_file(const char *path, uint64_t *out) {
+    uint64_t start = io_now_ns();
+    FILE *f = fopen(path, "rb");
+    io_counters.open++;
+    if (!f) {
+        io_counters.ns += io_now_ns() - start;
+        return false;
+    }
+    char buf[65536];
+    uint64_t h = HASH_SEED;
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        io_counters.read++;
+        io_counters.bytes_read += n;
+        h = hash_update(h, buf, n);
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    io_counters.close++;
+    io_counters.ns += io_now_ns() - start;
+    *out = h;
+    return ok;
+}
+
+/* Streams src against dst; true when dst exists with the same bytes. */
+static bool same_file_contents(const char *src, const char *dst) {
+    struct stat a;
+    struct stat b;
+    io_counters.stat += 2;
+    if (stat(src, &a) != 0 || stat(dst, &b) != 0 || !S_ISREG(b.st_mode) || a.st_size != b.st_size) {
+        return false;
+    }
+    FILE *fa = fopen(src, "rb");
+    FILE *fb = fopen(dst, "rb");
+    io_counters.open += 2;
+    bool same = fa && fb;
+    char buf_a[8192];
+    char buf_b[8192];
+    while (same) {
+        size_t na = fread(buf_a, 1, sizeof(buf_a), fa);
+        size_t nb = fread(buf_b, 1, sizeof(buf_b), fb);
+        io_counters.read += 2;
+        io_counters.bytes_read += na + nb;
+        same = na == nb && memcmp(buf_a, buf_b, na) == 0 && !ferror(fa) && !ferror(fb);
+        if (na < sizeof(buf_a)) {
+            break;
+        }
+    }
+    if (fa) {
+        fclose(fa);
+        io_counters.close++;
+    }
+    if (fb) {
+        fclose(fb);
+        io_counters.close++;
+    }
+    return same;
+}
+
+/* Copies through a temporary file, leaving dst alone when it already matches. */
+bool copy_file(const char *src, const char *dst) {
+    if (archive_claims(dst)) {
+        return archive_add_file(dst, src);
+    }
+    uint64_t start = io_now_ns();
+    if (same_file_contents(src, dst)) {
+        io_note_output(dst, false);
+        io_counters.ns += io_now_ns() - start;
+        return true;
+    }
+    FILE *in = fopen(src, "rb");
+    io_counters.open++;
+    if (!in) {
+        io_counters.ns += io_now_ns() - start;
+        return false;
+    }
+    char tmp[MAX_PATH_LEN + 64];
+    io_temp_path(dst, tmp, sizeof(tmp));
+    FILE *out = fopen(tmp, "wb");
+    io_counters.open++;
+    if (!out) {
+        fclose(in);
+        io_counters.close++;
+        io_counters.ns += io_now_ns() - start;
+        return false;
+    }
+
+    char buf[8192];
+    bool ok = true;
+    while (!feof(in)) {
+        size_t n = fread(buf, 1, sizeof(buf), in);
+        io_counters.read++;
+        if (ferror(in)) {
+            ok = false;
+            break;
+        }
+        io_counters.bytes_read += n;
+        if (n > 0 && fwrite(buf, 1, n, out) != n) {
+            ok = false;
+            break;
+        }
+        io_counters.write += n > 0 ? 1 : 0;
+        io_counters.bytes_written += n;
+    }
+
+    fclose(in);
+    if (fclose(out) != 0) {
+        ok = false;
+    }
+    io_counters.close += 2;
+    ok = ok && rename(tmp, dst) == 0;
+    if (ok) {
+        io_note_output(dst, true);
+    } else {
+        unlink(tmp);
+    }
+    io_counters.ns += io_now_ns() - start;
+    return ok;
+}
@@ -0,0 +1,304 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JSON_MAX_DEPTH 64
+
+/* A small reader for the JSON files defsite itself writes (reports,
+ * manifests); it accepts standard JSON and keeps object keys in order. */
+typedef struct {
+    const char *src;
+    size_t pos;
+    bool failed;
+} JsonReader;
+
+static JsonValue *json_new(JsonType type) {
+    JsonValue *v = xmalloc(sizeof(JsonValue));
+    memset(v, 0, sizeof(*v));
+    v->type = type;
+    return v;
+}
+
+static void skip_ws(JsonReader *r) {
+    for (;;) {
+        char c = r->src[r->pos];
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+            return;
+        }
+        r->pos++;
+    }
+}
+
+static void append_utf8(StrBuf *b, unsigned long cp) {
+    char out[4];
+    size_t n;
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        n = 2;
+    } else if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        n = 3;
+    } else {
+        out[0] = (char)(0xF0 | (cp >> 18));
+        out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (cp & 0x3F));
+        n = 4;
+    }
+    sb_append_n(b, out, n);
+}
+
+static bool read_hex4(JsonReader *r, unsigned long *out) {
+    unsigned long v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = r->src[r->pos++];
+        v <<= 4;
+        if (c >= '0' && c <= '9') {
+            v |= (unsigned long)(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            v |= (unsigned long)(c - 'a' + 10);
+        } else if (c >= 'A' && c <= 'F') {
+            v |= (unsigned long)(c - 'A' + 10);
+        } else {
+            return false;
+        }
+    }
+    *out = v;
+    return true;
+}
+
+/* Reads a string starting at the opening quote; returns NULL on error. */
+static char *read_string(JsonReader *r) {
+    StrBuf b = {0};
+    sb_append(&b, "");
+    r->pos++;
+    for (;;) {
+        char c = r->src[r->pos++];
+        if (c == '"') {
+            return b.data;
+        }
+        if (c == '\0' || (unsigned char)c < 0x20) {
+            break;
+        }
+        if (c != '\\') {
+            sb_append_n(&b, &c, 1);
+            continue;
+        }
+        char e = r->src[r->pos++];
+        unsigned long cp = 0;
+        switch (e) {
+        case '"': sb_append(&b, "\""); break;
+        case '\\': sb_append(&b, "\\"); break;
+        case '/': sb_append(&b, "/"); break;
+        case 'b': sb_append(&b, "\b"); break;
+        case 'f': sb_append(&b, "\f"); break;
+        case 'n': sb_append(&b, "\n"); break;
+        case 'r': sb_append(&b, "\r"); break;
+        case 't': sb_append(&b, "\t"); break;
+        case 'u':
+            if (!read_hex4(r, &cp)) {
+                xfree(b.data);
+                return NULL;
+            }
+            if (cp >= 0xD800 && cp < 0xDC00 && r->src[r->pos] == '\\' && r->src[r->pos + 1] == 'u') {
+                unsigned long low = 0;
+                r->pos += 2;
+                if (!read_hex4(r, &low) || low < 0xDC00 || low > 0xDFFF) {
+                    xfree(b.data);
+                    return NULL;
+                }
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            }
+            append_utf8(&b, cp);
+            break;
+        default:
+            xfree(b.data);
+            return NULL;
+        }
+    }
+    xfree(b.data);
+    return NULL;
+}
+
+static void container_push(JsonValue *v, char *key, JsonValue *item) {
+    if (v->count == v->cap) {
+        v->cap = v->cap == 0 ? 8 : v->cap * 2;
+        v->items = xrealloc(v->items, v->cap * sizeof(JsonValue *));
+        if (v->type == JSON_OBJECT) {
+            v->keys = xrealloc(v->keys, v->cap * sizeof(char *));
+        }
+    }
+    if (v->type == JSON_OBJECT) {
+        v->keys[v->count] = key;
+    }
+    v->items[v->count++] = item;
+}
+
+static JsonValue *read_value(JsonReader *r, int depth);
+
+static JsonValue *read_container(JsonReader *r, int depth, bool is_object) {
+    JsonValue *v = json_new(is_object ? JSON_OBJECT : JSON_ARRAY);
+    char close = is_object ? '}' : ']';
+    r->pos++;
+    skip_ws(r);
+    if (r->src[r->pos] == close) {
+        r->pos++;
+        return v;
+    }
+    for (;;) {
+        char *key = NULL;
+        if (is_object) {
+            skip_ws(r);
+            if (r->src[r->pos] != '"' || !(key = read_string(r))) {
+                break;
+            }
+            skip_ws(r);
+            if (r->src[r->pos++] != ':') {
+                xfree(key);
+                break;
+            }
+        }
+        JsonValue *item = read_value(r, depth + 1);
+        if (!item) {
+            xfree(key);
+            break;
+        }
+        container_push(v, key, item);
+        skip_ws(r);
+        char c = r->src[r->pos++];
+        if (c == close) {
+            return v;
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+    r->failed = true;
+    json_free(v);
+    return NULL;
+}
+
+static bool match_word(JsonReader *r, const char *word) {
+    size_t n = strlen(word);
+    if (strncmp(r->src + r->pos, word, n) != 0) {
+        return false;
+    }
+    r->pos += n;
+    return true;
+}
+
+static JsonValue *read_value(JsonReader *r, int depth) {
+    if (depth > JSON_MAX_DEPTH) {
+        return NULL;
+    }
+    skip_ws(r);
+    char c = r->src[r->pos];
+    if (c == '{' || c == '[') {
+        return read_container(r, depth, c == '{');
+    }
+    if (c == '"') {
+        char *s = read_string(r);
+        if (!s) {
+            return NULL;
+        }
+        JsonValue *v = json_new(JSON_STRING);
+        v->string = s;
+        return v;
+    }
+    if (match_word(r, "true") || match_word(r, "false")) {
+        JsonValue *v = json_new(JSON_BOOL);
+        v->boolean = c == 't';
+        return v;
+    }
+    if (match_word(r, "null")) {
+        return json_new(JSON_NULL);
+    }
+    if (c == '-' || (c >= '0' && c <= '9')) {
+        char *end = NULL;
+        double n = strtod(r->src + r->pos, &end);
+        if (end == r->src + r->pos) {
+            return NULL;
+        }
+        r->pos = (size_t)(end - r->src);
+        JsonValue *v = json_new(JSON_NUMBER);
+        v->number = n;
+        return v;
+    }
+    return NULL;
+}
+
+/* Parses a whole document; returns NULL (with *error_offset set when given)
+ * on malformed input or trailing data. */
+JsonValue *json_parse(const char *text, size_t *error_offset) {
+    JsonReader r = {text, 0, false};
+    JsonValue *v = read_value(&r, 0);
+    skip_ws(&r);
+    if (v && text[r.pos] != '\0') {
+        json_free(v);
+        v = NULL;
+    }
+    if (!v && error_offset) {
+        *error_offset = r.pos;
+    }
+    return v;
+}
+
+JsonValue *json_read_file(const char *path, BuildCtx *ctx) {
+    char *text = read_file(path);
+    if (!text) {
+        return NULL;
+    }
+    size_t offset = 0;
+    JsonValue *v = json_parse(text, &offset);
+    if (!v) {
+        log_error(ctx, "malformed JSON in %s at byte %zu", path, offset);
+    }
+    xfree(text);
+    return v;
+}
+
+const JsonValue *json_get(const JsonValue *obj, const char *key) {
+    if (!obj || obj->type != JSON_OBJECT) {
+        return NULL;
+    }
+    for (size_t i = 0; i < obj->count; i++) {
+        if (str_eq(obj->keys[i], key)) {
+            return obj->items[i];
+        }
+    }
+    return NULL;
+}
+
+const char *json_get_string(const JsonValue *obj, const char *key) {
+    const JsonValue *v = json_get(obj, key);
+    return v && v->type == JSON_STRING ? v->string : "";
+}
+
+double json_get_number(const JsonValue *obj, const char *key) {
+    const JsonValue *v = json_get(obj, key);
+    return v && v->type == JSON_NUMBER ? v->number : 0.0;
+}
+
+void json_free(JsonValue *v) {
+    if (!v) {
+        return;
+    }
+    for (size_t i = 0; i < v->count; i++) {
+        json_free(v->items[i]);
+        if (v->keys) {
+            xfree(v->keys[i]);
+        }
+    }
+    xfree(v->items);
+    xfree(v->keys);
+    xfree(v->string);
+    xfree(v);
+}
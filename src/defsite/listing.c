@@ -0,0 +1,438 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef DEFSITE_COMPILER_ID
+#define DEFSITE_COMPILER_ID "dev"
+#endif
+
+#define LISTING_SUFFIX ".listing.html"
+#define LISTING_STATE_NAME ".defsite-listings"
+#define LISTING_STATE_VERSION "defsite-listings 1"
+
+/* Static listing pages: a template `NAME.listing.html` holding one
+ * <listing card="TAG" ...> element is compiled once per page of discovery
+ * records, with the <listing> replaced by a <TAG> invocation per record.
+ * They are built after the discovery index, from its records, and a page
+ * is only recompiled when its key (template, settings and the records on
+ * it) differs from the one saved in .defsite-listings. */
+
+static struct {
+    StringStack templates;
+    bool scanned;
+} state;
+
+bool listing_is_template(const char *path) {
+    size_t len = strlen(path);
+    size_t suffix = strlen(LISTING_SUFFIX);
+    return len > suffix && str_eq(path + len - suffix, LISTING_SUFFIX);
+}
+
+static void scan_templates(const char *dir_path) {
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (str_eq(entry->d_name, ".") || str_eq(entry->d_name, "..")) {
+            continue;
+        }
+        char full[MAX_PATH_LEN];
+        snprintf(full, sizeof(full), "%s/%s", dir_path, entry->d_name);
+        struct stat st;
+        if (stat(full, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            scan_templates(full);
+        } else if (listing_is_template(full)) {
+            strstack_push(&state.templates, full);
+        }
+    }
+    closedir(dir);
+}
+
+static int cmp_str_ptr(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+bool listing_find(const char *src_dir) {
+    if (!state.scanned) {
+        scan_templates(src_dir);
+        qsort(state.templates.items, state.templates.count, sizeof(char *), cmp_str_ptr);
+        state.scanned = true;
+    }
+    return state.templates.count > 0;
+}
+
+/* ---- templates ---- */
+
+/* Finds the one <listing> outside def-* bodies and swaps it for a default
+ * <slot>, which the cards are bound into like a collection row's slot. */
+static Node *take_listing(Node *node, BuildCtx *ctx) {
+    Node *found = NULL;
+    for (size_t i = 0; i < node->child_count; i++) {
+        Node *child = node->children[i];
+        if (child->type != NODE_ELEMENT || is_def_tag(child->tag)) {
+            continue;
+        }
+        Node *inner = NULL;
+        if (str_eq(child->tag, "listing")) {
+            inner = child;
+            Node *slot = node_new_element("slot");
+            slot->parent = node;
+            node->children[i] = slot;
+            child->parent = NULL;
+        } else {
+            inner = take_listing(child, ctx);
+        }
+        if (inner && found) {
+            log_error(ctx, "a listing template holds one <listing>");
+            node_free(inner);
+        } else if (inner) {
+            found = inner;
+        }
+    }
+    return found;
+}
+
+/* Path from the listing's directory (rel_dir, "" or ending in '/') to a
+ * record's URL. */
+static void append_href(StrBuf *b, const char *rel_dir, const char *url) {
+    if (starts_with(url, rel_dir)) {
+        sb_append(b, url + strlen(rel_dir));
+        return;
+    }
+    for (const char *p = rel_dir; *p; p++) {
+        if (*p == '/') {
+            sb_append(b, "../");
+        }
+    }
+    sb_append(b, url);
+}
+
+/* STEM[-GROUP][-PAGE].html; page 1 has no number. */
+static char *page_name(const char *stem, const ListingGroup *g, size_t page) {
+    StrBuf b = {0};
+    sb_append(&b, stem);
+    if (g->slug[0]) {
+        sb_append(&b, "-");
+        sb_append(&b, g->slug);
+    }
+    if (page > 1) {
+        char number[32];
+        snprintf(number, sizeof(number), "-%zu", page);
+        sb_append(&b, number);
+    }
+    sb_append(&b, ".html");
+    return b.data;
+}
+
+static void set_number(Node *n, const char *name, size_t value) {
+    char text[32];
+    snprintf(text, sizeof(text), "%zu", value);
+    node_add_attr(n, name, text);
+}
+
+static void hash_attrs(uint64_t *h, const Node *n) {
+    *h = hash_update(*h, n->tag, strlen(n->tag) + 1);
+    for (size_t i = 0; i < n->attr_count; i++) {
+        *h = hash_update(*h, n->attrs[i].name, strlen(n->attrs[i].name) + 1);
+        *h = hash_update(*h, n->attrs[i].value ? n->attrs[i].value : "", strlen(n->attrs[i].value ? n->attrs[i].value : "") + 1);
+    }
+}
+
+typedef struct {
+    StrMap previous; /* output path -> saved key */
+    StrBuf next;
+    uint64_t settings;
+    bool reuse;
+    size_t written;
+    size_t unchanged;
+} ListingRun;
+
+static bool file_exists(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* `index` writes into an output tree the build may not have made yet. */
+static bool ensure_out_dirs(const char *out_dir, const char *rel_dir) {
+    char dir[MAX_PATH_LEN * 2];
+    size_t base = (size_t)snprintf(dir, sizeof(dir), "%s/", out_dir);
+    snprintf(dir + base, sizeof(dir) - base, "%s", rel_dir);
+    for (char *p = dir + base; *p; p++) {
+        if (*p != '/') {
+            continue;
+        }
+        *p = '\0';
+        int rc = ensure_dir(dir);
+        *p = '/';
+        if (rc != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void build_template(const char *template_path, const char *src_dir, const char *out_dir,
+                           const DiscoveryRecord *records, size_t count, ListingRun *run, BuildCtx *ctx) {
+    const char *rel = template_path + strlen(src_dir);
+    rel += *rel == '/';
+    const char *slash = strrchr(rel, '/');
+    int dir_len = slash ? (int)(slash - rel) + 1 : 0;
+    char rel_dir[MAX_PATH_LEN];
+    snprintf(rel_dir, sizeof(rel_dir), "%.*s", dir_len, rel);
+    char stem[MAX_PATH_LEN];
+    const char *base = rel + dir_len;
+    snprintf(stem, sizeof(stem), "%.*s", (int)(strlen(base) - strlen(LISTING_SUFFIX)), base);
+
+    char *source = read_file(template_path);
+    if (!source) {
+        log_error(ctx, "failed to read %s", template_path);
+        return;
+    }
+    const char *prev_file = ctx->current_file;
+    ctx->current_file = template_path;
+    Node *doc = domcache_parse(source, ctx);
+    Node *listing = take_listing(doc, ctx);
+    ListingSpec spec;
+    bool ok = listing != NULL;
+    if (!listing) {
+        log_error(ctx, "listing template has no <listing> element");
+    } else {
+        ok = listing_read_spec(listing, &spec, ctx);
+    }
+    ctx->current_file = prev_file;
+    if (!ok) {
+        node_free(listing);
+        node_free(doc);
+        xfree(source);
+        return;
+    }
+
+    ListingGroupList groups;
+    listing_select(&spec, records, count, template_path, stem, &groups, ctx);
+
+    const BuildOptions *opts = ctx->opts;
+    bool quiet = opts && opts->quiet;
+    uint64_t template_hash = hash_update(run->settings, source, strlen(source));
+    for (size_t gi = 0; gi < groups.count; gi++) {
+        const ListingGroup *g = &groups.items[gi];
+        size_t per_page = spec.per_page > 0 ? (size_t)spec.per_page : (g->count ? g->count : 1);
+        size_t pages = g->count ? (g->count + per_page - 1) / per_page : 1;
+        for (size_t page = 1; page <= pages; page++) {
+            char url[MAX_PATH_LEN * 2];
+            char src_path[MAX_PATH_LEN * 3];
+            char out_path[MAX_PATH_LEN * 4];
+            char *name = page_name(stem, g, page);
+            snprintf(url, sizeof(url), "%s%s", rel_dir, name);
+            xfree(name);
+            snprintf(src_path, sizeof(src_path), "%s/%s", src_dir, url);
+            snprintf(out_path, sizeof(out_path), "%s/%s", out_dir, url);
+            if (!shard_owns(opts, url)) {
+                continue;
+            }
+            if (file_exists(src_path)) {
+                log_error(ctx, "listing %s would replace the source page %s", template_path, src_path);
+                continue;
+            }
+
+            /* The page's own values, bound like a collection row. */
+            Node *fields = node_new_element("listing");
+            if (g->value[0]) {
+                node_add_attr(fields, "group", g->value);
+            }
+            set_number(fields, "page", page);
+            set_number(fields, "pages", pages);
+            set_number(fields, "total", g->count);
+            char *first_name = page_name(stem, g, 1);
+            char *prev_name = page_name(stem, g, page - 1);
+            char *next_name = page_name(stem, g, page + 1);
+            node_add_attr(fields, "first", first_name);
+            node_add_attr(fields, "prev", page > 1 ? prev_name : "");
+            node_add_attr(fields, "next", page < pages ? next_name : "");
+            xfree(first_name);
+            xfree(prev_name);
+            xfree(next_name);
+
+            size_t first = (page - 1) * per_page;
+            size_t last = first + per_page < g->count ? first + per_page : g->count;
+            set_number(fields, "count", last - first);
+            SlotPayload payload = {0};
+            uint64_t key = template_hash;
+            hash_attrs(&key, fields);
+            for (size_t i = first; i < last; i++) {
+                const DiscoveryRecord *r = g->items[i];
+                Node *card = node_new_element(spec.card);
+                StrBuf href = {0};
+                append_href(&href, rel_dir, r->url);
+                node_add_attr(card, "href", href.data);
+                xfree(href.data);
+                for (size_t m = 0; m < r->meta_count; m++) {
+                    if (!str_eq(r->meta[m].key, "href")) {
+                        node_add_attr(card, r->meta[m].key, r->meta[m].value);
+                    }
+                }
+                hash_attrs(&key, card);
+                nodelist_push(&payload.default_nodes, card);
+            }
+
+            char key_text[17];
+            snprintf(key_text, sizeof(key_text), "%016llx", (unsigned long long)key);
+            const char *saved = strmap_get(&run->previous, url);
+            bool same = saved && str_eq(saved, key_text);
+            if (saved) {
+                /* Still produced: not stale. */
+                xfree(strmap_put(&run->previous, url, NULL));
+            }
+            sb_append(&run->next, key_text);
+            sb_append(&run->next, "\t");
+            sb_append(&run->next, url);
+            sb_append(&run->next, "\n");
+            if (run->reuse && same && file_exists(out_path)) {
+                run->unchanged++;
+                slotpayload_free(&payload);
+                node_free(fields);
+                continue;
+            }
+
+            ctx->current_file = src_path;
+            profile_begin();
+            StrBuf out = {0};
+            compile_collection_row(doc, fields, &payload, &out, ctx);
+            profile_end("page", url, NULL);
+            stats_page(url, strlen(source), out.len);
+            ctx->current_file = prev_file;
+            slotpayload_free(&payload);
+            node_free(fields);
+
+            IoFile file = {out_path, out.data ? out.data : xstrdup(""), out.len, false};
+            if (ensure_out_dirs(out_dir, rel_dir)) {
+                io_write_batch(&file, 1);
+            }
+            if (!file.ok) {
+                log_error(ctx, "failed to write %s", out_path);
+                xfree(file.data);
+                continue;
+            }
+            run->written++;
+            if (!quiet) {
+                printf("Processed: %s -> %s\n", template_path, out_path);
+            }
+            compress_submit(out_path, file.data, file.len);
+        }
+    }
+
+    listing_groups_free(&groups);
+    node_free(listing);
+    node_free(doc);
+    xfree(source);
+}
+
+static void load_state(const char *path, ListingRun *run) {
+    char *text = read_file(path);
+    if (!text) {
+        return;
+    }
+    char *line = text;
+    char *next = strchr(line, '\n');
+    if (!next || strncmp(line, LISTING_STATE_VERSION, (size_t)(next - line)) != 0) {
+        xfree(text);
+        return;
+    }
+    for (line = next + 1; *line; line = next) {
+        next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        } else {
+            next = line + strlen(line);
+        }
+        char *tab = strchr(line, '\t');
+        if (tab) {
+            *tab = '\0';
+            strmap_put(&run->previous, tab + 1, xstrdup(line));
+        }
+    }
+    xfree(text);
+}
+
+/* Deletes the pages an earlier run wrote that no template produces now,
+ * e.g. after a group shrank or a template was removed. A path that is now
+ * an ordinary source page is left alone. */
+static void remove_stale(const char *src_dir, const char *out_dir, const ListingRun *run, BuildCtx *ctx) {
+    size_t removed = 0;
+    for (size_t i = 0; i < run->previous.cap; i++) {
+        const StrMapEntry *e = &run->previous.slots[i];
+        if (!e->key || !e->value) {
+            continue;
+        }
+        char path[MAX_PATH_LEN * 2];
+        snprintf(path, sizeof(path), "%s/%s", src_dir, e->key);
+        if (file_exists(path)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", out_dir, e->key);
+        if (unlink(path) == 0) {
+            removed++;
+        } else if (errno != ENOENT) {
+            log_warning(ctx, "failed to remove stale listing page %s: %s", path, strerror(errno));
+        }
+    }
+    if (removed > 0) {
+        fprintf(stderr, "Removed %zu stale listing page(s)\n", removed);
+    }
+}
+
+/* Builds every listing template's pages from the discovery records. */
+void listing_build(const char *src_dir, const char *out_dir, const DiscoveryRecord *records, size_t count, BuildCtx *ctx) {
+    const BuildOptions *opts = ctx->opts;
+    ListingRun run;
+    memset(&run, 0, sizeof(run));
+    strmap_init(&run.previous);
+    /* Everything besides the template and records that changes the pages. */
+    char settings[256];
+    snprintf(settings,
+             sizeof(settings),
+             "%s\x1f%s\x1fminify=%d:%d\x1f" "fingerprint=%d",
+             LISTING_STATE_VERSION,
+             DEFSITE_COMPILER_ID,
+             opts ? opts->minify : 0,
+             opts ? opts->keep_comments : 0,
+             opts ? opts->fingerprint : 0);
+    run.settings = hash_update(hash_str(settings), &(uint64_t){fingerprint_digest()}, sizeof(uint64_t));
+    /* Full-text terms are collected while a page compiles, and an archive
+     * only holds what this run writes, so those rebuild every page. */
+    run.reuse = !(opts && (opts->fulltext || opts->archive_path));
+
+    char state_path[MAX_PATH_LEN * 2];
+    snprintf(state_path, sizeof(state_path), "%s/%s", out_dir, LISTING_STATE_NAME);
+    load_state(state_path, &run);
+    sb_append(&run.next, LISTING_STATE_VERSION "\n");
+
+    int errors_before = ctx->error_count;
+    profile_begin();
+    for (size_t i = 0; i < state.templates.count; i++) {
+        build_template(state.templates.items[i], src_dir, out_dir, records, count, &run, ctx);
+    }
+    profile_end("phase", "listings", NULL);
+    /* A template that failed may not have produced all of its pages. */
+    if (ctx->error_count == errors_before) {
+        remove_stale(src_dir, out_dir, &run, ctx);
+    }
+
+    if (!write_file_n(state_path, run.next.data, run.next.len)) {
+        log_warning(ctx, "failed to write listing state %s", state_path);
+    }
+    fprintf(stderr, "Generated %zu listing page(s), %zu unchanged\n", run.written, run.unchanged);
+    xfree(run.next.data);
+    strmap_free(&run.previous, xfree);
+}
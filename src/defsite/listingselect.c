@@ -0,0 +1,222 @@
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Which discovery records a listing template shows and in what order:
+ * its <listing> settings, the kind filter, the sort and the group-by
+ * split. The pages themselves are rendered by listing.c. */
+
+static const char *meta_get(const DiscoveryRecord *r, const char *key) {
+    for (size_t i = 0; i < r->meta_count; i++) {
+        if (str_eq(r->meta[i].key, key)) {
+            return r->meta[i].value;
+        }
+    }
+    return NULL;
+}
+
+static bool parse_long(const char *s, long *out) {
+    if (!s || !*s) {
+        return false;
+    }
+    char *end = NULL;
+    *out = strtol(s, &end, 10);
+    return *end == '\0';
+}
+
+typedef struct {
+    const char *key;
+    bool descending;
+} SortSpec;
+
+/* qsort takes no context; listing_select sets this before sorting. */
+static SortSpec sort_spec;
+
+/* Records without the key go last; integers compare as numbers. Ties keep
+ * the index's URL order. */
+static int cmp_records(const void *a, const void *b) {
+    const DiscoveryRecord *ra = *(const DiscoveryRecord *const *)a;
+    const DiscoveryRecord *rb = *(const DiscoveryRecord *const *)b;
+    const char *va = meta_get(ra, sort_spec.key);
+    const char *vb = meta_get(rb, sort_spec.key);
+    int cmp = 0;
+    if (!va || !vb) {
+        cmp = va ? -1 : vb ? 1 : 0;
+    } else {
+        long na;
+        long nb;
+        cmp = parse_long(va, &na) && parse_long(vb, &nb) ? (na > nb) - (na < nb) : strcmp(va, vb);
+        if (sort_spec.descending) {
+            cmp = -cmp;
+        }
+    }
+    return cmp ? cmp : strcmp(ra->url, rb->url);
+}
+
+static ListingGroup *group_get(ListingGroupList *groups, StrMap *by_value, const char *value, const char *slug) {
+    void *found = strmap_get(by_value, value);
+    if (found) {
+        return &groups->items[(size_t)(uintptr_t)found - 1];
+    }
+    if (groups->count == groups->cap) {
+        groups->cap = groups->cap == 0 ? 16 : groups->cap * 2;
+        groups->items = xrealloc(groups->items, groups->cap * sizeof(ListingGroup));
+    }
+    ListingGroup *g = &groups->items[groups->count++];
+    memset(g, 0, sizeof(*g));
+    g->value = xstrdup(value);
+    g->slug = xstrdup(slug);
+    strmap_put(by_value, value, (void *)(uintptr_t)groups->count);
+    return g;
+}
+
+static void group_push(ListingGroup *g, const DiscoveryRecord *r) {
+    if (g->count == g->cap) {
+        g->cap = g->cap == 0 ? 16 : g->cap * 2;
+        g->items = xrealloc(g->items, g->cap * sizeof(DiscoveryRecord *));
+    }
+    g->items[g->count++] = r;
+}
+
+void listing_groups_free(ListingGroupList *groups) {
+    for (size_t i = 0; i < groups->count; i++) {
+        xfree(groups->items[i].value);
+        xfree(groups->items[i].slug);
+        xfree(groups->items[i].items);
+    }
+    xfree(groups->items);
+}
+
+static int cmp_groups(const void *a, const void *b) {
+    return strcmp(((const ListingGroup *)a)->value, ((const ListingGroup *)b)->value);
+}
+
+/* Lowercase letters and digits, with runs of anything else as one '-'. */
+static char *group_slug(const char *value) {
+    StrBuf b = {0};
+    bool dash = false;
+    for (const unsigned char *p = (const unsigned char *)value; *p; p++) {
+        if ((*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9')) {
+            if (dash && b.len > 0) {
+                sb_append_n(&b, "-", 1);
+            }
+            sb_append_n(&b, (const char *)p, 1);
+            dash = false;
+        } else if (*p >= 'A' && *p <= 'Z') {
+            char lower = (char)(*p - 'A' + 'a');
+            if (dash && b.len > 0) {
+                sb_append_n(&b, "-", 1);
+            }
+            sb_append_n(&b, &lower, 1);
+            dash = false;
+        } else {
+            dash = true;
+        }
+    }
+    return b.data ? b.data : xstrdup("");
+}
+
+/* Reads the <listing> attributes: card (required), kind, group-by,
+ * per-page and sort (a metadata key, '-' first for descending order). */
+bool listing_read_spec(const Node *listing, ListingSpec *spec, BuildCtx *ctx) {
+    spec->card = node_get_attr(listing, "card");
+    spec->kind = node_get_attr(listing, "kind");
+    spec->group_by = node_get_attr(listing, "group-by");
+    spec->per_page = 0;
+    const char *per_page = node_get_attr(listing, "per-page");
+    const char *sort = node_get_attr(listing, "sort");
+    spec->sort_key = sort && sort[0] == '-' ? sort + 1 : sort;
+    spec->sort_descending = sort && sort[0] == '-';
+    if (!spec->card || !spec->card[0]) {
+        log_error(ctx, "<listing> missing required card attribute");
+        return false;
+    }
+    if (per_page && (!parse_long(per_page, &spec->per_page) || spec->per_page < 1)) {
+        log_error(ctx, "<listing> per-page must be a positive number, got '%s'", per_page);
+        return false;
+    }
+    if (sort && !spec->sort_key[0]) {
+        log_error(ctx, "<listing> sort needs a metadata key");
+        return false;
+    }
+    return true;
+}
+
+/* Picks the records of spec's kind, sorts them, and splits them into one
+ * group per group-by value (a single unnamed group without group-by). The
+ * groups point into records. */
+void listing_select(const ListingSpec *spec, const DiscoveryRecord *records, size_t count, const char *template_path,
+                    const char *stem, ListingGroupList *groups, BuildCtx *ctx) {
+    const DiscoveryRecord **matched = xmalloc((count + 1) * sizeof(DiscoveryRecord *));
+    size_t nmatched = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *kind = meta_get(&records[i], "kind");
+        if (!spec->kind || (kind && str_eq(kind, spec->kind))) {
+            matched[nmatched++] = &records[i];
+        }
+    }
+    if (spec->sort_key) {
+        sort_spec.key = spec->sort_key;
+        sort_spec.descending = spec->sort_descending;
+        qsort(matched, nmatched, sizeof(DiscoveryRecord *), cmp_records);
+    }
+
+    memset(groups, 0, sizeof(*groups));
+    StrMap by_value;
+    strmap_init(&by_value);
+    if (!spec->group_by) {
+        ListingGroup *all = group_get(groups, &by_value, "", "");
+        for (size_t i = 0; i < nmatched; i++) {
+            group_push(all, matched[i]);
+        }
+    } else {
+        StrMap slugs; /* slug -> first value given it */
+        strmap_init(&slugs);
+        for (size_t i = 0; i < nmatched; i++) {
+            const char *field = meta_get(matched[i], spec->group_by);
+            StringStack values = {0};
+            const char *p = field ? field : "";
+            while (*p) {
+                const char *comma = strchr(p, ',');
+                const char *end = comma ? comma : p + strlen(p);
+                while (p < end && *p == ' ') {
+                    p++;
+                }
+                size_t n = (size_t)(end - p);
+                while (n > 0 && p[n - 1] == ' ') {
+                    n--;
+                }
+                StrBuf value = {0};
+                sb_append_n(&value, p, n);
+                if (n > 0 && !strstack_contains(&values, value.data)) {
+                    strstack_push(&values, value.data);
+                }
+                xfree(value.data);
+                p = comma ? comma + 1 : end;
+            }
+            for (size_t k = 0; k < values.count; k++) {
+                char *slug = group_slug(values.items[k]);
+                const char *owner = strmap_get(&slugs, slug);
+                if (!slug[0]) {
+                    log_warning(ctx, "listing %s: %s '%s' on %s has no letters or digits to name a page", template_path,
+                                spec->group_by, values.items[k], matched[i]->url);
+                } else if (owner && !str_eq(owner, values.items[k])) {
+                    log_error(ctx, "listing %s: %s values '%s' and '%s' both name page %s-%s.html", template_path,
+                              spec->group_by, owner, values.items[k], stem, slug);
+                } else {
+                    if (!owner) {
+                        strmap_put(&slugs, slug, xstrdup(values.items[k]));
+                    }
+                    group_push(group_get(groups, &by_value, values.items[k], slug), matched[i]);
+                }
+                xfree(slug);
+            }
+            strstack_free(&values);
+        }
+        strmap_free(&slugs, xfree);
+        qsort(groups->items, groups->count, sizeof(ListingGroup), cmp_groups);
+    }
+    strmap_free(&by_value, NULL);
+    xfree(matched);
+}
@@ -0,0 +1,100 @@
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+uint64_t hash_update(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+uint64_t hash_bytes(const void *data, size_t len) {
+    return hash_update(HASH_SEED, data, len);
+}
+
+uint64_t hash_str(const char *s) {
+    return hash_bytes(s, strlen(s));
+}
+
+void strmap_init(StrMap *map) {
+    map->slots = NULL;
+    map->count = 0;
+    map->cap = 0;
+}
+
+static StrMapEntry *strmap_slot(const StrMap *map, const char *key, uint64_t hash) {
+    size_t mask = map->cap - 1;
+    size_t i = (size_t)hash & mask;
+    for (;;) {
+        StrMapEntry *e = &map->slots[i];
+        if (!e->key || (e->hash == hash && str_eq(e->key, key))) {
+            return e;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static void strmap_grow(StrMap *map) {
+    size_t old_cap = map->cap;
+    StrMapEntry *old = map->slots;
+    map->cap = old_cap == 0 ? 16 : old_cap * 2;
+    map->slots = xmalloc(map->cap * sizeof(StrMapEntry));
+    memset(map->slots, 0, map->cap * sizeof(StrMapEntry));
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].key) {
+            *strmap_slot(map, old[i].key, old[i].hash) = old[i];
+        }
+    }
+    xfree(old);
+}
+
+void *strmap_get(const StrMap *map, const char *key) {
+    if (map->count == 0) {
+        return NULL;
+    }
+    StrMapEntry *e = strmap_slot(map, key, hash_str(key));
+    return e->key ? e->value : NULL;
+}
+
+bool strmap_contains(const StrMap *map, const char *key) {
+    if (map->count == 0) {
+        return false;
+    }
+    return strmap_slot(map, key, hash_str(key))->key != NULL;
+}
+
+/* Inserts or replaces; returns the previous value (NULL if the key was new). */
+void *strmap_put(StrMap *map, const char *key, void *value) {
+    if ((map->count + 1) * 4 > map->cap * 3) {
+        strmap_grow(map);
+    }
+    uint64_t hash = hash_str(key);
+    StrMapEntry *e = strmap_slot(map, key, hash);
+    if (e->key) {
+        void *prev = e->value;
+        e->value = value;
+        return prev;
+    }
+    e->key = xstrdup(key);
+    e->hash = hash;
+    e->value = value;
+    map->count++;
+    return NULL;
+}
+
+void strmap_free(StrMap *map, void (*free_value)(void *)) {
+    for (size_t i = 0; i < map->cap; i++) {
+        if (map->slots[i].key) {
+            xfree(map->slots[i].key);
+            if (free_value) {
+                free_value(map->slots[i].value);
+            }
+        }
+    }
+    xfree(map->slots);
+    strmap_init(map);
+}
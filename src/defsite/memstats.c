@@ -0,0 +1,323 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEM_REPORT_TOP 10
+
+static const char *SUBSYSTEM_NAMES[MEM_SUBSYSTEM_COUNT] = {"other", "parser", "dom", "expand", "serialize", "index"};
+
+/* Page records are kept with plain malloc so the bookkeeping does not count
+ * toward the figures it reports. */
+typedef struct {
+    char *path;
+    size_t allocs;
+    uint64_t bytes;
+    int64_t peak;
+    int64_t retained;
+    bool cached; /* taken from the page cache; nothing was allocated */
+} MemPage;
+
+/* Allocation counts of the calling thread; per-page figures are differences
+ * of these, so allocations made by worker threads do not leak into a page. */
+typedef struct {
+    size_t allocs;
+    uint64_t bytes;
+    int64_t live;
+    int64_t peak;
+} MemThread;
+
+bool mem_accounting = false;
+
+static struct {
+    const char *path;
+    _Atomic size_t allocs;
+    _Atomic size_t frees;
+    _Atomic uint64_t bytes;
+    _Atomic int64_t live;
+    _Atomic int64_t peak;
+    _Atomic size_t sub_allocs[MEM_SUBSYSTEM_COUNT];
+    _Atomic uint64_t sub_bytes[MEM_SUBSYSTEM_COUNT];
+    _Atomic int64_t sub_live[MEM_SUBSYSTEM_COUNT];
+    _Atomic int64_t sub_peak[MEM_SUBSYSTEM_COUNT];
+    pthread_mutex_t page_lock;
+    MemPage *pages;
+    size_t page_count;
+    size_t page_cap;
+} state = {.page_lock = PTHREAD_MUTEX_INITIALIZER};
+
+static _Thread_local MemSubsystem current = MEM_OTHER;
+static _Thread_local MemThread thread;
+/* Counts at mem_page_begin; pages render on pool threads, one per thread
+ * at a time. */
+static _Thread_local MemThread page_start;
+
+void mem_init(const BuildOptions *opts) {
+    if (!opts->mem_stats_path) {
+        return;
+    }
+    state.path = opts->mem_stats_path;
+    mem_accounting = true;
+}
+
+MemSubsystem mem_enter(MemSubsystem subsystem) {
+    MemSubsystem prev = current;
+    current = subsystem;
+    return prev;
+}
+
+void mem_leave(MemSubsystem prev) {
+    current = prev;
+}
+
+size_t mem_block_size(void *ptr) {
+#ifdef __GLIBC__
+    return ptr ? malloc_usable_size(ptr) : 0;
+#else
+    (void)ptr;
+    return 0;
+#endif
+}
+
+static void raise_peak(_Atomic int64_t *peak, int64_t value) {
+    int64_t seen = atomic_load(peak);
+    while (value > seen && !atomic_compare_exchange_weak(peak, &seen, value)) {
+    }
+}
+
+/* While accounting, blocks are allocated one byte larger than asked and
+ * that last usable byte names the subsystem that owns the block, so frees
+ * and resizes are charged to it. Blocks from before accounting started
+ * carry no tag and are charged to "other". */
+#define MEM_TAG_MAGIC 0xa0u
+
+static void tag_block(void *ptr, size_t size) {
+    if (size > 0) {
+        ((unsigned char *)ptr)[size - 1] = (unsigned char)(MEM_TAG_MAGIC | (unsigned)current);
+    }
+}
+
+MemSubsystem mem_block_owner(void *ptr) {
+    size_t size = mem_block_size(ptr);
+    if (size == 0) {
+        return MEM_OTHER;
+    }
+    unsigned tag = ((unsigned char *)ptr)[size - 1];
+    if ((tag & 0xf0u) != MEM_TAG_MAGIC || (tag & 0x0fu) >= MEM_SUBSYSTEM_COUNT) {
+        return MEM_OTHER;
+    }
+    return (MemSubsystem)(tag & 0x0fu);
+}
+
+/* Records a new block, or a resized one that used to be old_size bytes
+ * owned by old_owner. */
+void mem_note_alloc(size_t old_size, MemSubsystem old_owner, void *ptr) {
+    size_t size = mem_block_size(ptr);
+    int64_t delta = (int64_t)size - (int64_t)old_size;
+    uint64_t grown = delta > 0 ? (uint64_t)delta : 0;
+    tag_block(ptr, size);
+
+    atomic_fetch_add(&state.allocs, 1);
+    atomic_fetch_add(&state.bytes, grown);
+    atomic_fetch_add(&state.sub_allocs[current], 1);
+    atomic_fetch_add(&state.sub_bytes[current], grown);
+    int64_t live = atomic_fetch_add(&state.live, delta) + delta;
+    raise_peak(&state.peak, live);
+    if (old_size > 0) {
+        atomic_fetch_sub(&state.sub_live[old_owner], (int64_t)old_size);
+    }
+    int64_t sub_live = atomic_fetch_add(&state.sub_live[current], (int64_t)size) + (int64_t)size;
+    raise_peak(&state.sub_peak[current], sub_live);
+
+    thread.allocs++;
+    thread.bytes += grown;
+    thread.live += delta;
+    if (thread.live > thread.peak) {
+        thread.peak = thread.live;
+    }
+}
+
+void mem_note_free(void *ptr) {
+    int64_t size = (int64_t)mem_block_size(ptr);
+    atomic_fetch_add(&state.frees, 1);
+    atomic_fetch_sub(&state.live, size);
+    atomic_fetch_sub(&state.sub_live[mem_block_owner(ptr)], size);
+    thread.live -= size;
+}
+
+void mem_page_begin(void) {
+    if (!mem_accounting) {
+        return;
+    }
+    thread.peak = thread.live;
+    page_start = thread;
+}
+
+static void add_page(MemPage page) {
+    pthread_mutex_lock(&state.page_lock);
+    if (state.page_count == state.page_cap) {
+        state.page_cap = state.page_cap == 0 ? 256 : state.page_cap * 2;
+        state.pages = realloc(state.pages, state.page_cap * sizeof(MemPage));
+        if (!state.pages) {
+            fprintf(stderr, "fatal: out of memory\n");
+            exit(1);
+        }
+    }
+    state.pages[state.page_count++] = page;
+    pthread_mutex_unlock(&state.page_lock);
+}
+
+void mem_page_end(const char *path) {
+    if (!mem_accounting) {
+        return;
+    }
+    add_page((MemPage){
+        .path = strdup(path),
+        .allocs = thread.allocs - page_start.allocs,
+        .bytes = thread.bytes - page_start.bytes,
+        .peak = thread.peak - page_start.live,
+        .retained = thread.live - page_start.live,
+    });
+}
+
+/* A page taken from the page cache gets an empty record marked cached. */
+void mem_page_cached(const char *path) {
+    if (!mem_accounting) {
+        return;
+    }
+    add_page((MemPage){.path = strdup(path), .cached = true});
+}
+
+static int cmp_page_path(const void *a, const void *b) {
+    return strcmp(((const MemPage *)a)->path, ((const MemPage *)b)->path);
+}
+
+static int cmp_page_peak_desc(const void *a, const void *b) {
+    const MemPage *x = *(const MemPage *const *)a;
+    const MemPage *y = *(const MemPage *const *)b;
+    if (x->peak != y->peak) {
+        return x->peak < y->peak ? 1 : -1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+static void append_num(StrBuf *b, const char *fmt, long long value) {
+    char num[48];
+    snprintf(num, sizeof(num), fmt, value);
+    sb_append(b, num);
+}
+
+static bool write_report(void) {
+    StrBuf b = {0};
+    sb_append(&b, "{\n  \"build\": {\"allocations\": ");
+    append_num(&b, "%lld", (long long)state.allocs);
+    sb_append(&b, ", \"frees\": ");
+    append_num(&b, "%lld", (long long)state.frees);
+    sb_append(&b, ", \"bytes_allocated\": ");
+    append_num(&b, "%lld", (long long)state.bytes);
+    sb_append(&b, ", \"peak_live_bytes\": ");
+    append_num(&b, "%lld", (long long)state.peak);
+    sb_append(&b, ", \"live_bytes_at_exit\": ");
+    append_num(&b, "%lld", (long long)state.live);
+    sb_append(&b, "},\n  \"subsystems\": {");
+    for (int s = 0; s < MEM_SUBSYSTEM_COUNT; s++) {
+        sb_append(&b, s ? ",\n    " : "\n    ");
+        json_append_escaped(&b, SUBSYSTEM_NAMES[s]);
+        sb_append(&b, ": {\"allocations\": ");
+        append_num(&b, "%lld", (long long)state.sub_allocs[s]);
+        sb_append(&b, ", \"bytes_allocated\": ");
+        append_num(&b, "%lld", (long long)state.sub_bytes[s]);
+        sb_append(&b, ", \"peak_live_bytes\": ");
+        append_num(&b, "%lld", (long long)state.sub_peak[s]);
+        sb_append(&b, ", \"live_bytes_at_exit\": ");
+        append_num(&b, "%lld", (long long)state.sub_live[s]);
+        sb_append(&b, "}");
+    }
+    sb_append(&b, "\n  },\n  \"pages\": [");
+    for (size_t i = 0; i < state.page_count; i++) {
+        const MemPage *page = &state.pages[i];
+        sb_append(&b, i ? ",\n    {\"path\": " : "\n    {\"path\": ");
+        json_append_escaped(&b, page->path);
+        sb_append(&b, ", \"allocations\": ");
+        append_num(&b, "%lld", (long long)page->allocs);
+        sb_append(&b, ", \"bytes_allocated\": ");
+        append_num(&b, "%lld", (long long)page->bytes);
+        sb_append(&b, ", \"peak_live_bytes\": ");
+        append_num(&b, "%lld", (long long)page->peak);
+        sb_append(&b, ", \"retained_bytes\": ");
+        append_num(&b, "%lld", (long long)page->retained);
+        if (page->cached) {
+            sb_append(&b, ", \"cached\": true");
+        }
+        sb_append(&b, "}");
+    }
+    sb_append(&b, "\n  ]\n}\n");
+    bool ok = write_file(state.path, b.data);
+    free(b.data);
+    return ok;
+}
+
+static void print_summary(size_t top) {
+    fprintf(stderr,
+            "Memory: %zu allocation(s), %zu free(s), %.1f MB allocated, peak live %.1f MB, %.1f MB live at exit\n",
+            (size_t)state.allocs,
+            (size_t)state.frees,
+            (double)state.bytes / 1e6,
+            (double)state.peak / 1e6,
+            (double)state.live / 1e6);
+    fprintf(stderr, "  %-10s %12s %14s %14s %14s\n", "subsystem", "allocations", "allocated MB", "peak live MB", "live at exit");
+    for (int s = 0; s < MEM_SUBSYSTEM_COUNT; s++) {
+        fprintf(stderr,
+                "  %-10s %12zu %14.1f %14.1f %14.1f\n",
+                SUBSYSTEM_NAMES[s],
+                (size_t)state.sub_allocs[s],
+                (double)state.sub_bytes[s] / 1e6,
+                (double)state.sub_peak[s] / 1e6,
+                (double)state.sub_live[s] / 1e6);
+    }
+
+    if (state.page_count == 0) {
+        return;
+    }
+    MemPage **order = malloc(state.page_count * sizeof(MemPage *));
+    if (!order) {
+        return;
+    }
+    for (size_t i = 0; i < state.page_count; i++) {
+        order[i] = &state.pages[i];
+    }
+    qsort(order, state.page_count, sizeof(MemPage *), cmp_page_peak_desc);
+    fprintf(stderr, "Pages with the highest peak live memory:\n");
+    for (size_t i = 0; i < state.page_count && i < top; i++) {
+        fprintf(stderr,
+                "  %10.1f KB peak  %10zu allocation(s)  %s\n",
+                (double)order[i]->peak / 1e3,
+                order[i]->allocs,
+                order[i]->path);
+    }
+    free(order);
+}
+
+void mem_finish(BuildCtx *ctx) {
+    if (!mem_accounting) {
+        return;
+    }
+    mem_accounting = false;
+    qsort(state.pages, state.page_count, sizeof(MemPage), cmp_page_path);
+    print_summary(MEM_REPORT_TOP);
+    if (!write_report()) {
+        log_warning(ctx, "failed to write memory report %s", state.path);
+    }
+    for (size_t i = 0; i < state.page_count; i++) {
+        free(state.pages[i].path);
+    }
+    free(state.pages);
+    state.pages = NULL;
+    state.page_count = 0;
+    state.page_cap = 0;
+}
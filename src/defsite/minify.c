@@ -0,0 +1,305 @@
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Elements whose boundaries make adjacent whitespace insignificant. */
+static const char *BLOCK_TAGS[] = {
+    "html", "head", "body",
+    "address", "article", "aside", "blockquote", "details", "dialog", "dd", "div", "dl", "dt",
+    "fieldset", "figcaption", "figure", "footer", "form", "h1", "h2", "h3", "h4", "h5", "h6",
+    "header", "hgroup", "hr", "li", "main", "menu", "nav", "ol", "p", "pre", "section", "summary",
+    "table", "caption", "colgroup", "col", "thead", "tbody", "tfoot", "tr", "td", "th", "ul",
+    "option", "optgroup"
+};
+
+/* Elements that render nothing in the flow of text (or, for <noscript>,
+ * may render inline), so the whitespace around them is judged by what lies
+ * beyond them: `one <script></script> two` keeps both spaces, while a
+ * <meta> between block boundaries in <head> still loses its. */
+static const char *TRANSPARENT_TAGS[] = {
+    "script", "style", "template", "noscript", "title", "meta", "link", "base"
+};
+
+/* Elements that close an open <p> when they start (HTML end-tag omission rules). */
+static const char *P_CLOSERS[] = {
+    "address", "article", "aside", "blockquote", "details", "div", "dl", "fieldset", "figcaption",
+    "figure", "footer", "form", "h1", "h2", "h3", "h4", "h5", "h6", "header", "hgroup", "hr",
+    "main", "menu", "nav", "ol", "p", "pre", "section", "table", "ul"
+};
+
+static bool tag_in(const char *tag, const char *const *list, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (str_eq(tag, list[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_block(const Node *n) {
+    return n && n->type == NODE_ELEMENT && tag_in(n->tag, BLOCK_TAGS, sizeof(BLOCK_TAGS) / sizeof(BLOCK_TAGS[0]));
+}
+
+static bool is_transparent(const Node *n) {
+    return n->type == NODE_ELEMENT && tag_in(n->tag, TRANSPARENT_TAGS, sizeof(TRANSPARENT_TAGS) / sizeof(TRANSPARENT_TAGS[0]));
+}
+
+static bool is_ws(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static bool preserves_text(const Node *n) {
+    return n->type == NODE_ELEMENT
+           && (str_eq(n->tag, "pre") || str_eq(n->tag, "textarea") || str_eq(n->tag, "script") || str_eq(n->tag, "style"));
+}
+
+static bool is_kept_comment(const Node *n) {
+    /* Conditional comments carry markup for old browsers; never drop them. */
+    return n->text && (starts_with(n->text, "[if") || starts_with(n->text, "<![endif]"));
+}
+
+static void collapse_ws(char *s) {
+    char *w = s;
+    bool in_ws = false;
+    for (char *r = s; *r; r++) {
+        if (is_ws(*r)) {
+            if (!in_ws) {
+                *w++ = ' ';
+            }
+            in_ws = true;
+        } else {
+            *w++ = *r;
+            in_ws = false;
+        }
+    }
+    *w = '\0';
+}
+
+/* A text edge is insignificant when it touches a block boundary: a block
+ * sibling, or the start/end of a block (or document) parent, looking past
+ * transparent siblings. <title> text is trimmed like a block's. */
+static bool edge_is_block(const Node *parent, size_t idx, int dir) {
+    size_t j = idx;
+    for (;;) {
+        if (dir < 0 ? j == 0 : j + 1 >= parent->child_count) {
+            return parent->type == NODE_DOCUMENT || is_block(parent) || str_eq(parent->tag, "title");
+        }
+        j = dir < 0 ? j - 1 : j + 1;
+        const Node *sibling = parent->children[j];
+        if (!is_transparent(sibling)) {
+            return is_block(sibling);
+        }
+    }
+}
+
+void minify_tree(Node *n, bool keep_comments) {
+    if (preserves_text(n)) {
+        return;
+    }
+
+    size_t i = 0;
+    while (i < n->child_count) {
+        Node *child = n->children[i];
+        if (child->type == NODE_COMMENT && !keep_comments && !is_kept_comment(child)) {
+            node_replace_child(n, i, NULL, 0);
+            continue;
+        }
+        i++;
+    }
+
+    i = 0;
+    while (i < n->child_count) {
+        Node *child = n->children[i];
+        if (child->type != NODE_TEXT || !child->text) {
+            i++;
+            continue;
+        }
+        collapse_ws(child->text);
+        char *t = child->text;
+        size_t len = strlen(t);
+        if (len > 0 && t[0] == ' ' && edge_is_block(n, i, -1)) {
+            memmove(t, t + 1, len);
+            len--;
+        }
+        if (len > 0 && t[len - 1] == ' ' && edge_is_block(n, i, 1)) {
+            t[--len] = '\0';
+        }
+        if (len == 0) {
+            node_replace_child(n, i, NULL, 0);
+            continue;
+        }
+        i++;
+    }
+
+    for (i = 0; i < n->child_count; i++) {
+        minify_tree(n->children[i], keep_comments);
+    }
+}
+
+static bool attr_value_needs_quotes(const char *v) {
+    if (!v[0]) {
+        return true;
+    }
+    for (const char *p = v; *p; p++) {
+        if (is_ws(*p) || *p == '"' || *p == '\'' || *p == '=' || *p == '<' || *p == '>' || *p == '`') {
+            return true;
+        }
+    }
+    return v[strlen(v) - 1] == '/';
+}
+
+static void serialize_attr_min(StrBuf *b, const char *name, const char *value) {
+    sb_append(b, " ");
+    sb_append(b, name);
+    if (!value || !value[0]) {
+        return;
+    }
+    bool quoted = attr_value_needs_quotes(value);
+    sb_append(b, quoted ? "=\"" : "=");
+    for (const char *p = value; *p; p++) {
+        if (*p == '&') {
+            sb_append(b, "&amp;");
+        } else if (*p == '"') {
+            sb_append(b, "&quot;");
+        } else if (*p == '<') {
+            sb_append(b, "&lt;");
+        } else if (*p == '>') {
+            sb_append(b, "&gt;");
+        } else {
+            sb_append_n(b, p, 1);
+        }
+    }
+    if (quoted) {
+        sb_append(b, "\"");
+    }
+}
+
+static bool next_is(const Node *next, const char *a, const char *b) {
+    return next && next->type == NODE_ELEMENT && (str_eq(next->tag, a) || (b && str_eq(next->tag, b)));
+}
+
+static bool end_tag_optional(const Node *n, const Node *next) {
+    const char *tag = n->tag;
+    const Node *parent = n->parent;
+
+    if (str_eq(tag, "li")) {
+        return !next || next_is(next, "li", NULL);
+    }
+    if (str_eq(tag, "dt")) {
+        return next_is(next, "dt", "dd");
+    }
+    if (str_eq(tag, "dd")) {
+        return !next || next_is(next, "dt", "dd");
+    }
+    if (str_eq(tag, "p")) {
+        if (next) {
+            return next->type == NODE_ELEMENT && tag_in(next->tag, P_CLOSERS, sizeof(P_CLOSERS) / sizeof(P_CLOSERS[0]));
+        }
+        /* Only safe when the parent is a known element that is not a transparent one. */
+        return parent && parent->type == NODE_ELEMENT && is_native_tag(parent->tag) && !str_eq(parent->tag, "a")
+               && !str_eq(parent->tag, "audio") && !str_eq(parent->tag, "del") && !str_eq(parent->tag, "ins")
+               && !str_eq(parent->tag, "map") && !str_eq(parent->tag, "noscript") && !str_eq(parent->tag, "video");
+    }
+    if (str_eq(tag, "option")) {
+        return !next || next_is(next, "option", "optgroup");
+    }
+    if (str_eq(tag, "optgroup")) {
+        return !next || next_is(next, "optgroup", NULL);
+    }
+    if (str_eq(tag, "tr")) {
+        return !next || next_is(next, "tr", NULL);
+    }
+    if (str_eq(tag, "td") || str_eq(tag, "th")) {
+        return !next || next_is(next, "td", "th");
+    }
+    if (str_eq(tag, "thead")) {
+        return next_is(next, "tbody", "tfoot");
+    }
+    if (str_eq(tag, "tbody")) {
+        return !next || next_is(next, "tbody", "tfoot");
+    }
+    if (str_eq(tag, "tfoot")) {
+        return !next;
+    }
+    if (str_eq(tag, "head")) {
+        return !next || next->type == NODE_ELEMENT;
+    }
+    if (str_eq(tag, "body") || str_eq(tag, "html")) {
+        return !next || next->type != NODE_COMMENT;
+    }
+    return false;
+}
+
+static bool start_tag_optional(const Node *n) {
+    if (n->attr_count > 0) {
+        return false;
+    }
+    const Node *first = n->child_count > 0 ? n->children[0] : NULL;
+    if (str_eq(n->tag, "html")) {
+        return !first || first->type != NODE_COMMENT;
+    }
+    if (str_eq(n->tag, "head")) {
+        return !first || first->type == NODE_ELEMENT;
+    }
+    if (str_eq(n->tag, "body")) {
+        if (!first) {
+            return true;
+        }
+        if (first->type == NODE_COMMENT || (first->type == NODE_TEXT && first->text && is_ws(first->text[0]))) {
+            return false;
+        }
+        return !(first->type == NODE_ELEMENT
+                 && (str_eq(first->tag, "meta") || str_eq(first->tag, "link") || str_eq(first->tag, "script")
+                     || str_eq(first->tag, "style") || str_eq(first->tag, "template")));
+    }
+    return false;
+}
+
+static void serialize_min(StrBuf *b, const Node *n, const Node *next) {
+    switch (n->type) {
+    case NODE_DOCUMENT:
+        for (size_t i = 0; i < n->child_count; i++) {
+            serialize_min(b, n->children[i], i + 1 < n->child_count ? n->children[i + 1] : NULL);
+        }
+        break;
+    case NODE_TEXT:
+    case NODE_COMMENT:
+    case NODE_DECL:
+        serialize_node(b, n);
+        break;
+    case NODE_ELEMENT: {
+        const char *tag = n->tag ? n->tag : "";
+        if (!start_tag_optional(n)) {
+            sb_append(b, "<");
+            sb_append(b, tag);
+            for (size_t i = 0; i < n->attr_count; i++) {
+                serialize_attr_min(b, n->attrs[i].name, n->attrs[i].value);
+            }
+            sb_append(b, ">");
+        }
+        if (is_void_tag(tag)) {
+            break;
+        }
+        if (preserves_text(n)) {
+            for (size_t i = 0; i < n->child_count; i++) {
+                serialize_node(b, n->children[i]);
+            }
+        } else {
+            for (size_t i = 0; i < n->child_count; i++) {
+                serialize_min(b, n->children[i], i + 1 < n->child_count ? n->children[i + 1] : NULL);
+            }
+        }
+        if (!end_tag_optional(n, next)) {
+            sb_append(b, "</");
+            sb_append(b, tag);
+            sb_append(b, ">");
+        }
+        break;
+    }
+    }
+}
+
+void serialize_node_minified(StrBuf *b, const Node *n) {
+    serialize_min(b, n, NULL);
+}
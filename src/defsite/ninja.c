@@ -0,0 +1,436 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define NINJA_FILE "build.ninja"
+
+/* Single-file compiles (`defsite compile`) and the build.ninja that drives
+ * them (`defsite ninja`), so an outside build system can rebuild only the
+ * pages whose sources changed and run them in parallel. */
+
+typedef struct {
+    char **items;
+    size_t count;
+    size_t cap;
+} PathVec;
+
+static void pathvec_push(PathVec *v, const char *path) {
+    if (v->count == v->cap) {
+        v->cap = v->cap == 0 ? 64 : v->cap * 2;
+        v->items = xrealloc(v->items, v->cap * sizeof(char *));
+    }
+    v->items[v->count++] = xstrdup(path);
+}
+
+static void pathvec_free(PathVec *v) {
+    for (size_t i = 0; i < v->count; i++) {
+        xfree(v->items[i]);
+    }
+    xfree(v->items);
+}
+
+static int cmp_str_ptr(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Creates the directories leading up to path, like `mkdir -p $(dirname path)`. */
+static bool ensure_parent_dirs(const char *path) {
+    char dir[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = dir + 1; *p; p++) {
+        if (*p != '/') {
+            continue;
+        }
+        *p = '\0';
+        int rc = ensure_dir(dir);
+        *p = '/';
+        if (rc != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Makefile syntax, which Ninja's depfile reader also accepts. */
+static void append_make_path(StrBuf *b, const char *path) {
+    for (const char *p = path; *p; p++) {
+        if (*p == ' ' || *p == '#' || *p == '\\') {
+            sb_append(b, "\\");
+        } else if (*p == '$') {
+            sb_append(b, "$");
+        }
+        sb_append_n(b, p, 1);
+    }
+}
+
+/* Every file the output was built from. Components are defined in the page
+ * itself and whole-tree options are refused, so that is the source alone. */
+static bool write_depfile(const char *depfile, const char *output, const char *input, BuildCtx *ctx) {
+    StrBuf b = {0};
+    append_make_path(&b, output);
+    sb_append(&b, ": ");
+    append_make_path(&b, input);
+    sb_append(&b, "\n");
+    bool ok = ensure_parent_dirs(depfile) && write_file_n(depfile, b.data, b.len);
+    if (!ok) {
+        log_error(ctx, "failed to write %s", depfile);
+    }
+    xfree(b.data);
+    return ok;
+}
+
+/* Compiles a page or copies any other file. Like every output, it is
+ * replaced atomically and only when its bytes change; a page that fails
+ * leaves it alone, so a build system never sees a half-written file. */
+static void compile_one(const char *input, const char *output, const char *depfile, BuildCtx *ctx) {
+    IoFile in = {input, NULL, 0, false};
+    io_read_batch(&in, 1);
+    if (!in.ok) {
+        log_error(ctx, "failed to read %s", input);
+        return;
+    }
+
+    bool ok = true;
+    char *data = in.data;
+    size_t len = in.len;
+    StrBuf page = {0};
+    if (collection_is_template(input) || listing_is_template(input)) {
+        log_error(ctx, "%s is a %s template; its pages are only built by a whole-tree build", input,
+                  listing_is_template(input) ? "listing" : "collection");
+        xfree(in.data);
+        return;
+    }
+    if (has_html_ext(input)) {
+        const char *prev_file = ctx->current_file;
+        ctx->current_file = input;
+        int errors = ctx->error_count;
+        ok = compile_page(input, in.data, in.len, &page, ctx) && ctx->error_count == errors;
+        ctx->current_file = prev_file;
+        data = page.data ? page.data : "";
+        len = page.len;
+    }
+
+    if (ok) {
+        if (!ensure_parent_dirs(output) || !write_file_n(output, data, len)) {
+            log_error(ctx, "failed to write %s", output);
+        } else {
+            if (depfile) {
+                write_depfile(depfile, output, input, ctx);
+            }
+            if (!ctx->opts->quiet) {
+                printf("Processed: %s -> %s\n", input, output);
+            }
+        }
+    }
+    xfree(page.data);
+    xfree(in.data);
+}
+
+/* Splits a --batch line into up to three fields: on tabs when it has any,
+ * else on runs of spaces. */
+static size_t split_batch_line(char *line, char **fields) {
+    const char *sep = strchr(line, '\t') ? "\t" : " ";
+    size_t n = 0;
+    for (char *tok = strtok(line, sep); tok; tok = strtok(NULL, sep)) {
+        if (n == 3) {
+            return 4;
+        }
+        fields[n++] = tok;
+    }
+    return n;
+}
+
+void compile_files(const BuildOptions *opts, BuildCtx *ctx) {
+    if (!opts->compile_batch) {
+        compile_one(opts->compile_input, opts->compile_output, opts->depfile_path, ctx);
+        return;
+    }
+
+    IoStream *in = io_stream_open("/dev/stdin");
+    if (!in) {
+        log_error(ctx, "failed to read the file list from stdin");
+        return;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    size_t line_no = 0;
+    size_t compiled = 0;
+    while (io_stream_read_line(in, &line, &cap)) {
+        line_no++;
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\r') {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+        char *fields[3] = {NULL, NULL, NULL};
+        size_t n = split_batch_line(line, fields);
+        if (n < 2 || n > 3) {
+            log_error(ctx, "stdin:%zu: expected \"input output [depfile]\"", line_no);
+            continue;
+        }
+        compile_one(fields[0], fields[1], fields[2], ctx);
+        compiled++;
+    }
+    io_stream_close(in);
+    xfree(line);
+    if (opts->quiet) {
+        printf("Processed %zu file(s)\n", compiled);
+    }
+}
+
+/* Collects files (sorted, relative to root) and the directories holding them. */
+static void scan_tree(const char *root, const char *rel, PathVec *files, PathVec *dirs, BuildCtx *ctx) {
+    char path[MAX_PATH_LEN * 2];
+    snprintf(path, sizeof(path), "%s%s%s", root, rel[0] ? "/" : "", rel);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        log_error(ctx, "failed to open directory %s: %s", path, strerror(errno));
+        return;
+    }
+    pathvec_push(dirs, path);
+    PathVec entries = {0};
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!str_eq(entry->d_name, ".") && !str_eq(entry->d_name, "..")) {
+            pathvec_push(&entries, entry->d_name);
+        }
+    }
+    closedir(dir);
+    qsort(entries.items, entries.count, sizeof(char *), cmp_str_ptr);
+
+    for (size_t i = 0; i < entries.count; i++) {
+        char child[MAX_PATH_LEN];
+        snprintf(child, sizeof(child), "%s%s%s", rel, rel[0] ? "/" : "", entries.items[i]);
+        snprintf(path, sizeof(path), "%s/%s", root, child);
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            log_error(ctx, "stat failed for %s: %s", path, strerror(errno));
+        } else if (S_ISDIR(st.st_mode)) {
+            scan_tree(root, child, files, dirs, ctx);
+        } else if (collection_is_template(path) || listing_is_template(path)) {
+            /* Their outputs are named by data, which Ninja would need
+             * regenerating on every edit to know. */
+            log_error(ctx, "%s is a %s template; build this tree without ninja", path,
+                      listing_is_template(path) ? "listing" : "collection");
+        } else {
+            pathvec_push(files, child);
+        }
+    }
+    pathvec_free(&entries);
+}
+
+/* Paths in build statements escape '$', ' ' and ':' with '$'. */
+static void append_ninja_path(StrBuf *b, const char *path) {
+    for (const char *p = path; *p; p++) {
+        if (*p == '$' || *p == ' ' || *p == ':') {
+            sb_append(b, "$");
+        }
+        sb_append_n(b, p, 1);
+    }
+}
+
+static void append_ninja_join(StrBuf *b, const char *dir, const char *rel) {
+    append_ninja_path(b, dir);
+    sb_append(b, "/");
+    append_ninja_path(b, rel);
+}
+
+/* A shell word inside a Ninja variable: single-quoted when it holds anything
+ * beyond a safe set, with '$' doubled for Ninja. */
+static void append_shell_word(StrBuf *b, const char *word) {
+    bool plain = word[0] != '\0';
+    for (const char *p = word; *p; p++) {
+        if (!strchr("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-+=,./:@%", *p)) {
+            plain = false;
+        }
+    }
+    if (!plain) {
+        sb_append(b, "'");
+    }
+    for (const char *p = word; *p; p++) {
+        if (*p == '\'') {
+            sb_append(b, "'\\''");
+        } else if (*p == '$') {
+            sb_append(b, "$$");
+        } else {
+            sb_append_n(b, p, 1);
+        }
+    }
+    if (!plain) {
+        sb_append(b, "'");
+    }
+}
+
+static void append_flag(StrBuf *b, const char *name, const char *value) {
+    sb_append(b, " ");
+    StrBuf word = {0};
+    sb_append(&word, name);
+    if (value) {
+        sb_append(&word, "=");
+        sb_append(&word, value);
+    }
+    append_shell_word(b, word.data);
+    xfree(word.data);
+}
+
+static void append_size_flag(StrBuf *b, const char *name, size_t value) {
+    char text[32];
+    snprintf(text, sizeof(text), "%zu", value);
+    append_flag(b, name, text);
+}
+
+/* The options that change page output or the index, as they were given. */
+static void append_forwarded_flags(StrBuf *b, const BuildOptions *opts) {
+    BuildOptions defaults;
+    options_init(&defaults);
+    if (opts->minify) {
+        append_flag(b, "--minify", NULL);
+    }
+    if (opts->keep_comments) {
+        append_flag(b, "--keep-comments", NULL);
+    }
+    if (opts->max_page_nodes != defaults.max_page_nodes) {
+        append_size_flag(b, "--max-page-nodes", opts->max_page_nodes);
+    }
+    if (opts->max_page_bytes != defaults.max_page_bytes) {
+        append_size_flag(b, "--max-page-bytes", opts->max_page_bytes);
+    }
+    if (opts->max_page_ms != defaults.max_page_ms) {
+        append_size_flag(b, "--max-page-ms", opts->max_page_ms);
+    }
+    if (opts->index_binary) {
+        append_flag(b, "--index-binary", NULL);
+    }
+    if (opts->index_shard_size != defaults.index_shard_size) {
+        append_size_flag(b, "--index-shard-size", opts->index_shard_size);
+    }
+    if (!str_eq(opts->index_facets, defaults.index_facets)) {
+        append_flag(b, "--index-facets", opts->index_facets);
+    }
+    if (!str_eq(opts->index_sorts, defaults.index_sorts)) {
+        append_flag(b, "--index-sorts", opts->index_sorts);
+    }
+    if (!str_eq(opts->index_unique, defaults.index_unique)) {
+        append_flag(b, "--index-unique", opts->index_unique);
+    }
+    if (opts->index_memory_kb != defaults.index_memory_kb) {
+        char text[32];
+        snprintf(text, sizeof(text), "%zuK", opts->index_memory_kb);
+        append_flag(b, "--index-memory", text);
+    }
+    if (opts->cache_dir) {
+        append_flag(b, "--cache-dir", opts->cache_dir);
+    }
+    if (opts->parse_cache_dir) {
+        append_flag(b, "--parse-cache", opts->parse_cache_dir);
+    }
+}
+
+/* `defsite ninja SRC OUT`: one edge per source file, one for the discovery
+ * index over all pages, and one that regenerates build.ninja when a source
+ * directory changes (files added, removed or renamed). */
+void write_build_ninja(const BuildOptions *opts, BuildCtx *ctx) {
+    PathVec files = {0};
+    PathVec dirs = {0};
+    scan_tree(opts->src_dir, "", &files, &dirs, ctx);
+    if (ctx->error_count > 0) {
+        pathvec_free(&files);
+        pathvec_free(&dirs);
+        return;
+    }
+    /* A program found through PATH has no file for Ninja to watch. */
+    bool track_program = strchr(opts->program, '/') != NULL;
+
+    StrBuf b = {0};
+    sb_append(&b, "# Generated by `defsite ninja`. Rerun it, or let ninja, when sources are added or removed.\n");
+    sb_append(&b, "ninja_required_version = 1.3\n\n");
+    sb_append(&b, "defsite = ");
+    append_shell_word(&b, opts->program);
+    sb_append(&b, "\nflags =");
+    append_forwarded_flags(&b, opts);
+    sb_append(&b, "\nsrcdir = ");
+    append_shell_word(&b, opts->src_dir);
+    sb_append(&b, "\noutdir = ");
+    append_shell_word(&b, opts->out_dir);
+    sb_append(&b, "\n\n");
+
+    sb_append(&b, "rule page\n"
+                  "  command = $defsite compile --quiet $flags --depfile=$out.d $in $out\n"
+                  "  depfile = $out.d\n"
+                  "  deps = gcc\n"
+                  "  restat = 1\n"
+                  "  description = PAGE $out\n\n");
+    sb_append(&b, "rule copy\n"
+                  "  command = $defsite compile --quiet $in $out\n"
+                  "  restat = 1\n"
+                  "  description = COPY $out\n\n");
+    sb_append(&b, "rule index\n"
+                  "  command = $defsite index $flags $srcdir $outdir\n"
+                  "  restat = 1\n"
+                  "  description = INDEX $out\n\n");
+    sb_append(&b, "rule regenerate\n"
+                  "  command = $defsite ninja $flags $srcdir $outdir\n"
+                  "  description = REGENERATE " NINJA_FILE "\n"
+                  "  generator = 1\n"
+                  "  restat = 1\n\n");
+
+    StrBuf program_dep = {0};
+    if (track_program) {
+        sb_append(&program_dep, " | ");
+        append_ninja_path(&program_dep, opts->program);
+    }
+    size_t pages = 0;
+    for (size_t i = 0; i < files.count; i++) {
+        bool is_page = has_html_ext(files.items[i]);
+        pages += is_page;
+        sb_append(&b, "build ");
+        append_ninja_join(&b, opts->out_dir, files.items[i]);
+        sb_append(&b, is_page ? ": page " : ": copy ");
+        append_ninja_join(&b, opts->src_dir, files.items[i]);
+        sb_append(&b, program_dep.data ? program_dep.data : "");
+        sb_append(&b, "\n");
+    }
+
+    sb_append(&b, "\nbuild ");
+    append_ninja_join(&b, opts->out_dir, "search-index.json");
+    if (opts->index_binary) {
+        sb_append(&b, " | ");
+        append_ninja_join(&b, opts->out_dir, "search-index.bin");
+    }
+    sb_append(&b, ": index |");
+    for (size_t i = 0; i < files.count; i++) {
+        if (has_html_ext(files.items[i])) {
+            sb_append(&b, " $\n    ");
+            append_ninja_join(&b, opts->src_dir, files.items[i]);
+        }
+    }
+    if (track_program) {
+        sb_append(&b, " $\n    ");
+        append_ninja_path(&b, opts->program);
+    }
+
+    sb_append(&b, "\n\nbuild " NINJA_FILE ": regenerate |");
+    for (size_t i = 0; i < dirs.count; i++) {
+        sb_append(&b, " $\n    ");
+        append_ninja_path(&b, dirs.items[i]);
+    }
+    sb_append(&b, "\n");
+
+    if (!write_file_n(NINJA_FILE, b.data, b.len)) {
+        log_error(ctx, "failed to write " NINJA_FILE);
+    } else {
+        fprintf(stderr, "Wrote " NINJA_FILE ": %zu page(s), %zu other file(s)\n", pages, files.count - pages);
+    }
+    xfree(b.data);
+    xfree(program_dep.data);
+    pathvec_free(&files);
+    pathvec_free(&dirs);
+}
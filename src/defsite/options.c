@@ -0,0 +1,558 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void options_init(BuildOptions *opts) {
+    opts->command = COMMAND_BUILD;
+    opts->program = "defsite";
+    opts->src_dir = NULL;
+    opts->out_dir = NULL;
+    opts->io_backend = IO_BACKEND_STDIO;
+    opts->io_report = false;
+    opts->compress_formats = 0;
+    opts->gzip_level = 9;
+    opts->zstd_level = 19;
+    opts->jobs = 0;
+    opts->minify = false;
+    opts->keep_comments = false;
+    opts->fingerprint = false;
+    opts->fingerprint_exts = NULL;
+    opts->index_binary = false;
+    opts->index_shard_size = 0;
+    opts->index_facets = "tags,category,kind";
+    opts->index_sorts = "published";
+    opts->index_unique = "slug";
+    opts->index_memory_kb = 256 * 1024;
+    opts->fulltext = false;
+    opts->fulltext_shard_len = 2;
+    opts->fulltext_prefixes = false;
+    opts->profile_path = NULL;
+    opts->profile_top = 10;
+    opts->mem_stats_path = NULL;
+    opts->stats_path = NULL;
+    opts->max_page_nodes = 5000000;
+    opts->max_page_bytes = 256u * 1024u * 1024u;
+    opts->max_page_ms = 0;
+    opts->diagnostics_json = NULL;
+    opts->quiet = false;
+    opts->shard_index = 0;
+    opts->shard_count = 0;
+    opts->merge_inputs = NULL;
+    opts->merge_input_count = 0;
+    opts->cache_dir = NULL;
+    opts->parse_cache_dir = NULL;
+    opts->compile_input = NULL;
+    opts->compile_output = NULL;
+    opts->depfile_path = NULL;
+    opts->compile_batch = false;
+    opts->archive_path = NULL;
+    opts->archive_format = ARCHIVE_TAR;
+    opts->serve_lazy = false;
+    opts->serve_bind = "127.0.0.1";
+    opts->serve_port = 8080;
+    opts->serve_cache_mb = 256;
+}
+
+void options_print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <input_dir> <output_dir>\n", prog);
+    fprintf(stderr, "       %s merge [options] <output_dir> <shard_output_dir>...\n", prog);
+    fprintf(stderr, "       %s compile [options] [--depfile=FILE] <input_file> <output_file>\n", prog);
+    fprintf(stderr, "       %s compile [options] --batch < lines of \"input output [depfile]\"\n", prog);
+    fprintf(stderr, "       %s index [options] <input_dir> <output_dir>\n", prog);
+    fprintf(stderr, "       %s ninja [options] <input_dir> <output_dir>   (writes ./build.ninja)\n", prog);
+    fprintf(stderr, "       %s serve --lazy [options] <input_dir>\n", prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --io=stdio|uring    file I/O backend (default: stdio; uring falls back to stdio)\n");
+    fprintf(stderr, "  --io-report         print file I/O counts and changed/unchanged outputs after the run\n");
+    fprintf(stderr, "  --compress=LIST     write .gz/.zst sidecars: gzip, zstd, or none (default: none)\n");
+    fprintf(stderr, "  --gzip-level=N      gzip level 1-9 (default: 9)\n");
+    fprintf(stderr, "  --zstd-level=N      zstd level 1-22 (default: 19)\n");
+    fprintf(stderr, "  --jobs=N            worker threads (default: online CPUs)\n");
+    fprintf(stderr, "  --minify            collapse whitespace, drop comments, omit optional quotes/tags\n");
+    fprintf(stderr, "  --keep-comments     keep comments when minifying\n");
+    fprintf(stderr, "  --index-binary      also write search-index.bin (columnar, string table)\n");
+    fprintf(stderr, "  --index-shard-size=N  also write search-index/ with N records per shard\n");
+    fprintf(stderr, "  --index-facets=LIST   meta keys with posting lists (default: tags,category,kind)\n");
+    fprintf(stderr, "  --index-sorts=LIST    meta keys with sort permutations (default: published)\n");
+    fprintf(stderr, "  --index-unique=LIST   meta keys that must be unique across pages (default: slug)\n");
+    fprintf(stderr, "  --index-memory=SIZE   records held in memory before the index sort spills to disk, in MB or with a K suffix (default: 256)\n");
+    fprintf(stderr, "  --fulltext          also write search-text/, a full-text index of indexed pages\n");
+    fprintf(stderr, "  --fulltext-shard-prefix=N  term prefix length per shard, 1-4 (default: 2)\n");
+    fprintf(stderr, "  --fulltext-prefixes   add prefix -> term entries for search-as-you-type\n");
+    fprintf(stderr, "  --fingerprint       content-hash asset names and rewrite references to them\n");
+    fprintf(stderr, "  --fingerprint-exts=LIST  asset extensions to fingerprint (default: css,js,images,fonts,media)\n");
+    fprintf(stderr, "  --profile=FILE      write a Chrome trace of build phases, files and components\n");
+    fprintf(stderr, "  --quiet             print a progress summary instead of one line per file\n");
+    fprintf(stderr, "  --diagnostics-json=FILE  also write deduplicated warnings and errors as JSON\n");
+    fprintf(stderr, "  --max-page-nodes=N  fail a page whose expansion creates more than N nodes (default: 5000000, 0: off)\n");
+    fprintf(stderr, "  --max-page-bytes=N  fail a page whose expanded output exceeds N bytes (default: 268435456, 0: off)\n");
+    fprintf(stderr, "  --max-page-ms=N     fail a page whose expansion runs longer than N ms (default: 0, off)\n");
+    fprintf(stderr, "  --stats=FILE        write per-component and per-page expansion statistics as JSON\n");
+    fprintf(stderr, "  --mem-stats=FILE    count allocations per subsystem and page; write a JSON report\n");
+    fprintf(stderr, "  --profile-top=N     slowest files/components listed after a profiled build (default: 10)\n");
+    fprintf(stderr, "  --cache-dir=DIR     reuse and publish compiled pages in a shared content-addressed cache\n");
+    fprintf(stderr, "  --parse-cache=DIR   keep parsed source trees in DIR and skip parsing unchanged sources\n");
+    fprintf(stderr, "  --archive=FILE|-    stream outputs into one tar/tar.gz/tar.zst/zip (format from the extension)\n");
+    fprintf(stderr, "  --archive-format=F  tar, tar.gz, tar.zst or zip (default for stdout: tar)\n");
+    fprintf(stderr, "  --depfile=FILE      compile: write a Makefile-syntax depfile for the output\n");
+    fprintf(stderr, "  --batch             compile: read one \"input output [depfile]\" per line from stdin\n");
+    fprintf(stderr, "  --lazy              serve: compile each page from source on first request\n");
+    fprintf(stderr, "  --bind=ADDR         serve: address to listen on (default: 127.0.0.1)\n");
+    fprintf(stderr, "  --port=N            serve: port to listen on, 0 for any free port (default: 8080)\n");
+    fprintf(stderr, "  --lazy-cache=MB     serve: compiled pages kept in memory, least recently used dropped first (default: 256)\n");
+    fprintf(stderr, "  --shard=I/N         build only shard I of N (by path hash) and write a partial index for merge\n");
+}
+
+static const char *option_value(const char *arg, const char *name) {
+    size_t n = strlen(name);
+    if (strncmp(arg, name, n) == 0 && arg[n] == '=') {
+        return arg + n + 1;
+    }
+    return NULL;
+}
+
+static bool parse_int_option(const char *name, const char *value, long min, long max, long *out) {
+    char *end = NULL;
+    long n = strtol(value, &end, 10);
+    if (!value[0] || *end != '\0' || n < min || n > max) {
+        fprintf(stderr, "invalid value '%s' for %s (expected %ld-%ld)\n", value, name, min, max);
+        return false;
+    }
+    *out = n;
+    return true;
+}
+
+/* A size in megabytes, or in kilobytes with a K suffix ("64", "512K"). */
+static bool parse_kb_option(const char *name, const char *value, long max_mb, size_t *out_kb) {
+    char *end = NULL;
+    long n = strtol(value, &end, 10);
+    long scale = 1024;
+    if (end && (*end == 'K' || *end == 'k')) {
+        scale = 1;
+        end++;
+    } else if (end && (*end == 'M' || *end == 'm')) {
+        end++;
+    }
+    if (!value[0] || end == value || *end != '\0' || n < 1 || n > max_mb * (1024 / scale)) {
+        fprintf(stderr, "invalid value '%s' for %s (expected 1K-%ldM)\n", value, name, max_mb);
+        return false;
+    }
+    *out_kb = (size_t)n * (size_t)scale;
+    return true;
+}
+
+static bool parse_compress_list(const char *value, unsigned *formats) {
+    *formats = 0;
+    if (str_eq(value, "none")) {
+        return true;
+    }
+    char *copy = xstrdup(value);
+    bool ok = true;
+    for (char *tok = strtok(copy, ","); tok && ok; tok = strtok(NULL, ",")) {
+        unsigned format = 0;
+        if (str_eq(tok, "gzip") || str_eq(tok, "gz")) {
+            format = COMPRESS_GZIP;
+        } else if (str_eq(tok, "zstd") || str_eq(tok, "zst")) {
+            format = COMPRESS_ZSTD;
+        } else {
+            fprintf(stderr, "unknown compression format '%s' (expected gzip, zstd or none)\n", tok);
+            ok = false;
+            break;
+        }
+        if (!compress_format_available(format)) {
+            fprintf(stderr, "defsite was built without %s support\n", tok);
+            ok = false;
+            break;
+        }
+        *formats |= format;
+    }
+    xfree(copy);
+    return ok;
+}
+
+static bool parse_shard(const char *value, BuildOptions *opts) {
+    char *end = NULL;
+    long index = strtol(value, &end, 10);
+    if (end == value || *end != '/') {
+        fprintf(stderr, "invalid value '%s' for --shard (expected I/N)\n", value);
+        return false;
+    }
+    const char *count_text = end + 1;
+    long count = strtol(count_text, &end, 10);
+    if (end == count_text || *end != '\0' || count < 1 || count > 65536 || index < 0 || index >= count) {
+        fprintf(stderr, "invalid value '%s' for --shard (expected I/N with 0 <= I < N)\n", value);
+        return false;
+    }
+    opts->shard_index = (size_t)index;
+    opts->shard_count = (size_t)count;
+    return true;
+}
+
+static BuildCommand parse_command(const char *arg) {
+    if (str_eq(arg, "merge")) {
+        return COMMAND_MERGE;
+    }
+    if (str_eq(arg, "compile")) {
+        return COMMAND_COMPILE;
+    }
+    if (str_eq(arg, "index")) {
+        return COMMAND_INDEX;
+    }
+    if (str_eq(arg, "ninja")) {
+        return COMMAND_NINJA;
+    }
+    if (str_eq(arg, "serve")) {
+        return COMMAND_SERVE;
+    }
+    return COMMAND_BUILD;
+}
+
+/* compile, ninja and serve work one file at a time; these need the whole tree. */
+static bool check_per_file_options(const BuildOptions *opts, const char *command) {
+    const char *flag = NULL;
+    if (opts->fingerprint) {
+        flag = "--fingerprint";
+    } else if (opts->fulltext) {
+        flag = "--fulltext";
+    } else if (opts->shard_count > 0) {
+        flag = "--shard";
+    } else if (opts->compress_formats != 0) {
+        flag = "--compress";
+    } else if (opts->archive_path) {
+        flag = "--archive";
+    }
+    if (flag) {
+        fprintf(stderr, "%s needs the whole source tree and cannot be used with %s\n", flag, command);
+        return false;
+    }
+    return true;
+}
+
+static bool parse_archive_format(const char *value, BuildOptions *opts) {
+    if (!archive_parse_format(value, &opts->archive_format)) {
+        fprintf(stderr, "unknown archive format '%s' (expected tar, tar.gz, tar.zst or zip)\n", value);
+        return false;
+    }
+    return true;
+}
+
+bool options_parse(BuildOptions *opts, int argc, char **argv) {
+    const char *archive_format = NULL;
+    const char **positional = xmalloc((size_t)argc * sizeof(char *));
+    int positional_count = 0;
+    opts->program = argv[0];
+    opts->command = argc > 1 ? parse_command(argv[1]) : COMMAND_BUILD;
+    bool merge = opts->command == COMMAND_MERGE;
+
+    for (int i = opts->command == COMMAND_BUILD ? 1 : 2; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = NULL;
+
+        if ((value = option_value(arg, "--io")) != NULL) {
+            if (str_eq(value, "stdio")) {
+                opts->io_backend = IO_BACKEND_STDIO;
+            } else if (str_eq(value, "uring")) {
+                opts->io_backend = IO_BACKEND_URING;
+            } else {
+                fprintf(stderr, "unknown I/O backend '%s' (expected stdio or uring)\n", value);
+                return false;
+            }
+            continue;
+        }
+        if (str_eq(arg, "--io-report")) {
+            opts->io_report = true;
+            continue;
+        }
+
+        if (str_eq(arg, "--minify")) {
+            opts->minify = true;
+            continue;
+        }
+        if (str_eq(arg, "--keep-comments")) {
+            opts->keep_comments = true;
+            continue;
+        }
+
+        if (str_eq(arg, "--quiet")) {
+            opts->quiet = true;
+            continue;
+        }
+        if (str_eq(arg, "--index-binary")) {
+            opts->index_binary = true;
+            continue;
+        }
+        if (str_eq(arg, "--fulltext")) {
+            opts->fulltext = true;
+            continue;
+        }
+        if (str_eq(arg, "--fulltext-prefixes")) {
+            opts->fulltext = true;
+            opts->fulltext_prefixes = true;
+            continue;
+        }
+        if (str_eq(arg, "--fingerprint")) {
+            opts->fingerprint = true;
+            continue;
+        }
+        if ((value = option_value(arg, "--index-facets")) != NULL) {
+            opts->index_facets = value;
+            continue;
+        }
+        if ((value = option_value(arg, "--index-unique")) != NULL) {
+            opts->index_unique = value;
+            continue;
+        }
+        if ((value = option_value(arg, "--index-sorts")) != NULL) {
+            opts->index_sorts = value;
+            continue;
+        }
+        if ((value = option_value(arg, "--diagnostics-json")) != NULL) {
+            opts->diagnostics_json = value;
+            continue;
+        }
+        if ((value = option_value(arg, "--cache-dir")) != NULL) {
+            opts->cache_dir = value;
+            continue;
+        }
+        if ((value = option_value(arg, "--parse-cache")) != NULL) {
+            opts->parse_cache_dir = value;
+            continue;
+        }
+        if ((value = option_value(arg, "--archive")) != NULL) {
+            opts->archive_path = value;
+            continue;
+        }
+        if ((value = option_value(arg, "--archive-format")) != NULL) {
+            if (!parse_archive_format(value, opts)) {
+                return false;
+            }
+            archive_format = value;
+            continue;
+        }
+        if ((value = option_value(arg, "--depfile")) != NULL && opts->command == COMMAND_COMPILE) {
+            opts->depfile_path = value;
+            continue;
+        }
+        if (str_eq(arg, "--batch") && opts->command == COMMAND_COMPILE) {
+            opts->compile_batch = true;
+            continue;
+        }
+        if (str_eq(arg, "--lazy") && opts->command == COMMAND_SERVE) {
+            opts->serve_lazy = true;
+            continue;
+        }
+        if ((value = option_value(arg, "--bind")) != NULL && opts->command == COMMAND_SERVE) {
+            opts->serve_bind = value;
+            continue;
+        }
+        if ((value = option_value(arg, "--shard")) != NULL) {
+            if (!parse_shard(value, opts)) {
+                return false;
+            }
+            continue;
+        }
+        if ((value = option_value(arg, "--stats")) != NULL) {
+            opts->stats_path = value;
+            continue;
+        }
+        if ((value = option_value(arg, "--mem-stats")) != NULL) {
+            opts->mem_stats_path = value;
+            continue;
+        }
+        if ((value = option_value(arg, "--profile")) != NULL) {
+            opts->profile_path = value;
+            continue;
+        }
+        if ((value = option_value(arg, "--fingerprint-exts")) != NULL) {
+            opts->fingerprint = true;
+            opts->fingerprint_exts = value;
+            continue;
+        }
+
+        if ((value = option_value(arg, "--compress")) != NULL) {
+            if (!parse_compress_list(value, &opts->compress_formats)) {
+                return false;
+            }
+            continue;
+        }
+
+        long n = 0;
+        if ((value = option_value(arg, "--gzip-level")) != NULL) {
+            if (!parse_int_option("--gzip-level", value, 1, 9, &n)) {
+                return false;
+            }
+            opts->gzip_level = (int)n;
+            continue;
+        }
+        if ((value = option_value(arg, "--zstd-level")) != NULL) {
+            if (!parse_int_option("--zstd-level", value, 1, 22, &n)) {
+                return false;
+            }
+            opts->zstd_level = (int)n;
+            continue;
+        }
+        if ((value = option_value(arg, "--index-shard-size")) != NULL) {
+            if (!parse_int_option("--index-shard-size", value, 1, 1000000, &n)) {
+                return false;
+            }
+            opts->index_shard_size = (size_t)n;
+            continue;
+        }
+        if ((value = option_value(arg, "--fulltext-shard-prefix")) != NULL) {
+            if (!parse_int_option("--fulltext-shard-prefix", value, 1, 4, &n)) {
+                return false;
+            }
+            opts->fulltext = true;
+            opts->fulltext_shard_len = (size_t)n;
+            continue;
+        }
+        if ((value = option_value(arg, "--index-memory")) != NULL) {
+            if (!parse_kb_option("--index-memory", value, 1048576, &opts->index_memory_kb)) {
+                return false;
+            }
+            continue;
+        }
+        if ((value = option_value(arg, "--profile-top")) != NULL) {
+            if (!parse_int_option("--profile-top", value, 1, 100000, &n)) {
+                return false;
+            }
+            opts->profile_top = (size_t)n;
+            continue;
+        }
+        if ((value = option_value(arg, "--max-page-nodes")) != NULL) {
+            if (!parse_int_option("--max-page-nodes", value, 0, 1000000000000L, &n)) {
+                return false;
+            }
+            opts->max_page_nodes = (size_t)n;
+            continue;
+        }
+        if ((value = option_value(arg, "--max-page-bytes")) != NULL) {
+            if (!parse_int_option("--max-page-bytes", value, 0, 1000000000000L, &n)) {
+                return false;
+            }
+            opts->max_page_bytes = (size_t)n;
+            continue;
+        }
+        if ((value = option_value(arg, "--max-page-ms")) != NULL) {
+            if (!parse_int_option("--max-page-ms", value, 0, 86400000, &n)) {
+                return false;
+            }
+            opts->max_page_ms = (size_t)n;
+            continue;
+        }
+        if ((value = option_value(arg, "--port")) != NULL && opts->command == COMMAND_SERVE) {
+            if (!parse_int_option("--port", value, 0, 65535, &n)) {
+                return false;
+            }
+            opts->serve_port = (int)n;
+            continue;
+        }
+        if ((value = option_value(arg, "--lazy-cache")) != NULL && opts->command == COMMAND_SERVE) {
+            if (!parse_int_option("--lazy-cache", value, 1, 1048576, &n)) {
+                return false;
+            }
+            opts->serve_cache_mb = (size_t)n;
+            continue;
+        }
+        if ((value = option_value(arg, "--jobs")) != NULL) {
+            if (!parse_int_option("--jobs", value, 1, 1024, &n)) {
+                return false;
+            }
+            opts->jobs = (size_t)n;
+            continue;
+        }
+
+        if (arg[0] == '-' && arg[1] == '-') {
+            fprintf(stderr, "unknown option '%s'\n", arg);
+            return false;
+        }
+
+        if (positional_count == 2 && !merge) {
+            fprintf(stderr, "unexpected argument '%s'\n", arg);
+            return false;
+        }
+        positional[positional_count++] = arg;
+    }
+
+    if (opts->archive_path && !archive_format && !str_eq(opts->archive_path, "-") &&
+        !archive_format_for_path(opts->archive_path, &opts->archive_format)) {
+        fprintf(stderr, "cannot tell the archive format of '%s'; pass --archive-format\n", opts->archive_path);
+        return false;
+    }
+    if (opts->archive_path && !archive_format_available(opts->archive_format)) {
+        fprintf(stderr, "defsite was built without %s support\n", opts->archive_format == ARCHIVE_TAR_GZ ? "gzip" : "zstd");
+        return false;
+    }
+    if (opts->archive_path && opts->shard_count > 0) {
+        fprintf(stderr, "--archive cannot be combined with --shard; archive the merge instead\n");
+        return false;
+    }
+    if (opts->fulltext && (opts->shard_count > 0 || merge)) {
+        fprintf(stderr, "--fulltext cannot be combined with sharded builds\n");
+        return false;
+    }
+    if (merge) {
+        if (opts->shard_count > 0) {
+            fprintf(stderr, "--shard is a build option, not a merge option\n");
+            return false;
+        }
+        if (positional_count < 2) {
+            return false;
+        }
+        /* Merge takes the build's flags as-is; fingerprinting was done by
+         * the shards, whose asset manifests merge combines. */
+        opts->fingerprint = false;
+        opts->out_dir = positional[0];
+        opts->merge_inputs = positional + 1;
+        opts->merge_input_count = (size_t)positional_count - 1;
+        return true;
+    }
+    if (opts->command == COMMAND_COMPILE) {
+        if (!check_per_file_options(opts, "compile")) {
+            return false;
+        }
+        if (opts->compile_batch) {
+            if (positional_count != 0 || opts->depfile_path) {
+                fprintf(stderr, "compile --batch reads its files from stdin\n");
+                return false;
+            }
+            return true;
+        }
+        if (positional_count != 2) {
+            return false;
+        }
+        opts->compile_input = positional[0];
+        opts->compile_output = positional[1];
+        xfree(positional);
+        return true;
+    }
+    if (opts->command == COMMAND_NINJA && !check_per_file_options(opts, "ninja")) {
+        return false;
+    }
+    if (opts->command == COMMAND_SERVE) {
+        if (!check_per_file_options(opts, "serve")) {
+            return false;
+        }
+        if (!opts->serve_lazy) {
+            fprintf(stderr, "serve compiles pages on request and needs --lazy; serve a built output_dir with any static server\n");
+            return false;
+        }
+        if (positional_count != 1) {
+            return false;
+        }
+        opts->src_dir = positional[0];
+        xfree(positional);
+        return true;
+    }
+
+    if (positional_count != 2) {
+        return false;
+    }
+    opts->src_dir = positional[0];
+    opts->out_dir = positional[1];
+    xfree(positional);
+    return true;
+}
@@ -91,7 +91,7 @@ static void parser_parse_comment(Parser *p, Node *parent) {
     if (end == (size_t)-1) {
         char *t = substr_dup(p->src, start, p->len);
         node_add_child(parent, node_new_comment(t));
-        free(t);
+        xfree(t);
         p->pos = p->len;
         p->parse_errors++;
         return;
@@ -99,7 +99,7 @@ static void parser_parse_comment(Parser *p, Node *parent) {
 
     char *t = substr_dup(p->src, start, end);
     node_add_child(parent, node_new_comment(t));
-    free(t);
+    xfree(t);
     p->pos = end + 3;
 }
 
@@ -111,7 +111,7 @@ static void parser_parse_decl(Parser *p, Node *parent) {
     }
     char *t = substr_dup(p->src, start, p->pos);
     node_add_child(parent, node_new_decl(t));
-    free(t);
+    xfree(t);
     if (p->pos < p->len && p->src[p->pos] == '>') {
         p->pos++;
     }
@@ -125,7 +125,7 @@ static void parser_parse_text(Parser *p, Node *parent) {
     if (p->pos > start) {
         char *t = substr_dup(p->src, start, p->pos);
         node_add_child(parent, node_new_text(t));
-        free(t);
+        xfree(t);
     }
 }
 
@@ -136,7 +136,7 @@ static void parser_parse_raw_text(Parser *p, Node *parent, const char *tag) {
     if (end == (size_t)-1) {
         char *t = substr_dup(p->src, p->pos, p->len);
         node_add_child(parent, node_new_text(t));
-        free(t);
+        xfree(t);
         p->pos = p->len;
         p->parse_errors++;
         return;
@@ -145,7 +145,7 @@ static void parser_parse_raw_text(Parser *p, Node *parent, const char *tag) {
     if (end > p->pos) {
         char *t = substr_dup(p->src, p->pos, end);
         node_add_child(parent, node_new_text(t));
-        free(t);
+        xfree(t);
     }
     p->pos = end;
 }
@@ -159,7 +159,7 @@ static void parser_parse_start_tag(Parser *p, Node *parent) {
     }
 
     Node *elem = node_new_element(tag);
-    free(tag);
+    xfree(tag);
 
     bool self_closing = false;
     while (!parser_eof(p)) {
@@ -184,13 +184,13 @@ static void parser_parse_start_tag(Parser *p, Node *parent) {
         char *attr_value = xstrdup("");
         if (parser_peek(p, '=')) {
             p->pos++;
-            free(attr_value);
+            xfree(attr_value);
             attr_value = parser_read_attr_value(p);
         }
 
         node_add_attr(elem, attr_name, attr_value);
-        free(attr_name);
-        free(attr_value);
+        xfree(attr_name);
+        xfree(attr_value);
     }
 
     node_add_child(parent, elem);
@@ -230,7 +230,7 @@ static void parser_parse_nodes(Parser *p, Node *parent, const char *closing_tag)
             char *end_name = NULL;
             parser_parse_close_tag(p, &end_name);
             bool matched = end_name && str_eq(end_name, closing_tag);
-            free(end_name);
+            xfree(end_name);
             if (matched) {
                 return;
             }
@@ -248,7 +248,7 @@ static void parser_parse_nodes(Parser *p, Node *parent, const char *closing_tag)
             if (starts_with_at(p->src, p->len, p->pos, "</")) {
                 char *end_name = NULL;
                 parser_parse_close_tag(p, &end_name);
-                free(end_name);
+                xfree(end_name);
             } else {
                 parser_parse_start_tag(p, parent);
             }
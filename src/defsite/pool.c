@@ -0,0 +1,136 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+    PoolFn fn;
+    void *arg;
+} PoolJob;
+
+struct WorkPool {
+    pthread_t *threads;
+    size_t thread_count;
+    PoolJob *queue;
+    size_t queue_cap;
+    size_t head;
+    size_t len;
+    size_t active;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;
+    pthread_cond_t has_room;
+    pthread_cond_t idle;
+};
+
+static void *pool_worker(void *arg) {
+    WorkPool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->len == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->has_work, &pool->lock);
+        }
+        if (pool->len == 0 && pool->stopping) {
+            break;
+        }
+        PoolJob job = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->queue_cap;
+        pool->len--;
+        pool->active++;
+        pthread_cond_signal(&pool->has_room);
+        pthread_mutex_unlock(&pool->lock);
+
+        job.fn(job.arg);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->active--;
+        if (pool->len == 0 && pool->active == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+size_t pool_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+WorkPool *pool_create(size_t threads) {
+    if (threads == 0) {
+        threads = pool_default_threads();
+    }
+    WorkPool *pool = xmalloc(sizeof(WorkPool));
+    pool->thread_count = 0;
+    pool->threads = xmalloc(threads * sizeof(pthread_t));
+    pool->queue_cap = threads * 4;
+    pool->queue = xmalloc(pool->queue_cap * sizeof(PoolJob));
+    pool->head = 0;
+    pool->len = 0;
+    pool->active = 0;
+    pool->stopping = false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->has_work, NULL);
+    pthread_cond_init(&pool->has_room, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for (size_t i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[pool->thread_count], NULL, pool_worker, pool) == 0) {
+            pool->thread_count++;
+        }
+    }
+    return pool;
+}
+
+size_t pool_thread_count(const WorkPool *pool) {
+    return pool->thread_count;
+}
+
+/* Blocks while the queue is full so producers cannot run far ahead of workers. */
+void pool_submit(WorkPool *pool, PoolFn fn, void *arg) {
+    if (pool->thread_count == 0) {
+        fn(arg);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (pool->len == pool->queue_cap) {
+        pthread_cond_wait(&pool->has_room, &pool->lock);
+    }
+    size_t tail = (pool->head + pool->len) % pool->queue_cap;
+    pool->queue[tail].fn = fn;
+    pool->queue[tail].arg = arg;
+    pool->len++;
+    pthread_cond_signal(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(WorkPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->len > 0 || pool->active > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(WorkPool *pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->has_work);
+    pthread_cond_destroy(&pool->has_room);
+    pthread_cond_destroy(&pool->idle);
+    xfree(pool->threads);
+    xfree(pool->queue);
+    xfree(pool);
+}
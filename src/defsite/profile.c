@@ -0,0 +1,368 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PROFILE_MAX_DEPTH 128
+#define PROFILE_MAX_EVENTS 2000000
+
+/* Totals for one (category, name) pair across the whole build. */
+typedef struct {
+    char *cat;
+    char *name;
+    size_t count;
+    size_t cached; /* of count, taken from a cache */
+    uint64_t total_ns;
+    uint64_t self_ns;
+} ProfileAgg;
+
+typedef struct {
+    const ProfileAgg *agg;
+    const char *detail;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    unsigned tid;
+    bool cached;
+} ProfileEvent;
+
+/* Open spans of the calling thread; child time is subtracted for self time. */
+typedef struct {
+    uint64_t start[PROFILE_MAX_DEPTH];
+    uint64_t child[PROFILE_MAX_DEPTH];
+    int depth;
+    unsigned tid;
+} ProfileStack;
+
+static struct {
+    bool enabled;
+    const char *path;
+    size_t top;
+    uint64_t origin_ns;
+    StrMap aggs;
+    StrMap details;
+    ProfileEvent *events;
+    size_t event_count;
+    size_t event_cap;
+    size_t dropped;
+    pthread_mutex_t lock;
+} state;
+
+static _Thread_local ProfileStack stack;
+static _Atomic unsigned next_tid = 1;
+
+static uint64_t profile_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void profile_init(const BuildOptions *opts) {
+    memset(&state, 0, sizeof(state));
+    strmap_init(&state.aggs);
+    strmap_init(&state.details);
+    if (!opts->profile_path) {
+        return;
+    }
+    state.enabled = true;
+    state.path = opts->profile_path;
+    state.top = opts->profile_top;
+    state.origin_ns = profile_now_ns();
+    stack.tid = atomic_fetch_add(&next_tid, 1);
+    pthread_mutex_init(&state.lock, NULL);
+}
+
+bool profile_enabled(void) {
+    return state.enabled;
+}
+
+void profile_begin(void) {
+    if (!state.enabled) {
+        return;
+    }
+    if (stack.depth < PROFILE_MAX_DEPTH) {
+        stack.start[stack.depth] = profile_now_ns();
+        stack.child[stack.depth] = 0;
+    }
+    stack.depth++;
+}
+
+static ProfileAgg *agg_for(const char *cat, const char *name) {
+    char small[256];
+    char *key = small;
+    size_t cat_len = strlen(cat);
+    size_t name_len = strlen(name);
+    if (cat_len + name_len + 2 > sizeof(small)) {
+        key = xmalloc(cat_len + name_len + 2);
+    }
+    memcpy(key, cat, cat_len);
+    key[cat_len] = '\x1f';
+    memcpy(key + cat_len + 1, name, name_len + 1);
+
+    ProfileAgg *agg = strmap_get(&state.aggs, key);
+    if (!agg) {
+        agg = xmalloc(sizeof(ProfileAgg));
+        agg->cat = xstrdup(cat);
+        agg->name = xstrdup(name);
+        agg->count = 0;
+        agg->cached = 0;
+        agg->total_ns = 0;
+        agg->self_ns = 0;
+        strmap_put(&state.aggs, key, agg);
+    }
+    if (key != small) {
+        xfree(key);
+    }
+    return agg;
+}
+
+static const char *intern_detail(const char *detail) {
+    if (!detail) {
+        return NULL;
+    }
+    char *copy = strmap_get(&state.details, detail);
+    if (!copy) {
+        copy = xstrdup(detail);
+        strmap_put(&state.details, detail, copy);
+    }
+    return copy;
+}
+
+/* Appends a trace event; called with state.lock held. */
+static void add_event(const ProfileAgg *agg, const char *detail, uint64_t start, uint64_t dur, bool cached) {
+    if (state.event_count >= PROFILE_MAX_EVENTS) {
+        state.dropped++;
+        return;
+    }
+    if (state.event_count == state.event_cap) {
+        state.event_cap = state.event_cap == 0 ? 4096 : state.event_cap * 2;
+        state.events = xrealloc(state.events, state.event_cap * sizeof(ProfileEvent));
+    }
+    ProfileEvent *e = &state.events[state.event_count++];
+    e->agg = agg;
+    e->detail = intern_detail(detail);
+    e->start_ns = start - state.origin_ns;
+    e->dur_ns = dur;
+    e->tid = stack.tid;
+    e->cached = cached;
+}
+
+/* Closes the innermost span opened by profile_begin on this thread. `detail`
+ * (usually the source file) is shown as an argument in the trace viewer. */
+void profile_end(const char *cat, const char *name, const char *detail) {
+    if (!state.enabled) {
+        return;
+    }
+    stack.depth--;
+    if (stack.depth >= PROFILE_MAX_DEPTH) {
+        return;
+    }
+    uint64_t end = profile_now_ns();
+    uint64_t start = stack.start[stack.depth];
+    uint64_t dur = end - start;
+    uint64_t self = dur > stack.child[stack.depth] ? dur - stack.child[stack.depth] : 0;
+    if (stack.depth > 0) {
+        stack.child[stack.depth - 1] += dur;
+    }
+    if (stack.tid == 0) {
+        stack.tid = atomic_fetch_add(&next_tid, 1);
+    }
+
+    pthread_mutex_lock(&state.lock);
+    ProfileAgg *agg = agg_for(cat, name);
+    agg->count++;
+    agg->total_ns += dur;
+    agg->self_ns += self;
+    add_event(agg, detail, start, dur, false);
+    pthread_mutex_unlock(&state.lock);
+}
+
+/* Records a zero-length span, marked cached in the trace, for work that was
+ * taken from a cache instead of being done, so every page still shows up. */
+void profile_cached(const char *cat, const char *name) {
+    if (!state.enabled) {
+        return;
+    }
+    if (stack.tid == 0) {
+        stack.tid = atomic_fetch_add(&next_tid, 1);
+    }
+    uint64_t now = profile_now_ns();
+    pthread_mutex_lock(&state.lock);
+    ProfileAgg *agg = agg_for(cat, name);
+    agg->count++;
+    agg->cached++;
+    add_event(agg, NULL, now, 0, true);
+    pthread_mutex_unlock(&state.lock);
+}
+
+static void append_us(StrBuf *b, uint64_t ns) {
+    char num[32];
+    snprintf(num, sizeof(num), "%llu.%03llu", (unsigned long long)(ns / 1000), (unsigned long long)(ns % 1000));
+    sb_append(b, num);
+}
+
+static bool write_trace(void) {
+    IoStream *out = io_stream_create(state.path);
+    if (!out) {
+        return false;
+    }
+    StrBuf b = {0};
+    bool ok = true;
+    unsigned max_tid = 0;
+    sb_append(&b, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    sb_append(&b, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"defsite\"}}");
+    for (size_t i = 0; i < state.event_count && ok; i++) {
+        const ProfileEvent *e = &state.events[i];
+        if (e->tid > max_tid) {
+            max_tid = e->tid;
+        }
+        sb_append(&b, ",\n{\"name\":");
+        json_append_escaped(&b, e->agg->name);
+        sb_append(&b, ",\"cat\":");
+        json_append_escaped(&b, e->agg->cat);
+        sb_append(&b, ",\"ph\":\"X\",\"pid\":1,\"tid\":");
+        char num[32];
+        snprintf(num, sizeof(num), "%u", e->tid);
+        sb_append(&b, num);
+        sb_append(&b, ",\"ts\":");
+        append_us(&b, e->start_ns);
+        sb_append(&b, ",\"dur\":");
+        append_us(&b, e->dur_ns);
+        if (e->detail) {
+            sb_append(&b, ",\"args\":{\"file\":");
+            json_append_escaped(&b, e->detail);
+            sb_append(&b, "}");
+        } else if (e->cached) {
+            sb_append(&b, ",\"args\":{\"cached\":true}");
+        }
+        sb_append(&b, "}");
+        if (b.len >= 64 * 1024) {
+            ok = io_stream_write(out, b.data, b.len);
+            b.len = 0;
+        }
+    }
+    for (unsigned tid = 1; tid <= max_tid; tid++) {
+        char meta[160];
+        char name[32];
+        if (tid == 1) {
+            snprintf(name, sizeof(name), "main");
+        } else {
+            snprintf(name, sizeof(name), "worker-%u", tid - 1);
+        }
+        snprintf(meta, sizeof(meta), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", tid, name);
+        sb_append(&b, meta);
+    }
+    sb_append(&b, "\n]}\n");
+    ok = ok && io_stream_write(out, b.data, b.len);
+    xfree(b.data);
+    return io_stream_close(out) && ok;
+}
+
+static int cmp_agg_total_desc(const void *a, const void *b) {
+    const ProfileAgg *x = *(const ProfileAgg *const *)a;
+    const ProfileAgg *y = *(const ProfileAgg *const *)b;
+    if (x->total_ns != y->total_ns) {
+        return x->total_ns < y->total_ns ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static int cmp_agg_self_desc(const void *a, const void *b) {
+    const ProfileAgg *x = *(const ProfileAgg *const *)a;
+    const ProfileAgg *y = *(const ProfileAgg *const *)b;
+    if (x->self_ns != y->self_ns) {
+        return x->self_ns < y->self_ns ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+/* Collects the aggregates of one category, sorted by the given order. */
+static size_t collect_aggs(const char *cat, int (*cmp)(const void *, const void *), ProfileAgg ***out) {
+    ProfileAgg **items = xmalloc((state.aggs.count + 1) * sizeof(ProfileAgg *));
+    size_t n = 0;
+    for (size_t i = 0; i < state.aggs.cap; i++) {
+        ProfileAgg *agg = state.aggs.slots[i].value;
+        if (state.aggs.slots[i].key && str_eq(agg->cat, cat)) {
+            items[n++] = agg;
+        }
+    }
+    qsort(items, n, sizeof(ProfileAgg *), cmp);
+    *out = items;
+    return n;
+}
+
+static void print_summary(void) {
+    ProfileAgg **items = NULL;
+    size_t n = collect_aggs("phase", cmp_agg_total_desc, &items);
+    fprintf(stderr, "Profile phases:");
+    for (size_t i = 0; i < n; i++) {
+        fprintf(stderr, "%s %s %.2f ms", i ? "," : "", items[i]->name, (double)items[i]->total_ns / 1e6);
+    }
+    fprintf(stderr, "\n");
+    xfree(items);
+
+    n = collect_aggs("page", cmp_agg_total_desc, &items);
+    if (n > 0) {
+        size_t cached = 0;
+        for (size_t i = 0; i < n; i++) {
+            cached += items[i]->cached;
+        }
+        if (cached > 0) {
+            fprintf(stderr, "Slowest files (%zu page(s) taken from the page cache):\n", cached);
+        } else {
+            fprintf(stderr, "Slowest files:\n");
+        }
+        for (size_t i = 0; i < n && i < state.top; i++) {
+            fprintf(stderr, "  %10.3f ms  %s\n", (double)items[i]->total_ns / 1e6, items[i]->name);
+        }
+    }
+    xfree(items);
+
+    n = collect_aggs("component", cmp_agg_self_desc, &items);
+    if (n > 0) {
+        fprintf(stderr, "Slowest components (self time):\n");
+        fprintf(stderr, "  %10s  %10s  %10s  %s\n", "self ms", "total ms", "calls", "component");
+        for (size_t i = 0; i < n && i < state.top; i++) {
+            fprintf(stderr,
+                    "  %10.3f  %10.3f  %10zu  <%s>\n",
+                    (double)items[i]->self_ns / 1e6,
+                    (double)items[i]->total_ns / 1e6,
+                    items[i]->count,
+                    items[i]->name);
+        }
+    }
+    xfree(items);
+}
+
+static void free_agg(void *value) {
+    ProfileAgg *agg = value;
+    xfree(agg->cat);
+    xfree(agg->name);
+    xfree(agg);
+}
+
+void profile_finish(BuildCtx *ctx) {
+    if (!state.enabled) {
+        return;
+    }
+    if (!write_trace()) {
+        log_warning(ctx, "failed to write profile %s", state.path);
+    } else {
+        fprintf(stderr, "Wrote profile %s (%zu spans", state.path, state.event_count);
+        if (state.dropped > 0) {
+            fprintf(stderr, ", %zu more counted in the summary only", state.dropped);
+        }
+        fprintf(stderr, ")\n");
+    }
+    print_summary();
+
+    strmap_free(&state.aggs, free_agg);
+    strmap_free(&state.details, xfree);
+    xfree(state.events);
+    pthread_mutex_destroy(&state.lock);
+    state.enabled = false;
+}
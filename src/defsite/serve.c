@@ -0,0 +1,265 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVE_MIN_HANDLERS 8
+#define SERVE_MAX_HOST 1025
+
+/* `defsite serve --lazy`: pages are compiled from the source tree when first
+ * requested and kept in a size-bounded LRU until their source changes. This
+ * file runs the listener and answers requests; the page cache and compile
+ * thread live in servecache.c, source watching in servewatch.c and the HTTP
+ * plumbing in servehttp.c. */
+
+static struct {
+    const BuildOptions *opts;
+    const char *src_dir;
+    size_t requests;
+    pthread_mutex_t lock;
+} state = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER};
+
+static int stop_pipe[2] = {-1, -1};
+
+static void on_stop_signal(int sig) {
+    (void)sig;
+    char c = 0;
+    ssize_t n = write(stop_pipe[1], &c, 1);
+    (void)n;
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) * 1e3 + (double)(now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int respond(int fd, const char *method, const char *target, const char **how) {
+    bool head_only = str_eq(method, "HEAD");
+    *how = "";
+    if (!head_only && !str_eq(method, "GET")) {
+        http_send_text(fd, 405, "Method Not Allowed", false, "Allow: GET, HEAD\r\n");
+        return 405;
+    }
+    char rel[MAX_PATH_LEN];
+    int refused = http_request_rel_path(target, rel, sizeof(rel));
+    if (refused != 0) {
+        http_send_text(fd, refused, refused == 404 ? "Not Found" : "Bad Request", head_only, NULL);
+        return refused;
+    }
+
+    char path[MAX_PATH_LEN * 2];
+    snprintf(path, sizeof(path), "%s%s%s", state.src_dir, rel[0] ? "/" : "", rel);
+    struct stat st;
+    bool exists = stat(path, &st) == 0;
+    if (!exists && !has_html_ext(rel)) {
+        http_send_text(fd, 404, "Not Found", head_only, NULL);
+        return 404;
+    }
+    if (exists && S_ISDIR(st.st_mode)) {
+        char location[MAX_PATH_LEN + 32];
+        size_t len = strcspn(target, "?#");
+        snprintf(location, sizeof(location), "Location: %.*s/\r\n", (int)len, target);
+        http_send_text(fd, 301, "Moved Permanently", head_only, location);
+        return 301;
+    }
+    if (!has_html_ext(rel)) {
+        http_send_file(fd, path, rel, head_only);
+        return 200;
+    }
+
+    ServePage page;
+    ServeEntry *e = serve_cache_acquire(rel, &page, how);
+    if (page.status == 200) {
+        http_send_head(fd, 200, "OK", "text/html; charset=utf-8", page.len, NULL);
+        if (!head_only) {
+            http_send_all(fd, page.body, page.len);
+        }
+    } else if (page.status == 404) {
+        http_send_text(fd, 404, "Not Found", head_only, NULL);
+    } else {
+        http_send_text(fd, 500, "Internal Server Error", head_only, NULL);
+    }
+    serve_cache_release(e);
+    return page.status;
+}
+
+static void handle_connection(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char method[16];
+    char target[MAX_PATH_LEN];
+    bool parsed = http_read_request(fd, method, target);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const char *how = "";
+    int status;
+    if (parsed) {
+        status = respond(fd, method, target, &how);
+    } else {
+        snprintf(method, sizeof(method), "-");
+        snprintf(target, sizeof(target), "-");
+        status = 400;
+        http_send_text(fd, 400, "Bad Request", false, NULL);
+    }
+    close(fd);
+
+    pthread_mutex_lock(&state.lock);
+    state.requests++;
+    pthread_mutex_unlock(&state.lock);
+    if (!state.opts->quiet) {
+        fprintf(stderr, "%s %s %d%s%s (%.1f ms)\n", method, target, status, how[0] ? " " : "", how, elapsed_ms(&start));
+    }
+}
+
+static int open_listener(const BuildOptions *opts, BuildCtx *ctx, char *shown, size_t shown_cap) {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", opts->serve_port);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    struct addrinfo *addrs = NULL;
+    int rc = getaddrinfo(opts->serve_bind, port, &hints, &addrs);
+    if (rc != 0) {
+        log_error(ctx, "cannot resolve %s: %s", opts->serve_bind, gai_strerror(rc));
+        return -1;
+    }
+    int fd = -1;
+    int err = 0;
+    for (struct addrinfo *ai = addrs; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 128) != 0) {
+            err = errno;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    if (fd < 0) {
+        log_error(ctx, "cannot listen on %s:%d: %s", opts->serve_bind, opts->serve_port, strerror(err));
+        return -1;
+    }
+
+    struct sockaddr_storage bound;
+    socklen_t bound_len = sizeof(bound);
+    char host[SERVE_MAX_HOST] = "?";
+    char service[32] = "?";
+    if (getsockname(fd, (struct sockaddr *)&bound, &bound_len) == 0) {
+        getnameinfo((struct sockaddr *)&bound, bound_len, host, sizeof(host), service, sizeof(service),
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+    }
+    bool v6 = strchr(host, ':') != NULL;
+    snprintf(shown, shown_cap, "http://%s%s%s:%s/", v6 ? "[" : "", host, v6 ? "]" : "", service);
+    return fd;
+}
+
+void serve_run(const BuildOptions *opts, BuildCtx *ctx) {
+    state.opts = opts;
+    state.src_dir = opts->src_dir;
+    state.requests = 0;
+
+    struct stat st;
+    if (stat(state.src_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        log_error(ctx, "%s is not a directory", state.src_dir);
+        return;
+    }
+    char shown[SERVE_MAX_HOST + 64];
+    int listen_fd = open_listener(opts, ctx, shown, sizeof(shown));
+    if (listen_fd < 0) {
+        return;
+    }
+    int watch_fd = serve_watch_start(state.src_dir);
+    if (watch_fd < 0) {
+        log_warning(ctx, "inotify unavailable (%s); pages are cached until restart", strerror(errno));
+    }
+    if (pipe(stop_pipe) != 0) {
+        log_error(ctx, "pipe failed: %s", strerror(errno));
+        close(listen_fd);
+        serve_watch_finish();
+        return;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    size_t handlers = opts->jobs ? opts->jobs : pool_default_threads() * 2;
+    if (!opts->jobs && handlers < SERVE_MIN_HANDLERS) {
+        handlers = SERVE_MIN_HANDLERS;
+    }
+    WorkPool *pool = pool_create(handlers);
+    /* Only the compile thread records diagnostics from here on: flushing
+     * frees every thread's buffer. */
+    diag_flush(ctx);
+    bool compiler_started = serve_cache_start(opts);
+    if (!compiler_started) {
+        log_error(ctx, "failed to start the compile thread");
+    }
+    fprintf(stderr, "Serving %s on %s (pages compiled on request, %zu MB cache); Ctrl-C to stop\n", state.src_dir, shown,
+            opts->serve_cache_mb);
+
+    int poll_errno = 0;
+    while (compiler_started) {
+        struct pollfd fds[3] = {
+            {stop_pipe[0], POLLIN, 0},
+            {watch_fd, POLLIN, 0},
+            {listen_fd, POLLIN, 0},
+        };
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            poll_errno = errno;
+            break;
+        }
+        if (fds[0].revents) {
+            break;
+        }
+        /* Source changes go first, so a request made after an edit never
+         * sees the page from before it. */
+        if (fds[1].revents) {
+            serve_watch_events();
+        }
+        if (fds[2].revents & POLLIN) {
+            int client = accept(listen_fd, NULL, NULL);
+            if (client >= 0) {
+                pool_submit(pool, handle_connection, (void *)(intptr_t)client);
+            }
+        }
+    }
+
+    close(listen_fd);
+    pool_destroy(pool);
+    if (compiler_started) {
+        serve_cache_finish(true, state.requests);
+    }
+    if (poll_errno != 0) {
+        log_error(ctx, "poll failed: %s", strerror(poll_errno));
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    serve_watch_finish();
+}
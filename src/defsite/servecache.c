@@ -0,0 +1,326 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The page cache behind `serve --lazy`: compiled pages in a size-bounded
+ * LRU, dropped when their source changes.
+ *
+ * The compiler is not thread-safe, so one compile thread runs every page;
+ * connection handlers only wait for it. A request for a page that is already
+ * queued or compiling waits for that compile instead of starting another. */
+
+struct ServeEntry {
+    char *rel_path;
+    char *body;
+    size_t len;
+    bool ready;
+    bool ok;
+    bool missing; /* neither a source page nor a collection row */
+    bool cached;  /* reachable from the page map and the LRU list */
+    size_t refs;  /* requests holding the entry */
+    ServeEntry *newer;
+    ServeEntry *older;
+    ServeEntry *queue_next;
+};
+
+static struct {
+    const BuildOptions *opts;
+    const char *src_dir;
+    size_t budget;
+    size_t bytes;
+    StrMap pages; /* rel path -> ServeEntry, NULL once dropped */
+    ServeEntry *newest;
+    ServeEntry *oldest;
+    ServeEntry *queue_head;
+    ServeEntry *queue_tail;
+    bool stopping;
+    bool collections_stale; /* a template or data file changed */
+    pthread_t compiler;
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;
+    pthread_cond_t compiled;
+    size_t hits;
+    size_t compiles;
+    size_t coalesced;
+    size_t evictions;
+    size_t invalidations;
+} state;
+
+/* ---- LRU (all under state.lock) ---- */
+
+static void entry_free(void *value) {
+    ServeEntry *e = value;
+    if (!e) {
+        return;
+    }
+    xfree(e->rel_path);
+    xfree(e->body);
+    xfree(e);
+}
+
+static void lru_unlink(ServeEntry *e) {
+    if (e->newer) {
+        e->newer->older = e->older;
+    } else {
+        state.newest = e->older;
+    }
+    if (e->older) {
+        e->older->newer = e->newer;
+    } else {
+        state.oldest = e->newer;
+    }
+    e->newer = NULL;
+    e->older = NULL;
+}
+
+static void lru_push(ServeEntry *e) {
+    e->older = state.newest;
+    e->newer = NULL;
+    if (state.newest) {
+        state.newest->newer = e;
+    } else {
+        state.oldest = e;
+    }
+    state.newest = e;
+}
+
+/* Drops e from the cache; requests still holding it finish with its body. */
+static void uncache(ServeEntry *e) {
+    strmap_put(&state.pages, e->rel_path, NULL);
+    lru_unlink(e);
+    e->cached = false;
+    if (e->ready && e->ok) {
+        state.bytes -= e->len;
+    }
+    if (e->refs == 0) {
+        entry_free(e);
+    }
+}
+
+/* Oldest first; pages still compiling have no size yet and stay. */
+static void evict_over_budget(void) {
+    ServeEntry *e = state.oldest;
+    while (e && state.bytes > state.budget) {
+        ServeEntry *newer = e->newer;
+        if (e->ready) {
+            uncache(e);
+            state.evictions++;
+        }
+        e = newer;
+    }
+}
+
+/* An empty prefix drops everything. Matches are collected first because
+ * uncache writes to the map being scanned. */
+static void invalidate_prefix(const char *prefix) {
+    ServeEntry **matches = xmalloc((state.pages.count + 1) * sizeof(ServeEntry *));
+    size_t n = 0;
+    for (size_t i = 0; i < state.pages.cap; i++) {
+        ServeEntry *e = state.pages.slots[i].key ? state.pages.slots[i].value : NULL;
+        if (e && starts_with(e->rel_path, prefix)) {
+            matches[n++] = e;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        uncache(matches[i]);
+        state.invalidations++;
+    }
+    xfree(matches);
+}
+
+void serve_cache_invalidate(const char *rel_path) {
+    pthread_mutex_lock(&state.lock);
+    ServeEntry *e = strmap_get(&state.pages, rel_path);
+    if (e) {
+        uncache(e);
+        state.invalidations++;
+    }
+    pthread_mutex_unlock(&state.lock);
+}
+
+/* rel_dir ends with '/', or is "" for the whole tree. */
+void serve_cache_invalidate_dir(const char *rel_dir) {
+    pthread_mutex_lock(&state.lock);
+    invalidate_prefix(rel_dir);
+    pthread_mutex_unlock(&state.lock);
+}
+
+/* A collection's rows are pages of the template's directory; they are
+ * dropped, and the collections are loaded again before the next compile. */
+void serve_cache_collection_changed(const char *rel_dir) {
+    pthread_mutex_lock(&state.lock);
+    state.collections_stale = true;
+    invalidate_prefix(rel_dir);
+    pthread_mutex_unlock(&state.lock);
+}
+
+/* ---- compile thread ---- */
+
+static void compile_entry(ServeEntry *e) {
+    char src_path[MAX_PATH_LEN * 2];
+    snprintf(src_path, sizeof(src_path), "%s/%s", state.src_dir, e->rel_path);
+
+    BuildCtx ctx;
+    ctx.error_count = 0;
+    ctx.warning_count = 0;
+    ctx.current_file = src_path;
+    ctx.opts = state.opts;
+
+    StrBuf page = {0};
+    bool ok = false;
+    bool missing = false;
+    char *source = read_file(src_path);
+    if (source) {
+        ok = compile_page(e->rel_path, source, strlen(source), &page, &ctx);
+        xfree(source);
+    } else if (access(src_path, F_OK) == 0) {
+        log_error(&ctx, "failed to read %s", src_path);
+    } else {
+        /* Collection rows have no source page of their own. */
+        pthread_mutex_lock(&state.lock);
+        bool stale = state.collections_stale;
+        state.collections_stale = false;
+        pthread_mutex_unlock(&state.lock);
+        if (stale) {
+            collection_finish();
+        }
+        bool found = false;
+        ok = collection_render_url(state.src_dir, e->rel_path, &page, &ctx, &found);
+        missing = !found && ctx.error_count == 0;
+    }
+    /* Each page's diagnostics are printed as soon as it is compiled. */
+    diag_flush(&ctx);
+
+    pthread_mutex_lock(&state.lock);
+    e->body = page.data;
+    e->len = page.len;
+    e->ok = ok;
+    e->missing = missing;
+    e->ready = true;
+    if (e->cached) {
+        /* A failed page is compiled again (and reported again) next time. */
+        if (ok) {
+            state.bytes += e->len;
+            evict_over_budget();
+        } else {
+            uncache(e);
+        }
+    }
+    pthread_cond_broadcast(&state.compiled);
+    pthread_mutex_unlock(&state.lock);
+}
+
+static void *compile_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&state.lock);
+    for (;;) {
+        while (!state.queue_head && !state.stopping) {
+            pthread_cond_wait(&state.has_work, &state.lock);
+        }
+        ServeEntry *e = state.queue_head;
+        if (!e) {
+            break;
+        }
+        state.queue_head = e->queue_next;
+        if (!state.queue_head) {
+            state.queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&state.lock);
+        compile_entry(e);
+        pthread_mutex_lock(&state.lock);
+    }
+    pthread_mutex_unlock(&state.lock);
+    return NULL;
+}
+
+/* Returns the entry for rel_path, compiled, with a reference held, and
+ * fills *page from it; *how says whether it was cached, compiled for this
+ * request, or shared with a compile another request started. */
+ServeEntry *serve_cache_acquire(const char *rel_path, ServePage *page, const char **how) {
+    pthread_mutex_lock(&state.lock);
+    ServeEntry *e = strmap_get(&state.pages, rel_path);
+    if (e && e->ready) {
+        state.hits++;
+        lru_unlink(e);
+        lru_push(e);
+        *how = "cached";
+    } else if (e) {
+        state.coalesced++;
+        *how = "coalesced";
+    } else {
+        e = xmalloc(sizeof(ServeEntry));
+        memset(e, 0, sizeof(*e));
+        e->rel_path = xstrdup(rel_path);
+        e->cached = true;
+        strmap_put(&state.pages, rel_path, e);
+        lru_push(e);
+        if (state.queue_tail) {
+            state.queue_tail->queue_next = e;
+        } else {
+            state.queue_head = e;
+        }
+        state.queue_tail = e;
+        state.compiles++;
+        pthread_cond_signal(&state.has_work);
+        *how = "compiled";
+    }
+    e->refs++;
+    while (!e->ready) {
+        pthread_cond_wait(&state.compiled, &state.lock);
+    }
+    pthread_mutex_unlock(&state.lock);
+    page->body = e->body ? e->body : "";
+    page->len = e->len;
+    page->status = e->missing ? 404 : e->ok ? 200 : 500;
+    return e;
+}
+
+void serve_cache_release(ServeEntry *e) {
+    pthread_mutex_lock(&state.lock);
+    e->refs--;
+    if (!e->cached && e->refs == 0) {
+        entry_free(e);
+    }
+    pthread_mutex_unlock(&state.lock);
+}
+
+/* Starts the compile thread; false if it could not be started. */
+bool serve_cache_start(const BuildOptions *opts) {
+    memset(&state, 0, sizeof(state));
+    state.opts = opts;
+    state.src_dir = opts->src_dir;
+    state.budget = opts->serve_cache_mb * 1024u * 1024u;
+    strmap_init(&state.pages);
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.has_work, NULL);
+    pthread_cond_init(&state.compiled, NULL);
+    if (pthread_create(&state.compiler, NULL, compile_thread, NULL) != 0) {
+        serve_cache_finish(false, 0);
+        return false;
+    }
+    return true;
+}
+
+/* Stops the compile thread (when started), prints the summary and frees
+ * every cached page. */
+void serve_cache_finish(bool started, size_t requests) {
+    if (started) {
+        pthread_mutex_lock(&state.lock);
+        state.stopping = true;
+        pthread_cond_signal(&state.has_work);
+        pthread_mutex_unlock(&state.lock);
+        pthread_join(state.compiler, NULL);
+        fprintf(stderr,
+                "Served %zu request(s): %zu page(s) from cache, %zu compiled, %zu coalesced; %zu evicted, %zu invalidated\n",
+                requests, state.hits, state.compiles, state.coalesced, state.evictions, state.invalidations);
+    }
+    strmap_free(&state.pages, entry_free);
+    pthread_cond_destroy(&state.has_work);
+    pthread_cond_destroy(&state.compiled);
+    pthread_mutex_destroy(&state.lock);
+}
@@ -0,0 +1,228 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define SERVE_MAX_REQUEST 16384
+#define SERVE_IO_TIMEOUT_SEC 10
+#define SERVE_SEND_CHUNK (64u * 1024u)
+
+/* The HTTP side of `serve --lazy`: just enough HTTP/1.1 for a local dev
+ * server. One request per connection, GET and HEAD only. */
+
+/* Reads the request head and splits out its method (up to 15 bytes) and
+ * target (up to MAX_PATH_LEN - 1); false for a request without both. */
+bool http_read_request(int fd, char *method, char *target) {
+    struct timeval timeout = {SERVE_IO_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char req[SERVE_MAX_REQUEST + 1];
+    size_t len = 0;
+    while (len < SERVE_MAX_REQUEST) {
+        ssize_t n = recv(fd, req + len, SERVE_MAX_REQUEST - len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += (size_t)n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+            break;
+        }
+    }
+    req[len] = '\0';
+    return sscanf(req, "%15s %4095s", method, target) == 2;
+}
+
+bool http_send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+void http_send_head(int fd, int status, const char *reason, const char *type, size_t len, const char *extra) {
+    char head[1024];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Cache-Control: no-cache\r\n"
+                     "%s"
+                     "Connection: close\r\n\r\n",
+                     status, reason, type, len, extra ? extra : "");
+    if (n > 0 && (size_t)n < sizeof(head)) {
+        http_send_all(fd, head, (size_t)n);
+    }
+}
+
+void http_send_text(int fd, int status, const char *reason, bool head_only, const char *extra) {
+    char body[256];
+    snprintf(body, sizeof(body), "%d %s\n", status, reason);
+    http_send_head(fd, status, reason, "text/plain; charset=utf-8", strlen(body), extra);
+    if (!head_only) {
+        http_send_all(fd, body, strlen(body));
+    }
+}
+
+static const char *content_type(const char *path) {
+    static const char *const TYPES[][2] = {
+        {".html", "text/html; charset=utf-8"},
+        {".htm", "text/html; charset=utf-8"},
+        {".css", "text/css; charset=utf-8"},
+        {".js", "text/javascript; charset=utf-8"},
+        {".mjs", "text/javascript; charset=utf-8"},
+        {".json", "application/json"},
+        {".xml", "application/xml"},
+        {".txt", "text/plain; charset=utf-8"},
+        {".svg", "image/svg+xml"},
+        {".png", "image/png"},
+        {".jpg", "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"},
+        {".webp", "image/webp"},
+        {".avif", "image/avif"},
+        {".ico", "image/x-icon"},
+        {".woff", "font/woff"},
+        {".woff2", "font/woff2"},
+        {".pdf", "application/pdf"},
+        {".mp4", "video/mp4"},
+        {".webm", "video/webm"},
+        {".wasm", "application/wasm"},
+    };
+    const char *dot = strrchr(path, '.');
+    if (dot && !strchr(dot, '/')) {
+        char ext[16];
+        snprintf(ext, sizeof(ext), "%s", dot);
+        to_lower_inplace(ext);
+        for (size_t i = 0; i < sizeof(TYPES) / sizeof(TYPES[0]); i++) {
+            if (str_eq(ext, TYPES[i][0])) {
+                return TYPES[i][1];
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Decodes the request path into a source-relative path, dropping empty and
+ * "." segments. A trailing slash maps to the directory's index.html.
+ * Returns 0, or the status to answer with: 400 for "..", encoded NULs and
+ * oversized paths, 404 for any hidden segment (".git/config", ".env"). */
+int http_request_rel_path(const char *target, char *rel, size_t cap) {
+    if (target[0] != '/') {
+        return 400;
+    }
+    char decoded[MAX_PATH_LEN];
+    size_t n = 0;
+    for (const char *p = target; *p && *p != '?' && *p != '#'; p++) {
+        char c = *p;
+        if (c == '%') {
+            int hi = hex_value(p[1]);
+            int lo = hi < 0 ? -1 : hex_value(p[2]);
+            if (lo < 0) {
+                return 400;
+            }
+            c = (char)(hi * 16 + lo);
+            p += 2;
+            if (c == '\0') {
+                return 400;
+            }
+        }
+        if (n + 1 >= sizeof(decoded)) {
+            return 400;
+        }
+        decoded[n++] = c;
+    }
+    decoded[n] = '\0';
+    bool dir_request = decoded[n - 1] == '/';
+
+    size_t out = 0;
+    rel[0] = '\0';
+    for (char *seg = decoded; seg;) {
+        char *slash = strchr(seg, '/');
+        if (slash) {
+            *slash = '\0';
+        }
+        if (str_eq(seg, "..")) {
+            return 400;
+        }
+        if (seg[0] == '.' && seg[1]) {
+            return 404;
+        }
+        if (seg[0] && !str_eq(seg, ".")) {
+            size_t len = strlen(seg);
+            if (out + len + 2 >= cap) {
+                return 400;
+            }
+            if (out > 0) {
+                rel[out++] = '/';
+            }
+            memcpy(rel + out, seg, len);
+            out += len;
+            rel[out] = '\0';
+        }
+        seg = slash ? slash + 1 : NULL;
+    }
+    if (dir_request) {
+        const char *index = out > 0 ? "/index.html" : "index.html";
+        if (out + strlen(index) >= cap) {
+            return 400;
+        }
+        snprintf(rel + out, cap - out, "%s", index);
+    }
+    return 0;
+}
+
+void http_send_file(int fd, const char *path, const char *rel_path, bool head_only) {
+    int in = open(path, O_RDONLY);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) != 0) {
+        if (in >= 0) {
+            close(in);
+        }
+        http_send_text(fd, 404, "Not Found", head_only, NULL);
+        return;
+    }
+    http_send_head(fd, 200, "OK", content_type(rel_path), (size_t)st.st_size, NULL);
+    if (!head_only) {
+        char *buf = xmalloc(SERVE_SEND_CHUNK);
+        ssize_t n;
+        while ((n = read(in, buf, SERVE_SEND_CHUNK)) > 0 && http_send_all(fd, buf, (size_t)n)) {
+        }
+        xfree(buf);
+    }
+    close(in);
+}
+
@@ -0,0 +1,142 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SERVE_WATCH_MASK \
+    (IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF)
+
+/* Source watching for `serve --lazy`: one inotify watch per source
+ * directory, turning changes into page cache invalidations. Runs on the
+ * main thread only. */
+
+static struct {
+    const char *src_dir;
+    int fd;
+    char **watches; /* wd -> rel dir */
+    size_t watch_cap;
+    bool watch_limit_hit;
+} state = {NULL, -1, NULL, 0, false};
+
+static void watch_tree(const char *rel_dir) {
+    char path[MAX_PATH_LEN * 2];
+    snprintf(path, sizeof(path), "%s%s%s", state.src_dir, rel_dir[0] ? "/" : "", rel_dir);
+    int wd = inotify_add_watch(state.fd, path, SERVE_WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) {
+        if (!state.watch_limit_hit) {
+            fprintf(stderr, "WARN: cannot watch %s (%s); edits under it are not noticed until restart\n", path, strerror(errno));
+            state.watch_limit_hit = errno == ENOSPC;
+        }
+        return;
+    }
+    if ((size_t)wd >= state.watch_cap) {
+        size_t cap = state.watch_cap ? state.watch_cap : 64;
+        while (cap <= (size_t)wd) {
+            cap *= 2;
+        }
+        state.watches = xrealloc(state.watches, cap * sizeof(char *));
+        memset(state.watches + state.watch_cap, 0, (cap - state.watch_cap) * sizeof(char *));
+        state.watch_cap = cap;
+    }
+    xfree(state.watches[wd]);
+    state.watches[wd] = xstrdup(rel_dir);
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (str_eq(entry->d_name, ".") || str_eq(entry->d_name, "..")) {
+            continue;
+        }
+        char child[MAX_PATH_LEN * 2 + 256];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (stat(child, &st) == 0 && S_ISDIR(st.st_mode)) {
+            char rel[MAX_PATH_LEN * 2];
+            snprintf(rel, sizeof(rel), "%s%s%s", rel_dir, rel_dir[0] ? "/" : "", entry->d_name);
+            watch_tree(rel);
+        }
+    }
+    closedir(dir);
+}
+
+/* Watches the whole tree; returns the descriptor to poll, or -1 (with errno
+ * set) when inotify is unavailable. */
+int serve_watch_start(const char *src_dir) {
+    state.src_dir = src_dir;
+    state.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (state.fd >= 0) {
+        watch_tree("");
+    }
+    return state.fd;
+}
+
+static bool is_collection_data(const char *rel_path) {
+    char path[MAX_PATH_LEN * 4];
+    snprintf(path, sizeof(path), "%s/%s", state.src_dir, rel_path);
+    return collection_is_data(path);
+}
+
+void serve_watch_events(void) {
+    _Alignas(struct inotify_event) char buf[64 * 1024];
+    ssize_t n = read(state.fd, buf, sizeof(buf));
+    for (ssize_t off = 0; off < n;) {
+        const struct inotify_event *ev = (const struct inotify_event *)(buf + off);
+        off += (ssize_t)(sizeof(struct inotify_event) + ev->len);
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+            serve_cache_invalidate_dir("");
+        }
+        const char *dir = ev->wd >= 0 && (size_t)ev->wd < state.watch_cap ? state.watches[ev->wd] : NULL;
+        if (dir && (ev->mask & IN_IGNORED)) {
+            xfree(state.watches[ev->wd]);
+            state.watches[ev->wd] = NULL;
+        } else if (dir && ev->len > 0) {
+            char rel[MAX_PATH_LEN * 2];
+            snprintf(rel, sizeof(rel), "%s%s%s", dir, dir[0] ? "/" : "", ev->name);
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    watch_tree(rel);
+                }
+                size_t len = strlen(rel);
+                if (len + 1 < sizeof(rel)) {
+                    rel[len] = '/';
+                    rel[len + 1] = '\0';
+                }
+                serve_cache_invalidate_dir(rel);
+            } else if (collection_is_template(rel) || is_collection_data(rel)) {
+                char *slash = strrchr(rel, '/');
+                if (slash) {
+                    slash[1] = '\0';
+                } else {
+                    rel[0] = '\0';
+                }
+                serve_cache_collection_changed(rel);
+            } else {
+                serve_cache_invalidate(rel);
+            }
+        }
+    }
+}
+
+void serve_watch_finish(void) {
+    if (state.fd >= 0) {
+        close(state.fd);
+        state.fd = -1;
+    }
+    for (size_t i = 0; i < state.watch_cap; i++) {
+        xfree(state.watches[i]);
+    }
+    xfree(state.watches);
+    state.watches = NULL;
+    state.watch_cap = 0;
+}
@@ -0,0 +1,272 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define SHARD_PREFIX ".defsite-shard-"
+#define SHARD_ASSET_MANIFEST "asset-manifest.json"
+
+/* --shard=I/N builds the pages and assets whose path hashes to I modulo N.
+ * The path is relative to the source root, so every shard agrees on the
+ * split no matter where it runs. */
+bool shard_owns(const BuildOptions *opts, const char *rel_path) {
+    if (!opts || opts->shard_count == 0) {
+        return true;
+    }
+    return hash_str(rel_path) % opts->shard_count == opts->shard_index;
+}
+
+/* Shards leave their partial index, stats and diagnostics next to their
+ * output as .defsite-shard-<name>; `defsite merge` reads them back. */
+char *shard_fragment_path(const char *dir, const char *name) {
+    StrBuf path = {0};
+    sb_append(&path, dir);
+    sb_append(&path, "/" SHARD_PREFIX);
+    sb_append(&path, name);
+    return path.data;
+}
+
+static bool same_file(const char *a, const char *b) {
+    struct stat sa;
+    struct stat sb;
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/* Copies a shard's output tree into the merged output, leaving out build
+ * state and the files merge writes itself. */
+static void copy_tree(const char *src, const char *dst, bool top, size_t *copied, BuildCtx *ctx) {
+    if (ensure_dir(dst) != 0) {
+        log_error(ctx, "failed to create directory %s: %s", dst, strerror(errno));
+        return;
+    }
+    DIR *dir = opendir(src);
+    if (!dir) {
+        log_error(ctx, "failed to open directory %s: %s", src, strerror(errno));
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (str_eq(name, ".") || str_eq(name, "..") || starts_with(name, ".defsite-")) {
+            continue;
+        }
+        if (top && (str_eq(name, "search-index") || starts_with(name, "search-index.json") || starts_with(name, "search-index.bin") ||
+                    starts_with(name, SHARD_ASSET_MANIFEST))) {
+            continue;
+        }
+        char src_path[MAX_PATH_LEN];
+        char dst_path[MAX_PATH_LEN];
+        snprintf(src_path, sizeof(src_path), "%s/%s", src, name);
+        snprintf(dst_path, sizeof(dst_path), "%s/%s", dst, name);
+        struct stat st;
+        if (stat(src_path, &st) != 0) {
+            log_error(ctx, "stat failed for %s: %s", src_path, strerror(errno));
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            copy_tree(src_path, dst_path, false, copied, ctx);
+        } else if (!same_file(src_path, dst_path)) {
+            if (copy_file(src_path, dst_path)) {
+                (*copied)++;
+            } else {
+                log_error(ctx, "failed to copy %s to %s", src_path, dst_path);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+/* Reads "defsite-shard-index 1 TAB I/N" from the head of a fragment. */
+static bool read_shard_header(const char *path, size_t *index, size_t *count) {
+    IoStream *in = io_stream_open(path);
+    if (!in) {
+        return false;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    bool ok = io_stream_read_line(in, &line, &cap) && sscanf(line, "defsite-shard-index 1\t%zu/%zu", index, count) == 2;
+    io_stream_close(in);
+    xfree(line);
+    return ok && *count > 0 && *index < *count;
+}
+
+/* Checks that the inputs are shards 0..N-1 of one split, each exactly once. */
+static bool check_shard_set(const BuildOptions *opts, char **fragments, BuildCtx *ctx) {
+    size_t expected = 0;
+    bool *seen = NULL;
+    bool ok = true;
+    for (size_t i = 0; i < opts->merge_input_count; i++) {
+        size_t index = 0;
+        size_t count = 0;
+        if (!read_shard_header(fragments[i], &index, &count)) {
+            log_error(ctx, "%s is not a shard output directory (missing or unreadable %s)", opts->merge_inputs[i], fragments[i]);
+            ok = false;
+            continue;
+        }
+        if (!seen) {
+            expected = count;
+            seen = xmalloc(count * sizeof(bool));
+            memset(seen, 0, count * sizeof(bool));
+        }
+        if (count != expected) {
+            log_error(ctx, "%s was built as shard %zu/%zu but other inputs use %zu shards", opts->merge_inputs[i], index, count, expected);
+            ok = false;
+        } else if (seen[index]) {
+            log_error(ctx, "shard %zu/%zu given more than once (%s)", index, count, opts->merge_inputs[i]);
+            ok = false;
+        } else {
+            seen[index] = true;
+        }
+    }
+    for (size_t i = 0; seen && i < expected; i++) {
+        if (!seen[i]) {
+            log_error(ctx, "shard %zu/%zu missing from merge inputs", i, expected);
+            ok = false;
+        }
+    }
+    xfree(seen);
+    return ok;
+}
+
+static int cmp_str_ptr(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Every shard hashes all fingerprinted assets, so the manifests normally
+ * agree; the union is written and disagreements are errors. */
+static void merge_asset_manifests(const BuildOptions *opts, BuildCtx *ctx) {
+    StrMap assets;
+    strmap_init(&assets);
+    bool any = false;
+    for (size_t i = 0; i < opts->merge_input_count; i++) {
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s", opts->merge_inputs[i], SHARD_ASSET_MANIFEST);
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        JsonValue *manifest = json_read_file(path, ctx);
+        if (!manifest) {
+            continue;
+        }
+        any = true;
+        for (size_t k = 0; manifest->type == JSON_OBJECT && k < manifest->count; k++) {
+            const JsonValue *v = manifest->items[k];
+            if (v->type != JSON_STRING) {
+                continue;
+            }
+            const char *prev = strmap_get(&assets, manifest->keys[k]);
+            if (!prev) {
+                strmap_put(&assets, manifest->keys[k], xstrdup(v->string));
+            } else if (!str_eq(prev, v->string)) {
+                log_error(ctx, "shards disagree on fingerprinted name of %s (%s and %s)", manifest->keys[k], prev, v->string);
+            }
+        }
+        json_free(manifest);
+    }
+    if (!any) {
+        strmap_free(&assets, xfree);
+        return;
+    }
+
+    char **keys = xmalloc((assets.count + 1) * sizeof(char *));
+    size_t n = 0;
+    for (size_t i = 0; i < assets.cap; i++) {
+        if (assets.slots[i].key) {
+            keys[n++] = assets.slots[i].key;
+        }
+    }
+    qsort(keys, n, sizeof(char *), cmp_str_ptr);
+    StrBuf out = {0};
+    sb_append(&out, "{\n");
+    for (size_t i = 0; i < n; i++) {
+        sb_append(&out, "  ");
+        json_append_escaped(&out, keys[i]);
+        sb_append(&out, ": ");
+        json_append_escaped(&out, strmap_get(&assets, keys[i]));
+        sb_append(&out, i + 1 < n ? ",\n" : "\n");
+    }
+    sb_append(&out, "}\n");
+
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", opts->out_dir, SHARD_ASSET_MANIFEST);
+    if (!write_file(path, out.data)) {
+        log_error(ctx, "failed to write %s", path);
+        xfree(out.data);
+    } else {
+        compress_submit(path, out.data, out.len);
+    }
+    xfree(keys);
+    strmap_free(&assets, xfree);
+}
+
+/* Folds one JSON fragment per shard into diag.c or stats.c. */
+static void absorb_fragments(const BuildOptions *opts, const char *name, bool is_stats, BuildCtx *ctx) {
+    size_t missing = 0;
+    for (size_t i = 0; i < opts->merge_input_count; i++) {
+        char *path = shard_fragment_path(opts->merge_inputs[i], name);
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            missing++;
+            xfree(path);
+            continue;
+        }
+        JsonValue *report = json_read_file(path, ctx);
+        if (report) {
+            if (is_stats) {
+                stats_absorb(report);
+            } else {
+                diag_absorb(report, ctx);
+            }
+            json_free(report);
+        }
+        xfree(path);
+    }
+    if (is_stats && missing > 0) {
+        log_warning(ctx, "%zu shard(s) were built without --stats; merged statistics are partial", missing);
+    }
+}
+
+/* `defsite merge OUT SHARD...`: copies the shard outputs into OUT, writes
+ * the discovery index from the shards' partial indexes, and combines the
+ * asset manifests, statistics and diagnostics. */
+void merge_shards(const BuildOptions *opts, BuildCtx *ctx) {
+    char **fragments = xmalloc(opts->merge_input_count * sizeof(char *));
+    for (size_t i = 0; i < opts->merge_input_count; i++) {
+        fragments[i] = shard_fragment_path(opts->merge_inputs[i], "index");
+    }
+
+    if (check_shard_set(opts, fragments, ctx)) {
+        size_t copied = 0;
+        profile_begin();
+        for (size_t i = 0; i < opts->merge_input_count; i++) {
+            copy_tree(opts->merge_inputs[i], opts->out_dir, true, &copied, ctx);
+        }
+        profile_end("phase", "copy", NULL);
+
+        char index_path[MAX_PATH_LEN];
+        snprintf(index_path, sizeof(index_path), "%s/search-index.json", opts->out_dir);
+        profile_begin();
+        MemSubsystem prev_mem = mem_enter(MEM_INDEX);
+        merge_index_fragments((const char *const *)fragments, opts->merge_input_count, index_path, ctx);
+        mem_leave(prev_mem);
+        profile_end("phase", "index", NULL);
+
+        merge_asset_manifests(opts, ctx);
+        absorb_fragments(opts, "diagnostics.json", false, ctx);
+        if (stats_enabled()) {
+            absorb_fragments(opts, "stats.json", true, ctx);
+        }
+        fprintf(stderr, "Merged %zu shard(s) into %s (%zu file(s))\n", opts->merge_input_count, opts->out_dir, copied);
+    }
+
+    for (size_t i = 0; i < opts->merge_input_count; i++) {
+        xfree(fragments[i]);
+    }
+    xfree(fragments);
+}
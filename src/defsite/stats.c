@@ -0,0 +1,337 @@
+#define _POSIX_C_SOURCE 200809L
+#include "common.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STATS_TABLE_ROWS 20
+
+typedef struct {
+    char *symbol;
+    size_t invocations;
+    size_t nodes;
+    size_t bytes;
+    int max_depth;
+    size_t slot_nodes;
+    size_t max_slot_nodes;
+    size_t slot_bytes;
+    size_t max_slot_bytes;
+    uint64_t ns;
+} ComponentStats;
+
+typedef struct {
+    char *path;
+    size_t input_bytes;
+    size_t output_bytes;
+} PageStats;
+
+static struct {
+    bool enabled;
+    const char *path;
+    char *shard_path;
+    StrMap components;
+    PageStats *pages;
+    size_t page_count;
+    size_t page_cap;
+    pthread_mutex_t lock;
+} state;
+
+void stats_init(const BuildOptions *opts) {
+    memset(&state, 0, sizeof(state));
+    strmap_init(&state.components);
+    if (!opts->stats_path) {
+        return;
+    }
+    state.enabled = true;
+    state.path = opts->stats_path;
+    if (opts->shard_count > 0) {
+        state.shard_path = shard_fragment_path(opts->out_dir, "stats.json");
+    }
+    pthread_mutex_init(&state.lock, NULL);
+}
+
+bool stats_enabled(void) {
+    return state.enabled;
+}
+
+uint64_t stats_now(void) {
+    if (!state.enabled) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static ComponentStats *component_for(const char *symbol) {
+    ComponentStats *c = strmap_get(&state.components, symbol);
+    if (!c) {
+        c = xmalloc(sizeof(ComponentStats));
+        memset(c, 0, sizeof(*c));
+        c->symbol = xstrdup(symbol);
+        strmap_put(&state.components, symbol, c);
+    }
+    return c;
+}
+
+/* Records one expansion of `invocation` at nesting `depth` (1 = invoked from
+ * page content), which produced `produced`; `start` is from stats_now(). */
+void stats_component(const Node *invocation, int depth, Node *const *produced, size_t produced_count, uint64_t start) {
+    if (!state.enabled) {
+        return;
+    }
+    uint64_t ns = stats_now() - start;
+    size_t nodes = 0;
+    size_t bytes = 0;
+    for (size_t i = 0; i < produced_count; i++) {
+        node_measure(produced[i], &nodes, &bytes);
+    }
+    size_t slot_nodes = 0;
+    size_t slot_bytes = 0;
+    for (size_t i = 0; i < invocation->child_count; i++) {
+        node_measure(invocation->children[i], &slot_nodes, &slot_bytes);
+    }
+
+    pthread_mutex_lock(&state.lock);
+    ComponentStats *c = component_for(invocation->tag);
+    c->invocations++;
+    c->nodes += nodes;
+    c->bytes += bytes;
+    c->ns += ns;
+    c->slot_nodes += slot_nodes;
+    if (slot_nodes > c->max_slot_nodes) {
+        c->max_slot_nodes = slot_nodes;
+    }
+    c->slot_bytes += slot_bytes;
+    if (slot_bytes > c->max_slot_bytes) {
+        c->max_slot_bytes = slot_bytes;
+    }
+    if (depth > c->max_depth) {
+        c->max_depth = depth;
+    }
+    pthread_mutex_unlock(&state.lock);
+}
+
+void stats_page(const char *path, size_t input_bytes, size_t output_bytes) {
+    if (!state.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&state.lock);
+    if (state.page_count == state.page_cap) {
+        state.page_cap = state.page_cap == 0 ? 256 : state.page_cap * 2;
+        state.pages = xrealloc(state.pages, state.page_cap * sizeof(PageStats));
+    }
+    PageStats *page = &state.pages[state.page_count++];
+    page->path = xstrdup(path);
+    page->input_bytes = input_bytes;
+    page->output_bytes = output_bytes;
+    pthread_mutex_unlock(&state.lock);
+}
+
+/* Adds a written report (a shard's, when merging) to the running totals. */
+void stats_absorb(const JsonValue *report) {
+    if (!state.enabled) {
+        return;
+    }
+    const JsonValue *components = json_get(report, "components");
+    for (size_t i = 0; components && components->type == JSON_ARRAY && i < components->count; i++) {
+        const JsonValue *item = components->items[i];
+        ComponentStats *c = component_for(json_get_string(item, "symbol"));
+        c->invocations += (size_t)json_get_number(item, "invocations");
+        c->nodes += (size_t)json_get_number(item, "nodes");
+        c->bytes += (size_t)json_get_number(item, "bytes");
+        c->slot_nodes += (size_t)json_get_number(item, "slot_nodes");
+        c->slot_bytes += (size_t)json_get_number(item, "slot_bytes");
+        c->ns += (uint64_t)(json_get_number(item, "time_ms") * 1e6);
+        int depth = (int)json_get_number(item, "max_depth");
+        size_t max_slot = (size_t)json_get_number(item, "max_slot_nodes");
+        c->max_depth = depth > c->max_depth ? depth : c->max_depth;
+        c->max_slot_nodes = max_slot > c->max_slot_nodes ? max_slot : c->max_slot_nodes;
+        size_t max_slot_bytes = (size_t)json_get_number(item, "max_slot_bytes");
+        c->max_slot_bytes = max_slot_bytes > c->max_slot_bytes ? max_slot_bytes : c->max_slot_bytes;
+    }
+    const JsonValue *pages = json_get(report, "pages");
+    for (size_t i = 0; pages && pages->type == JSON_ARRAY && i < pages->count; i++) {
+        const JsonValue *item = pages->items[i];
+        stats_page(json_get_string(item, "path"),
+                   (size_t)json_get_number(item, "input_bytes"),
+                   (size_t)json_get_number(item, "output_bytes"));
+    }
+}
+
+static double page_ratio(const PageStats *page) {
+    return page->input_bytes ? (double)page->output_bytes / (double)page->input_bytes : 0.0;
+}
+
+static int cmp_component_time_desc(const void *a, const void *b) {
+    const ComponentStats *x = *(const ComponentStats *const *)a;
+    const ComponentStats *y = *(const ComponentStats *const *)b;
+    if (x->ns != y->ns) {
+        return x->ns < y->ns ? 1 : -1;
+    }
+    return strcmp(x->symbol, y->symbol);
+}
+
+static int cmp_page_path(const void *a, const void *b) {
+    return strcmp(((const PageStats *)a)->path, ((const PageStats *)b)->path);
+}
+
+static int cmp_page_ratio_desc(const void *a, const void *b) {
+    const PageStats *x = *(const PageStats *const *)a;
+    const PageStats *y = *(const PageStats *const *)b;
+    double rx = page_ratio(x);
+    double ry = page_ratio(y);
+    if (rx != ry) {
+        return rx < ry ? 1 : -1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+static void append_fmt_size(StrBuf *b, const char *key, size_t value) {
+    char num[96];
+    snprintf(num, sizeof(num), ", \"%s\": %zu", key, value);
+    sb_append(b, num);
+}
+
+static bool write_report(const char *path, ComponentStats **components, size_t count) {
+    StrBuf b = {0};
+    char num[96];
+    size_t input_total = 0;
+    size_t output_total = 0;
+    for (size_t i = 0; i < state.page_count; i++) {
+        input_total += state.pages[i].input_bytes;
+        output_total += state.pages[i].output_bytes;
+    }
+    snprintf(num,
+             sizeof(num),
+             "{\n  \"totals\": {\"pages\": %zu, \"input_bytes\": %zu, \"output_bytes\": %zu",
+             state.page_count,
+             input_total,
+             output_total);
+    sb_append(&b, num);
+    snprintf(num, sizeof(num), ", \"expansion_ratio\": %.4f},\n", input_total ? (double)output_total / (double)input_total : 0.0);
+    sb_append(&b, num);
+
+    sb_append(&b, "  \"components\": [");
+    for (size_t i = 0; i < count; i++) {
+        const ComponentStats *c = components[i];
+        sb_append(&b, i ? ",\n    {\"symbol\": " : "\n    {\"symbol\": ");
+        json_append_escaped(&b, c->symbol);
+        append_fmt_size(&b, "invocations", c->invocations);
+        append_fmt_size(&b, "nodes", c->nodes);
+        append_fmt_size(&b, "bytes", c->bytes);
+        append_fmt_size(&b, "max_depth", (size_t)c->max_depth);
+        append_fmt_size(&b, "slot_nodes", c->slot_nodes);
+        append_fmt_size(&b, "max_slot_nodes", c->max_slot_nodes);
+        append_fmt_size(&b, "slot_bytes", c->slot_bytes);
+        append_fmt_size(&b, "max_slot_bytes", c->max_slot_bytes);
+        snprintf(num, sizeof(num), ", \"time_ms\": %.3f}", (double)c->ns / 1e6);
+        sb_append(&b, num);
+    }
+    sb_append(&b, "\n  ],\n  \"pages\": [");
+    for (size_t i = 0; i < state.page_count; i++) {
+        const PageStats *page = &state.pages[i];
+        sb_append(&b, i ? ",\n    {\"path\": " : "\n    {\"path\": ");
+        json_append_escaped(&b, page->path);
+        append_fmt_size(&b, "input_bytes", page->input_bytes);
+        append_fmt_size(&b, "output_bytes", page->output_bytes);
+        snprintf(num, sizeof(num), ", \"expansion_ratio\": %.4f}", page_ratio(page));
+        sb_append(&b, num);
+    }
+    sb_append(&b, "\n  ]\n}\n");
+    bool ok = write_file(path, b.data);
+    xfree(b.data);
+    return ok;
+}
+
+static void print_table(ComponentStats **components, size_t count) {
+    if (count > 0) {
+        fprintf(stderr, "Component expansion (by cumulative time):\n");
+        fprintf(stderr,
+                "  %-24s %10s %10s %12s %6s %10s %12s %12s %10s\n",
+                "component",
+                "calls",
+                "nodes",
+                "bytes",
+                "depth",
+                "slot avg",
+                "slot bytes",
+                "slot max B",
+                "time ms");
+        for (size_t i = 0; i < count && i < STATS_TABLE_ROWS; i++) {
+            const ComponentStats *c = components[i];
+            fprintf(stderr,
+                    "  %-24s %10zu %10zu %12zu %6d %10.1f %12zu %12zu %10.3f\n",
+                    c->symbol,
+                    c->invocations,
+                    c->nodes,
+                    c->bytes,
+                    c->max_depth,
+                    (double)c->slot_nodes / (double)c->invocations,
+                    c->slot_bytes,
+                    c->max_slot_bytes,
+                    (double)c->ns / 1e6);
+        }
+    }
+
+    if (state.page_count == 0) {
+        return;
+    }
+    PageStats **order = xmalloc(state.page_count * sizeof(PageStats *));
+    for (size_t i = 0; i < state.page_count; i++) {
+        order[i] = &state.pages[i];
+    }
+    qsort(order, state.page_count, sizeof(PageStats *), cmp_page_ratio_desc);
+    fprintf(stderr, "Highest expansion ratio (output bytes / input bytes):\n");
+    for (size_t i = 0; i < state.page_count && i < STATS_TABLE_ROWS / 2; i++) {
+        fprintf(stderr,
+                "  %8.2fx  %10zu -> %10zu  %s\n",
+                page_ratio(order[i]),
+                order[i]->input_bytes,
+                order[i]->output_bytes,
+                order[i]->path);
+    }
+    xfree(order);
+}
+
+static void free_component(void *value) {
+    ComponentStats *c = value;
+    xfree(c->symbol);
+    xfree(c);
+}
+
+void stats_finish(BuildCtx *ctx) {
+    if (!state.enabled) {
+        return;
+    }
+    ComponentStats **components = xmalloc((state.components.count + 1) * sizeof(ComponentStats *));
+    size_t count = 0;
+    for (size_t i = 0; i < state.components.cap; i++) {
+        if (state.components.slots[i].key) {
+            components[count++] = state.components.slots[i].value;
+        }
+    }
+    qsort(components, count, sizeof(ComponentStats *), cmp_component_time_desc);
+    qsort(state.pages, state.page_count, sizeof(PageStats), cmp_page_path);
+
+    print_table(components, count);
+    if (!write_report(state.path, components, count)) {
+        log_warning(ctx, "failed to write stats report %s", state.path);
+    }
+    if (state.shard_path && !write_report(state.shard_path, components, count)) {
+        log_warning(ctx, "failed to write stats report %s", state.shard_path);
+    }
+    xfree(state.shard_path);
+
+    xfree(components);
+    for (size_t i = 0; i < state.page_count; i++) {
+        xfree(state.pages[i].path);
+    }
+    xfree(state.pages);
+    strmap_free(&state.components, free_component);
+    pthread_mutex_destroy(&state.lock);
+    state.enabled = false;
+}
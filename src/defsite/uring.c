@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct IoUring {
+    int fd;
+    unsigned sq_entries;
+    unsigned cq_entries;
+    void *sq_ptr;
+    size_t sq_map_len;
+    void *cq_ptr;
+    size_t cq_map_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_map_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+IoUring *uring_open(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = sys_uring_setup(entries, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    IoUring *r = xmalloc(sizeof(IoUring));
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->sq_entries = p.sq_entries;
+    r->cq_entries = p.cq_entries;
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && r->cq_map_len > r->sq_map_len) {
+        r->sq_map_len = r->cq_map_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        close(fd);
+        xfree(r);
+        return NULL;
+    }
+
+    if (single_mmap) {
+        r->cq_ptr = r->sq_ptr;
+        r->cq_map_len = 0;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            munmap(r->sq_ptr, r->sq_map_len);
+            close(fd);
+            xfree(r);
+            return NULL;
+        }
+    }
+
+    r->sqes_map_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_map_len > 0) {
+            munmap(r->cq_ptr, r->cq_map_len);
+        }
+        munmap(r->sq_ptr, r->sq_map_len);
+        close(fd);
+        xfree(r);
+        return NULL;
+    }
+
+    char *sq = r->sq_ptr;
+    char *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return r;
+}
+
+void uring_close(IoUring *r) {
+    if (!r) {
+        return;
+    }
+    munmap(r->sqes, r->sqes_map_len);
+    if (r->cq_map_len > 0) {
+        munmap(r->cq_ptr, r->cq_map_len);
+    }
+    munmap(r->sq_ptr, r->sq_map_len);
+    close(r->fd);
+    xfree(r);
+}
+
+static void uring_prep(struct io_uring_sqe *sqe, UringOp *op, struct statx *stx) {
+    memset(sqe, 0, sizeof(*sqe));
+    switch (op->kind) {
+    case URING_OPENAT:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)op->path;
+        sqe->len = 0644;
+        sqe->open_flags = (uint32_t)op->flags;
+        break;
+    case URING_STATX:
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)op->path;
+        sqe->len = STATX_SIZE;
+        sqe->off = (uint64_t)(uintptr_t)stx;
+        break;
+    case URING_READ:
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = op->fd;
+        sqe->addr = (uint64_t)(uintptr_t)op->buf;
+        sqe->len = (uint32_t)op->len;
+        sqe->off = op->offset;
+        break;
+    case URING_WRITE:
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = op->fd;
+        sqe->addr = (uint64_t)(uintptr_t)op->buf;
+        sqe->len = (uint32_t)op->len;
+        sqe->off = op->offset;
+        break;
+    case URING_CLOSE:
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = op->fd;
+        break;
+    }
+}
+
+static size_t uring_reap(IoUring *r, UringOp *ops) {
+    size_t reaped = 0;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        ops[cqe->user_data].result = cqe->res;
+        head++;
+        reaped++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+size_t uring_run(IoUring *r, UringOp *ops, size_t count) {
+    size_t enters = 0;
+    size_t chunk_max = r->sq_entries < r->cq_entries ? r->sq_entries : r->cq_entries;
+    struct statx *stx = xmalloc(chunk_max * sizeof(struct statx));
+    bool failed = false;
+
+    for (size_t i = 0; i < count; i++) {
+        ops[i].result = -ECANCELED;
+    }
+    for (size_t base = 0; base < count && !failed; base += chunk_max) {
+        size_t chunk = count - base < chunk_max ? count - base : chunk_max;
+        UringOp *batch = ops + base;
+
+        unsigned tail = *r->sq_tail;
+        for (size_t i = 0; i < chunk; i++) {
+            unsigned idx = tail & *r->sq_mask;
+            uring_prep(&r->sqes[idx], &batch[i], &stx[i]);
+            r->sqes[idx].user_data = i;
+            r->sq_array[idx] = idx;
+            tail++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+        size_t to_submit = chunk;
+        size_t done = 0;
+        while (done < chunk - to_submit || (!failed && done < chunk)) {
+            /* After a failed enter nothing more is submitted, but the kernel
+             * may still be writing into buffers of the ops it accepted, so
+             * their completions are waited for before returning. */
+            unsigned submit = failed ? 0 : (unsigned)to_submit;
+            unsigned wait = (unsigned)((failed ? chunk - to_submit : chunk) - done);
+            int rc = sys_uring_enter(r->fd, submit, wait, IORING_ENTER_GETEVENTS);
+            enters++;
+            if (rc < 0) {
+                if (errno == EINTR || errno == EAGAIN) {
+                    continue;
+                }
+                if (failed) {
+                    /* Cannot wait; poll for the rest. */
+                    done += uring_reap(r, batch);
+                    continue;
+                }
+                /* Withdraw the entries the kernel has not consumed. */
+                failed = true;
+                unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+                to_submit = *r->sq_tail - head;
+                __atomic_store_n(r->sq_tail, head, __ATOMIC_RELEASE);
+                continue;
+            }
+            to_submit -= (size_t)rc < to_submit ? (size_t)rc : to_submit;
+            done += uring_reap(r, batch);
+        }
+
+        for (size_t i = 0; i < chunk; i++) {
+            if (batch[i].kind == URING_STATX && batch[i].result == 0) {
+                batch[i].size = (size_t)stx[i].stx_size;
+            }
+        }
+    }
+
+    xfree(stx);
+    return enters;
+}
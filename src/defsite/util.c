@@ -9,24 +9,41 @@
 #include <string.h>
 #include <sys/stat.h>
 
+/* With --mem-stats, one extra byte holds the block's owning subsystem. */
 void *xmalloc(size_t size) {
-    void *ptr = malloc(size);
+    void *ptr = malloc(mem_accounting ? size + 1 : size);
     if (!ptr) {
         fprintf(stderr, "fatal: out of memory\n");
         exit(1);
     }
+    if (mem_accounting) {
+        mem_note_alloc(0, MEM_OTHER, ptr);
+    }
     return ptr;
 }
 
 void *xrealloc(void *ptr, size_t size) {
-    void *next = realloc(ptr, size);
+    size_t old_size = mem_accounting ? mem_block_size(ptr) : 0;
+    MemSubsystem old_owner = mem_accounting && ptr ? mem_block_owner(ptr) : MEM_OTHER;
+    void *next = realloc(ptr, mem_accounting ? size + 1 : size);
     if (!next) {
         fprintf(stderr, "fatal: out of memory\n");
         exit(1);
     }
+    if (mem_accounting) {
+        mem_note_alloc(old_size, old_owner, next);
+    }
     return next;
 }
 
+/* Releases memory from xmalloc/xrealloc/xstrdup. */
+void xfree(void *ptr) {
+    if (mem_accounting && ptr) {
+        mem_note_free(ptr);
+    }
+    free(ptr);
+}
+
 char *xstrdup(const char *s) {
     size_t n = strlen(s);
     char *out = xmalloc(n + 1);
@@ -89,19 +106,11 @@ size_t find_ci(const char *haystack, size_t len, size_t start, const char *needl
     return (size_t)-1;
 }
 
-static void log_msg(BuildCtx *ctx, const char *kind, const char *fmt, va_list ap) {
-    fprintf(stderr, "%s", kind);
-    if (ctx->current_file && ctx->current_file[0] != '\0') {
-        fprintf(stderr, "[%s] ", ctx->current_file);
-    }
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-}
-
+/* Diagnostics are buffered by diag.c and printed by diag_flush. */
 void log_error(BuildCtx *ctx, const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    log_msg(ctx, "ERROR: ", fmt, ap);
+    diag_record(true, ctx->current_file, fmt, ap);
     va_end(ap);
     ctx->error_count++;
 }
@@ -109,7 +118,7 @@ void log_error(BuildCtx *ctx, const char *fmt, ...) {
 void log_warning(BuildCtx *ctx, const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    log_msg(ctx, "WARN: ", fmt, ap);
+    diag_record(false, ctx->current_file, fmt, ap);
     va_end(ap);
     ctx->warning_count++;
 }
@@ -137,48 +146,11 @@ void sb_append(StrBuf *b, const char *s) {
     sb_append_n(b, s, strlen(s));
 }
 
-char *read_file(const char *path) {
-    FILE *f = fopen(path, "rb");
-    if (!f) {
-        return NULL;
-    }
-    if (fseek(f, 0, SEEK_END) != 0) {
-        fclose(f);
-        return NULL;
-    }
-    long size = ftell(f);
-    if (size < 0) {
-        fclose(f);
-        return NULL;
-    }
-    if (fseek(f, 0, SEEK_SET) != 0) {
-        fclose(f);
-        return NULL;
-    }
-
-    char *buf = xmalloc((size_t)size + 1);
-    size_t got = fread(buf, 1, (size_t)size, f);
-    fclose(f);
-    if (got != (size_t)size) {
-        free(buf);
-        return NULL;
-    }
-    buf[size] = '\0';
-    return buf;
-}
-
-bool write_file(const char *path, const char *data) {
-    FILE *f = fopen(path, "wb");
-    if (!f) {
-        return false;
-    }
-    size_t n = strlen(data);
-    bool ok = fwrite(data, 1, n, f) == n;
-    fclose(f);
-    return ok;
-}
-
 int ensure_dir(const char *path) {
+    /* Directories inside an archived output exist only as archive entries. */
+    if (archive_claims(path)) {
+        return 0;
+    }
     struct stat st;
     if (stat(path, &st) == 0) {
         if (S_ISDIR(st.st_mode)) {
@@ -204,32 +176,17 @@ bool has_html_ext(const char *path) {
     return str_eq(dot, ".html") || str_eq(dot, ".htm");
 }
 
-bool copy_file(const char *src, const char *dst) {
-    FILE *in = fopen(src, "rb");
-    if (!in) {
-        return false;
-    }
-    FILE *out = fopen(dst, "wb");
-    if (!out) {
-        fclose(in);
-        return false;
-    }
-
-    char buf[8192];
-    bool ok = true;
-    while (!feof(in)) {
-        size_t n = fread(buf, 1, sizeof(buf), in);
-        if (ferror(in)) {
-            ok = false;
-            break;
-        }
-        if (n > 0 && fwrite(buf, 1, n, out) != n) {
-            ok = false;
-            break;
+void json_append_escaped(StrBuf *b, const char *s) {
+    sb_append(b, "\"");
+    for (const char *p = s ? s : ""; *p; p++) {
+        switch (*p) {
+        case '\\': sb_append(b, "\\\\"); break;
+        case '"': sb_append(b, "\\\""); break;
+        case '\n': sb_append(b, "\\n"); break;
+        case '\r': sb_append(b, "\\r"); break;
+        case '\t': sb_append(b, "\\t"); break;
+        default: sb_append_n(b, p, 1); break;
         }
     }
-
-    fclose(in);
-    fclose(out);
-    return ok;
+    sb_append(b, "\"");
 }
@@ -2,35 +2,109 @@
 
 #include <stdio.h>
 
-static void print_usage(const char *prog) {
-    fprintf(stderr, "Usage: %s <input_dir> <output_dir>\n", prog);
-}
-
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        print_usage(argv[0]);
+    BuildOptions opts;
+    options_init(&opts);
+    if (!options_parse(&opts, argc, argv)) {
+        options_print_usage(argv[0]);
         return 2;
     }
 
-    const char *src_dir = argv[1];
-    const char *out_dir = argv[2];
+    mem_init(&opts);
+    diag_init(&opts);
+    const char *src_dir = opts.src_dir;
+    const char *out_dir = opts.out_dir;
+
+    if (!io_init(opts.io_backend)) {
+        fprintf(stderr, "WARN: io_uring unavailable; falling back to stdio I/O\n");
+    }
+    if (!archive_init(&opts)) {
+        return 1;
+    }
+    if (opts.command != COMMAND_COMPILE && opts.command != COMMAND_NINJA && opts.command != COMMAND_SERVE &&
+        !opts.archive_path) {
+        io_set_output_dir(out_dir);
+    }
+
+    profile_init(&opts);
+    stats_init(&opts);
+    compress_init(&opts);
+    fingerprint_init(&opts);
+    fulltext_init(&opts);
+    cache_init(&opts);
+    domcache_init(&opts);
 
     BuildCtx ctx;
     ctx.error_count = 0;
     ctx.warning_count = 0;
     ctx.current_file = NULL;
+    ctx.opts = &opts;
+
+    switch (opts.command) {
+    case COMMAND_MERGE:
+        merge_shards(&opts, &ctx);
+        break;
+    case COMMAND_COMPILE:
+        compile_files(&opts, &ctx);
+        break;
+    case COMMAND_NINJA:
+        write_build_ninja(&opts, &ctx);
+        break;
+    case COMMAND_SERVE:
+        serve_run(&opts, &ctx);
+        break;
+    case COMMAND_BUILD:
+    case COMMAND_INDEX:
+        if (opts.command == COMMAND_BUILD) {
+            process_directory(src_dir, out_dir, &ctx);
+        } else if (ensure_dir(out_dir) != 0) {
+            log_error(&ctx, "failed to create directory %s", out_dir);
+            break;
+        }
 
-    process_directory(src_dir, out_dir, &ctx);
+        char index_path[MAX_PATH_LEN];
+        snprintf(index_path, sizeof(index_path), "%s/search-index.json", out_dir);
+        profile_begin();
+        MemSubsystem prev_mem = mem_enter(MEM_INDEX);
+        generate_discovery_index(src_dir, index_path, &ctx);
+        mem_leave(prev_mem);
+        profile_end("phase", "index", NULL);
+        break;
+    }
 
-    char index_path[MAX_PATH_LEN];
-    snprintf(index_path, sizeof(index_path), "%s/search-index.json", out_dir);
-    generate_discovery_index(src_dir, index_path, &ctx);
+    profile_begin();
+    fulltext_finish(out_dir, &ctx);
+    profile_end("phase", "fulltext", NULL);
+    profile_begin();
+    fingerprint_finish(out_dir, &ctx);
+    profile_end("phase", "fingerprint", NULL);
+    profile_begin();
+    compress_finish(&ctx);
+    profile_end("phase", "compress", NULL);
+    profile_begin();
+    archive_finish(&ctx);
+    profile_end("phase", "archive", NULL);
+    collection_finish();
+    cache_finish();
+    domcache_finish();
+    if (opts.io_report) {
+        io_report();
+    }
+    profile_finish(&ctx);
+    stats_finish(&ctx);
+    mem_finish(&ctx);
+    io_shutdown();
+    diag_flush(&ctx);
 
     if (ctx.error_count > 0) {
         fprintf(stderr, "Build failed with %d error(s), %d warning(s).\n", ctx.error_count, ctx.warning_count);
         return 1;
     }
 
-    fprintf(stderr, "Build complete with %d warning(s).\n", ctx.warning_count);
+    /* A compile is one step of someone else's build; stay quiet on success.
+     * serve has already summarized what it did. */
+    if (opts.command != COMMAND_COMPILE && opts.command != COMMAND_SERVE) {
+        fprintf(stderr, "Build complete with %d warning(s).\n", ctx.warning_count);
+    }
     return 0;
 }